@@ -89,7 +89,7 @@ void wrcff(char *peripheral, char *password, char *file_path, char *cipher_file_
     write_cipher_file_from_file(&s, fd, &sefile_file);
     //closing files
     fclose(fd);
-    secure_close(&sefile_file);
+    close_cipher_file(&s, &sefile_file);
     //closing device
     close_device(&s);
 }
@@ -118,7 +118,7 @@ void wrcfs(char *peripheral, char *password, char *string, char *cipher_file_pat
     //printf("writing cipher file...\n");
     write_cipher_file_from_buffer(&s, string, strlen(string), &sefile_file);
     //closing files
-    secure_close(&sefile_file);
+    close_cipher_file(&s, &sefile_file);
     //closing device
     close_device(&s);
 }
@@ -190,7 +190,8 @@ void help(void)  {
     printf("  --help - shows this message\n");
     printf("\n");
     printf("options:\n");
-    printf("  -pe - device drive letter for windows (ex: \"D\") or path for linux\n");
+    printf("  -pe - device drive letter for windows (ex: \"D\") or path for linux,\n");
+    printf("        a comma separated list shares the work among devices with the same keys\n");
     printf("  -i  - input file or string\n");
     printf("  -o  - output file\n");
     printf("  -c  - input or output cipher file\n");
@@ -201,6 +202,7 @@ void help(void)  {
     printf("  SEfile-cli wrcfs -pa test -i \"Hello world!\" -c cipher_file_out.txt\n");
     printf("  on Windows: SEfile-cli wrcff -pe D -pa test -i text_file_in.txt -c cipher_file_out.txt\n");
     printf("  on Linux: SEfile-cli wrffc -pe /mnt/sdb1 -pa test -o text_file_out.txt -c cipher_file_out.txt\n");
+    printf("  two devices: SEfile-cli wrcff -pe /mnt/sdb1,/mnt/sdc1 -pa test -i text_file_in.txt -c cipher_file_out.txt\n");
     printf("\n");
     printf("For all the commands if -pe is not specified all the available\n");
     printf("devices will be displayed and one of them must be chosen.\n");
@@ -8,11 +8,36 @@
 
 #ifdef __linux__
 #define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #endif
 
 #include "SEfile.h"
+#include "se3/L1_worker.h"
 
 #define SEFILE_NONCE_LEN 32
+#if SEFILE_POOL_MAX > SE3_WORKER_FOR_MAX
+#error "SEFILE_POOL_MAX is larger than SE3_WORKER_FOR_MAX"
+#endif
+/**
+ * @brief The SEFILE_CONTEXT struct
+ *
+ * This abstract data type holds what secure_init() used to store
+ * in global variables: the session, the key and the algorithm
+ * used to encrypt files. Every file handle is bound to the context
+ * it was opened with. The session is only used by the worker thread
+ * of its device, so handles of the same context can be used by
+ * different threads. Devices added by secure_ctx_add_device() only
+ * take part in sector encryption and decryption.
+ */
+struct SEFILE_CONTEXT {
+    se3_session session;    /**< Private copy of the session we want to use*/
+    int32_t keyID;          /**< Which KeyID we want to use*/
+    uint16_t crypto;        /**< Which cipher algorithm and mode we want to use*/
+    se3_worker *worker;     /**< Device I/O thread running every L1 call of this context*/
+    size_t n_devices;       /**< Devices of the context, session included, see \ref ctx_session*/
+    se3_session pool[SEFILE_POOL_MAX - 1];          /**< Private copies of the sessions of the added devices*/
+    se3_worker *pool_worker[SEFILE_POOL_MAX - 1];   /**< Their device I/O threads*/
+};
 /**
  * @brief The SEFILE_HANDLE struct
  *
@@ -22,7 +47,8 @@
  * file descriptor OS-dependent data type.
  */
 struct SEFILE_HANDLE {
-    uint32_t log_offset;    /**< Actual pointer position in bytes*/
+    int64_t log_offset;     /**< Actual pointer position in bytes, 64 bit wide as off_t*/
+    uint64_t file_length;   /**< Logic size of the file, kept up to date by every write*/
 #if defined(__linux__) || defined(__APPLE__)
     int32_t fd;             /**< File descriptor in Unix environment*/
 #elif _WIN32      
@@ -30,6 +56,15 @@ struct SEFILE_HANDLE {
 #endif
     uint8_t nonce_ctr[16];  /**< Nonce used for the CTR feedback*/
     uint8_t nonce_pbkdf2[SEFILE_NONCE_LEN]; /**< Nonce used for the PBKDF2*/
+    uint32_t enc_sess_id[SEFILE_POOL_MAX];  /**< Device crypto sessions used to encrypt sectors, one per device, see \ref open_sessions*/
+    uint32_t dec_sess_id[SEFILE_POOL_MAX];  /**< Device crypto sessions used to decrypt sectors, one per device, see \ref open_sessions*/
+    size_t n_sessions;      /**< Devices of the context with open sessions, the first ones*/
+    SEFILE_CTX ctx;         /**< Context the file was opened with*/
+    struct SEFILE_CACHE_ENTRY *cache;   /**< Plaintext sector cache, allocated on first use*/
+    uint32_t cache_size;    /**< Capacity of the cache in sectors, 0 disables it*/
+    uint32_t cache_clock;   /**< Access counter used by the LRU replacement*/
+    uint32_t cache_hits;    /**< Sectors served by the cache*/
+    uint32_t cache_misses;  /**< Sectors read and decrypted from the file*/
 };
 
 /**
@@ -82,19 +117,31 @@ typedef struct {
 ///@}
 /** @}*/
 #pragma pack(pop)
-#define POS_TO_CIPHER_BLOCK(current_position) ((current_position / SEFILE_SECTOR_SIZE) - 1)*(SEFILE_SECTOR_DATA_SIZE / SEFILE_BLOCK_SIZE) /**< Macro used to convert the actual pointer position to the cipher blocks amount*/ 
+
+/**
+ * @brief The SEFILE_CACHE_ENTRY struct
+ *
+ * One slot of the per-handle sector cache. It holds the plaintext of
+ * a sector together with the data needed by the LRU replacement and
+ * by the write-back policy.
+ */
+typedef struct SEFILE_CACHE_ENTRY {
+    uint64_t position;      /**< Physical offset of the sector, 0 (the header) marks a free slot*/
+    uint32_t last_use;      /**< Value of SEFILE_HANDLE::cache_clock at the last access*/
+    bool dirty;             /**< The plaintext is newer than the file content*/
+    SEFILE_SECTOR sector;   /**< Plaintext sector*/
+} SEFILE_CACHE_ENTRY;
+#define POS_TO_CIPHER_BLOCK(current_position) ((((uint64_t)(current_position)) / SEFILE_SECTOR_SIZE) - 1)*(SEFILE_SECTOR_DATA_SIZE / SEFILE_BLOCK_SIZE) /**< Macro used to convert the actual pointer position to the cipher blocks amount*/ 
 /**
  * @defgroup EnvironmentalVars
  * @{
  */
 /** \name Environmental Variables
- * This static variables will store some data useful
- * during the active session.
+ * This static variable stores the context used by the
+ * functions that do not take an explicit one.
  */
 ///@{
-static se3_session *EnvSession=NULL;			/**< Which session we want to use*/
-static int32_t *EnvKeyID=NULL;             		/**< Which KeyID we want to use*/
-static uint16_t *EnvCrypto=NULL;	            /**< Which cipher algorithm and mode we want to use*/
+static SEFILE_CTX EnvCtx=NULL;			/**< Context set by secure_init()*/
 ///@}
 /** @}*/
 /**
@@ -115,35 +162,39 @@ void get_filename(char *path, char *file_name);
  */
 void get_path(char *full_path, char *path);
 /**
- * @brief This function check if the environmental variables
- *        are correctly initialized and set.
+ * @brief This function check if a context is correctly
+ *        initialized and set.
+ * @param [in] ctx Context to be checked.
  * @return The function returns a (uint16_t) '0' in case of success.
  *         See \ref errorValues for error list.
  */
-uint16_t check_env();
+uint16_t check_ctx(SEFILE_CTX ctx);
 /**
- *  \brief This function encrypts the buff_decrypt data by exploiting the
+ *  \brief This function encrypts the buff_decrypt sectors by exploiting the
  *        functions provided by \ref L1.h.
  *
- *  \param [in] buff_decrypt The plaintext data to be encrypted
+ *  \param [in] ctx Context of the file handle
+ *  \param [in] buff_decrypt The plaintext sectors to be encrypted
  *  \param [out] buff_crypt  The preallocated buffer where to store the
- *        encrypted data.
- *  \param [in] datain_len Specify how many data we want to encrypt.
- *  \param [in] current_offset Current position inside the file expressed
+ *        encrypted sectors, each one followed by its signature.
+ *  \param [in] n_sectors How many consecutive sectors we want to encrypt.
+ *  \param [in] current_offset Position of the first sector inside the file expressed
  *  			as number of cipher blocks
  *  \param [in] nonce_ctr Initialization vector, see \ref SEFILE_HEADER
- *  \param [in] nonce_pbkdf2 Initialization vector, see \ref SEFILE_HEADER
+ *  \param [in] sess_id Encryption sessions of the file handle, one per device, see \ref open_sessions
+ *  \param [in] n_sessions How many devices share the sectors, see \ref secure_ctx_add_device
  *  \return The function returns a (uint16_t) '0' in case of success.
  *         See \ref errorValues for error list.
  *
  */
-uint16_t crypt_sectors(void *buff_decrypt, void *buff_crypt, size_t datain_len, size_t current_offset, uint8_t* nonce_ctr, uint8_t* nonce_pbkdf2);
+uint16_t crypt_sectors(SEFILE_CTX ctx, void *buff_decrypt, void *buff_crypt, size_t n_sectors, uint64_t current_offset, uint8_t* nonce_ctr, const uint32_t* sess_id, size_t n_sessions);
 
 
 /**
  *  \brief This function encrypts a header buffer by exploiting the
  *        functions provided by \ref L1.h.
  *
+ *  \param [in] ctx Context whose key and algorithm shall be used.
  *  \param [in] buff1 Pointer to the header we want to encrypt/decrypt.
  *  \param [out] buff2 Pointer to an allocated header where to store the
  *  			result.
@@ -153,39 +204,193 @@ uint16_t crypt_sectors(void *buff_decrypt, void *buff_crypt, size_t datain_len,
  *         See \ref errorValues for error list.
  *
  */
-uint16_t crypt_header(void *buff1, void *buff2, size_t datain_len, uint16_t direction);
+uint16_t crypt_header(SEFILE_CTX ctx, void *buff1, void *buff2, size_t datain_len, uint16_t direction);
 
 //uint16_t decrypt_sectors(void *buff_crypt, void *buff_decrypt, uint32_t size);
 /**
- *  \brief This function decrypts the buff_crypt data by exploiting the
+ *  \brief This function decrypts the buff_crypt sectors by exploiting the
  *        functions provided by \ref L1.h.
  *
- *  \param [in] buff_crypt The cipher text data to be decrypted
+ *  \param [in] ctx Context of the file handle
+ *  \param [in] buff_crypt The cipher text sectors to be decrypted
  *  \param [out] buff_decrypt  The preallocated buffer where to store the
- *        decrypted data.
- *  \param [in] datain_len Specify how many data we want to decrypt.
- *  \param [in] current_offset Current position inside the file expressed
+ *        decrypted sectors, each one followed by the signature computed
+ *        by the device.
+ *  \param [in] n_sectors How many consecutive sectors we want to decrypt.
+ *  \param [in] current_offset Position of the first sector inside the file expressed
  *  			as number of cipher blocks
  *  \param [in] nonce_ctr Initialization vector, see \ref SEFILE_HEADER
- *  \param [in] nonce_pbkdf2 Initialization vector, see \ref SEFILE_HEADER
+ *  \param [in] sess_id Decryption sessions of the file handle, one per device, see \ref open_sessions
+ *  \param [in] n_sessions How many devices share the sectors, see \ref secure_ctx_add_device
  *  \return The function returns a (uint16_t) '0' in case of success.
  *         See \ref errorValues for error list.
  *
  */
-uint16_t decrypt_sectors(void *buff_crypt, void *buff_decrypt, size_t datain_len, size_t current_offset, uint8_t* nonce_ctr, uint8_t* nonce_pbkdf2);
+uint16_t decrypt_sectors(SEFILE_CTX ctx, void *buff_crypt, void *buff_decrypt, size_t n_sectors, uint64_t current_offset, uint8_t* nonce_ctr, const uint32_t* sess_id, size_t n_sessions);
+/**
+ * @brief This function returns the session and the worker of a device
+ *        of the context.
+ * @param [in] ctx Context.
+ * @param [in] device Index of the device, 0 is the session given to
+ *        secure_ctx_init(), the others were added by secure_ctx_add_device().
+ * @param [out] worker Where to store the worker of the device, can be NULL.
+ * @return The session.
+ */
+se3_session *ctx_session(SEFILE_CTX ctx, size_t device, se3_worker **worker);
+/**
+ * @brief This function encrypts a zero sector with a fixed nonce on a
+ *        device of the context, to compare the key material of two devices.
+ * @param [in] ctx Context.
+ * @param [in] device Index of the device, see \ref ctx_session.
+ * @param [out] out Encrypted sector, followed by its signature.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t probe_key(SEFILE_CTX ctx, size_t device, SEFILE_SECTOR *out);
+/**
+ * @brief This function opens the device crypto sessions used by a file
+ *        handle: one for encryption and one for decryption. The key
+ *        derivation triggered by SETNONCE is done only once here, each
+ *        sector will then just reset the CTR IV.
+ * @param [in] hFile File handle whose nonces are already set.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t open_sessions(SEFILE_FHANDLE hFile);
+/**
+ * @brief This function releases the device crypto sessions opened by
+ *        \ref open_sessions.
+ * @param [in] hFile File handle whose sessions shall be released.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t close_sessions(SEFILE_FHANDLE hFile);
+/**
+ * @brief This function compares the signatures stored inside the encrypted
+ *        sectors with the ones computed by the device during decryption.
+ * @param [in] buff_crypt The cipher text sectors read from the file.
+ * @param [in] buff_decrypt The same sectors as returned by \ref decrypt_sectors.
+ * @param [in] n_sectors How many sectors shall be checked.
+ * @return The function returns a (uint16_t) '0' in case of success,
+ *         \ref SEFILE_SIGNATURE_MISMATCH otherwise.
+ */
+uint16_t verify_sectors(SEFILE_SECTOR *buff_crypt, SEFILE_SECTOR *buff_decrypt, size_t n_sectors);
+/**
+ * @brief This function reads up to n_sectors consecutive encrypted sectors
+ *        with a single file I/O call.
+ * @param [in] hFile Open file handle.
+ * @param [in] position Physical offset of the first sector inside the file.
+ * @param [out] buff Preallocated buffer of at least n_sectors sectors.
+ * @param [in] n_sectors How many sectors shall be read.
+ * @return The function returns the number of whole sectors read (0 at the
+ *         end of the file) or -1 in case of error.
+ */
+int32_t read_sectors(SEFILE_FHANDLE hFile, uint64_t position, SEFILE_SECTOR *buff, size_t n_sectors);
+/**
+ * @brief This function writes n_sectors consecutive encrypted sectors
+ *        with a single file I/O call.
+ * @param [in] hFile Open file handle.
+ * @param [in] position Physical offset of the first sector inside the file.
+ * @param [in] buff Sectors to be written.
+ * @param [in] n_sectors How many sectors shall be written.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t write_sectors(SEFILE_FHANDLE hFile, uint64_t position, SEFILE_SECTOR *buff, size_t n_sectors);
 /**
- * @brief This function is used to compute the total logic size of an open
- *        file handle.
+ * @brief This function moves the OS file pointer of a file handle using
+ *        64 bit offsets, so that files bigger than 2 GB can be handled.
+ * @param [in] hFile Open file handle.
+ * @param [in] offset Physical offset, relative to whence.
+ * @param [in] whence See \ref Seek_Defines.
+ * @return The function returns the new physical position of the file
+ *         pointer or -1 in case of error.
+ */
+int64_t move_filepointer(SEFILE_FHANDLE hFile, int64_t offset, uint8_t whence);
+/**
+ * @brief This function resets the sector cache of a newly allocated
+ *        file handle to its default capacity.
+ * @param [in] hFile File handle to be initialized.
+ */
+void cache_init(SEFILE_FHANDLE hFile);
+/**
+ * @brief This function looks for the plaintext of a sector inside the
+ *        cache of a file handle.
+ * @param [in] hFile Open file handle.
+ * @param [in] position Physical offset of the sector inside the file.
+ * @return The cache entry holding the sector, NULL if it is not cached.
+ */
+SEFILE_CACHE_ENTRY *cache_lookup(SEFILE_FHANDLE hFile, uint64_t position);
+/**
+ * @brief This function stores consecutive plaintext sectors inside the
+ *        cache, replacing the least recently used entries. If a dirty
+ *        entry has to be replaced, all dirty entries are written back
+ *        first by \ref cache_flush.
+ * @param [in] hFile Open file handle.
+ * @param [in] position Physical offset of the first sector inside the file.
+ * @param [in] buff Plaintext sectors to be stored.
+ * @param [in] n_sectors How many sectors shall be stored.
+ * @param [in] dirty True if the sectors were modified and must be written
+ *        back, false if they were just read from the file. Clean sectors
+ *        never replace an entry already holding the same position.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t cache_store(SEFILE_FHANDLE hFile, uint64_t position, SEFILE_SECTOR *buff, size_t n_sectors, bool dirty);
+/**
+ * @brief This function encrypts and writes back all dirty sectors of the
+ *        cache, grouping consecutive ones in batches of at most
+ *        \ref SEFILE_BATCH_SECTORS. The file pointer is left where
+ *        SEFILE_HANDLE::log_offset expects it.
+ * @param [in] hFile Open file handle.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t cache_flush(SEFILE_FHANDLE hFile);
+/**
+ * @brief This function discards every cached sector without writing it
+ *        back. Call \ref cache_flush first if dirty data must be kept.
+ * @param [in] hFile Open file handle.
+ */
+void cache_drop(SEFILE_FHANDLE hFile);
+/**
+ * @brief This function retrieves the plaintext of a single sector, from
+ *        the cache if possible, from the file otherwise.
+ * @param [in] hFile Open file handle.
+ * @param [in] position Physical offset of the sector inside the file.
+ * @param [out] buff Preallocated sector where to store the plaintext.
+ * @param [out] found Set to false if the sector is neither cached nor
+ *        stored inside the file.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t load_sector(SEFILE_FHANDLE hFile, uint64_t position, SEFILE_SECTOR *buff, bool *found);
+/**
+ * @brief This function is used to get the total logic size of an open
+ *        file handle, as tracked by SEFILE_HANDLE::file_length.
+ * @param [in] hFile Open file handle whose size shall be returned.
+ * @param [out] length Pointer to a preallocated variable where to store
+ *        the logic size.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t get_filesize(SEFILE_FHANDLE *hFile, uint64_t * length);
+/**
+ * @brief This function computes the total logic size of an open file
+ *        handle by reading and decrypting its last sector. It is used
+ *        only when the file is opened, afterwards the size is tracked
+ *        inside the handle.
  * @param [in] hFile Open file handle whose size shall be computed.
  * @param [out] length Pointer to a preallocated variable where to store
  *        the logic size.
  * @return The function returns a (uint16_t) '0' in case of success.
  *         See \ref errorValues for error list.
  */
-uint16_t get_filesize(SEFILE_FHANDLE *hFile, uint32_t * length);
+uint16_t read_filesize(SEFILE_FHANDLE *hFile, uint64_t * length);
 /**
  * @brief This function is used to compute the plaintext of a encrypted
  *        filename stored in path.
+ * @param [in] ctx Context whose key shall be used.
  * @param [in] path Where the encrypted file is stored, it can be an absolute
  *        or relative path. No encrypted directory are allowed inside the path.
  * @param [out] filename  A preallocated string where to store the plaintext
@@ -193,7 +398,7 @@ uint16_t get_filesize(SEFILE_FHANDLE *hFile, uint32_t * length);
  * @return The function returns a (uint16_t) '0' in case of success.
  *         See \ref errorValues for error list.
  */
-uint16_t decrypt_filename(char *path, char *filename);
+uint16_t decrypt_filename(SEFILE_CTX ctx, char *path, char *filename);
 /**
  * @brief This function is used to compute the plaintext of a encrypted
  *        filename stored in an already open hFile header.
@@ -208,6 +413,7 @@ uint16_t decrypt_filehandle(SEFILE_FHANDLE *hFile, char *filename);
 /**
  * @brief This function is used to compute the plaintext of a encrypted
  *        directory name stored in dirname.
+ * @param [in] ctx Context whose key shall be used.
  * @param [in] dirpath Path to the directory whose name has to be decrypted.
  *        No encrypted directory are allowed inside the path.
  * @param [out] decDirname A preallocated string where to store the decrypted
@@ -215,7 +421,7 @@ uint16_t decrypt_filehandle(SEFILE_FHANDLE *hFile, char *filename);
  * @return The function returns a (uint16_t) '0' in case of success.
  *         See \ref errorValues for error list.
  */
-uint16_t decrypt_dirname(char *dirpath, char *decDirname);
+uint16_t decrypt_dirname(SEFILE_CTX ctx, char *dirpath, char *decDirname);
 /**
  * @brief This function checks if the given name can be a valid encrypted
  *        filename/directory name.
@@ -226,13 +432,22 @@ uint16_t decrypt_dirname(char *dirpath, char *decDirname);
 uint16_t valid_name(char *name);
 
 uint16_t secure_init(se3_session *s, uint32_t keyID, uint16_t crypto){
-    int i = 0, j = 0, count = 0;
+    if(EnvCtx != NULL){
+        return SEFILE_ENV_INIT_ERROR;
+    }
+    return secure_ctx_init(&EnvCtx, s, keyID, crypto);
+}
+
+uint16_t secure_ctx_init(SEFILE_CTX *ctx, se3_session *s, uint32_t keyID, uint16_t crypto){
+    int i = 0;
+    uint16_t count = 0;
     se3_key keyTable;
     se3_algo algTable[SE3_ALGO_MAX];
     uint16_t ret = 0;
     bool found = false;
+    SEFILE_CTX cTmp = NULL;
 
-    if(EnvSession != NULL || EnvKeyID != NULL || EnvCrypto != NULL ){
+    if(ctx == NULL){
         return SEFILE_ENV_INIT_ERROR;
     }
 
@@ -244,30 +459,33 @@ uint16_t secure_init(se3_session *s, uint32_t keyID, uint16_t crypto){
         return SEFILE_ENV_INIT_ERROR;
     }
 
-    EnvSession=(se3_session *)malloc(sizeof(se3_session));
-    EnvKeyID=(int32_t *)malloc(sizeof(int32_t));
-    EnvCrypto = (uint16_t *)malloc(sizeof(uint16_t));
-    *EnvCrypto = SE3_ALGO_MAX + 1; //No valid algorithm still set
-
-    if(EnvSession == NULL || EnvKeyID == NULL || EnvCrypto == NULL ){
+    cTmp=(SEFILE_CTX)malloc(sizeof(struct SEFILE_CONTEXT));
+    if(cTmp == NULL){
         return SEFILE_ENV_INIT_ERROR;
     }
+    cTmp->crypto = SE3_ALGO_MAX + 1; //No valid algorithm still set
+    cTmp->n_devices = 1;
 
-    memcpy(EnvSession, s, sizeof(se3_session));
+    memcpy(&cTmp->session, s, sizeof(se3_session));
+    if(L1_worker_get(&cTmp->session.device, &cTmp->worker)){
+        free(cTmp);
+        return SEFILE_ENV_INIT_ERROR;
+    }
+    *ctx = cTmp;
     if (keyID == -1){ //use first available KeyID
         i=0;
         do{
-            if(L1_key_list(s, i, 1, NULL, &keyTable, &count)){
-                secure_finit();
+            if(L1_worker_key_list(cTmp->worker, &cTmp->session, i, 1, NULL, &keyTable, &count)){
+                secure_ctx_finit(ctx);
                 return SEFILE_ENV_INIT_ERROR;
             }
 
             if(count == 0){
-                secure_finit();
+                secure_ctx_finit(ctx);
                 return SEFILE_KEYID_NOT_PRESENT;
             }
             if(keyTable.validity>time(0)){
-                *EnvKeyID=keyTable.id;
+                cTmp->keyID=keyTable.id;
                 found = true;
                 break;
             }
@@ -275,38 +493,38 @@ uint16_t secure_init(se3_session *s, uint32_t keyID, uint16_t crypto){
         }while(found == false);
 
         if (found == false){
-            secure_finit();
+            secure_ctx_finit(ctx);
             return SEFILE_KEYID_NOT_PRESENT;
         }
     }else{
-        if(!L1_find_key(EnvSession, keyID)){
-            secure_finit();
+        if(!L1_worker_find_key(cTmp->worker, &cTmp->session, keyID)){
+            secure_ctx_finit(ctx);
             return SEFILE_ENV_INIT_ERROR;
         }
-        *EnvKeyID = keyID;
+        cTmp->keyID = keyID;
     }
 
     if(crypto!=(SE3_ALGO_MAX + 1)){
-        if ((ret = L1_get_algorithms(EnvSession, 0, SE3_ALGO_MAX, algTable, &count)) == 0 && count > 0 && algTable[crypto].type == SE3_CRYPTO_TYPE_BLOCKCIPHER_AUTH){
-            *EnvCrypto = crypto;
+        if ((ret = L1_worker_get_algorithms(cTmp->worker, &cTmp->session, 0, SE3_ALGO_MAX, algTable, &count)) == 0 && count > 0 && algTable[crypto].type == SE3_CRYPTO_TYPE_BLOCKCIPHER_AUTH){
+            cTmp->crypto = crypto;
         }else{
-            secure_finit();
+            secure_ctx_finit(ctx);
             return SEFILE_ENV_INIT_ERROR;
         }
     } else {
-        if ((ret = L1_get_algorithms(EnvSession, 0, SE3_ALGO_MAX, algTable, &count)) == 0 && count > 0){
+        if ((ret = L1_worker_get_algorithms(cTmp->worker, &cTmp->session, 0, SE3_ALGO_MAX, algTable, &count)) == 0 && count > 0){
             for (i = 0; i < count; i++){
                 if (algTable[i].type == SE3_CRYPTO_TYPE_BLOCKCIPHER_AUTH) {
-                    *EnvCrypto = i;
+                    cTmp->crypto = i;
                     break;
                 }
             }
-            if (*EnvCrypto == SE3_ALGO_MAX + 1){
-                secure_finit();
+            if (cTmp->crypto == SE3_ALGO_MAX + 1){
+                secure_ctx_finit(ctx);
                 return SEFILE_ENV_INIT_ERROR;
             }
         }else{
-            secure_finit();
+            secure_ctx_finit(ctx);
             return SEFILE_ENV_INIT_ERROR;
         }
     }
@@ -315,32 +533,60 @@ uint16_t secure_init(se3_session *s, uint32_t keyID, uint16_t crypto){
 }
 
 uint16_t secure_update(se3_session *s, int32_t keyID, uint16_t crypto){
+    return secure_ctx_update(EnvCtx, s, keyID, crypto);
+}
+
+uint16_t secure_ctx_update(SEFILE_CTX ctx, se3_session *s, int32_t keyID, uint16_t crypto){
     uint16_t count = 0, ret = 0;
+    size_t i = 0;
+    int32_t old_keyID = 0;
+    se3_session *pool_s = NULL;
+    SEFILE_SECTOR probe[2];
     se3_key keyTable;
     se3_algo algTable[SE3_ALGO_MAX];
+    se3_worker *worker = NULL;
 
-    if(check_env()){
+    if(check_ctx(ctx)){
         return SEFILE_ENV_UPDATE_ERROR;
     }
 
     if(s!=NULL){
         if(s->logged_in){
-            memcpy(EnvSession, s, sizeof(*s));
+            if(s->device.request != ctx->session.device.request){ //session on another device
+                if(L1_worker_get(&s->device, &worker)){
+                    return SEFILE_ENV_UPDATE_ERROR;
+                }
+                L1_worker_put(ctx->worker);
+                ctx->worker = worker;
+            }
+            memcpy(&ctx->session, s, sizeof(*s));
         }else{
             return SEFILE_ENV_UPDATE_ERROR;
         }
     }
 
     if(keyID!=-1){
-        if(!L1_find_key(EnvSession, keyID)){
-            return SEFILE_ENV_UPDATE_ERROR;
+        for(i=0; i<ctx->n_devices; i++){
+            pool_s = ctx_session(ctx, i, &worker);
+            if(!L1_worker_find_key(worker, pool_s, keyID)){
+                return SEFILE_ENV_UPDATE_ERROR;
+            }
+        }
+        old_keyID = ctx->keyID;
+        ctx->keyID=keyID;
+        //the added devices must still produce the very same sectors
+        for(i=1; i<ctx->n_devices; i++){
+            if(probe_key(ctx, 0, &probe[0]) || probe_key(ctx, i, &probe[1]) ||
+               memcmp(&probe[0], &probe[1], sizeof(SEFILE_SECTOR))){
+                ctx->keyID = old_keyID;
+                return SEFILE_POOL_ERROR;
+            }
         }
-        *EnvKeyID=keyID;
     }
 
     if (crypto != (SE3_ALGO_MAX + 1)){
-        if ((ret = L1_get_algorithms(EnvSession, 0, SE3_ALGO_MAX, algTable, &count)) == 0 && count > 0 && algTable[crypto].type == SE3_CRYPTO_TYPE_BLOCKCIPHER_AUTH){
-            *EnvCrypto = crypto;
+        if ((ret = L1_worker_get_algorithms(ctx->worker, &ctx->session, 0, SE3_ALGO_MAX, algTable, &count)) == 0 && count > 0 && algTable[crypto].type == SE3_CRYPTO_TYPE_BLOCKCIPHER_AUTH){
+            ctx->crypto = crypto;
         }else{
             return SEFILE_ENV_UPDATE_ERROR;
         }
@@ -349,24 +595,71 @@ uint16_t secure_update(se3_session *s, int32_t keyID, uint16_t crypto){
     return 0;
 }
 
-uint16_t secure_finit(){
-    if(EnvSession!=NULL){
-        free(EnvSession);
-        EnvSession=NULL;
+uint16_t secure_add_device(se3_session *s){
+    return secure_ctx_add_device(EnvCtx, s);
+}
+
+uint16_t secure_ctx_add_device(SEFILE_CTX ctx, se3_session *s){
+    SEFILE_SECTOR probe[2];
+    size_t i = 0, n = 0;
+
+    if(check_ctx(ctx)){
+        return SEFILE_ENV_UPDATE_ERROR;
     }
-    if(EnvKeyID!=NULL){
-        free(EnvKeyID);
-        EnvKeyID=NULL;
+    if(s==NULL || !s->logged_in){
+        return SEFILE_ENV_UPDATE_ERROR;
     }
-    if(EnvCrypto!=NULL){
-        free(EnvCrypto);
-        EnvCrypto=NULL;
+    if(ctx->n_devices >= SEFILE_POOL_MAX){
+        return SEFILE_POOL_ERROR;
+    }
+    for(i=0; i<ctx->n_devices; i++){
+        if(ctx_session(ctx, i, NULL)->device.request == s->device.request){ //already in the pool
+            return SEFILE_POOL_ERROR;
+        }
+    }
+
+    n = ctx->n_devices;
+    memcpy(&ctx->pool[n - 1], s, sizeof(se3_session));
+    if(L1_worker_get(&ctx->pool[n - 1].device, &ctx->pool_worker[n - 1])){
+        return SEFILE_ENV_UPDATE_ERROR;
+    }
+    //the new device must produce the very same sectors
+    if(!L1_worker_find_key(ctx->pool_worker[n - 1], &ctx->pool[n - 1], ctx->keyID) ||
+       probe_key(ctx, 0, &probe[0]) || probe_key(ctx, n, &probe[1]) ||
+       memcmp(&probe[0], &probe[1], sizeof(SEFILE_SECTOR))){
+        L1_worker_put(ctx->pool_worker[n - 1]);
+        ctx->pool_worker[n - 1] = NULL;
+        return SEFILE_POOL_ERROR;
+    }
+    ctx->n_devices = n + 1;
+
+    return 0;
+}
+
+uint16_t secure_finit(){
+    return secure_ctx_finit(&EnvCtx);
+}
+
+uint16_t secure_ctx_finit(SEFILE_CTX *ctx){
+    size_t i = 0;
+
+    if(ctx!=NULL && *ctx!=NULL){
+        for(i=1; i<(*ctx)->n_devices; i++){
+            L1_worker_put((*ctx)->pool_worker[i - 1]);
+        }
+        L1_worker_put((*ctx)->worker);
+        free(*ctx);
+        *ctx=NULL;
     }
 
     return 0;
 }
 
 uint16_t secure_open(char *path, SEFILE_FHANDLE *hFile, int32_t mode, int32_t creation){
+    return secure_ctx_open(EnvCtx, path, hFile, mode, creation);
+}
+
+uint16_t secure_ctx_open(SEFILE_CTX ctx, char *path, SEFILE_FHANDLE *hFile, int32_t mode, int32_t creation){
 
     uint16_t commandError=0;
     char enc_filename[MAX_PATHNAME];
@@ -377,14 +670,14 @@ uint16_t secure_open(char *path, SEFILE_FHANDLE *hFile, int32_t mode, int32_t cr
     DWORD nBytesRead = 0;
 #endif
 
-    if(check_env()){
+    if(check_ctx(ctx)){
         return SEFILE_OPEN_ERROR;
     }
 
     memset(enc_filename, 0, MAX_PATHNAME*sizeof(char));
 
     if(creation==(SEFILE_NEWFILE)){
-        if((commandError=secure_create(path, &hTmp, mode))!=0){
+        if((commandError=secure_ctx_create(ctx, path, &hTmp, mode))!=0){
             return SEFILE_OPEN_ERROR;
         }
         memcpy(hFile, &hTmp, sizeof(hTmp));
@@ -399,6 +692,8 @@ uint16_t secure_open(char *path, SEFILE_FHANDLE *hFile, int32_t mode, int32_t cr
 
         return SEFILE_OPEN_ERROR;
     }
+    hTmp->ctx = ctx;
+    cache_init(hTmp);
     /* open phase start */
 #if defined(__linux__) || defined(__APPLE__)
     if((hTmp->fd = open(enc_filename, mode | creation, S_IRWXU)) == -1 ){
@@ -438,18 +733,31 @@ uint16_t secure_open(char *path, SEFILE_FHANDLE *hFile, int32_t mode, int32_t cr
     }
     hTmp->log_offset = SetFilePointer(hTmp->fd, 0, NULL, FILE_CURRENT);
 #endif
-    if (crypt_header(&buffEnc, &buffDec, SEFILE_SECTOR_DATA_SIZE, SE3_DIR_DECRYPT)){
+    if (crypt_header(hTmp->ctx, &buffEnc, &buffDec, SEFILE_SECTOR_DATA_SIZE, SE3_DIR_DECRYPT)){
         commandError = SEFILE_OPEN_ERROR;
     }
 
     memcpy(hTmp->nonce_ctr, buffDec.header.nonce_ctr, 16);
     memcpy(hTmp->nonce_pbkdf2, buffDec.header.nonce_pbkdf2, SEFILE_NONCE_LEN);
 
+    hTmp->n_sessions = 0;
+    if (!commandError && open_sessions(hTmp)){
+        commandError = SEFILE_OPEN_ERROR;
+    }
+    hTmp->file_length = 0;
+    if (!commandError && read_filesize(&hTmp, &hTmp->file_length)){
+        commandError = SEFILE_OPEN_ERROR;
+    }
+
     memcpy(hFile, &hTmp, sizeof(hTmp));
     return commandError;
 }
 
 uint16_t secure_create(char *path, SEFILE_FHANDLE *hFile, int mode){
+    return secure_ctx_create(EnvCtx, path, hFile, mode);
+}
+
+uint16_t secure_ctx_create(SEFILE_CTX ctx, char *path, SEFILE_FHANDLE *hFile, int mode){
     uint16_t commandError=0;
     char enc_filename[MAX_PATHNAME], *filename=NULL;
     uint16_t lenc=0;
@@ -460,7 +768,7 @@ uint16_t secure_create(char *path, SEFILE_FHANDLE *hFile, int mode){
 #ifdef _WIN32
     DWORD nBytesWritten = 0;
 #endif
-    if(check_env()){
+    if(check_ctx(ctx)){
         return SEFILE_CREATE_ERROR;
     }
     memset(enc_filename, 0, MAX_PATHNAME*sizeof(char));
@@ -473,6 +781,8 @@ uint16_t secure_create(char *path, SEFILE_FHANDLE *hFile, int mode){
 
         return SEFILE_CREATE_ERROR;
     }
+    hTmp->ctx = ctx;
+    cache_init(hTmp);
 
     /* create phase start */
 #if defined(__linux__) || defined(__APPLE__)
@@ -514,6 +824,10 @@ uint16_t secure_create(char *path, SEFILE_FHANDLE *hFile, int mode){
     memcpy(hTmp->nonce_ctr, buff->header.nonce_ctr, 16);
     se3c_rand(SEFILE_NONCE_LEN, buff->header.nonce_pbkdf2);
     memcpy(hTmp->nonce_pbkdf2, buff->header.nonce_pbkdf2, SEFILE_NONCE_LEN);
+    if (open_sessions(hTmp)){
+        commandError=SEFILE_CREATE_ERROR;
+    }
+    hTmp->file_length=0;
     buff->header.uid=0;
     buff->header.uid_cnt=0;
     buff->header.ver=0;
@@ -537,7 +851,7 @@ uint16_t secure_create(char *path, SEFILE_FHANDLE *hFile, int mode){
     se3c_rand(random_padding, padding_ptr);
 
 
-    if (crypt_header(buff, buffEnc, SEFILE_SECTOR_DATA_SIZE, SE3_DIR_ENCRYPT)){
+    if (crypt_header(hTmp->ctx, buff, buffEnc, SEFILE_SECTOR_DATA_SIZE, SE3_DIR_ENCRYPT)){
         free(buff);
         free(buffEnc);
         return SEFILE_CREATE_ERROR;
@@ -569,155 +883,123 @@ uint16_t secure_create(char *path, SEFILE_FHANDLE *hFile, int mode){
 
 uint16_t secure_write(SEFILE_FHANDLE *hFile, uint8_t * dataIn, uint32_t dataIn_len){
     SEFILE_FHANDLE hTmp=NULL;
-    int32_t absOffset=0, sectOffset=0;
+    int64_t absOffset=0;
+    int32_t sectOffset=0, endOffset=0;
+    int32_t nSectors=0, last=0, i=0;
+    int32_t start=0, end=0;
+    bool oldFirst=false, oldLast=false;
     SEFILE_SECTOR *cryptBuff=NULL, *decryptBuff=NULL;
-    int length = 0;
-    size_t current_position = SEFILE_SECTOR_SIZE;
+    uint32_t length = 0;
+    uint64_t current_position = SEFILE_SECTOR_SIZE, end_position = 0;
     size_t random_padding = 0;
     uint8_t *padding_ptr = NULL;
-#if defined(__linux__) || defined(__APPLE__)
-    int nBytesRead=0;
-#elif _WIN32
-    DWORD nBytesWritten=0, nBytesRead=0;
-#endif
+    uint16_t ret = 0;
 
-    if(check_env() || hFile==NULL){
+    if(hFile==NULL || check_ctx((*hFile)->ctx)){
         return SEFILE_WRITE_ERROR;
     }
     hTmp=*hFile;
     if (dataIn_len == 0){
         return 0;
     }
-    //    if (secure_sync(hFile)){
-    //        return SEFILE_WRITE_ERROR;
-    //    }
-    //move the pointer to the begin of the sector
-#if defined(__linux__) || defined(__APPLE__)
-    if((absOffset=lseek(hTmp->fd, 0, SEEK_CUR))<0 || absOffset!=hTmp->log_offset){
+    if((absOffset=move_filepointer(hTmp, 0, SEFILE_CURRENT))<0 || absOffset!=hTmp->log_offset){
 
         return SEFILE_WRITE_ERROR;
     }
-    current_position = lseek(hTmp->fd,((int32_t)(absOffset/SEFILE_SECTOR_SIZE))*SEFILE_SECTOR_SIZE, SEEK_SET);
-#elif _WIN32
-    if((absOffset=SetFilePointer(hTmp->fd, 0, NULL, FILE_CURRENT))<0 || absOffset!=hTmp->log_offset){
 
-        return SEFILE_WRITE_ERROR;
-    }
-    current_position = SetFilePointer(hTmp->fd,((int32_t)(absOffset/SEFILE_SECTOR_SIZE))*SEFILE_SECTOR_SIZE, NULL, FILE_BEGIN);
-#endif
-
-    cryptBuff=(SEFILE_SECTOR *)calloc(1, sizeof(SEFILE_SECTOR));
-    decryptBuff=(SEFILE_SECTOR *)calloc(1, sizeof(SEFILE_SECTOR));
+    cryptBuff=(SEFILE_SECTOR *)calloc(SEFILE_BATCH_SECTORS, sizeof(SEFILE_SECTOR));
+    decryptBuff=(SEFILE_SECTOR *)calloc(SEFILE_BATCH_SECTORS, sizeof(SEFILE_SECTOR));
     if(cryptBuff==NULL || decryptBuff==NULL){
-
+        free(cryptBuff);
+        free(decryptBuff);
         return SEFILE_WRITE_ERROR;
     }
-    //save the relative position inside the sector
+    //begin of the current sector and relative position inside it
+    current_position=(absOffset/SEFILE_SECTOR_SIZE)*SEFILE_SECTOR_SIZE;
     sectOffset=absOffset%SEFILE_SECTOR_SIZE;
-    //read the whole sector and move back the pointer
-#if defined(__linux__) || defined(__APPLE__)
-    nBytesRead=read(hTmp->fd, cryptBuff, SEFILE_SECTOR_SIZE);
-#elif _WIN32
-    ReadFile(hTmp->fd, cryptBuff, SEFILE_SECTOR_SIZE, &nBytesRead, NULL);
-#endif
-    if(nBytesRead>0){
 
-        if (decrypt_sectors(cryptBuff, decryptBuff, SEFILE_SECTOR_DATA_SIZE, POS_TO_CIPHER_BLOCK(current_position), hTmp->nonce_ctr, hTmp->nonce_pbkdf2)){
-            free(cryptBuff);
-            free(decryptBuff);
-            return SEFILE_WRITE_ERROR;
-        }
-        //sector integrity check
-        if (memcmp(cryptBuff->signature, decryptBuff->signature, B5_SHA256_DIGEST_SIZE)){
-            free(cryptBuff);
-            free(decryptBuff);
-            return SEFILE_SIGNATURE_MISMATCH;
-        }
-
-
-
-#if defined(__linux__) || defined(__APPLE__)
-        lseek(hTmp->fd, (-1)*SEFILE_SECTOR_SIZE, SEEK_CUR);
-#elif _WIN32
-        SetFilePointer(hTmp->fd, (-1)*SEFILE_SECTOR_SIZE, NULL, FILE_CURRENT);
-#endif
-
-    }else{
-        //sector empty
-        decryptBuff->len=0;
-    }
     do{
-        //fill the sector with input data until datain are over or the sector is full
-        length = dataIn_len < SEFILE_LOGIC_DATA-sectOffset? dataIn_len : SEFILE_LOGIC_DATA-sectOffset;
-        memcpy(decryptBuff->data+sectOffset, dataIn, length);
-
-        //update sector data length if needed
-        if( (length + (sectOffset)) > decryptBuff->len){
-            decryptBuff->len = length + sectOffset;
+        //sectors touched by this batch and the amount of dataIn they hold
+        nSectors=(sectOffset+dataIn_len+SEFILE_LOGIC_DATA-1)/SEFILE_LOGIC_DATA;
+        if(nSectors>SEFILE_BATCH_SECTORS){
+            nSectors=SEFILE_BATCH_SECTORS;
         }
-        /*Padding must be random! (known plaintext attack)*/
-        padding_ptr = decryptBuff->data + decryptBuff->len;
-        random_padding = decryptBuff->data + SEFILE_LOGIC_DATA - padding_ptr;
-        se3c_rand(random_padding, padding_ptr);
-
-
-        //encrypt sector
-        if (crypt_sectors(decryptBuff, cryptBuff, SEFILE_SECTOR_DATA_SIZE, POS_TO_CIPHER_BLOCK(current_position), hTmp->nonce_ctr, hTmp->nonce_pbkdf2)){
-            free(cryptBuff);
-            free(decryptBuff);
-            return SEFILE_WRITE_ERROR;
+        last=nSectors-1;
+        length=nSectors*SEFILE_LOGIC_DATA-sectOffset;
+        if(length>dataIn_len){
+            length=dataIn_len;
         }
+        endOffset=sectOffset+length-last*SEFILE_LOGIC_DATA;
 
-
-        /* writeback sector into file phase start */
-#if defined(__linux__) || defined (__APPLE__)
-
-        if(write(hTmp->fd, cryptBuff, SEFILE_SECTOR_SIZE) != SEFILE_SECTOR_SIZE){
-            free(cryptBuff);
-            free(decryptBuff);
-            return SEFILE_WRITE_ERROR;
+        //only the sectors partially overwritten need their old content
+        oldFirst=(sectOffset>0);
+        oldLast=(endOffset<SEFILE_LOGIC_DATA && !(last==0 && oldFirst));
+        if(oldFirst && (ret=load_sector(hTmp, current_position, decryptBuff, &oldFirst))){
+            break;
+        }
+        if(oldLast && (ret=load_sector(hTmp, current_position+last*SEFILE_SECTOR_SIZE, decryptBuff+last, &oldLast))){
+            break;
         }
 
-#elif _WIN32
-
-        if (WriteFile(hTmp->fd, cryptBuff, SEFILE_SECTOR_SIZE, &nBytesWritten, NULL) == FALSE){
-            free(cryptBuff);
-            free(decryptBuff);
-            return SEFILE_WRITE_ERROR;
+        //fill the sectors with input data
+        for(i=0;i<nSectors;i++){
+            start=(i==0)? sectOffset : 0;
+            end=(i==last)? endOffset : SEFILE_LOGIC_DATA;
+            if(!((i==0 && oldFirst) || (i==last && oldLast))){
+                decryptBuff[i].len=0;
+            }
+            memcpy(decryptBuff[i].data+start, dataIn, end-start);
+            dataIn+=end-start;
+            //update sector data length if needed
+            if(end>decryptBuff[i].len){
+                decryptBuff[i].len=end;
+            }
+            /*Padding must be random! (known plaintext attack)*/
+            padding_ptr = decryptBuff[i].data + decryptBuff[i].len;
+            random_padding = decryptBuff[i].data + SEFILE_LOGIC_DATA - padding_ptr;
+            se3c_rand(random_padding, padding_ptr);
         }
 
-        if(nBytesWritten != (DWORD) SEFILE_SECTOR_SIZE){
-            free(cryptBuff);
-            free(decryptBuff);
-            return SEFILE_WRITE_ERROR;
+        if(hTmp->cache_size>0){
+            //write-back: the file is updated on eviction, sync, seek and close
+            if((ret=cache_store(hTmp, current_position, decryptBuff, nSectors, true))){
+                break;
+            }
+        }else{
+            //encrypt and write back the whole batch
+            if (crypt_sectors(hTmp->ctx, decryptBuff, cryptBuff, nSectors, POS_TO_CIPHER_BLOCK(current_position), hTmp->nonce_ctr, hTmp->enc_sess_id, hTmp->n_sessions)){
+                ret=SEFILE_WRITE_ERROR;
+                break;
+            }
+            if((ret=write_sectors(hTmp, current_position, cryptBuff, nSectors))){
+                break;
+            }
         }
 
-#endif
-        /* writeback sector into file phase end */
-        current_position += SEFILE_SECTOR_SIZE;
         dataIn_len-=length;
-        dataIn+=length;
-        sectOffset=(sectOffset+length)%(SEFILE_LOGIC_DATA);
-        decryptBuff->len=0;
-
+        current_position+=last*SEFILE_SECTOR_SIZE;
+        sectOffset=endOffset;
+        if(sectOffset==SEFILE_LOGIC_DATA){
+            current_position+=SEFILE_SECTOR_SIZE;
+            sectOffset=0;
+        }
+        //the file grows if data were written past its end
+        end_position=((current_position/SEFILE_SECTOR_SIZE)-1)*SEFILE_LOGIC_DATA+sectOffset;
+        if(end_position>hTmp->file_length){
+            hTmp->file_length=end_position;
+        }
     }while(dataIn_len>0); //cycles unless all dataIn are processed
 
-    //move the pointer inside the last sector written
-    if(sectOffset!=0){
-#if defined(__linux__) || defined(__APPLE__)
-        hTmp->log_offset=lseek(hTmp->fd, (sectOffset - SEFILE_SECTOR_SIZE), SEEK_CUR);
-#elif _WIN32
-        hTmp->log_offset = SetFilePointer(hTmp->fd, (LONG)(sectOffset - SEFILE_SECTOR_SIZE), NULL, FILE_CURRENT);
-#endif
-    }else{
-#if defined(__linux__) || defined(__APPLE__)
-        hTmp->log_offset=lseek(hTmp->fd, 0, SEEK_CUR);
-#elif _WIN32
-        hTmp->log_offset=SetFilePointer(hTmp->fd, 0, NULL, FILE_CURRENT);
-#endif
-    }
     free(cryptBuff);
     free(decryptBuff);
+    if(ret){
+        //keep the file pointer where the caller expects it
+        move_filepointer(hTmp, hTmp->log_offset, SEFILE_BEGIN);
+        return ret;
+    }
+
+    //move the pointer inside the last sector written
+    hTmp->log_offset=move_filepointer(hTmp, current_position+sectOffset, SEFILE_BEGIN);
     return 0;
 }
 
@@ -725,19 +1007,19 @@ uint16_t secure_write(SEFILE_FHANDLE *hFile, uint8_t * dataIn, uint32_t dataIn_l
 
 uint16_t secure_read(SEFILE_FHANDLE *hFile,  uint8_t * dataOut, uint32_t dataOut_len, uint32_t * bytesRead){
     SEFILE_FHANDLE hTmp=NULL;
-    int32_t absOffset=0, sectOffset=0;
+    int64_t absOffset=0;
+    int32_t sectOffset=0;
+    int32_t nSectors=0, nRead=0, nMiss=0, i=0;
     uint32_t dataRead=0;
     SEFILE_SECTOR *cryptBuff=NULL, *decryptBuff=NULL;
+    SEFILE_CACHE_ENTRY *entry=NULL;
     int length = 0;
-    size_t current_position = SEFILE_SECTOR_SIZE;
+    uint64_t current_position = SEFILE_SECTOR_SIZE;
     int32_t data_remaining = 0;
-#if defined(__linux__) || defined(__APPLE__)
-    int nBytesRead=0;
-#elif _WIN32
-    DWORD nBytesRead=0;
-#endif
+    bool eof = false, cached = false;
+    uint16_t ret = 0;
 
-    if(check_env() || hFile==NULL){
+    if(hFile==NULL || check_ctx((*hFile)->ctx)){
         return SEFILE_READ_ERROR;
     }
     if (dataOut_len == 0){
@@ -745,97 +1027,126 @@ uint16_t secure_read(SEFILE_FHANDLE *hFile,  uint8_t * dataOut, uint32_t dataOut
         return 0;
     }
     hTmp=*hFile;
-    //    if (secure_sync(hFile)){
-    //        return SEFILE_WRITE_ERROR;
-    //    }
-    //move the pointer to the begin of the sector
-#if defined(__linux__) || defined(__APPLE__)
-    if((absOffset=lseek(hTmp->fd, 0, SEEK_CUR))<0 || absOffset!=hTmp->log_offset){
+    if((absOffset=move_filepointer(hTmp, 0, SEFILE_CURRENT))<0 || absOffset!=hTmp->log_offset){
 
         return SEFILE_READ_ERROR;
     }
-    current_position = lseek(hTmp->fd,((int32_t)(absOffset/SEFILE_SECTOR_SIZE))*SEFILE_SECTOR_SIZE, SEEK_SET);
-#elif _WIN32
-    if((absOffset=SetFilePointer(hTmp->fd, 0, NULL, FILE_CURRENT))<0 || absOffset!=hTmp->log_offset){
 
-        return SEFILE_READ_ERROR;
-    }
-    current_position = SetFilePointer(hTmp->fd, ((int32_t)(absOffset / SEFILE_SECTOR_SIZE))*SEFILE_SECTOR_SIZE, NULL, FILE_BEGIN);
-#endif
-
-    cryptBuff=(SEFILE_SECTOR *)calloc(1, sizeof(SEFILE_SECTOR));
-    decryptBuff=(SEFILE_SECTOR *)calloc(1, sizeof(SEFILE_SECTOR));
+    cryptBuff=(SEFILE_SECTOR *)calloc(SEFILE_BATCH_SECTORS, sizeof(SEFILE_SECTOR));
+    decryptBuff=(SEFILE_SECTOR *)calloc(SEFILE_BATCH_SECTORS, sizeof(SEFILE_SECTOR));
     if(cryptBuff==NULL || decryptBuff==NULL){
+        free(cryptBuff);
+        free(decryptBuff);
         return SEFILE_READ_ERROR;
     }
-    //save the relative position inside the sector
+    //begin of the current sector and relative position inside it
+    current_position=(absOffset/SEFILE_SECTOR_SIZE)*SEFILE_SECTOR_SIZE;
     sectOffset=absOffset%SEFILE_SECTOR_SIZE;
 
     do{
-        //read the whole sector
-#if defined(__linux__) || defined(__APPLE__)
-        nBytesRead=read(hTmp->fd, cryptBuff, SEFILE_SECTOR_SIZE);
-#elif _WIN32
-        ReadFile(hTmp->fd, cryptBuff, SEFILE_SECTOR_SIZE, &nBytesRead, NULL);
-#endif
-        if(nBytesRead>0){
-            
-            if (decrypt_sectors(cryptBuff, decryptBuff, SEFILE_SECTOR_DATA_SIZE, POS_TO_CIPHER_BLOCK(current_position), hTmp->nonce_ctr, hTmp->nonce_pbkdf2)){
-                free(cryptBuff);
-                free(decryptBuff);
-                return SEFILE_READ_ERROR;
+        //read as many sectors as needed (up to a batch) with a single call
+        nSectors=(sectOffset+dataOut_len+SEFILE_LOGIC_DATA-1)/SEFILE_LOGIC_DATA;
+        if(nSectors>SEFILE_BATCH_SECTORS){
+            nSectors=SEFILE_BATCH_SECTORS;
+        }
+        //leading sectors already cached do not need the device
+        for(nRead=0;nRead<nSectors && (entry=cache_lookup(hTmp, current_position+nRead*SEFILE_SECTOR_SIZE))!=NULL;nRead++){
+            memcpy(decryptBuff+nRead, &entry->sector, sizeof(SEFILE_SECTOR));
+        }
+        cached=(nRead>0);
+        if(nRead==0){
+            //fetch the following uncached sectors with a single call
+            for(nMiss=1;nMiss<nSectors && cache_lookup(hTmp, current_position+nMiss*SEFILE_SECTOR_SIZE)==NULL;nMiss++);
+            if((nRead=read_sectors(hTmp, current_position, cryptBuff, nMiss))<0){
+                ret=SEFILE_READ_ERROR;
+                break;
+            }
+            if(nRead==0){
+                break;
+            }
+            if (decrypt_sectors(hTmp->ctx, cryptBuff, decryptBuff, nRead, POS_TO_CIPHER_BLOCK(current_position), hTmp->nonce_ctr, hTmp->dec_sess_id, hTmp->n_sessions)){
+                ret=SEFILE_READ_ERROR;
+                break;
             }
             //sector integrity check
-            if (memcmp(cryptBuff->signature, decryptBuff->signature, B5_SHA256_DIGEST_SIZE)){
-                free(cryptBuff);
-                free(decryptBuff);
-                return SEFILE_SIGNATURE_MISMATCH;
+            if((ret=verify_sectors(cryptBuff, decryptBuff, nRead))){
+                break;
+            }
+            hTmp->cache_misses+=nRead;
+            if((ret=cache_store(hTmp, current_position, decryptBuff, nRead, false))){
+                break;
             }
-
-        }else{
-            break;
         }
 
-        data_remaining = (decryptBuff->len) - sectOffset; //remaining data in THIS sector
-        length = dataOut_len < SEFILE_LOGIC_DATA-sectOffset? dataOut_len : SEFILE_LOGIC_DATA-sectOffset;
-
-        if(data_remaining<length)
-            length = data_remaining;
+        for(i=0;i<nRead && dataOut_len>0;i++){
+            data_remaining = (decryptBuff[i].len) - sectOffset; //remaining data in THIS sector
+            length = dataOut_len < SEFILE_LOGIC_DATA-sectOffset? dataOut_len : SEFILE_LOGIC_DATA-sectOffset;
+
+            if(data_remaining<length)
+                length = data_remaining > 0 ? data_remaining : 0;
+
+            memcpy(dataOut+dataRead, decryptBuff[i].data+sectOffset, length);
+            dataOut_len-=length;
+            dataRead+=length;
+            sectOffset+=length;
+            if(sectOffset==SEFILE_LOGIC_DATA){
+                current_position+=SEFILE_SECTOR_SIZE;
+                sectOffset=0;
+            }else if(dataOut_len>0){
+                //last sector of the file
+                eof=true;
+            }
+        }
+        if(cached){
+            //only the sectors actually copied count as hits
+            hTmp->cache_hits+=i;
+        }
+    }while(dataOut_len>0 && !eof); //cycles unless all data requested are read
 
-        memcpy(dataOut+dataRead, decryptBuff->data+sectOffset, length);
-        current_position += SEFILE_SECTOR_SIZE;
-        dataOut_len-=length;
-        dataRead+=length;
-        sectOffset=(sectOffset+length)%SEFILE_LOGIC_DATA;
-    }while(dataOut_len>0); //cycles unless all data requested are read
+    free(cryptBuff);
+    free(decryptBuff);
+    if(ret){
+        move_filepointer(hTmp, hTmp->log_offset, SEFILE_BEGIN);
+        return ret;
+    }
 
     //move the pointer inside the last sector read
-    if(sectOffset!=0){
-#if defined(__linux__) || defined(__APPLE__)
-        hTmp->log_offset=lseek(hTmp->fd, (-1)*(SEFILE_SECTOR_SIZE-sectOffset), SEEK_CUR);//todo check sectoffset
-#elif _WIN32
-        hTmp->log_offset=SetFilePointer(hTmp->fd,(-1)*(SEFILE_SECTOR_SIZE-sectOffset), NULL, FILE_CURRENT);
-#endif
-    }else{
-#if defined(__linux__) || defined(__APPLE__)
-        hTmp->log_offset=lseek(hTmp->fd, 0, SEEK_CUR);//todo check sectoffset
-#elif _WIN32
-        hTmp->log_offset=SetFilePointer(hTmp->fd, 0, NULL, FILE_CURRENT);
-#endif
-    }
+    hTmp->log_offset=move_filepointer(hTmp, current_position+sectOffset, SEFILE_BEGIN);
     *bytesRead=dataRead;
-    free(cryptBuff);
-    free(decryptBuff);
     return 0;
 }
 
 uint16_t secure_seek(SEFILE_FHANDLE *hFile, int32_t offset, int32_t *position, uint8_t whence){
-    int32_t dest=0, tmp=0, buffer_size=0;
-    int32_t overhead=0, absOffset=0, sectOffset=0;
+    int64_t position64=0;
+    uint16_t ret=0;
+
+    if(hFile==NULL || check_ctx((*hFile)->ctx)){
+        return SEFILE_SEEK_ERROR;
+    }
+    //the destination is checked before anything moves or is written
+    if(whence==SEFILE_BEGIN){
+        position64=offset;
+    }else if(whence==SEFILE_CURRENT){
+        position64=((*hFile)->log_offset%SEFILE_SECTOR_SIZE)+(((*hFile)->log_offset/SEFILE_SECTOR_SIZE)-1)*SEFILE_LOGIC_DATA+offset;
+    }else if(whence==SEFILE_END){
+        position64=(int64_t)(*hFile)->file_length+offset;
+    }
+    if(position64>INT32_MAX){	//not representable, secure_seek64() must be used
+        *position=-1;
+        return SEFILE_SEEK_ERROR;
+    }
+    ret=secure_seek64(hFile, offset, &position64, whence);
+    *position=(int32_t)position64;
+    return ret;
+}
+
+uint16_t secure_seek64(SEFILE_FHANDLE *hFile, int64_t offset, int64_t *position, uint8_t whence){
+    int64_t dest=0, tmp=0, buffer_size=0, chunk=0;
+    int64_t overhead=0, absOffset=0, sectOffset=0;
     uint8_t * buffer=NULL;
-    uint32_t file_length=0;
+    uint64_t file_length=0;
     SEFILE_FHANDLE hTmp=NULL;
-    if(check_env() || hFile==NULL){
+    if(hFile==NULL || check_ctx((*hFile)->ctx)){
         return SEFILE_SEEK_ERROR;
     }
     hTmp=*hFile;
@@ -846,19 +1157,13 @@ uint16_t secure_seek(SEFILE_FHANDLE *hFile, int32_t offset, int32_t *position, u
     //    if (secure_sync(hFile)){
     //        return SEFILE_WRITE_ERROR;
     //    }
-#if defined(__linux__) || defined(__APPLE__)
-    if((absOffset=lseek(hTmp->fd, 0, SEEK_CUR))<0 || absOffset!=hTmp->log_offset){
-        return SEFILE_SEEK_ERROR;
-    }
-#elif _WIN32
-    if((absOffset=SetFilePointer(hTmp->fd, 0, NULL, FILE_CURRENT))<0 || absOffset!=hTmp->log_offset){
-
+    if(cache_flush(hTmp)){
         return SEFILE_SEEK_ERROR;
     }
-#endif
-    if(get_filesize(&hTmp, &file_length)){
+    if((absOffset=move_filepointer(hTmp, 0, SEFILE_CURRENT))<0 || absOffset!=hTmp->log_offset){
         return SEFILE_SEEK_ERROR;
     }
+    file_length=hTmp->file_length;
 
     sectOffset=absOffset%SEFILE_SECTOR_SIZE;
 
@@ -913,45 +1218,36 @@ uint16_t secure_seek(SEFILE_FHANDLE *hFile, int32_t offset, int32_t *position, u
     }
 
     *position=(dest%SEFILE_SECTOR_SIZE)+(((dest/SEFILE_SECTOR_SIZE)-1)*SEFILE_LOGIC_DATA);
-    buffer_size=*position-file_length;
+    buffer_size=*position-(int64_t)file_length;
 
     if(buffer_size>0){ 			//if destination exceed the end of the file, empty sectors are inserted at the end of the file to keep the file consistency
-        buffer=calloc(buffer_size, sizeof(uint8_t));
+        //zeros are written one batch at a time, the gap may be bigger than the memory
+        chunk=buffer_size<SEFILE_BATCH_SECTORS*SEFILE_LOGIC_DATA ? buffer_size : SEFILE_BATCH_SECTORS*SEFILE_LOGIC_DATA;
+        buffer=calloc((size_t)chunk, sizeof(uint8_t));
         if(buffer==NULL){
             return SEFILE_SEEK_ERROR;
         }
-        if((file_length%SEFILE_LOGIC_DATA)){
-#if defined(__linux__) || defined(__APPLE__)
-            hTmp->log_offset=lseek(hTmp->fd, ((file_length%SEFILE_LOGIC_DATA)-SEFILE_SECTOR_SIZE), SEEK_END);
-#elif _WIN32
-            hTmp->log_offset=SetFilePointer(hTmp->fd, ((file_length%SEFILE_LOGIC_DATA)-SEFILE_SECTOR_SIZE), NULL, FILE_END);
-#endif
-        }
-        if(secure_write(&hTmp, buffer, buffer_size)){
-            free(buffer);
-            return SEFILE_SEEK_ERROR;
+        //the zeros are appended at the current end of the file
+        tmp=((file_length/SEFILE_LOGIC_DATA)+1)*SEFILE_SECTOR_SIZE+(file_length%SEFILE_LOGIC_DATA);
+        hTmp->log_offset=move_filepointer(hTmp, tmp, SEFILE_BEGIN);
+        while(buffer_size>0){
+            if(chunk>buffer_size){
+                chunk=buffer_size;
+            }
+            if(secure_write(&hTmp, buffer, (uint32_t)chunk)){
+                free(buffer);
+                return SEFILE_SEEK_ERROR;
+            }
+            buffer_size-=chunk;
         }
         free(buffer);
     } else {
-
-#if defined(__linux__) || defined(__APPLE__)
-
-        tmp=lseek(hTmp->fd, (off_t) dest, SEEK_SET);
-        if(( tmp == -1)){
+        tmp=move_filepointer(hTmp, dest, SEFILE_BEGIN);
+        if(tmp == -1){
 
             return SEFILE_SEEK_ERROR;
         }
 
-#elif _WIN32
-
-        tmp = SetFilePointer( hTmp->fd, dest, NULL, FILE_BEGIN);
-
-        if ( tmp == INVALID_SET_FILE_POINTER){
-
-            return SEFILE_SEEK_ERROR;
-        }
-#endif
-
         hTmp->log_offset=tmp;
     }
 
@@ -959,23 +1255,33 @@ uint16_t secure_seek(SEFILE_FHANDLE *hFile, int32_t offset, int32_t *position, u
 }
 
 uint16_t secure_truncate(SEFILE_FHANDLE *hFile, uint32_t size){
+    return secure_truncate64(hFile, size);
+}
+
+uint16_t secure_truncate64(SEFILE_FHANDLE *hFile, uint64_t size){
 
     SEFILE_FHANDLE hTmp = *hFile;
-    uint32_t fPosition = 0;
-    int rOffset = 0, nSector = 0; //New Relative offset & new number of sectors
+    int64_t fPosition = 0;
+    int rOffset = 0; //New Relative offset
+    int64_t nSector = 0; //New number of sectors
     uint8_t *buffer = NULL;
-    uint32_t aSize = 0, bytesRead = 0;
+    uint64_t aSize = 0;
+    uint32_t bytesRead = 0;
 
     //    if (secure_sync(hFile)){
     //        return SEFILE_WRITE_ERROR;
     //    }
+    if(cache_flush(hTmp)){
+        return SEFILE_TRUNCATE_ERROR;
+    }
+    cache_drop(hTmp);
 
     if(get_filesize(hFile, &aSize)){
         return SEFILE_TRUNCATE_ERROR;
     }
 
     if(aSize < size){ //File should be enlarged
-        if (secure_seek(hFile, (size-aSize), (int32_t*)&fPosition, SEFILE_END) || fPosition != size+aSize){
+        if (secure_seek64(hFile, (int64_t)(size-aSize), &fPosition, SEFILE_END) || (uint64_t)fPosition != size){
             return SEFILE_TRUNCATE_ERROR;
         }
     }else{
@@ -983,19 +1289,11 @@ uint16_t secure_truncate(SEFILE_FHANDLE *hFile, uint32_t size){
         rOffset = size % SEFILE_LOGIC_DATA; //Relative offset inside a sector
         nSector = (size / SEFILE_LOGIC_DATA) + 1; //Number of sectors in a file (including header)
 
-#if defined(__linux__) || defined(__APPLE__)
-        hTmp->log_offset = lseek(hTmp->fd, nSector*SEFILE_SECTOR_SIZE, SEEK_SET);
+        hTmp->log_offset = move_filepointer(hTmp, nSector*SEFILE_SECTOR_SIZE, SEFILE_BEGIN);
         if(hTmp->log_offset < 0){
 
             return SEFILE_TRUNCATE_ERROR;
         }
-#elif _WIN32
-        hTmp->log_offset = SetFilePointer(hTmp->fd, nSector*SEFILE_SECTOR_SIZE, NULL, FILE_BEGIN);
-        if(hTmp->log_offset == INVALID_SET_FILE_POINTER){
-
-            return SEFILE_TRUNCATE_ERROR;
-        }
-#endif
 
         buffer=(uint8_t *)malloc(rOffset*(sizeof(uint8_t)));
         if(buffer == NULL){
@@ -1005,27 +1303,25 @@ uint16_t secure_truncate(SEFILE_FHANDLE *hFile, uint32_t size){
         if(secure_read(&hTmp, buffer, rOffset, &bytesRead)){
             return SEFILE_TRUNCATE_ERROR;
         }
-#if defined(__linux__) || defined(__APPLE__)
-        hTmp->log_offset = lseek(hTmp->fd, nSector*SEFILE_SECTOR_SIZE, SEEK_SET);
+        //cached sectors would outlive the truncation
+        cache_drop(hTmp);
+        hTmp->log_offset = move_filepointer(hTmp, nSector*SEFILE_SECTOR_SIZE, SEFILE_BEGIN);
         if(hTmp->log_offset < 0){
 
             return SEFILE_TRUNCATE_ERROR;
         }
-        if(ftruncate(hTmp->fd, nSector*SEFILE_SECTOR_SIZE)){	//truncate
+#if defined(__linux__) || defined(__APPLE__)
+        if(ftruncate(hTmp->fd, (off_t)(nSector*SEFILE_SECTOR_SIZE))){	//truncate
 
             return SEFILE_TRUNCATE_ERROR;
         }
 #elif _WIN32
-        hTmp->log_offset = SetFilePointer(hTmp->fd, nSector*SEFILE_SECTOR_SIZE, NULL, FILE_BEGIN);
-        if(hTmp->log_offset == INVALID_SET_FILE_POINTER){
-
-            return SEFILE_TRUNCATE_ERROR;
-        }
         if(!SetEndOfFile(hTmp->fd)){	//truncate
 
             return SEFILE_TRUNCATE_ERROR;
         }
 #endif
+        hTmp->file_length = size - rOffset;
 
         if(secure_write(&hTmp, buffer, rOffset)){
             return SEFILE_TRUNCATE_ERROR;
@@ -1036,13 +1332,23 @@ uint16_t secure_truncate(SEFILE_FHANDLE *hFile, uint32_t size){
 }
 
 uint16_t secure_close(SEFILE_FHANDLE *hFile){
-    SEFILE_FHANDLE hTmp=*hFile;
-    if(check_env()){
+    SEFILE_FHANDLE hTmp=NULL;
+    uint16_t ret=0;
+    if(hFile==NULL || check_ctx((*hFile)->ctx)){
         return SEFILE_CLOSE_HANDLE_ERR;
     }
+    hTmp=*hFile;
     //    if (secure_sync(hFile)){
     //        return SEFILE_WRITE_ERROR;
     //    }
+    if(hFile!=NULL){
+        //dirty sectors are lost if they cannot be written back
+        if(cache_flush(hTmp)){
+            ret=SEFILE_WRITE_ERROR;
+        }
+        close_sessions(hTmp);
+        free(hTmp->cache);
+    }
 #if defined(__linux__) || defined(__APPLE__)
     if(hFile!=NULL){
         if(close(hTmp->fd) == -1 ){
@@ -1069,38 +1375,47 @@ uint16_t secure_close(SEFILE_FHANDLE *hFile){
     }
 #endif
 
-    return 0;
+    return ret;
 }
 
 uint16_t secure_ls(char *path, char *list, uint32_t * list_length){
+    return secure_ctx_ls(EnvCtx, path, list, list_length);
+}
+
+uint16_t secure_ctx_ls(SEFILE_CTX ctx, char *path, char *list, uint32_t * list_length){
     uint16_t commandError=0;
     char bufferEnc[MAX_PATHNAME], bufferDec[MAX_PATHNAME], *pFile=NULL;
     uint16_t encoded_length=0;
-    char cwd[MAX_PATHNAME];
+    char entry[MAX_PATHNAME];
 #ifdef _WIN32
     HANDLE hDir;
     WIN32_FIND_DATA dDir;
 #endif
     memset(bufferEnc, 0, MAX_PATHNAME*sizeof(char));
     memset(bufferDec, 0, MAX_PATHNAME*sizeof(char));
-    memset(cwd, 0, MAX_PATHNAME*sizeof(char));
-    if(check_env() || list == NULL){
+    memset(entry, 0, MAX_PATHNAME*sizeof(char));
+    if(check_ctx(ctx) || path == NULL || list == NULL){
         return SEFILE_LS_ERROR;
     }
     *list_length=0;
+    /* entries are reached through path, the process working directory is left untouched */
 #if defined(__linux__) || defined(__APPLE__)
     DIR *hDir=NULL;
     struct dirent *dDir;
-    getcwd(cwd, MAX_PATHNAME);
-    chdir(path);
     pFile=list;
-    hDir=opendir(".");
+    if((hDir=opendir(path))==NULL){
+        return SEFILE_LS_ERROR;
+    }
     while((dDir=readdir(hDir))!=NULL){
         if((!strcmp(dDir->d_name,"."))||(!strcmp(dDir->d_name,".."))){
             continue;
-        }else if(dDir->d_type==DT_DIR){
+        }
+        if(snprintf(entry, MAX_PATHNAME, "%s/%s", path, dDir->d_name) >= MAX_PATHNAME){
+            continue;
+        }
+        if(dDir->d_type==DT_DIR){
             if(valid_name(dDir->d_name)) continue;
-            commandError=decrypt_dirname(dDir->d_name, bufferDec);
+            commandError=decrypt_dirname(ctx, entry, bufferDec);
             if(commandError==SEFILE_USER_NOT_ALLOWED){
                 continue;
             }else if(commandError==0){
@@ -1110,13 +1425,15 @@ uint16_t secure_ls(char *path, char *list, uint32_t * list_length){
                 memset(bufferEnc, 0, MAX_PATHNAME*sizeof(char));
                 memset(bufferDec, 0, MAX_PATHNAME*sizeof(char));
             }else {
+                closedir(hDir);
                 return SEFILE_LS_ERROR;
             }
         }else if(dDir->d_type==DT_REG){
-            if(valid_name(dDir->d_name) || decrypt_filename(dDir->d_name, bufferDec)){
+            if(valid_name(dDir->d_name) || decrypt_filename(ctx, entry, bufferDec)){
                 continue;
             }
             if(crypto_filename(bufferDec, bufferEnc, &encoded_length)){
+                closedir(hDir);
                 return SEFILE_LS_ERROR;
             }
             if(!strncmp(bufferEnc, dDir->d_name,encoded_length)){//user allowed
@@ -1130,21 +1447,27 @@ uint16_t secure_ls(char *path, char *list, uint32_t * list_length){
 
     }
     closedir(hDir);
-    chdir(cwd);
 #elif _WIN32
 
-    GetCurrentDirectory(MAX_PATHNAME, cwd);
-    SetCurrentDirectory(path);
-
     pFile=list;
 
-    hDir=FindFirstFile("*", &dDir);
+    if(snprintf(entry, MAX_PATHNAME, "%s\\*", path) >= MAX_PATHNAME){
+        return SEFILE_LS_ERROR;
+    }
+    hDir=FindFirstFile(entry, &dDir);
+    if(hDir==INVALID_HANDLE_VALUE){
+        return SEFILE_LS_ERROR;
+    }
     do{
         if((!strcmp(dDir.cFileName,"."))||(!strcmp(dDir.cFileName,".."))){
             continue;
-        }else if(dDir.dwFileAttributes==FILE_ATTRIBUTE_DIRECTORY){
+        }
+        if(snprintf(entry, MAX_PATHNAME, "%s\\%s", path, dDir.cFileName) >= MAX_PATHNAME){
+            continue;
+        }
+        if(dDir.dwFileAttributes==FILE_ATTRIBUTE_DIRECTORY){
             if(valid_name(dDir.cFileName)) continue;
-            commandError=decrypt_dirname(dDir.cFileName, bufferDec);
+            commandError=decrypt_dirname(ctx, entry, bufferDec);
             if(commandError==SEFILE_USER_NOT_ALLOWED){
                 continue;
             }else if(commandError==0){
@@ -1152,13 +1475,15 @@ uint16_t secure_ls(char *path, char *list, uint32_t * list_length){
                 pFile+=(1+strlen(bufferDec));
                 *list_length+=(1+strlen(bufferDec));
             }else {
+                FindClose(hDir);
                 return SEFILE_LS_ERROR;
             }
         }else{
-            if(valid_name(dDir.cFileName) || decrypt_filename(dDir.cFileName, bufferDec)){
+            if(valid_name(dDir.cFileName) || decrypt_filename(ctx, entry, bufferDec)){
                 continue;
             }
             if(crypto_filename(bufferDec, bufferEnc, &encoded_length)){
+                FindClose(hDir);
                 return SEFILE_LS_ERROR;
             }
             if(!strncmp(bufferEnc, dDir.cFileName,encoded_length)){//user allowed
@@ -1170,7 +1495,6 @@ uint16_t secure_ls(char *path, char *list, uint32_t * list_length){
 
     }while(FindNextFile(hDir, &dDir));
     FindClose(hDir);
-    SetCurrentDirectory(cwd);
 
 #endif
 
@@ -1179,14 +1503,48 @@ uint16_t secure_ls(char *path, char *list, uint32_t * list_length){
 }
 
 uint16_t secure_getfilesize(char *path, uint32_t * position){
+    uint64_t position64 = 0;
+    uint16_t ret = SE3_OK;
+
+    ret = secure_getfilesize64(path, &position64);
+    if(ret){
+        return ret;
+    }
+    if(position64 > UINT32_MAX){	//not representable, secure_getfilesize64() must be used
+        return SEFILE_FILESIZE_ERROR;
+    }
+    *position = (uint32_t)position64;
+    return 0;
+}
+
+uint16_t secure_getfilesize64(char *path, uint64_t * position){
+    return secure_ctx_getfilesize64(EnvCtx, path, position);
+}
+
+uint16_t secure_ctx_getfilesize(SEFILE_CTX ctx, char *path, uint32_t * position){
+    uint64_t position64 = 0;
+    uint16_t ret = SE3_OK;
+
+    ret = secure_ctx_getfilesize64(ctx, path, &position64);
+    if(ret){
+        return ret;
+    }
+    if(position64 > UINT32_MAX){	//not representable, secure_ctx_getfilesize64() must be used
+        return SEFILE_FILESIZE_ERROR;
+    }
+    *position = (uint32_t)position64;
+    return 0;
+}
+
+uint16_t secure_ctx_getfilesize64(SEFILE_CTX ctx, char *path, uint64_t * position){
     uint16_t ret = SE3_OK;
     SEFILE_FHANDLE hFile=NULL;
 
-    if(check_env()){
+    if(check_ctx(ctx)){
         return SEFILE_FILESIZE_ERROR;
     }
 
-    if (secure_open(path, &hFile, SEFILE_READ, SEFILE_OPEN )){
+    if (secure_ctx_open(ctx, path, &hFile, SEFILE_READ, SEFILE_OPEN )){
         return SEFILE_FILESIZE_ERROR;
     }
 
@@ -1199,6 +1557,10 @@ uint16_t secure_getfilesize(char *path, uint32_t * position){
 }
 
 uint16_t secure_mkdir(char *path){
+    return secure_ctx_mkdir(EnvCtx, path);
+}
+
+uint16_t secure_ctx_mkdir(SEFILE_CTX ctx, char *path){
     char encDirname[MAX_PATHNAME];
     uint32_t enc_len = 0;
 #ifdef _WIN32
@@ -1207,11 +1569,11 @@ uint16_t secure_mkdir(char *path){
     int errValue = 0;
 #endif
     memset(encDirname, 0, MAX_PATHNAME*sizeof(char));
-    if(check_env()){
+    if(check_ctx(ctx)){
         return SEFILE_MKDIR_ERROR;
     }
 
-    if(crypt_dirname(path, encDirname, &enc_len) || enc_len > MAX_PATHNAME){
+    if(crypt_ctx_dirname(ctx, path, encDirname, &enc_len) || enc_len > MAX_PATHNAME){
         return SEFILE_MKDIR_ERROR;
     }
 #if defined(__linux__)||defined(__APPLE__)
@@ -1316,14 +1678,14 @@ uint16_t crypto_filename(char *path, char *enc_name, uint16_t *encoded_length){
     return 0;
 }
 
-uint16_t check_env(){
-    if(EnvSession == NULL || EnvKeyID == NULL || EnvCrypto == NULL ){
+uint16_t check_ctx(SEFILE_CTX ctx){
+    if(ctx == NULL){
         return SEFILE_ENV_NOT_SET;
     }
     return 0;
 }
 
-uint16_t crypt_header(void *buff1, void *buff2, size_t datain_len, uint16_t direction){
+uint16_t crypt_header(SEFILE_CTX ctx, void *buff1, void *buff2, size_t datain_len, uint16_t direction){
     enum {
         MAX_DATA_IN = SE3_CRYPTO_MAX_DATAIN - (SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA + SEFILE_BLOCK_SIZE) - SEFILE_NONCE_LEN
     };
@@ -1341,19 +1703,19 @@ uint16_t crypt_header(void *buff1, void *buff2, size_t datain_len, uint16_t dire
     curr_chunk = datain_len < MAX_DATA_IN ? datain_len : MAX_DATA_IN;
 
 
-    error = L1_crypto_init(EnvSession, *EnvCrypto, SE3_FEEDBACK_ECB | direction, *EnvKeyID, &enc_sess_id);
+    error = L1_worker_crypto_init(ctx->worker, &ctx->session, ctx->crypto, SE3_FEEDBACK_ECB | direction, ctx->keyID, &enc_sess_id);
     if (error != SE3_OK) {
         return error;
     }
-    error = L1_crypto_update(EnvSession, enc_sess_id, SE3_CRYPTO_FLAG_SETNONCE, SEFILE_NONCE_LEN, nonce_pbkdf2, 0, NULL, NULL, NULL);
+    error = L1_worker_crypto_update(ctx->worker, &ctx->session, enc_sess_id, SE3_CRYPTO_FLAG_SETNONCE, SEFILE_NONCE_LEN, nonce_pbkdf2, 0, NULL, NULL, NULL);
     if (error != SE3_OK) {
         return error;
     }
     do {
         if (datain_len - curr_chunk)
-            error = L1_crypto_update(EnvSession, enc_sess_id, SE3_FEEDBACK_ECB | direction, 0, NULL, curr_chunk, sp + SEFILE_NONCE_LEN, &curr_len, rp + SEFILE_NONCE_LEN);
+            error = L1_worker_crypto_update(ctx->worker, &ctx->session, enc_sess_id, SE3_FEEDBACK_ECB | direction, 0, NULL, curr_chunk, sp + SEFILE_NONCE_LEN, &curr_len, rp + SEFILE_NONCE_LEN);
         else
-            error = L1_crypto_update(EnvSession, enc_sess_id, flag_reset_auth | SE3_CRYPTO_FLAG_FINIT, 0, NULL, curr_chunk, sp + SEFILE_NONCE_LEN, &curr_len, rp + SEFILE_NONCE_LEN);
+            error = L1_worker_crypto_update(ctx->worker, &ctx->session, enc_sess_id, flag_reset_auth | SE3_CRYPTO_FLAG_FINIT, 0, NULL, curr_chunk, sp + SEFILE_NONCE_LEN, &curr_len, rp + SEFILE_NONCE_LEN);
 
         if(error) break;
         datain_len -= curr_chunk;
@@ -1366,7 +1728,7 @@ uint16_t crypt_header(void *buff1, void *buff2, size_t datain_len, uint16_t dire
 
     return(error);
 }
-void compute_blk_offset(size_t current_offset, uint8_t* nonce){
+void compute_blk_offset(uint64_t current_offset, uint8_t* nonce){
     uint8_t i = 15, old_v;
     uint16_t cb;
     do{
@@ -1377,105 +1739,409 @@ void compute_blk_offset(size_t current_offset, uint8_t* nonce){
         if (cb) nonce[i - 1]++;
     } while (i-- && current_offset > 0);
 }
-uint16_t crypt_sectors(void *buff_decrypt, void *buff_crypt, size_t datain_len, size_t current_offset, uint8_t* nonce_ctr, uint8_t* nonce_pbkdf2){
-
-    enum {
-        MAX_DATA_IN = SE3_CRYPTO_MAX_DATAIN - (SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA + SEFILE_BLOCK_SIZE) - B5_SHA256_DIGEST_SIZE
-    };
-    uint8_t* sp = buff_decrypt, *rp = buff_crypt;
+/** \brief Sectors processed by \ref crypt_range, see \ref crypt_sectors*/
+typedef struct crypt_range_args_ {
+    SEFILE_CTX ctx;
+    SEFILE_SECTOR *src;
+    SEFILE_SECTOR *dst;
+    uint64_t current_offset;
+    uint8_t* nonce_ctr;
+    const uint32_t* sess_id;
+} crypt_range_args;
+
+/* run by L1_worker_for on the worker of the device, so the session is used directly */
+static uint16_t crypt_range(void* arg, size_t device, size_t begin, size_t end){
+    crypt_range_args *a = (crypt_range_args*)arg;
+    se3_session *s = ctx_session(a->ctx, device, NULL);
     uint16_t error = SE3_OK;
     uint16_t curr_len = 0;
-    uint32_t enc_sess_id = 0;
-    size_t curr_chunk = datain_len < MAX_DATA_IN ? datain_len : MAX_DATA_IN;
     uint8_t nonce_local[16];
-    uint16_t flag_reset_auth = datain_len < MAX_DATA_IN ? SE3_CRYPTO_FLAG_RESET | SE3_CRYPTO_FLAG_AUTH : SE3_CRYPTO_FLAG_AUTH;
+    size_t i = 0;
+
+    for (i = begin; i < end; i++) {
+        /* the IV of each sector is always derived from its absolute position */
+        memcpy(nonce_local, a->nonce_ctr, 16);
+        compute_blk_offset(a->current_offset + i*(SEFILE_SECTOR_DATA_SIZE / SEFILE_BLOCK_SIZE), nonce_local);
+        /* every sector carries its own signature, so it needs its own AUTH update */
+        error = L1_crypto_update(s, a->sess_id[device], SE3_CRYPTO_FLAG_RESET | SE3_CRYPTO_FLAG_AUTH, SEFILE_BLOCK_SIZE, nonce_local, SEFILE_SECTOR_DATA_SIZE, (uint8_t*)(a->src + i), &curr_len, (uint8_t*)(a->dst + i));
+        if (error) break;
+    }
+    return(error);
+}
 
-    if (datain_len < 0 || buff_crypt == NULL)
+/* sectors are claimed one at a time by the devices of the handle, see L1_worker_for */
+static uint16_t crypt_pool(SEFILE_CTX ctx, SEFILE_SECTOR *src, SEFILE_SECTOR *dst, size_t n_sectors, uint64_t current_offset, uint8_t* nonce_ctr, const uint32_t* sess_id, size_t n_sessions){
+    crypt_range_args args;
+    se3_worker *workers[SEFILE_POOL_MAX];
+    size_t i = 0;
+
+    if (n_sectors == 0 || src == NULL || dst == NULL || sess_id == NULL || n_sessions == 0 || n_sessions > ctx->n_devices)
         return(SE3_ERR_PARAMS);
+    for (i = 0; i < n_sessions; i++) {
+        if (sess_id[i] == SE3_SESSION_INVALID)
+            return(SE3_ERR_PARAMS);
+        ctx_session(ctx, i, &workers[i]);
+    }
+    /* a single sector is not worth waking more than one device */
+    if (n_sectors < n_sessions)
+        n_sessions = n_sectors;
+
+    args.ctx = ctx;
+    args.src = src;
+    args.dst = dst;
+    args.current_offset = current_offset;
+    args.nonce_ctr = nonce_ctr;
+    args.sess_id = sess_id;
+    return L1_worker_for(workers, n_sessions, n_sectors, 1, crypt_range, &args);
+}
+
+uint16_t crypt_sectors(SEFILE_CTX ctx, void *buff_decrypt, void *buff_crypt, size_t n_sectors, uint64_t current_offset, uint8_t* nonce_ctr, const uint32_t* sess_id, size_t n_sessions){
+    return crypt_pool(ctx, (SEFILE_SECTOR*)buff_decrypt, (SEFILE_SECTOR*)buff_crypt, n_sectors, current_offset, nonce_ctr, sess_id, n_sessions);
+}
+
+uint16_t decrypt_sectors(SEFILE_CTX ctx, void *buff_crypt, void *buff_decrypt, size_t n_sectors, uint64_t current_offset, uint8_t* nonce_ctr, const uint32_t* sess_id, size_t n_sessions){
+    return crypt_pool(ctx, (SEFILE_SECTOR*)buff_crypt, (SEFILE_SECTOR*)buff_decrypt, n_sectors, current_offset, nonce_ctr, sess_id, n_sessions);
+}
 
-    error = L1_crypto_init(EnvSession, *EnvCrypto, SE3_FEEDBACK_CTR | SE3_DIR_ENCRYPT, *EnvKeyID, &enc_sess_id);
+se3_session *ctx_session(SEFILE_CTX ctx, size_t device, se3_worker **worker){
+    if (device == 0) {
+        if (worker != NULL) *worker = ctx->worker;
+        return &ctx->session;
+    }
+    if (worker != NULL) *worker = ctx->pool_worker[device - 1];
+    return &ctx->pool[device - 1];
+}
+
+uint16_t probe_key(SEFILE_CTX ctx, size_t device, SEFILE_SECTOR *out){
+    SEFILE_SECTOR zero;
+    uint8_t nonce[SEFILE_NONCE_LEN];
+    uint8_t iv[SEFILE_BLOCK_SIZE];
+    uint32_t sess_id = SE3_SESSION_INVALID;
+    uint16_t curr_len = 0, error = SE3_OK;
+    se3_worker *worker = NULL;
+    se3_session *s = ctx_session(ctx, device, &worker);
+
+    memset(&zero, 0, sizeof(zero));
+    memset(nonce, 0, sizeof(nonce));
+    memset(iv, 0, sizeof(iv));
+    memset(out, 0, sizeof(SEFILE_SECTOR));
+    error = L1_worker_crypto_init(worker, s, ctx->crypto, SE3_FEEDBACK_CTR | SE3_DIR_ENCRYPT, ctx->keyID, &sess_id);
     if (error != SE3_OK) {
         return error;
     }
-    error = L1_crypto_update(EnvSession, enc_sess_id, SE3_CRYPTO_FLAG_SETNONCE, SEFILE_NONCE_LEN, nonce_pbkdf2, 0, NULL, NULL, NULL);
+    error = L1_worker_crypto_update(worker, s, sess_id, SE3_CRYPTO_FLAG_SETNONCE, SEFILE_NONCE_LEN, nonce, 0, NULL, NULL, NULL);
+    if (error == SE3_OK) {
+        error = L1_worker_crypto_update(worker, s, sess_id, SE3_CRYPTO_FLAG_RESET | SE3_CRYPTO_FLAG_AUTH, SEFILE_BLOCK_SIZE, iv, SEFILE_SECTOR_DATA_SIZE, (uint8_t*)&zero, &curr_len, (uint8_t*)out);
+    }
+    L1_worker_crypto_update(worker, s, sess_id, SE3_CRYPTO_FLAG_FINIT, 0, NULL, 0, NULL, NULL, NULL);
+    return error;
+}
+
+uint16_t open_sessions(SEFILE_FHANDLE hFile){
+    uint16_t error = SE3_OK;
+    se3_session *s = NULL;
+    se3_worker *worker = NULL;
+    size_t i = 0;
+
+    hFile->n_sessions = 0;
+    for (i = 0; i < hFile->ctx->n_devices && error == SE3_OK; i++) {
+        /* every device derives the same sector key from the same nonce */
+        s = ctx_session(hFile->ctx, i, &worker);
+        hFile->enc_sess_id[i] = SE3_SESSION_INVALID;
+        hFile->dec_sess_id[i] = SE3_SESSION_INVALID;
+        hFile->n_sessions = i + 1;
+        error = L1_worker_crypto_init(worker, s, hFile->ctx->crypto, SE3_FEEDBACK_CTR | SE3_DIR_ENCRYPT, hFile->ctx->keyID, &hFile->enc_sess_id[i]);
+        if (error == SE3_OK) {
+            error = L1_worker_crypto_update(worker, s, hFile->enc_sess_id[i], SE3_CRYPTO_FLAG_SETNONCE, SEFILE_NONCE_LEN, hFile->nonce_pbkdf2, 0, NULL, NULL, NULL);
+        }
+        if (error == SE3_OK) {
+            error = L1_worker_crypto_init(worker, s, hFile->ctx->crypto, SE3_FEEDBACK_CTR | SE3_DIR_DECRYPT, hFile->ctx->keyID, &hFile->dec_sess_id[i]);
+        }
+        if (error == SE3_OK) {
+            error = L1_worker_crypto_update(worker, s, hFile->dec_sess_id[i], SE3_CRYPTO_FLAG_SETNONCE, SEFILE_NONCE_LEN, hFile->nonce_pbkdf2, 0, NULL, NULL, NULL);
+        }
+    }
     if (error != SE3_OK) {
-        return error;
+        close_sessions(hFile);
     }
-    memcpy(nonce_local, nonce_ctr, 16);
-    compute_blk_offset(current_offset, nonce_local);
-    do {
+    return error;
+}
 
-        if (datain_len - curr_chunk)
-            error = L1_crypto_update(EnvSession, enc_sess_id, SE3_CRYPTO_FLAG_RESET | SE3_FEEDBACK_CTR | SE3_DIR_ENCRYPT, SEFILE_BLOCK_SIZE, nonce_local, curr_chunk, sp, &curr_len, rp);
-        else
-            error = L1_crypto_update(EnvSession, enc_sess_id, flag_reset_auth | SE3_CRYPTO_FLAG_FINIT, SEFILE_BLOCK_SIZE, nonce_local, curr_chunk, sp, &curr_len, rp);
+uint16_t close_sessions(SEFILE_FHANDLE hFile){
+    uint16_t error = SE3_OK, ret = SE3_OK;
+    se3_session *s = NULL;
+    se3_worker *worker = NULL;
+    size_t i = 0;
+
+    for (i = 0; i < hFile->n_sessions; i++) {
+        s = ctx_session(hFile->ctx, i, &worker);
+        if (hFile->enc_sess_id[i] != SE3_SESSION_INVALID) {
+            error = L1_worker_crypto_update(worker, s, hFile->enc_sess_id[i], SE3_CRYPTO_FLAG_FINIT, 0, NULL, 0, NULL, NULL, NULL);
+            if (ret == SE3_OK) ret = error;
+            hFile->enc_sess_id[i] = SE3_SESSION_INVALID;
+        }
+        if (hFile->dec_sess_id[i] != SE3_SESSION_INVALID) {
+            error = L1_worker_crypto_update(worker, s, hFile->dec_sess_id[i], SE3_CRYPTO_FLAG_FINIT, 0, NULL, 0, NULL, NULL, NULL);
+            if (ret == SE3_OK) ret = error;
+            hFile->dec_sess_id[i] = SE3_SESSION_INVALID;
+        }
+    }
+    hFile->n_sessions = 0;
+    return ret;
+}
 
-        if(error) break;
-        compute_blk_offset(((curr_len - B5_SHA256_DIGEST_SIZE) / SEFILE_BLOCK_SIZE), nonce_local);
-        datain_len -= curr_chunk;
-        sp += curr_chunk;
-        rp += curr_chunk;
-        curr_chunk = datain_len < MAX_DATA_IN ? datain_len : MAX_DATA_IN;
-    } while (datain_len > 0);
+uint16_t verify_sectors(SEFILE_SECTOR *buff_crypt, SEFILE_SECTOR *buff_decrypt, size_t n_sectors){
+    size_t i = 0;
+    for (i = 0; i < n_sectors; i++) {
+        if (memcmp(buff_crypt[i].signature, buff_decrypt[i].signature, B5_SHA256_DIGEST_SIZE)) {
+            return SEFILE_SIGNATURE_MISMATCH;
+        }
+    }
+    return 0;
+}
 
+int32_t read_sectors(SEFILE_FHANDLE hFile, uint64_t position, SEFILE_SECTOR *buff, size_t n_sectors){
+    size_t total = 0;
+#if defined(__linux__) || defined(__APPLE__)
+    ssize_t nBytesRead = 0;
 
-    return(error);
+    if (move_filepointer(hFile, (int64_t)position, SEFILE_BEGIN) == -1) {
+        return -1;
+    }
+    while (total < n_sectors*SEFILE_SECTOR_SIZE) {
+        nBytesRead = read(hFile->fd, ((uint8_t*)buff) + total, n_sectors*SEFILE_SECTOR_SIZE - total);
+        if (nBytesRead < 0) {
+            return -1;
+        }
+        if (nBytesRead == 0) {
+            break;
+        }
+        total += nBytesRead;
+    }
+#elif _WIN32
+    DWORD nBytesRead = 0;
+
+    if (move_filepointer(hFile, (int64_t)position, SEFILE_BEGIN) == -1) {
+        return -1;
+    }
+    while (total < n_sectors*SEFILE_SECTOR_SIZE) {
+        if (ReadFile(hFile->fd, ((uint8_t*)buff) + total, (DWORD)(n_sectors*SEFILE_SECTOR_SIZE - total), &nBytesRead, NULL) == FALSE) {
+            return -1;
+        }
+        if (nBytesRead == 0) {
+            break;
+        }
+        total += nBytesRead;
+    }
+#endif
+    return (int32_t)(total / SEFILE_SECTOR_SIZE);
 }
-uint16_t decrypt_sectors(void *buff_crypt, void *buff_decrypt, size_t datain_len, size_t current_offset, uint8_t* nonce_ctr, uint8_t* nonce_pbkdf2){
 
-    enum {
-        MAX_DATA_IN = SE3_CRYPTO_MAX_DATAIN - (SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA + SEFILE_BLOCK_SIZE) - B5_SHA256_DIGEST_SIZE
-    };
-    uint8_t* sp = buff_crypt, *rp = buff_decrypt;
-    uint16_t error = SE3_OK;
-    uint16_t curr_len = 0;
-    uint32_t enc_sess_id = 0;
-    size_t curr_chunk = datain_len < MAX_DATA_IN ? datain_len : MAX_DATA_IN;
-    uint8_t nonce_local[16];
-    uint16_t flag_reset_auth = datain_len < MAX_DATA_IN ? SE3_CRYPTO_FLAG_RESET | SE3_CRYPTO_FLAG_AUTH : SE3_CRYPTO_FLAG_AUTH;
+uint16_t write_sectors(SEFILE_FHANDLE hFile, uint64_t position, SEFILE_SECTOR *buff, size_t n_sectors){
+#if defined(__linux__) || defined(__APPLE__)
+    if (move_filepointer(hFile, (int64_t)position, SEFILE_BEGIN) == -1) {
+        return SEFILE_WRITE_ERROR;
+    }
+    if (write(hFile->fd, buff, n_sectors*SEFILE_SECTOR_SIZE) != (ssize_t)(n_sectors*SEFILE_SECTOR_SIZE)) {
+        return SEFILE_WRITE_ERROR;
+    }
+#elif _WIN32
+    DWORD nBytesWritten = 0;
 
-    if (datain_len < 0 || buff_crypt == NULL)
-        return(SE3_ERR_PARAMS);
+    if (move_filepointer(hFile, (int64_t)position, SEFILE_BEGIN) == -1) {
+        return SEFILE_WRITE_ERROR;
+    }
+    if (WriteFile(hFile->fd, buff, (DWORD)(n_sectors*SEFILE_SECTOR_SIZE), &nBytesWritten, NULL) == FALSE ||
+        nBytesWritten != (DWORD)(n_sectors*SEFILE_SECTOR_SIZE)) {
+        return SEFILE_WRITE_ERROR;
+    }
+#endif
+    return 0;
+}
 
+int64_t move_filepointer(SEFILE_FHANDLE hFile, int64_t offset, uint8_t whence){
+#if defined(__linux__) || defined(__APPLE__)
+    return (int64_t)lseek(hFile->fd, (off_t)offset, whence);
+#elif _WIN32
+    LARGE_INTEGER distance, position;
 
-    error = L1_crypto_init(EnvSession, *EnvCrypto, SE3_FEEDBACK_CTR | SE3_DIR_DECRYPT, *EnvKeyID, &enc_sess_id);
-    if (error != SE3_OK) {
-        return error;
+    distance.QuadPart = offset;
+    if (SetFilePointerEx(hFile->fd, distance, &position, whence) == 0) {
+        return -1;
     }
-    error = L1_crypto_update(EnvSession, enc_sess_id, SE3_CRYPTO_FLAG_SETNONCE, SEFILE_NONCE_LEN, nonce_pbkdf2, 0, NULL, NULL, NULL);
-    if (error != SE3_OK) {
-        return error;
+    return (int64_t)position.QuadPart;
+#endif
+}
+
+void cache_init(SEFILE_FHANDLE hFile){
+    hFile->cache = NULL;
+    hFile->cache_size = SEFILE_CACHE_SECTORS;
+    hFile->cache_clock = 0;
+    hFile->cache_hits = 0;
+    hFile->cache_misses = 0;
+}
+
+SEFILE_CACHE_ENTRY *cache_lookup(SEFILE_FHANDLE hFile, uint64_t position){
+    uint32_t i = 0;
+
+    if (hFile->cache == NULL) {
+        return NULL;
     }
-    memcpy(nonce_local, nonce_ctr, 16);
-    compute_blk_offset(current_offset, nonce_local);
-    do {
+    for (i = 0; i < hFile->cache_size; i++) {
+        if (hFile->cache[i].position == position) {
+            hFile->cache[i].last_use = ++hFile->cache_clock;
+            return &hFile->cache[i];
+        }
+    }
+    return NULL;
+}
 
-        if (datain_len - curr_chunk)
-            error = L1_crypto_update(EnvSession, enc_sess_id, SE3_CRYPTO_FLAG_RESET | SE3_FEEDBACK_CTR | SE3_DIR_DECRYPT, SEFILE_BLOCK_SIZE, nonce_local, curr_chunk, sp, &curr_len, rp);
-        else
-            error = L1_crypto_update(EnvSession, enc_sess_id, flag_reset_auth | SE3_CRYPTO_FLAG_FINIT, SEFILE_BLOCK_SIZE, nonce_local, curr_chunk, sp, &curr_len, rp);
+uint16_t cache_store(SEFILE_FHANDLE hFile, uint64_t position, SEFILE_SECTOR *buff, size_t n_sectors, bool dirty){
+    SEFILE_CACHE_ENTRY *entry = NULL;
+    uint16_t ret = 0;
+    uint32_t j = 0;
+    size_t i = 0;
 
-        if(error) break;
-        compute_blk_offset(((curr_len-B5_SHA256_DIGEST_SIZE) / SEFILE_BLOCK_SIZE), nonce_local);
-        datain_len -= curr_chunk;
-        sp += curr_chunk;
-        rp += curr_chunk;
-        curr_chunk = datain_len < MAX_DATA_IN ? datain_len : MAX_DATA_IN;
-    } while (datain_len > 0);
+    if (hFile->cache_size == 0) {
+        return 0;
+    }
+    if (hFile->cache == NULL) {
+        hFile->cache = (SEFILE_CACHE_ENTRY*)calloc(hFile->cache_size, sizeof(SEFILE_CACHE_ENTRY));
+        if (hFile->cache == NULL) {
+            return SEFILE_BUFFER_MALLOC_ERR;
+        }
+    }
+    for (i = 0; i < n_sectors; i++, position += SEFILE_SECTOR_SIZE) {
+        if ((entry = cache_lookup(hFile, position)) != NULL) {
+            if (!dirty) {
+                continue;
+            }
+        } else {
+            //free slot or least recently used one
+            entry = &hFile->cache[0];
+            for (j = 0; j < hFile->cache_size && entry->position != 0; j++) {
+                if (hFile->cache[j].position == 0 || hFile->cache[j].last_use < entry->last_use) {
+                    entry = &hFile->cache[j];
+                }
+            }
+            if (entry->dirty && (ret = cache_flush(hFile))) {
+                return ret;
+            }
+            entry->position = position;
+            entry->last_use = ++hFile->cache_clock;
+        }
+        memcpy(&entry->sector, buff + i, sizeof(SEFILE_SECTOR));
+        entry->dirty = dirty;
+    }
+    return 0;
+}
 
+static int cache_cmp(const void *a, const void *b){
+    uint64_t pa = (*(SEFILE_CACHE_ENTRY* const*)a)->position, pb = (*(SEFILE_CACHE_ENTRY* const*)b)->position;
+    return (pa > pb) - (pa < pb);
+}
 
-    return(error);
+uint16_t cache_flush(SEFILE_FHANDLE hFile){
+    SEFILE_CACHE_ENTRY **dirty = NULL;
+    SEFILE_SECTOR *plainBuff = NULL, *cryptBuff = NULL;
+    uint32_t nDirty = 0, i = 0, n = 0, k = 0;
+    uint16_t ret = 0;
+
+    if (hFile->cache == NULL) {
+        return 0;
+    }
+    for (i = 0; i < hFile->cache_size; i++) {
+        if (hFile->cache[i].dirty) nDirty++;
+    }
+    if (nDirty == 0) {
+        return 0;
+    }
+    dirty = (SEFILE_CACHE_ENTRY**)malloc(nDirty * sizeof(SEFILE_CACHE_ENTRY*));
+    plainBuff = (SEFILE_SECTOR*)calloc(SEFILE_BATCH_SECTORS, sizeof(SEFILE_SECTOR));
+    cryptBuff = (SEFILE_SECTOR*)calloc(SEFILE_BATCH_SECTORS, sizeof(SEFILE_SECTOR));
+    if (dirty == NULL || plainBuff == NULL || cryptBuff == NULL) {
+        free(dirty);
+        free(plainBuff);
+        free(cryptBuff);
+        return SEFILE_BUFFER_MALLOC_ERR;
+    }
+    for (i = 0, n = 0; i < hFile->cache_size; i++) {
+        if (hFile->cache[i].dirty) dirty[n++] = &hFile->cache[i];
+    }
+    qsort(dirty, nDirty, sizeof(SEFILE_CACHE_ENTRY*), cache_cmp);
+
+    for (i = 0; i < nDirty; i += n) {
+        //consecutive sectors are written with a single call
+        for (n = 0; i + n < nDirty && n < SEFILE_BATCH_SECTORS && dirty[i + n]->position == dirty[i]->position + n*SEFILE_SECTOR_SIZE; n++) {
+            memcpy(plainBuff + n, &dirty[i + n]->sector, sizeof(SEFILE_SECTOR));
+        }
+        if (crypt_sectors(hFile->ctx, plainBuff, cryptBuff, n, POS_TO_CIPHER_BLOCK(dirty[i]->position), hFile->nonce_ctr, hFile->enc_sess_id, hFile->n_sessions)) {
+            ret = SEFILE_WRITE_ERROR;
+            break;
+        }
+        if ((ret = write_sectors(hFile, dirty[i]->position, cryptBuff, n))) {
+            break;
+        }
+        for (k = 0; k < n; k++) {
+            dirty[i + k]->dirty = false;
+        }
+    }
+    free(dirty);
+    free(plainBuff);
+    free(cryptBuff);
+
+    move_filepointer(hFile, hFile->log_offset, SEFILE_BEGIN);
+    return ret;
 }
 
-uint16_t get_filesize(SEFILE_FHANDLE *hFile, uint32_t * length){
+void cache_drop(SEFILE_FHANDLE hFile){
+    if (hFile->cache != NULL) {
+        memset(hFile->cache, 0, hFile->cache_size * sizeof(SEFILE_CACHE_ENTRY));
+    }
+}
+
+uint16_t load_sector(SEFILE_FHANDLE hFile, uint64_t position, SEFILE_SECTOR *buff, bool *found){
+    SEFILE_CACHE_ENTRY *entry = NULL;
+    SEFILE_SECTOR cryptBuff;
+    int32_t nRead = 0;
+
+    *found = true;
+    if ((entry = cache_lookup(hFile, position)) != NULL) {
+        memcpy(buff, &entry->sector, sizeof(SEFILE_SECTOR));
+        hFile->cache_hits++;
+        return 0;
+    }
+    if ((nRead = read_sectors(hFile, position, &cryptBuff, 1)) < 0) {
+        return SEFILE_READ_ERROR;
+    }
+    if (nRead == 0) {
+        *found = false;
+        return 0;
+    }
+    hFile->cache_misses++;
+    if (decrypt_sectors(hFile->ctx, &cryptBuff, buff, 1, POS_TO_CIPHER_BLOCK(position), hFile->nonce_ctr, hFile->dec_sess_id, hFile->n_sessions)) {
+        return SEFILE_READ_ERROR;
+    }
+    return verify_sectors(&cryptBuff, buff, 1);
+}
+
+uint16_t get_filesize(SEFILE_FHANDLE *hFile, uint64_t * length){
+    if(hFile==NULL || length==NULL){
+
+        return SEFILE_FILESIZE_ERROR;
+    }
+    *length=(*hFile)->file_length;
+    return 0;
+}
+
+uint16_t read_filesize(SEFILE_FHANDLE *hFile, uint64_t * length){
     SEFILE_SECTOR *crypt_buffer=NULL, *decrypt_buffer=NULL;
-    int32_t total_size=0;
+    int64_t total_size=0;
     SEFILE_FHANDLE hTmp=NULL;
+    int64_t orig_off;
 #if defined(__linux__) || defined(__APPLE__)
-    off_t orig_off;
     size_t BytesRead = 0;
 #elif _WIN32
-    DWORD orig_off;
     DWORD BytesRead = 0;
 #endif
     if(hFile==NULL){
@@ -1522,31 +2188,31 @@ uint16_t get_filesize(SEFILE_FHANDLE *hFile, uint32_t * length){
         return SEFILE_SEEK_ERROR;
     }
 #elif _WIN32
-    orig_off=SetFilePointer(hTmp->fd, 0, 0, FILE_CURRENT);
-    total_size=SetFilePointer(hTmp->fd, (-1)*(SEFILE_SECTOR_SIZE), NULL, FILE_END);
+    orig_off=move_filepointer(hTmp, 0, FILE_CURRENT);
+    total_size=move_filepointer(hTmp, (-1)*(SEFILE_SECTOR_SIZE), FILE_END);
 
-    if(orig_off==INVALID_SET_FILE_POINTER || total_size==INVALID_SET_FILE_POINTER){
+    if(orig_off==-1 || total_size==-1){
         free(crypt_buffer);
         free(decrypt_buffer);
 
         return SEFILE_SEEK_ERROR;
     }
     if(!total_size) {
-        SetFilePointer(hTmp->fd, orig_off, NULL, FILE_BEGIN);
+        move_filepointer(hTmp, orig_off, FILE_BEGIN);
         *length=0;
         free(crypt_buffer);
         free(decrypt_buffer);
         return 0;
     }
     if ((ReadFile(hTmp->fd, crypt_buffer, SEFILE_SECTOR_SIZE, &BytesRead, NULL))==0 || BytesRead!=SEFILE_SECTOR_SIZE){
-        SetFilePointer(hTmp->fd, orig_off, NULL, FILE_BEGIN);
+        move_filepointer(hTmp, orig_off, FILE_BEGIN);
         free(crypt_buffer);
         free(decrypt_buffer);
 
         return SEFILE_READ_ERROR;
     }
 
-    if((SetFilePointer(hTmp->fd, orig_off, NULL, FILE_BEGIN))==INVALID_SET_FILE_POINTER){
+    if(move_filepointer(hTmp, orig_off, FILE_BEGIN)==-1){
         free(crypt_buffer);
         free(decrypt_buffer);
 
@@ -1555,7 +2221,7 @@ uint16_t get_filesize(SEFILE_FHANDLE *hFile, uint32_t * length){
 
 #endif
 
-    if (decrypt_sectors(crypt_buffer, decrypt_buffer, SEFILE_SECTOR_DATA_SIZE, POS_TO_CIPHER_BLOCK(total_size), hTmp->nonce_ctr, hTmp->nonce_pbkdf2)){
+    if (decrypt_sectors(hTmp->ctx, crypt_buffer, decrypt_buffer, 1, POS_TO_CIPHER_BLOCK(total_size), hTmp->nonce_ctr, hTmp->dec_sess_id, hTmp->n_sessions)){
         free(crypt_buffer);
         free(decrypt_buffer);
         return SEFILE_FILESIZE_ERROR;
@@ -1572,7 +2238,7 @@ uint16_t get_filesize(SEFILE_FHANDLE *hFile, uint32_t * length){
     return 0;
 
 }
-uint16_t decrypt_filename(char *path, char *filename){
+uint16_t decrypt_filename(SEFILE_CTX ctx, char *path, char *filename){
     SEFILE_FHANDLE hFile=NULL;
 
     hFile=(SEFILE_FHANDLE)malloc(sizeof(struct SEFILE_HANDLE));
@@ -1580,6 +2246,11 @@ uint16_t decrypt_filename(char *path, char *filename){
 
         return SEFILE_FILENAME_DEC_ERROR;
     }
+    /* only the header is needed, no crypto session is opened */
+    hFile->ctx = ctx;
+    hFile->n_sessions = 0;
+    cache_init(hFile);
+    hFile->file_length = 0;
 #if defined(__linux__) || defined(__APPLE__)
     if((hFile->fd = open(path, O_RDONLY)) == -1 ){
 
@@ -1691,7 +2362,7 @@ uint16_t decrypt_filehandle(SEFILE_FHANDLE *hFile, char *filename){
     }
 #endif
 
-    if (crypt_header(header_buffer, bufferDec, SEFILE_SECTOR_DATA_SIZE, SE3_DIR_DECRYPT)){
+    if (crypt_header(hTmp->ctx, header_buffer, bufferDec, SEFILE_SECTOR_DATA_SIZE, SE3_DIR_DECRYPT)){
         free(header_buffer);
         free(bufferDec);
         return SEFILE_FILENAME_DEC_ERROR;
@@ -1713,11 +2384,15 @@ uint16_t decrypt_filehandle(SEFILE_FHANDLE *hFile, char *filename){
     return 0;
 }
 
-uint16_t encrypt_name(void* buff1, void* buff2, size_t size, uint16_t direction){
-    return L1_encrypt(EnvSession, *EnvCrypto, SE3_FEEDBACK_ECB | direction, *EnvKeyID, size, buff1, NULL, buff2);
+uint16_t encrypt_name(SEFILE_CTX ctx, void* buff1, void* buff2, size_t size, uint16_t direction){
+    return L1_worker_encrypt(ctx->worker, &ctx->session, ctx->crypto, SE3_FEEDBACK_ECB | direction, ctx->keyID, size, buff1, NULL, buff2);
 }
 
 uint16_t crypt_dirname(char *dirpath, char *encDirname, uint32_t* enc_len){
+    return crypt_ctx_dirname(EnvCtx, dirpath, encDirname, enc_len);
+}
+
+uint16_t crypt_ctx_dirname(SEFILE_CTX ctx, char *dirpath, char *encDirname, uint32_t* enc_len){
     uint16_t commandError=0;
     uint8_t *pDir=NULL;
     int32_t maxLen = 0;
@@ -1725,7 +2400,7 @@ uint16_t crypt_dirname(char *dirpath, char *encDirname, uint32_t* enc_len){
     uint8_t *buffDec=NULL, *buffEnc=NULL;
     int i=0;
 
-    if(check_env()) return SEFILE_DIRNAME_ENC_ERROR;
+    if(check_ctx(ctx)) return SEFILE_DIRNAME_ENC_ERROR;
     
     filename=strrchr(dirpath, '/');
     if(filename==NULL){
@@ -1751,14 +2426,14 @@ uint16_t crypt_dirname(char *dirpath, char *encDirname, uint32_t* enc_len){
     }
     memcpy(buffDec, filename, strlen(filename));
 
-    if((commandError = encrypt_name(buffDec, buffEnc, maxLen, SE3_DIR_ENCRYPT))){
+    if((commandError = encrypt_name(ctx, buffDec, buffEnc, maxLen, SE3_DIR_ENCRYPT))){
         free(buffDec);
         free(buffEnc);
         return commandError;
     }
     memcpy(encDirname, dirpath, filename-dirpath);
     pDir=encDirname+(filename-dirpath);
-    sprintf(pDir, "%08x", (uint32_t)*EnvKeyID);
+    sprintf(pDir, "%08x", (uint32_t)ctx->keyID);
     pDir+=8;
     for(i=0;i<maxLen;i++){
         sprintf(pDir+(i*2), "%02x", (uint8_t)buffEnc[i]);
@@ -1772,7 +2447,7 @@ uint16_t crypt_dirname(char *dirpath, char *encDirname, uint32_t* enc_len){
     return 0;
 }
 
-uint16_t decrypt_dirname(char *dirpath, char *decDirname){
+uint16_t decrypt_dirname(SEFILE_CTX ctx, char *dirpath, char *decDirname){
     uint16_t commandError=0;
     int32_t maxLen = 0;
     int32_t key=0;
@@ -1780,7 +2455,7 @@ uint16_t decrypt_dirname(char *dirpath, char *decDirname){
     char tmp[9], *pName;
     uint32_t i=0;
 
-    if(check_env()) return SEFILE_DIRNAME_ENC_ERROR;
+    if(check_ctx(ctx)) return SEFILE_DIRNAME_ENC_ERROR;
     memset(tmp, 0, 9);
     filename=strrchr(dirpath, '/');
     if(filename==NULL){
@@ -1807,8 +2482,8 @@ uint16_t decrypt_dirname(char *dirpath, char *decDirname){
     memcpy(tmp, filename, 8);
     key=strtol(tmp, NULL, 16);
 
-    if(*EnvKeyID==key){
-        if((commandError = encrypt_name(buffEnc, decDirname, maxLen/2, SE3_DIR_DECRYPT))){
+    if(ctx->keyID==key){
+        if((commandError = encrypt_name(ctx, buffEnc, decDirname, maxLen/2, SE3_DIR_DECRYPT))){
             free(buffEnc);
             return commandError;
         }
@@ -1834,10 +2509,13 @@ uint16_t secure_sync(SEFILE_FHANDLE *hFile){
     SEFILE_FHANDLE hTmp;
     uint16_t ret = SE3_OK;
 
-    if(check_env() || hFile == NULL){
+    if(hFile == NULL || check_ctx((*hFile)->ctx)){
         return SEFILE_SYNC_ERR;
     }
     hTmp = *hFile;
+    if(cache_flush(hTmp)){
+        return SEFILE_SYNC_ERR;
+    }
 #if defined(__linux__) || defined(__APPLE__)
     if(fsync(hTmp->fd)){
         ret = SEFILE_SYNC_ERR;
@@ -1849,3 +2527,28 @@ uint16_t secure_sync(SEFILE_FHANDLE *hFile){
 #endif
     return ret;
 }
+
+uint16_t secure_set_cache_size(SEFILE_FHANDLE *hFile, uint32_t n_sectors){
+    SEFILE_FHANDLE hTmp;
+
+    if(hFile == NULL || check_ctx((*hFile)->ctx)){
+        return SEFILE_CACHE_ERROR;
+    }
+    hTmp = *hFile;
+    if(cache_flush(hTmp)){
+        return SEFILE_CACHE_ERROR;
+    }
+    free(hTmp->cache);
+    hTmp->cache = NULL;
+    hTmp->cache_size = n_sectors;
+    return 0;
+}
+
+uint16_t secure_get_cache_stats(SEFILE_FHANDLE *hFile, uint32_t *hits, uint32_t *misses){
+    if(hFile == NULL || hits == NULL || misses == NULL){
+        return SEFILE_CACHE_ERROR;
+    }
+    *hits = (*hFile)->cache_hits;
+    *misses = (*hFile)->cache_misses;
+    return 0;
+}
@@ -25,6 +25,7 @@ extern "C" {
 #include <ctype.h>
 
 typedef struct SEFILE_HANDLE * SEFILE_FHANDLE;  /**< Data struct used to access encrypted files @hideinitializer */
+typedef struct SEFILE_CONTEXT * SEFILE_CTX;     /**< Environment (session, key and algorithm) used by the secure_ctx_* functions @hideinitializer */
 
 #ifdef __linux__
 ///    @cond linuxDef
@@ -217,6 +218,8 @@ typedef struct SEFILE_HANDLE * SEFILE_FHANDLE;  /**< Data struct used to access
 #define SEFILE_PATH_TOO_LONG        47
 #define SEFILE_SYNC_ERR             48
 #define SEFILE_SIGNATURE_MISMATCH   49
+#define SEFILE_CACHE_ERROR          50
+#define SEFILE_POOL_ERROR           51
 
 ///@}
 /** @}*/
@@ -240,6 +243,12 @@ typedef struct SEFILE_HANDLE * SEFILE_FHANDLE;  /**< Data struct used to access
 #define SEFILE_LOGIC_DATA			(SEFILE_SECTOR_DATA_SIZE-2)
 /** The amount of Overhead created by \ref SEFILE_SECTOR::len and \ref SEFILE_SECTOR::signature */
 #define SEFILE_SECTOR_OVERHEAD 		(SEFILE_SECTOR_SIZE-SEFILE_LOGIC_DATA)									
+/** How many consecutive sectors are processed by a single device crypto session and a single file I/O call */
+#define SEFILE_BATCH_SECTORS		(SE3_CRYPTO_MAX_DATAIN / SEFILE_SECTOR_SIZE)
+#ifndef SEFILE_CACHE_SECTORS
+#define SEFILE_CACHE_SECTORS		32				    /**< Default capacity, in sectors, of the plaintext cache of each file handle. See secure_set_cache_size()*/
+#endif
+#define SEFILE_POOL_MAX				8				    /**< Maximum number of devices of a context, the first one included. See secure_add_device()*/
 ///@}
 /** @}*/
 
@@ -283,6 +292,25 @@ uint16_t secure_init(se3_session *s, uint32_t keyID, uint16_t crypto);
  * a No-Operation one.
  */
 uint16_t secure_update(se3_session *s, int32_t keyID, uint16_t crypto);
+/**
+ * @brief This function adds a device to the environment set by
+ *        secure_init(), so that sectors are encrypted and decrypted by
+ *        several devices at once.
+ * @param [in] s Session logged in to another device holding the same
+ *        key material as the environment one (same key ID and value).
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ *
+ * @details Each batch of sectors processed by secure_write(), secure_read()
+ * and the cache is split among the devices: every device takes the next
+ * sector as soon as it is done with its previous one, and the results are
+ * stored in file order. The key is checked by encrypting the same sector on
+ * both devices, \ref SEFILE_POOL_ERROR is returned if the results differ.
+ * Only files opened after this call use the new device. Up to
+ * \ref SEFILE_POOL_MAX devices, the first one included, can be used.
+ * As for secure_init(), a copy of s is made.
+ */
+uint16_t secure_add_device(se3_session *s);
 /**
  * @brief This function deallocate the structures defined by the
  *        secure_init(). Should be called at the end of a session.
@@ -341,6 +369,12 @@ uint16_t secure_create(char *path, SEFILE_FHANDLE *hFile, int mode);
  * @param [in] dataIn_len The length, in bytes, of the data that have to be written.
  * @return The function returns a (uint16_t) '0' in case of success.
  *         See \ref errorValues for error list.
+ * @details With the cache of hFile enabled (the default, see
+ *          \ref SEFILE_CACHE_SECTORS) the written sectors may stay in
+ *          memory: a success only means they were accepted, the errors
+ *          writing them back are reported by a later call, at the latest
+ *          by secure_sync() or secure_close(). Check their result, or
+ *          disable the cache with secure_set_cache_size().
  */
 uint16_t secure_write(SEFILE_FHANDLE *hFile, uint8_t * dataIn, uint32_t dataIn_len);
 /**
@@ -367,6 +401,19 @@ uint16_t secure_read(SEFILE_FHANDLE *hFile,  uint8_t * dataOut, uint32_t dataOut
  *         See \ref errorValues for error list.
  */
 uint16_t secure_seek(SEFILE_FHANDLE *hFile, int32_t offset, int32_t *position ,uint8_t whence);
+/**
+ * @brief This function is the 64 bit version of secure_seek(), it must be
+ *        used with files bigger than 2 GB. secure_seek() fails with
+ *        \ref SEFILE_SEEK_ERROR if the final position does not fit 32 bit.
+ * @param [in] hFile The handle to the file to manipulate.
+ * @param [in] offset Amount of character we want to move.
+ * @param [out] position Pointer to a int64_t variable where the final position is
+ *        stored, MUST NOT BE NULL.
+ * @param [in] whence See \ref Seek_Defines.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_seek64(SEFILE_FHANDLE *hFile, int64_t offset, int64_t *position, uint8_t whence);
 /**
  * @brief This function resizes the file pointed by hFile to size. If size is
  *        bigger than its current size the gap is filled with 0s.
@@ -376,12 +423,24 @@ uint16_t secure_seek(SEFILE_FHANDLE *hFile, int32_t offset, int32_t *position ,u
  *         See \ref errorValues for error list.
  */
 uint16_t secure_truncate(SEFILE_FHANDLE *hFile, uint32_t size);
+/**
+ * @brief This function is the 64 bit version of secure_truncate().
+ * @param [in] hFile The handle to the file to manipulate.
+ * @param [in] size  New size of the file.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_truncate64(SEFILE_FHANDLE *hFile, uint64_t size);
 /**
  * @brief This function releases resources related to hFile.
  * @param [in] hFile The handle to the file we do not want to manipulate
  *        no more.
  * @return The function returns a (uint16_t) '0' in case of success.
  *         See \ref errorValues for error list.
+ * @details The dirty sectors of the cache are written back first; if
+ *          that fails the handle is released anyway, the data written
+ *          since the last successful sync is lost and
+ *          \ref SEFILE_WRITE_ERROR is returned.
  */
 uint16_t secure_close(SEFILE_FHANDLE *hFile);
 /**
@@ -411,6 +470,18 @@ uint16_t secure_ls(char *path, char *list, uint32_t * list_length);
  *         See \ref errorValues for error list.
  */
 uint16_t secure_getfilesize(char *path, uint32_t * position);
+/**
+ * @brief This function is the 64 bit version of secure_getfilesize(),
+ *        which fails with \ref SEFILE_FILESIZE_ERROR if the size does not
+ *        fit 32 bit.
+ * @param [in] path Absolute or relative path the file.
+ *        No encrypted directory are allowed inside the path.
+ * @param [out] position Pointer to an allocated uint64_t variable where will
+ *        be stored the file size.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_getfilesize64(char *path, uint64_t * position);
 /**
  * @brief This function is used to compute the ciphertext of a directory
  *        name stored in dirname.
@@ -440,6 +511,122 @@ uint16_t secure_mkdir(char *path);
  *         See \ref errorValues for error list.
  */
 uint16_t secure_sync(SEFILE_FHANDLE *hFile);
+/**
+ * @brief This function sets how many decrypted sectors are kept in the
+ *        cache of hFile. Written sectors stay in the cache and reach the
+ *        file only when they are evicted or when secure_sync(), secure_seek(),
+ *        secure_truncate() or secure_close() is called. Dirty sectors are
+ *        written back before the cache is resized.
+ * @param [in] hFile The handle to the file to manipulate.
+ * @param [in] n_sectors New capacity of the cache, 0 disables it so that
+ *        every secure_write() reaches the file immediately.
+ *        See \ref SEFILE_CACHE_SECTORS for the default value.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_set_cache_size(SEFILE_FHANDLE *hFile, uint32_t n_sectors);
+/**
+ * @brief This function reports how effective the cache of hFile is.
+ * @param [in] hFile The handle to the file to inspect.
+ * @param [out] hits Pointer to a uint32_t where the number of sectors
+ *        served by the cache is stored.
+ * @param [out] misses Pointer to a uint32_t where the number of sectors
+ *        read and decrypted from the file is stored.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_get_cache_stats(SEFILE_FHANDLE *hFile, uint32_t *hits, uint32_t *misses);
+/**
+ * \defgroup ctx_functions Context functions
+ * @{
+ * \brief Reentrant version of the environment functions.
+ *
+ * \details Each SEFILE_CTX holds its own copy of the session, the key and
+ * the algorithm, so different threads can work on different contexts at
+ * the same time. secure_init(), secure_update() and secure_finit() manage
+ * a default context which is the one used by secure_open(), secure_create(),
+ * secure_ls(), secure_getfilesize(), secure_mkdir() and crypt_dirname().
+ * A file handle stays bound to the context it was opened with, so
+ * secure_write(), secure_read() and the other handle functions do not
+ * take a context. All the handles of a context must be closed before
+ * calling secure_ctx_finit() on it.
+ */
+/**
+ * @brief Same as secure_init(), but the environment is stored in a new
+ *        context instead of the default one.
+ * @param [out] ctx Pointer where the new context is placed after a success,
+ *        NULL in case of failure.
+ * @param [in] s See secure_init().
+ * @param [in] keyID See secure_init().
+ * @param [in] crypto See secure_init().
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_ctx_init(SEFILE_CTX *ctx, se3_session *s, uint32_t keyID, uint16_t crypto);
+/**
+ * @brief Same as secure_update(), applied to ctx. Handles opened before
+ *        the update keep the device sessions they already have.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_ctx_update(SEFILE_CTX ctx, se3_session *s, int32_t keyID, uint16_t crypto);
+/**
+ * @brief Same as secure_add_device(), applied to ctx.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_ctx_add_device(SEFILE_CTX ctx, se3_session *s);
+/**
+ * @brief Deallocate a context created by secure_ctx_init() and set
+ *        *ctx to NULL.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_ctx_finit(SEFILE_CTX *ctx);
+/**
+ * @brief Same as secure_open(), the returned handle uses ctx.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_ctx_open(SEFILE_CTX ctx, char *path, SEFILE_FHANDLE *hFile, int32_t mode, int32_t access);
+/**
+ * @brief Same as secure_create(), the returned handle uses ctx.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_ctx_create(SEFILE_CTX ctx, char *path, SEFILE_FHANDLE *hFile, int mode);
+/**
+ * @brief Same as secure_ls(), only entries encrypted with ctx are listed.
+ *        The working directory of the process is not changed.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_ctx_ls(SEFILE_CTX ctx, char *path, char *list, uint32_t * list_length);
+/**
+ * @brief Same as secure_getfilesize(), using ctx.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_ctx_getfilesize(SEFILE_CTX ctx, char *path, uint32_t * position);
+/**
+ * @brief Same as secure_getfilesize64(), using ctx.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_ctx_getfilesize64(SEFILE_CTX ctx, char *path, uint64_t * position);
+/**
+ * @brief Same as crypt_dirname(), using the key of ctx.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t crypt_ctx_dirname(SEFILE_CTX ctx, char *dirpath, char *encDirname, uint32_t* enc_len);
+/**
+ * @brief Same as secure_mkdir(), using ctx.
+ * @return The function returns a (uint16_t) '0' in case of success.
+ *         See \ref errorValues for error list.
+ */
+uint16_t secure_ctx_mkdir(SEFILE_CTX ctx, char *path);
+/** @} */
 #ifdef __cplusplus
 }
 #endif
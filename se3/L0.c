@@ -1,36 +1,37 @@
 #include "L0.h"
 
-static uint16_t L0_TX(se3_device* device, uint16_t cmd, uint16_t cmd_flags, uint16_t len, const uint8_t* data);
-static uint16_t L0_RX(se3_device* device, uint16_t* resp_status, uint16_t* resp_len, uint8_t* resp_data);
+static uint16_t L0_TX(se3_device* device, uint64_t deadline, uint16_t cmd, uint16_t cmd_flags, uint16_t len, const se3_iovec* data, size_t count);
+static uint16_t L0_RX(se3_device* device, uint64_t deadline, size_t req_nblocks, uint16_t* resp_status, uint16_t* resp_len, uint8_t* resp_data, uint16_t resp_copy);
+static void L0_gather(uint8_t* dst, uint16_t n, const se3_iovec* src, size_t count, size_t* seg, uint16_t* seg_off);
+static void L0_unframe(const uint8_t* response, uint16_t offset, uint16_t len, uint8_t* dst);
+static bool L0_write(se3_device* device, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout);
+static bool L0_read(se3_device* device, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout);
+static bool L0_poll(se3_device* device, uint8_t* buf, size_t nblocks, uint32_t timeout);
 
 
 #ifdef CUBESIM
-#include "se3_proto.h"
+#include "se3sim.h"
 
-bool se3c_write_sim(uint8_t* buf, se3_file hfile, size_t block, size_t nblocks, uint32_t timeout) {
-    se3_proto_recv(1, buf, (uint32_t)(101 + block), (uint16_t)nblocks); return true;
-}
-bool se3c_read_sim(uint8_t* buf, se3_file hfile, size_t block, size_t nblocks, uint32_t timeout) {
-    se3_proto_send(1, buf, (uint32_t)(101 + block), (uint16_t)nblocks); return true;
+#ifdef _WIN32
+#define SE3SIM_URI (L"sim://")
+#else
+#define SE3SIM_URI ("sim://")
+#endif
+
+/** \brief Write the transport URI of the emulated device index (less than 10) */
+static void L0_sim_uri(se3_char* path, uint32_t index) {
+    size_t n = sizeof(SE3SIM_URI) / sizeof(se3_char) - 1;
+    se3c_pathcopy(path, SE3SIM_URI);
+    path[n] = (se3_char)('0' + index);
+    path[n + 1] = 0;
 }
+
 uint16_t L0_open_sim(se3_device* s) {
-	uint8_t* buf = NULL;
-    size_t i, k; se3_file foo = { 0 };
-    memset(s, 0, sizeof(se3_device));
-    s->request = (uint8_t*)malloc(SE3_COMM_N*SE3_COMM_BLOCK);
-    s->response = (uint8_t*)malloc(SE3_COMM_N*SE3_COMM_BLOCK);
-	buf = (uint8_t*)malloc(SE3_COMM_N * SE3_COMM_BLOCK);
-    for (i = 0; i < 16; i++) {
-        for (k = 0; k < SE3_COMM_BLOCK; k += SE3_MAGIC_SIZE)
-            memcpy(buf + i*SE3_COMM_BLOCK + k, se3_magic, SE3_MAGIC_SIZE);
-        buf[(i + 1)*SE3_COMM_BLOCK - 1] = (uint8_t)i;
-    }
-    se3c_write_sim(buf, foo, 0, 16, 0);
-	free(buf);
-    return SE3_OK;
+    se3_device_info info;
+    memset(&info, 0, sizeof(se3_device_info));
+    L0_sim_uri(info.path, 0);
+    return L0_open(s, &info, SE3_TIMEOUT);
 }
-#define se3c_write se3c_write_sim
-#define se3c_read se3c_read_sim
 #endif
 
 // L0_TXRX
@@ -39,19 +40,49 @@ uint16_t L0_open_sim(se3_device* s) {
  *  
  */
 uint16_t L0_TXRX(se3_device* device, uint16_t req_cmd, uint16_t req_cmdflags, uint16_t req_len, const uint8_t* req_data, uint16_t* resp_status, uint16_t* resp_len, uint8_t* resp_data) {
-	uint16_t r = 0;   // return value
+	se3_iovec req;
+	uint16_t resp_max = 0;
+	uint16_t error = 0;
+
+	if (resp_len == NULL)
+		return(SE3_ERR_PARAMS);
+	req.data = (uint8_t*)req_data;
+	req.len = req_len;
+	resp_max = *resp_len;
+	error = L0_TXRXv(device, req_cmd, req_cmdflags, &req, 1, resp_status, resp_len, resp_data, resp_max);
+	if (error != SE3_OK) {
+		return(error);
+	}
+	if (*resp_len > resp_max) {
+		return(SE3_ERR_COMM);
+	}
+	return(SE3_OK);
+}
+
+uint16_t L0_TXRXv(se3_device* device, uint16_t req_cmd, uint16_t req_cmdflags, const se3_iovec* req, size_t req_count, uint16_t* resp_status, uint16_t* resp_len, uint8_t* resp_data, uint16_t resp_copy) {
 	uint16_t error = 0;   // error value
+	uint64_t deadline = 0;   // end of the whole command, shared by TX and RX
+	uint64_t start_us = 0, us = 0;
+	size_t bucket = 0, i = 0;
+	uint32_t req_len = 0;
 
 
 
 	/* Check parameters are valid */
-    if (device == NULL ||
-        req_len > SE3_REQ_MAX_DATA)
-        return(SE3_ERR_PARAMS);
+	if (device == NULL || (req == NULL && req_count > 0))
+		return(SE3_ERR_PARAMS);
+	for (i = 0; i < req_count; i++) {
+		req_len += req[i].len;
+	}
+	if (req_len > SE3_REQ_MAX_DATA)
+		return(SE3_ERR_PARAMS);
 	/* */
 
+	deadline = se3c_deadline((device->timeout) ? (device->timeout) : (SE3_TIMEOUT));
+	start_us = se3c_clock_us();
+
 	/* Send Request */
-	error = L0_TX(device, req_cmd, req_cmdflags, req_len, req_data);
+	error = L0_TX(device, deadline, req_cmd, req_cmdflags, (uint16_t)req_len, req, req_count);
     if (error != SE3_OK) {
         return(error);
     }
@@ -59,30 +90,38 @@ uint16_t L0_TXRX(se3_device* device, uint16_t req_cmd, uint16_t req_cmdflags, ui
 
 
 	/* Receive Response */
-	error = L0_RX(device, resp_status, resp_len, resp_data);
+	error = L0_RX(device, deadline, se3_nblocks(se3_req_len_data_and_headers((uint16_t)req_len)), resp_status, resp_len, resp_data, resp_copy);
     if (error != SE3_OK) {
         return(error);
     }
 	/* */
 
+	us = se3c_clock_us() - start_us;
+	while (us > 1 && bucket < SE3_LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	device->poll_stats.latency_hist[bucket]++;
+
 
 	return(SE3_OK);
 }
 
 
 
-static uint16_t L0_TX(se3_device* device, uint16_t cmd, uint16_t cmd_flags, uint16_t len, const uint8_t* data) {
+static uint16_t L0_TX(se3_device* device, uint64_t deadline, uint16_t cmd, uint16_t cmd_flags, uint16_t len, const se3_iovec* data, size_t count) {
 	uint8_t* request = device->request;   // Buffer to be sent
 	uint32_t cmd_token = 0;   // Command Token
 #if SE3_CONF_CRC
 	uint16_t crc;
+	size_t i = 0;   // index variable
 #endif
 	uint16_t nblocks = 0;   // Number of logical data blocks
 	uint16_t n = 0;
-	size_t i = 0;   // index variable
-	uint32_t cmd_token_block = 0;   // Command Token for data blocks
 	uint32_t offset_src = 0;   // Offset for source data buffer
 	uint32_t offset_dst = 0;   // Offset for destination blocks buffer
+	size_t seg = 0;   // current source segment
+	uint16_t seg_off = 0;   // offset inside the current source segment
     uint16_t len_data_and_headers = se3_req_len_data_and_headers(len);
     
 
@@ -98,15 +137,17 @@ static uint16_t L0_TX(se3_device* device, uint16_t cmd, uint16_t cmd_flags, uint
 #if SE3_CONF_CRC
 	// compute crc of headers and data
 	crc = se3_crc16_update(SE3_REQ_OFFSET_CRC, request, 0);
-	if (len > 0) {
-		crc = se3_crc16_update(len, data, crc);
+	for (i = 0; i < count; i++) {
+		if (data[i].len > 0) {
+			crc = se3_crc16_update(data[i].len, data[i].data, crc);
+		}
 	}
 	SE3_SET16(request, SE3_REQ_OFFSET_CRC, crc);
 #endif
 
-	/* Set data */
+	/* Set data: segments are framed straight into the transfer buffer */
     n = (len < (SE3_COMM_BLOCK - SE3_REQ_SIZE_HEADER)) ? (len) : (SE3_COMM_BLOCK - SE3_REQ_SIZE_HEADER);
-    memcpy(request + SE3_REQ_SIZE_HEADER, data, n);
+    L0_gather(request + SE3_REQ_SIZE_HEADER, n, data, count, &seg, &seg_off);
     offset_dst = SE3_COMM_BLOCK;
     offset_src = n;
     nblocks = 1;
@@ -114,7 +155,7 @@ static uint16_t L0_TX(se3_device* device, uint16_t cmd, uint16_t cmd_flags, uint
         cmd_token++;
         n = ((len - offset_src) < (SE3_COMM_BLOCK - SE3_REQDATA_SIZE_HEADER)) ? (len - offset_src) : (SE3_COMM_BLOCK - SE3_REQDATA_SIZE_HEADER);
         SE3_SET32(request + offset_dst, SE3_REQDATA_OFFSET_CMDTOKEN, cmd_token);
-        memcpy(request + offset_dst + SE3_REQDATA_OFFSET_DATA, data + offset_src, n);
+        L0_gather(request + offset_dst + SE3_REQDATA_OFFSET_DATA, n, data, count, &seg, &seg_off);
         offset_dst += SE3_COMM_BLOCK;
         offset_src += n;
         nblocks++;
@@ -124,7 +165,10 @@ static uint16_t L0_TX(se3_device* device, uint16_t cmd, uint16_t cmd_flags, uint
 
 
 	/* Send data */
-    if (!se3c_write(request, device->f, 0, nblocks, SE3_TIMEOUT)) {
+    if (se3c_remaining(deadline) == 0) {
+        return (SE3_ERR_COMM);
+    }
+    if (!L0_write(device, request, 0, nblocks, se3c_remaining(deadline))) {
         return (SE3_ERR_COMM);
     }
 	/* */
@@ -135,45 +179,104 @@ static uint16_t L0_TX(se3_device* device, uint16_t cmd, uint16_t cmd_flags, uint
 
 
 
-static uint16_t L0_RX(se3_device* device, uint16_t* resp_status, uint16_t* resp_len, uint8_t* resp_data) {
-	bool ready = false, success = true;
+static uint16_t L0_RX(se3_device* device, uint64_t deadline, size_t req_nblocks, uint16_t* resp_status, uint16_t* resp_len, uint8_t* resp_data, uint16_t resp_copy) {
+	bool ready = false, success = true, spec_late = false;
     size_t i = 0;
-    uint16_t n;
 	size_t nblocks = 0;
+	size_t expect = 1, have = 0;   // speculative read size, blocks of the response already read
 	uint16_t len_data_and_headers = 0, len = 0, u16tmp;
 	uint32_t cmdtok0, u32tmp;
-	uint64_t deadline = se3c_deadline(SE3_TIMEOUT);
-    uint16_t offset_src, offset_dst;
+    uint32_t polls = 0;
+    uint32_t ready_after_us = 0;   // predicted time from the request to the response being ready
+    uint64_t sent_us = se3c_clock_us(), poll_us = sent_us;
+    uint32_t sleep_us = (device->poll.min_sleep_us) ? (device->poll.min_sleep_us) : (SE3_POLL_MIN_SLEEP_US);
+    uint32_t max_sleep_us = (device->poll.max_sleep_us) ? (device->poll.max_sleep_us) : (SE3_POLL_MAX_SLEEP_US);
 #if SE3_CONF_CRC
 	uint16_t crc;
+    uint16_t n;
+    uint16_t offset_src, offset_dst;
 #endif
+    if (device->poll.speculate && req_nblocks <= SE3_COMM_N) {
+        // responses are usually as long as the last one to a request of the same size
+        expect = (device->spec_blocks[req_nblocks]) ? (device->spec_blocks[req_nblocks]) : (req_nblocks);
+        ready_after_us = (device->spec_ready_us[req_nblocks]) ? (device->spec_ready_us[req_nblocks]) : (device->timing.ready_us);
+        spec_late = (expect > 1 && ready_after_us > 0);
+    }
 	while (!ready) {
-        se3c_sleep();
-		if (!se3c_read(device->response, device->f, 0, 1, SE3_TIMEOUT)) {
+        if (device->poll.mode == SE3_POLL_FIXED) {
+            se3c_sleep();
+        }
+        else if (polls > device->poll.spin) {
+            // the device is slow on this command, back off exponentially
+            if ((uint64_t)sleep_us > (uint64_t)se3c_remaining(deadline) * 1000) {
+                sleep_us = se3c_remaining(deadline) * 1000;
+            }
+            se3c_usleep(sleep_us);
+            device->poll_stats.sleep_us += sleep_us;
+            sleep_us = (sleep_us * 2 > max_sleep_us) ? (max_sleep_us) : (sleep_us * 2);
+        }
+        // the whole predicted response is read on the first read, and once on the first read after
+        // the predicted time to ready; the other reads only look at the first block.
+        // A transport with its own poll (e.g. uring) has the first block already prefetched.
+        poll_us = se3c_clock_us();
+        if (polls == 0) {
+            have = (device->transport->poll == NULL) ? (expect) : (1);
+            spec_late = spec_late && (have == 1 || poll_us - sent_us < ready_after_us);
+        }
+        else if (spec_late && poll_us - sent_us >= ready_after_us) {
+            have = expect;
+            spec_late = false;
+        }
+        else {
+            have = 1;
+        }
+		if (!L0_poll(device, device->response, have, se3c_remaining(deadline))) {
 			success = false;
 			break;
 		}
+        polls++;
 		SE3_GET16(device->response, 0, u16tmp);
 		ready = (u16tmp == 1);
+		if (!ready && have > 1) {
+			device->poll_stats.spec_extra_blocks += have - 1;
+		}
 		if ((se3c_clock() > deadline) && !ready) {
 			success = false;
 			break;
 		}
 	}
+    device->poll_stats.polls += polls;
+    if (polls > device->poll_stats.max_polls) {
+        device->poll_stats.max_polls = polls;
+    }
     if (!success) {
         return SE3_ERR_COMM;
     }
+    device->poll_stats.commands++;
     
 	SE3_GET16(device->response, SE3_RESP_OFFSET_LEN, len_data_and_headers);
     len = se3_resp_len_data(len_data_and_headers);
-    if (len > *resp_len) {
+    nblocks = se3_nblocks(len_data_and_headers);
+    if (nblocks > SE3_COMM_N) {
         return SE3_ERR_COMM;
     }
-    
-    nblocks = se3_nblocks(len_data_and_headers);
+    if (device->poll.speculate && req_nblocks <= SE3_COMM_N) {
+        device->spec_blocks[req_nblocks] = (uint8_t)nblocks;
+        device->spec_ready_us[req_nblocks] = (poll_us - sent_us > UINT32_MAX) ? (UINT32_MAX) : ((uint32_t)(poll_us - sent_us));
+    }
+    if (have > 1 && nblocks <= have) {
+        device->poll_stats.spec_hits++;
+        device->poll_stats.spec_extra_blocks += have - nblocks;
+    }
+    else if (have > 1) {
+        device->poll_stats.spec_short++;
+    }
 
-	if (nblocks > 1) {
-		if (!se3c_read(device->response + 1*SE3_COMM_BLOCK, device->f, 1, nblocks - 1, SE3_TIMEOUT))
+	if (nblocks > have) {
+		// fall back to reading what is missing
+		if (!L0_read(device, device->response + have*SE3_COMM_BLOCK, have, nblocks - have, se3c_remaining(deadline)))
+			return SE3_ERR_COMM;
+		if (se3c_clock() > deadline)
 			return SE3_ERR_COMM;
 	}
 
@@ -186,31 +289,26 @@ static uint16_t L0_RX(se3_device* device, uint16_t* resp_status, uint16_t* resp_
 			return SE3_ERR_COMM;
 		}
 	}
+	// only the first resp_copy bytes are copied, the rest can be read in place with L0_resp_read
+	device->response_len = len;
+	if (resp_data != NULL && resp_copy > 0) {
+		L0_unframe(device->response, 0, (len < resp_copy) ? (len) : (resp_copy), resp_data);
+	}
 #if SE3_CONF_CRC
 	crc = se3_crc16_update(SE3_REQ_OFFSET_CRC, device->response, 0);
-#endif
 	n = (len < (SE3_COMM_BLOCK - SE3_RESP_SIZE_HEADER)) ? (len) : (SE3_COMM_BLOCK - SE3_RESP_SIZE_HEADER);
-	if (resp_data != NULL) {
-		memcpy(resp_data, device->response + SE3_RESP_SIZE_HEADER, n);
-	}
-#if SE3_CONF_CRC
 	if (n > 0) {
 		crc = se3_crc16_update(n, device->response + SE3_RESP_SIZE_HEADER, crc);
 	}
-#endif
 	offset_src = SE3_COMM_BLOCK;
     offset_dst = n;
     while(offset_dst < len) {
         n = ((len - offset_dst) < (SE3_COMM_BLOCK - SE3_RESPDATA_SIZE_HEADER)) ? (len - offset_dst) : (SE3_COMM_BLOCK - SE3_RESPDATA_SIZE_HEADER);
-		if (resp_data != NULL) {
-			memcpy(resp_data + offset_dst, device->response + offset_src + SE3_RESPDATA_SIZE_HEADER, n);
-		}
-#if SE3_CONF_CRC
 		crc = se3_crc16_update(n, device->response + offset_src + SE3_RESPDATA_SIZE_HEADER, crc);
-#endif
 		offset_src += SE3_COMM_BLOCK;
         offset_dst += n;
     }
+#endif
 
     // read headers
     SE3_GET16(device->response, SE3_RESP_OFFSET_STATUS, u16tmp);
@@ -228,6 +326,208 @@ static uint16_t L0_RX(se3_device* device, uint16_t* resp_status, uint16_t* resp_
 }
 
 
+static void L0_gather(uint8_t* dst, uint16_t n, const se3_iovec* src, size_t count, size_t* seg, uint16_t* seg_off)
+{
+    uint16_t k;
+
+    while (n > 0 && *seg < count) {
+        k = src[*seg].len - *seg_off;
+        if (k > n) {
+            k = n;
+        }
+        if (k > 0) {
+            if (src[*seg].data != NULL) {
+                memcpy(dst, src[*seg].data + *seg_off, k);
+            }
+            else {
+                memset(dst, 0, k);
+            }
+            dst += k;
+            n -= k;
+            *seg_off += k;
+        }
+        if (*seg_off == src[*seg].len) {
+            (*seg)++;
+            *seg_off = 0;
+        }
+    }
+}
+
+static void L0_unframe(const uint8_t* response, uint16_t offset, uint16_t len, uint8_t* dst)
+{
+    size_t block, pos;
+    uint16_t n;
+
+    // offset inside the payload, as concatenated by the device
+    while (len > 0) {
+        if (offset < SE3_COMM_BLOCK - SE3_RESP_SIZE_HEADER) {
+            pos = SE3_RESP_SIZE_HEADER + offset;
+            n = (SE3_COMM_BLOCK - SE3_RESP_SIZE_HEADER) - offset;
+        }
+        else {
+            block = 1 + (offset - (SE3_COMM_BLOCK - SE3_RESP_SIZE_HEADER)) / (SE3_COMM_BLOCK - SE3_RESPDATA_SIZE_HEADER);
+            pos = (offset - (SE3_COMM_BLOCK - SE3_RESP_SIZE_HEADER)) % (SE3_COMM_BLOCK - SE3_RESPDATA_SIZE_HEADER);
+            n = (SE3_COMM_BLOCK - SE3_RESPDATA_SIZE_HEADER) - (uint16_t)pos;
+            pos += block*SE3_COMM_BLOCK + SE3_RESPDATA_SIZE_HEADER;
+        }
+        if (n > len) {
+            n = len;
+        }
+        memcpy(dst, response + pos, n);
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+uint16_t L0_resp_read(se3_device* device, uint16_t offset, uint16_t len, uint8_t* data)
+{
+    if (device == NULL || data == NULL || (uint32_t)offset + len > device->response_len) {
+        return SE3_ERR_PARAMS;
+    }
+    L0_unframe(device->response, offset, len, data);
+    return SE3_OK;
+}
+
+
+/* Timing model, see se3_timing_model */
+
+static void L0_timing_delay(se3_device* device, uint64_t us)
+{
+    uint64_t end;
+
+    if (us == 0) {
+        return;
+    }
+    device->poll_stats.model_us += us;
+    if (device->timing.busy_wait) {
+        end = se3c_clock_us() + us;
+        while (se3c_clock_us() < end);
+    }
+    else {
+        se3c_usleep(us);
+    }
+}
+
+static bool L0_write(se3_device* device, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    bool ret;
+
+    L0_timing_delay(device, (uint64_t)device->timing.latency_us + (uint64_t)device->timing.block_us * nblocks);
+    ret = device->transport->write_blocks(device->handle, buf, block, nblocks, timeout);
+    if (device->timing.ready_us) {
+        device->ready_at_us = se3c_clock_us() + device->timing.ready_us;
+    }
+    return ret;
+}
+
+static bool L0_read(se3_device* device, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    L0_timing_delay(device, (uint64_t)device->timing.latency_us + (uint64_t)device->timing.block_us * nblocks);
+    return device->transport->read_blocks(device->handle, buf, block, nblocks, timeout);
+}
+
+static bool L0_poll(se3_device* device, uint8_t* buf, size_t nblocks, uint32_t timeout)
+{
+    L0_timing_delay(device, (uint64_t)device->timing.latency_us + (uint64_t)device->timing.block_us * nblocks);
+    if (nblocks > 1) {
+        // speculative read, it bypasses the poll operation of the transport
+        if (!device->transport->read_blocks(device->handle, buf, 0, nblocks, timeout)) {
+            return false;
+        }
+    }
+    else if (device->transport->poll != NULL) {
+        if (!device->transport->poll(device->handle, buf, timeout)) {
+            return false;
+        }
+    }
+    else if (!device->transport->read_blocks(device->handle, buf, 0, 1, timeout)) {
+        return false;
+    }
+    if (device->timing.ready_us && se3c_clock_us() < device->ready_at_us) {
+        // the modeled device is still working: hide the ready flag
+        memset(buf, 0, 2);
+    }
+    return true;
+}
+
+static void L0_timing_parse(const char* s, se3_timing_model* model)
+{
+    char key[16];
+    size_t n;
+    unsigned long value;
+    char* end;
+
+    while (*s != '\0') {
+        if (*s == '#') {
+            while (*s != '\0' && *s != '\n') s++;
+            continue;
+        }
+        if (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n' || *s == ',' || *s == ';') {
+            s++;
+            continue;
+        }
+        n = 0;
+        while (*s != '\0' && *s != '=' && n < sizeof(key) - 1) {
+            key[n++] = *s++;
+        }
+        key[n] = '\0';
+        if (*s != '=') {
+            // malformed entry, skip it
+            while (*s != '\0' && *s != '\n' && *s != ',' && *s != ';') s++;
+            continue;
+        }
+        s++;
+        value = strtoul(s, &end, 10);
+        s = end;
+        if (!strcmp(key, "latency_us")) model->latency_us = (uint32_t)value;
+        else if (!strcmp(key, "block_us")) model->block_us = (uint32_t)value;
+        else if (!strcmp(key, "ready_us")) model->ready_us = (uint32_t)value;
+        else if (!strcmp(key, "busy_wait")) model->busy_wait = (value != 0);
+    }
+}
+
+bool L0_timing_load(se3_timing_model* model)
+{
+    const char* s;
+    char buf[1024];
+    size_t n;
+    FILE* fp;
+    bool found = false;
+
+    memset(model, 0, sizeof(se3_timing_model));
+    s = getenv(SE3_TIMING_PROFILE_ENV);
+    if (s != NULL && (fp = fopen(s, "r")) != NULL) {
+        n = fread(buf, 1, sizeof(buf) - 1, fp);
+        fclose(fp);
+        buf[n] = '\0';
+        L0_timing_parse(buf, model);
+        found = true;
+    }
+    s = getenv(SE3_TIMING_ENV);
+    if (s != NULL) {
+        L0_timing_parse(s, model);
+        found = true;
+    }
+    return found;
+}
+
+uint16_t L0_set_timing(se3_device* dev, const se3_timing_model* model)
+{
+    if (dev == NULL) {
+        return SE3_ERR_PARAMS;
+    }
+    if (model == NULL) {
+        memset(&(dev->timing), 0, sizeof(se3_timing_model));
+    }
+    else {
+        memcpy(&(dev->timing), model, sizeof(se3_timing_model));
+    }
+    dev->ready_at_us = 0;
+    return SE3_OK;
+}
+
+
 
 uint16_t L0_echo(se3_device* device, const uint8_t* data_in, uint16_t data_in_len, uint8_t* data_out) {
     uint16_t resp_status = 0, resp_len = 0;
@@ -255,27 +555,40 @@ uint16_t L0_factoryinit(se3_device* device, const uint8_t* serialno) {
 
 
 void L0_discover_init(se3_disco_it* it) {
-	se3c_drive_init(&(it->_drive_it));
+#ifdef CUBESIM
+	it->sim_next_ = 0;
+#endif
+	it->next_ = 0;
+	it->count_ = se3_disco_scan(it->found_, SE3_DISCO_MAX, &(it->stats));
 }
 
 
 
 bool L0_discover_next(se3_disco_it* it) {
-	se3_discover_info discov_nfo;
-	uint64_t deadline;
-
-	while (se3c_drive_next(&(it->_drive_it))) {
-		deadline = se3c_deadline(0);
-		if (se3c_info(it->_drive_it.path, deadline, &discov_nfo)) {   // True = SEcube
-
-			memcpy(it->device_info.serialno, discov_nfo.serialno, SE3_SN_SIZE);
-            memcpy(it->device_info.hello_msg, discov_nfo.hello_msg, SE3_HELLO_SIZE);
-            se3c_pathcopy(it->device_info.path, it->_drive_it.path);
-			it->device_info.status = discov_nfo.status;
+	se3_disco_result* r;
 
+#ifdef CUBESIM
+	// emulated devices come first, then the drives
+	if (it->sim_next_ < se3sim_count()) {
+		se3_device dev;
+		se3_device_info info;
+		memset(&info, 0, sizeof(se3_device_info));
+		L0_sim_uri(info.path, it->sim_next_++);
+		if (L0_open(&dev, &info, 0) == SE3_OK) {
+			memcpy(&(it->device_info), &(dev.info), sizeof(se3_device_info));
+			L0_close(&dev);
 			return true;
 		}
 	}
+#endif
+	if (it->next_ < it->count_) {
+		r = &(it->found_[it->next_++]);
+		memcpy(it->device_info.serialno, r->info.serialno, SE3_SN_SIZE);
+		memcpy(it->device_info.hello_msg, r->info.hello_msg, SE3_HELLO_SIZE);
+		se3c_pathcopy(it->device_info.path, r->path);
+		it->device_info.status = r->info.status;
+		return true;
+	}
 	return false;
 }
 
@@ -285,7 +598,7 @@ bool L0_discover_serialno(uint8_t* serialno, se3_device_info* device) {
 	
 	L0_discover_init(&it);
 	while (L0_discover_next(&it)) {
-		if (memcmp(serialno, it.device_info.serialno, SE3_SN_SIZE)) {
+		if (!memcmp(serialno, it.device_info.serialno, SE3_SN_SIZE)) {
             memcpy(device, &(it.device_info), sizeof(se3_device_info));
 			return(true);
 		}
@@ -296,41 +609,106 @@ bool L0_discover_serialno(uint8_t* serialno, se3_device_info* device) {
 
 uint16_t L0_open(se3_device* dev, se3_device_info* dev_info, uint32_t timeout)
 {
-	se3_file hfile;
+	static const uint8_t any_serialno[SE3_SN_SIZE] = { 0 };
+	const se3_transport* transport;
+	const se3_char* path = NULL;
+	void* handle = NULL;
 	se3_discover_info discov_nfo;
 
     memset(dev, 0, sizeof(se3_device));
     memcpy(&(dev->info), dev_info, sizeof(se3_device_info));
 
     dev->opened = false;
-	if (!se3c_open(dev->info.path, timeout, &hfile, &discov_nfo)) {
+	transport = se3_transport_find(dev->info.path, &path);
+	if (transport == NULL) {
+		return SE3_ERR_PARAMS;
+	}
+	if (!transport->open(path, se3c_deadline(timeout), &handle, &discov_nfo)) {
 		return SE3_ERR_COMM;
 	}
-	if (memcmp(discov_nfo.serialno, dev->info.serialno, SE3_SN_SIZE)) {   // SEcube serial number does not match.
-		se3c_close(hfile);
+	if (memcmp(dev->info.serialno, any_serialno, SE3_SN_SIZE) &&
+		memcmp(discov_nfo.serialno, dev->info.serialno, SE3_SN_SIZE)) {   // SEcube serial number does not match.
+		transport->close(handle);
 		return SE3_ERR_COMM;
 	}
-    dev->f = hfile;
-    dev->request = (uint8_t*)malloc(SE3_COMM_N*SE3_COMM_BLOCK);
-    dev->response = (uint8_t*)malloc(SE3_COMM_N*SE3_COMM_BLOCK);
+    memcpy(dev->info.serialno, discov_nfo.serialno, SE3_SN_SIZE);
+    memcpy(dev->info.hello_msg, discov_nfo.hello_msg, SE3_HELLO_SIZE);
+    dev->info.status = discov_nfo.status;
+    dev->transport = transport;
+    dev->handle = handle;
+    dev->request = se3c_alloc_blocks(SE3_COMM_N);
+    dev->response = se3c_alloc_blocks(SE3_COMM_N);
+    if (transport->buffers != NULL &&
+        !transport->buffers(handle, dev->request, dev->response, SE3_COMM_N * SE3_COMM_BLOCK)) {
+        se3c_free_blocks(dev->request);
+        se3c_free_blocks(dev->response);
+        transport->close(handle);
+        return SE3_ERR_COMM;
+    }
+    L0_set_timeout(dev, 0);
+    L0_set_poll(dev, NULL);
+    L0_timing_load(&(dev->timing));
     dev->opened = true;
 	return SE3_OK;
 }
 
+void L0_set_timeout(se3_device* dev, uint32_t timeout)
+{
+    if (dev != NULL) {
+        dev->timeout = (timeout) ? (timeout) : (SE3_TIMEOUT);
+    }
+}
+
+uint16_t L0_set_poll(se3_device* dev, const se3_poll_config* config)
+{
+    if (dev == NULL) {
+        return SE3_ERR_PARAMS;
+    }
+    if (config == NULL) {
+        dev->poll.mode = SE3_POLL_ADAPTIVE;
+        dev->poll.spin = SE3_POLL_SPIN;
+        dev->poll.min_sleep_us = SE3_POLL_MIN_SLEEP_US;
+        dev->poll.max_sleep_us = SE3_POLL_MAX_SLEEP_US;
+        dev->poll.speculate = true;
+        return SE3_OK;
+    }
+    if ((config->mode != SE3_POLL_ADAPTIVE && config->mode != SE3_POLL_FIXED) ||
+        config->min_sleep_us == 0 || config->min_sleep_us > config->max_sleep_us) {
+        return SE3_ERR_PARAMS;
+    }
+    memcpy(&(dev->poll), config, sizeof(se3_poll_config));
+    return SE3_OK;
+}
+
+void L0_get_poll_stats(se3_device* dev, se3_poll_stats* stats, bool reset)
+{
+    if (dev == NULL) {
+        return;
+    }
+    if (stats != NULL) {
+        memcpy(stats, &(dev->poll_stats), sizeof(se3_poll_stats));
+    }
+    if (reset) {
+        memset(&(dev->poll_stats), 0, sizeof(se3_poll_stats));
+    }
+}
+
 
 void L0_close(se3_device* dev)
 {
     if (dev->opened) {
         dev->opened = false;
+        // the transport may hold the buffers until closed
+        dev->transport->close(dev->handle);
+        dev->handle = NULL;
         if (NULL != dev->request) {
-            free(dev->request);
+            se3c_free_blocks(dev->request);
             dev->request = NULL;
         }
         if (NULL != dev->response) {
-            free(dev->response);
+            se3c_free_blocks(dev->response);
             dev->response = NULL;
         }
-        se3c_close(dev->f);
     }
 }
 
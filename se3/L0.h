@@ -8,6 +8,8 @@
 
 #include "se3_common.h"
 #include "se3comm.h"
+#include "se3transport.h"
+#include "se3disco.h"
 #include "crc16.h"
 
 
@@ -23,28 +25,104 @@ typedef struct se3_device_info_ {
     uint16_t status;
 } se3_device_info;
 
+/** \brief How L0_TXRX waits for the device to complete a command, see \ref L0_set_poll */
+enum {
+    SE3_POLL_ADAPTIVE = 0,  ///< immediate first read, short spin, then exponential backoff
+    SE3_POLL_FIXED = 1      ///< se3c_sleep() before every read of the response
+};
+
+/** \brief Response polling parameters */
+typedef struct se3_poll_config_ {
+    uint16_t mode;          ///< SE3_POLL_ADAPTIVE or SE3_POLL_FIXED
+    uint16_t spin;          ///< reads done back to back after the first one, before sleeping
+    uint32_t min_sleep_us;  ///< first sleep of the backoff
+    uint32_t max_sleep_us;  ///< cap of the backoff
+    bool speculate;         ///< read the predicted response size at once, see \ref L0_set_poll
+} se3_poll_config;
+
+/** Number of buckets of se3_poll_stats.latency_hist */
+#define SE3_LATENCY_BUCKETS (24)
+
+/** \brief Response polling statistics, see \ref L0_get_poll_stats */
+typedef struct se3_poll_stats_ {
+    uint64_t commands;      ///< responses received
+    uint64_t polls;         ///< reads of the first response block, over all commands
+    uint32_t max_polls;     ///< highest number of reads needed by one command
+    uint64_t sleep_us;      ///< total time requested to sleep between reads
+    uint64_t model_us;      ///< total delay added by the timing model, see \ref L0_set_timing
+    uint64_t spec_hits;     ///< responses that fit in the speculative read, saving a read
+    uint64_t spec_short;    ///< responses longer than predicted, completed by a second read
+    uint64_t spec_extra_blocks;   ///< blocks read speculatively and not used, also by reads that found no response
+    uint32_t latency_hist[SE3_LATENCY_BUCKETS];   ///< commands by duration of L0_TXRX: bucket i counts [2^i, 2^(i+1)) us, the last one everything above
+} se3_poll_stats;
+
+/**
+ *  \brief Delays added around every transfer to model a slower host, see \ref L0_set_timing
+ *
+ *  \details Every se3c_write and se3c_read issued by L0_TXRX waits
+ *  latency_us + nblocks * block_us before reaching the device. After a request
+ *  has been written, the response is reported as not ready until ready_us
+ *  have elapsed, so the polling loop sees the extra device time. A model with
+ *  all the delays set to 0 adds no overhead.
+ */
+typedef struct se3_timing_model_ {
+    uint32_t latency_us;    ///< fixed cost of one USB transaction
+    uint32_t block_us;      ///< cost of transferring one SE3_COMM_BLOCK block
+    uint32_t ready_us;      ///< time from the end of a request to its response being ready
+    bool busy_wait;         ///< spin on the clock instead of sleeping, for delays below the scheduler granularity
+} se3_timing_model;
+
+/** \brief Piece of a request payload, see \ref L0_TXRXv */
+typedef struct se3_iovec_ {
+    uint8_t* data;          ///< NULL for len zero bytes
+    uint16_t len;
+} se3_iovec;
+
 /** \brief SEcube Device structure */
 typedef struct se3_device_ {
     se3_device_info info;
-    uint8_t* request;
-    uint8_t* response;
-	se3_file f;
+    uint8_t* request;   ///< framed request, aligned to SE3_COMM_BLOCK so transports can transfer it in place
+    uint8_t* response;   ///< framed response, aligned as request
+    uint16_t response_len;   ///< payload length of the last response, see \ref L0_resp_read
+    const se3_transport* transport;   ///< selected by L0_open from info.path
+    void* handle;   ///< transport handle
     bool opened;
+    uint32_t timeout;   ///< maximum duration of a command in ms, see \ref L0_set_timeout
+    se3_poll_config poll;
+    se3_poll_stats poll_stats;
+    se3_timing_model timing;
+    uint64_t ready_at_us;   ///< se3c_clock_us() time at which the timing model lets the response be seen
+    uint8_t spec_blocks[SE3_COMM_N + 1];   ///< by request size in blocks: size of the last response, 0 if none yet
+    uint32_t spec_ready_us[SE3_COMM_N + 1];   ///< by request size in blocks: us from the request to the last response found ready, 0 if none yet
 } se3_device;
 
 /** \brief Discovery iterator */
 typedef struct se3_disco_it_ {
     se3_device_info device_info;
-    se3_drive_it _drive_it;
+    se3_disco_stats stats;   ///< how the drives were found, see \ref se3disco.h
+    se3_disco_result found_[SE3_DISCO_MAX];
+    size_t count_;
+    size_t next_;
+#ifdef CUBESIM
+    uint32_t sim_next_;   ///< next emulated device to report
+#endif
 } se3_disco_it;
 
 #ifdef CUBESIM
 uint16_t L0_open_sim(se3_device* s);
 #endif
 
+/** Environment variable holding a timing model, see \ref L0_timing_load */
+#define SE3_TIMING_ENV "SE3_TIMING"
+/** Environment variable holding the path of a timing model profile, see \ref L0_timing_load */
+#define SE3_TIMING_PROFILE_ENV "SE3_TIMING_PROFILE"
+
 
 /* defines */
 #define SE3_NBLOCKS    (SE3_COMM_N-1)   // Number of blocks
+#define SE3_POLL_SPIN           (4)      // default se3_poll_config.spin
+#define SE3_POLL_MIN_SLEEP_US   (50)     // default se3_poll_config.min_sleep_us
+#define SE3_POLL_MAX_SLEEP_US   (1000)   // default se3_poll_config.max_sleep_us
 #ifdef CUBESIM
 #define SE3_TIMEOUT (1024*1024)
 #else
@@ -75,6 +153,38 @@ uint16_t L0_open_sim(se3_device* s);
  */
 uint16_t L0_TXRX(se3_device* device, uint16_t req_cmd, uint16_t req_cmdflags, uint16_t req_len, const uint8_t* req_data, uint16_t* resp_status, uint16_t* resp_len, uint8_t* resp_data);
 
+/**
+ *  \brief Same as \ref L0_TXRX, with a scattered request and a partial copy of the response
+ *  
+ *  \param [in] device pointer to SEcube device structure
+ *  \param [in] req_cmd Command to be executed
+ *  \param [in] req_cmdflags Flag options for the command
+ *  \param [in] req Request payload, as the concatenation of req_count pieces
+ *  \param [in] req_count Number of pieces
+ *  \param [out] resp_status Response status
+ *  \param [out] resp_len Length of the response payload
+ *  \param [out] resp_data Where to copy the beginning of the response, can be NULL
+ *  \param [in] resp_copy Maximum number of bytes copied to resp_data
+ *  \return Error code or SE3_OK
+ *  
+ *  \details The pieces are framed directly into the device buffer, and the
+ *  response stays there until the next command: bytes past resp_copy can be
+ *  copied to their final destination with \ref L0_resp_read, so each byte is
+ *  copied once per direction.
+ */
+uint16_t L0_TXRXv(se3_device* device, uint16_t req_cmd, uint16_t req_cmdflags, const se3_iovec* req, size_t req_count, uint16_t* resp_status, uint16_t* resp_len, uint8_t* resp_data, uint16_t resp_copy);
+
+/**
+ *  \brief Copy part of the last response payload received by \ref L0_TXRXv
+ *  
+ *  \param [in] device pointer to SEcube device structure
+ *  \param [in] offset Offset in the response payload
+ *  \param [in] len Number of bytes
+ *  \param [out] data Destination
+ *  \return SE3_OK, SE3_ERR_PARAMS if the range is outside the response
+ */
+uint16_t L0_resp_read(se3_device* device, uint16_t offset, uint16_t len, uint8_t* data);
+
 /**
  *  \brief Echo service 
  *  
@@ -107,6 +217,9 @@ uint16_t L0_factoryinit(se3_device* device, const uint8_t* serialno);
  *  \param [in] timeout timeout in ms
  *  \return Error code or SE3_OK
  *  
+ *  \details dev_info->path selects the transport, see \ref se3transport.h.
+ *  If dev_info->serialno is all zeros, any device found at that path is
+ *  accepted and dev->info is completed with its serial number.
  */
 uint16_t L0_open(se3_device* dev, se3_device_info* dev_info, uint32_t timeout);
 
@@ -119,6 +232,80 @@ uint16_t L0_open(se3_device* dev, se3_device_info* dev_info, uint32_t timeout);
  */
 void L0_close(se3_device* dev);
 
+/**
+ *  \brief Set the maximum duration of a command
+ *  
+ *  \param [in] dev pointer to SEcube device structure
+ *  \param [in] timeout timeout in ms, 0 restores \ref SE3_TIMEOUT
+ *  
+ *  \details The deadline is computed once per L0_TXRX and covers every
+ *  read and write of the command. When it expires L0_TXRX returns
+ *  SE3_ERR_COMM, the command can then be retried or sent to another device.
+ */
+void L0_set_timeout(se3_device* dev, uint32_t timeout);
+
+/**
+ *  \brief Select how the device is polled for responses
+ *  
+ *  \param [in] dev pointer to SEcube device structure
+ *  \param [in] config polling parameters, NULL restores the defaults
+ *  	(adaptive, \ref SE3_POLL_SPIN, \ref SE3_POLL_MIN_SLEEP_US, \ref SE3_POLL_MAX_SLEEP_US,
+ *  	speculative reads on)
+ *  \return Error code or SE3_OK
+ *  
+ *  \details With speculate set, the first read of a response (unless the
+ *  transport has a poll operation) and the first read once the response is
+ *  likely ready fetch as many blocks as the last response to a request of
+ *  the same size (the size of the request the first time), so most
+ *  responses take a single read; a longer response is completed by reading
+ *  only the missing blocks. The response is likely ready when as much time
+ *  has passed since the request as the last response of the same size took
+ *  to be found, or ready_us of the timing model the first time. The other
+ *  reads fetch one block. The
+ *  spec_* counters of \ref se3_poll_stats show how well this works.
+ *  L0_open and L0_open_sim apply the defaults. A se3_session keeps
+ *  its own copy of the device, so the polling of a logged in session is
+ *  changed through its device member.
+ */
+uint16_t L0_set_poll(se3_device* dev, const se3_poll_config* config);
+
+/**
+ *  \brief Read and optionally reset the polling statistics
+ *  
+ *  \param [in] dev pointer to SEcube device structure
+ *  \param [out] stats where to copy the statistics, can be NULL
+ *  \param [in] reset if true, the statistics are cleared after the copy
+ *  
+ */
+void L0_get_poll_stats(se3_device* dev, se3_poll_stats* stats, bool reset);
+
+/**
+ *  \brief Set the timing model applied to the transfers of a device
+ *  
+ *  \param [in] dev pointer to SEcube device structure
+ *  \param [in] model delays to add, NULL to remove the model
+ *  \return SE3_OK, SE3_ERR_PARAMS if dev is NULL
+ *  
+ *  \details L0_open and L0_open_sim apply the model returned by
+ *  \ref L0_timing_load. As for \ref L0_set_poll, a logged in session is
+ *  changed through its device member.
+ */
+uint16_t L0_set_timing(se3_device* dev, const se3_timing_model* model);
+
+/**
+ *  \brief Load a timing model from the environment
+ *  
+ *  \param [out] model the model, all delays are 0 if nothing is configured
+ *  \return true if a model was found
+ *  
+ *  \details The file named by SE3_TIMING_PROFILE is read first, then
+ *  SE3_TIMING overrides its values. Both contain key=value pairs separated
+ *  by spaces, commas, semicolons or new lines; a '#' starts a comment that
+ *  runs to the end of the line. Keys are latency_us, block_us, ready_us and
+ *  busy_wait, e.g. SE3_TIMING="latency_us=125 block_us=40 ready_us=300".
+ */
+bool L0_timing_load(se3_timing_model* model);
+
 /**
  *  \brief Discover Serial Number information
  *  
@@ -135,6 +322,7 @@ bool L0_discover_serialno(uint8_t* serialno, se3_device_info* device);
  *  \param [in] it iterator
  *  \return Error code or SE3_OK
  *  
+ *  \details The drives are scanned here, see \ref se3_disco_scan
  */
 void L0_discover_init(se3_disco_it* it);
 
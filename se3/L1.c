@@ -3,14 +3,35 @@
 #include "aes256.h"
 
 static uint16_t key_list(se3_session* s, uint16_t skip, uint16_t max_keys, const uint8_t* salt, se3_key* key_array, uint16_t* count);
+static uint16_t key_cache(se3_session* s);
 static void se3_session_init(se3_session* s, se3_device* dev);
 static uint16_t L1_TXRX(se3_session* s, uint16_t cmd, uint16_t cmd_flags, uint16_t req_len, uint16_t* resp_len);
+static uint16_t L1_TXRXv(se3_session* s, uint16_t cmd, uint16_t cmd_flags, uint16_t req_len, const se3_iovec* req_ext, size_t req_ext_count, uint16_t resp_copy, uint16_t* resp_len);
 
 static uint16_t L1_TXRX(se3_session* s, uint16_t cmd, uint16_t cmd_flags, uint16_t req_len, uint16_t* resp_len)
 {
+	return L1_TXRXv(s, cmd, cmd_flags, req_len, NULL, 0, SE3_COMM_N*SE3_COMM_BLOCK, resp_len);
+}
+
+/**
+ *  \brief L1 command whose payload is partly outside s->buf
+ *
+ *  \param [in] req_len Length of the payload in s->buf
+ *  \param [in] req_ext Payload pieces that follow the part in s->buf
+ *  \param [in] resp_copy Bytes of the L1 response copied to s->buf, the rest
+ *  			   is left in the device buffer for L0_resp_read
+ *
+ *  \details req_ext and a partial resp_copy require cmd_flags to be 0: an
+ *  encrypted or signed payload must be contiguous in s->buf.
+ */
+static uint16_t L1_TXRXv(se3_session* s, uint16_t cmd, uint16_t cmd_flags, uint16_t req_len, const se3_iovec* req_ext, size_t req_ext_count, uint16_t resp_copy, uint16_t* resp_len)
+{
+	static uint8_t zeros[SE3_L1_CRYPTOBLOCK_SIZE] = { 0 };
+	se3_iovec req[4];
+	size_t i, req_count = 0;
 	uint16_t result;
 	uint16_t u16tmp = 0;
-	uint16_t req_len_padded, req0_len;
+	uint16_t req_len_padded, req0_len, ext_len = 0;
 	uint16_t resp0_len = 0, resp_status = 0;
 	uint8_t* session_data = s->buf + SE3_RESP1_OFFSET_DATA;
 
@@ -26,16 +47,32 @@ static uint16_t L1_TXRX(se3_session* s, uint16_t cmd, uint16_t cmd_flags, uint16
 	else {
 		memset(s->buf + SE3_REQ1_OFFSET_TOKEN, 0, SE3_L1_TOKEN_SIZE);
 	}
+	if (req_ext_count > 0 && (cmd_flags != 0 || req_ext_count > 2)) {
+		return SE3_ERR_PARAMS;
+	}
+	for (i = 0; i < req_ext_count; i++) {
+		ext_len += req_ext[i].len;
+	}
 	SE3_SET16(s->buf, SE3_REQ1_OFFSET_CMD, cmd);
-	SE3_SET16(s->buf, SE3_REQ1_OFFSET_LEN, req_len);
+	u16tmp = req_len + ext_len;
+	SE3_SET16(s->buf, SE3_REQ1_OFFSET_LEN, u16tmp);
 
 	req_len_padded = req_len;
-	if (req_len_padded % SE3_L1_CRYPTOBLOCK_SIZE != 0) {
+	if (req_ext_count == 0 && req_len_padded % SE3_L1_CRYPTOBLOCK_SIZE != 0) {
 		memset(session_data + req_len_padded, 0, (SE3_L1_CRYPTOBLOCK_SIZE - (req_len_padded % SE3_L1_CRYPTOBLOCK_SIZE)));
 		req_len_padded += (SE3_L1_CRYPTOBLOCK_SIZE - (req_len_padded % SE3_L1_CRYPTOBLOCK_SIZE));
 	}
 
 	req0_len = SE3_REQ1_OFFSET_DATA + req_len_padded;
+	req[req_count].data = s->buf;
+	req[req_count++].len = req0_len;
+	for (i = 0; i < req_ext_count; i++) {
+		req[req_count++] = req_ext[i];
+	}
+	if ((req_len + ext_len) % SE3_L1_CRYPTOBLOCK_SIZE != 0 && req_ext_count > 0) {
+		req[req_count].data = zeros;
+		req[req_count++].len = SE3_L1_CRYPTOBLOCK_SIZE - ((req_len + ext_len) % SE3_L1_CRYPTOBLOCK_SIZE);
+	}
 
 	// encrypt
 	if (!(s->cryptoctx_initialized)) {
@@ -52,8 +89,7 @@ static uint16_t L1_TXRX(se3_session* s, uint16_t cmd, uint16_t cmd_flags, uint16
 		&(s->cryptoctx), req_auth, req_iv,
 		(s->buf + SE3_L1_AUTH_SIZE + SE3_L1_IV_SIZE), (req0_len - SE3_L1_AUTH_SIZE - SE3_L1_IV_SIZE) / SE3_L1_CRYPTOBLOCK_SIZE, cmd_flags);
 
-	resp0_len = SE3_COMM_N*SE3_COMM_BLOCK;
-	result = L0_TXRX(&(s->device), SE3_CMD0_L1, cmd_flags, req0_len, s->buf, &resp_status, &resp0_len, s->buf);
+	result = L0_TXRXv(&(s->device), SE3_CMD0_L1, cmd_flags, req, req_count, &resp_status, &resp0_len, s->buf, resp_copy);
 
 	// comm error status
 	if (result != SE3_OK) {
@@ -65,9 +101,12 @@ static uint16_t L1_TXRX(se3_session* s, uint16_t cmd, uint16_t cmd_flags, uint16
 		return resp_status;
 	}
 
-	if (resp0_len < SE3_RESP1_OFFSET_DATA) {
+	if (resp0_len < SE3_RESP1_OFFSET_DATA || resp0_len > SE3_COMM_N*SE3_COMM_BLOCK) {
 		return SE3_ERR_COMM;
 	}
+	if (resp0_len > resp_copy && cmd_flags != 0) {
+		return SE3_ERR_PARAMS;
+	}
 
 	//decrypt
 	if (!se3_payload_decrypt(
@@ -168,6 +207,20 @@ uint16_t L1_login(se3_session* s, se3_device* dev, const uint8_t* pin, uint16_t
 	return(SE3_OK);
 }
 
+uint16_t L1_resume(se3_session* s, se3_device* dev, const uint8_t* token, const uint8_t* key) {
+	if (s == NULL || dev == NULL || token == NULL || key == NULL) {
+		return SE3_ERR_PARAMS;
+	}
+	se3_session_init(s, dev);
+	// packets are protected as after L1_login: the context set up by the challenge is kept
+	se3_payload_cryptoinit(&(s->cryptoctx), s->key);
+	s->cryptoctx_initialized = true;
+	memcpy(s->key, key, SE3_L1_KEY_SIZE);
+	memcpy(s->token, token, SE3_L1_TOKEN_SIZE);
+	s->logged_in = true;
+	return(SE3_OK);
+}
+
 
 
 uint16_t L1_logout(se3_session* s) {
@@ -257,6 +310,7 @@ uint16_t L1_key_edit(se3_session* s, uint16_t op, se3_key* k) {
 
 	data_len = 2 + 4 + 4 + 2 + 2 + k->data_size + k->name_size;   // op + id + validity + data_size + name_size + data + name
 	error = L1_TXRX(s, SE3_CMD1_KEY_EDIT, SE3_CMDFLAG_ENCRYPT | SE3_CMDFLAG_SIGN, data_len, &resp_len);
+	s->cache.keys_valid = false;
 	if (error != SE3_OK) {
 		return error;
 	}
@@ -313,9 +367,70 @@ static uint16_t key_list(se3_session* s, uint16_t skip, uint16_t max_keys, const
 	return(SE3_OK);
 }
 
+/** \brief Fill the key cache of s if it is empty or a listed key expired */
+static uint16_t key_cache(se3_session* s) {
+	se3_cache* c = &(s->cache);
+	se3_key extra;
+	uint16_t ret = SE3_OK, count = 0, i = 0, want = 0;
+	uint32_t now = (uint32_t)time(NULL);
+	size_t used = 0;
+	bool ended = false;
+
+	if (c->keys_valid && (c->keys_expiry == 0 || now < c->keys_expiry)) {
+		return SE3_OK;
+	}
+	c->keys_valid = false;
+	c->n_keys = 0;
+	// a response holds as many keys as fit, usually all of them
+	while (!ended && c->n_keys < SE3_L1_CACHE_KEYS) {
+		want = SE3_L1_CACHE_KEYS - c->n_keys;
+		if ((ret = key_list(s, c->n_keys, want, NULL, c->keys + c->n_keys, &count)) != SE3_OK) {
+			return ret;
+		}
+		used = SE3_CMD1_KEY_LIST_RESP_OFF_KEYINFO;
+		for (i = c->n_keys; i < c->n_keys + count; i++) {
+			used += SE3_CMD1_KEY_LIST_KEYINFO_OFF_NAME + c->keys[i].name_size;
+		}
+		c->n_keys += count;
+		// a short response with room for one more key is the end of the list
+		ended = (count < want && used + SE3_CMD1_KEY_LIST_KEYINFO_OFF_NAME + SE3_KEY_NAME_MAX <= SE3_RESP1_MAX_DATA) || count == 0;
+	}
+	if (!ended) {
+		if ((ret = key_list(s, SE3_L1_CACHE_KEYS, 1, NULL, &extra, &count)) != SE3_OK) {
+			return ret;
+		}
+		ended = (count == 0);
+	}
+	c->keys_complete = ended;
+	c->keys_expiry = 0;
+	for (i = 0; i < c->n_keys; i++) {
+		c->keys[i].data = NULL;
+		if (c->keys[i].validity > now && (c->keys_expiry == 0 || c->keys[i].validity < c->keys_expiry)) {
+			c->keys_expiry = c->keys[i].validity;
+		}
+	}
+	c->keys_valid = true;
+	return SE3_OK;
+}
+
+void L1_cache_invalidate(se3_session* s) {
+	s->cache.keys_valid = false;
+	s->cache.algos_valid = false;
+}
+
 uint16_t L1_key_list(se3_session* s, uint16_t skip, uint16_t max_keys, const uint8_t* salt, se3_key* key_array, uint16_t* count) {
 	int i = 0;
 	uint16_t return_value = 0, xcount = 0;
+	uint8_t* data;
+	if (salt == NULL && key_cache(s) == SE3_OK && s->cache.keys_complete) {
+		for (i = 0; i < max_keys && skip + i < s->cache.n_keys; i++) {
+			data = key_array[i].data;
+			key_array[i] = s->cache.keys[skip + i];
+			key_array[i].data = data;
+		}
+		*count = (uint16_t)i;
+		return SE3_OK;
+	}
 	while (i != max_keys &&
 		(return_value = key_list(s, i + skip, max_keys - i, salt, &(key_array[i]), &xcount)) == 0 &&
 		xcount>0){
@@ -332,7 +447,14 @@ bool L1_find_key(se3_session* s, uint32_t key_id){
 	se3_key key_array[FIND_KEY_NUM];
 	uint16_t ret = SE3_OK, count = 0;
 	int i = 0, j = 0;
-	while ((ret = L1_key_list(s, i, i + FIND_KEY_NUM, NULL, key_array, &count)) == SE3_OK && count>0){
+	if (key_cache(s) == SE3_OK) {
+		for (j = 0; j < s->cache.n_keys; j++) {
+			if (s->cache.keys[j].id == key_id) return true;
+		}
+		if (s->cache.keys_complete) return false;
+	}
+	// more keys than the cache holds
+	while ((ret = key_list(s, i, FIND_KEY_NUM, NULL, key_array, &count)) == SE3_OK && count>0){
 		for (j = 0; j<count; j++){
 			if (key_array[j].id == key_id) return true;
 		}
@@ -385,12 +507,13 @@ uint16_t L1_crypto_update(se3_session* s,
 	uint16_t data1_len_pad16 = 0;
 	uint16_t u16tmp;
 	uint8_t* session_data = s->buf + SE3_RESP1_OFFSET_DATA;
+	se3_iovec ext[2];
 	// Prepare data
 	//memset(session_data, 0, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA);   // Clear buffer
 	SE3_SET32(session_data, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_SID, sess_id);   // Session ID
 	SE3_SET16(session_data, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_FLAGS, flags);   // Flags
-	SE3_SET32(session_data, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATAIN1_LEN, data1_len);   // Length of Data1
-	SE3_SET32(session_data, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATAIN2_LEN, data2_len);   // Length of Data2
+	SE3_SET16(session_data, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATAIN1_LEN, data1_len);   // Length of Data1
+	SE3_SET16(session_data, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATAIN2_LEN, data2_len);   // Length of Data2
 	// compute offset for data2
 	if (data1_len % 16 != 0) {
 		data1_len_pad16 = data1_len + (16 - (data1_len % 16));
@@ -403,28 +526,45 @@ uint16_t L1_crypto_update(se3_session* s,
 	if (data_len > SE3_REQ1_MAX_DATA) {
 		return SE3_ERR_PARAMS;
 	}
-	// copy data1
+	// data1 (padded) is framed from s->buf, data2 straight from the caller unless
+	// the payload is protected: then it must be contiguous in s->buf
 	if (data1_len > 0) {
 		memcpy(session_data + SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA, data1, data1_len);
-	}
-	//copy data2
-	if (data2_len > 0) {
-		memcpy(session_data + SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA + data1_len_pad16, data2, data2_len);
+		memset(session_data + SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA + data1_len, 0, data1_len_pad16 - data1_len);
 	}
 
 	// Send data
-
-	error = L1_TXRX(s, SE3_CMD1_CRYPTO_UPDATE, 0, data_len, &resp_len);
+	if (SE3_L1_UPDATE_CMDFLAGS != 0) {
+		if (data2_len > 0) {
+			memcpy(session_data + SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA + data1_len_pad16, data2, data2_len);
+		}
+		error = L1_TXRX(s, SE3_CMD1_CRYPTO_UPDATE, SE3_L1_UPDATE_CMDFLAGS, data_len, &resp_len);
+	}
+	else {
+		ext[0].data = data2;
+		ext[0].len = data2_len;
+		error = L1_TXRXv(s, SE3_CMD1_CRYPTO_UPDATE, 0, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA + data1_len_pad16, ext, (data2_len > 0) ? (1) : (0),
+			SE3_RESP1_OFFSET_DATA + SE3_CMD1_CRYPTO_UPDATE_RESP_OFF_DATA, &resp_len);
+	}
 	if (error != SE3_OK) {
 		return error;
 	}
 
-	// Read response
+	// Read response: the output is in s->buf if protected, else still in the device buffer
 	SE3_GET16(session_data, SE3_CMD1_CRYPTO_UPDATE_RESP_OFF_DATAOUT_LEN, u16tmp);   // extract length of output data
 	if (dataout_len != NULL)
 		*dataout_len = u16tmp;
-	if (data_out != NULL)
-		memcpy(data_out, session_data + SE3_CMD1_CRYPTO_UPDATE_RESP_OFF_DATA, u16tmp);   // extract output data
+	if (data_out != NULL && u16tmp > 0) {
+		if (SE3_L1_UPDATE_CMDFLAGS != 0) {
+			if (u16tmp > resp_len - SE3_CMD1_CRYPTO_UPDATE_RESP_OFF_DATA) {
+				return SE3_ERR_COMM;
+			}
+			memcpy(data_out, session_data + SE3_CMD1_CRYPTO_UPDATE_RESP_OFF_DATA, u16tmp);
+		}
+		else if (L0_resp_read(&(s->device), SE3_RESP1_OFFSET_DATA + SE3_CMD1_CRYPTO_UPDATE_RESP_OFF_DATA, u16tmp, data_out) != SE3_OK) {
+			return SE3_ERR_COMM;
+		}
+	}
 
 
 	return(SE3_OK);
@@ -441,31 +581,36 @@ uint16_t L1_get_algorithms(se3_session* s,
 	uint16_t n_algo = 0;
 	size_t offset_algo = 0;
 	uint16_t i = 0;
-	uint16_t alg_to_skip = skip * SE3_CMD1_CRYPTO_ALGOINFO_SIZE;
 	uint8_t* session_data = s->buf + SE3_RESP1_OFFSET_DATA;
+	se3_cache* c = &(s->cache);
 
 	// Check parameters
 	if (max_algorithms <= 0 || skip < 0) {
 		return(SE3_ERR_PARAMS);
 	}
 
-	// Send request
-	error = L1_TXRX(s, SE3_CMD1_CRYPTO_LIST, 0, SE3_CMD1_CRYPTO_LIST_REQ_SIZE, &resp_len);
-	if (error != SE3_OK) {
-		return error;
-	}
-
+	if (!(c->algos_valid)) {
+		// Send request
+		error = L1_TXRX(s, SE3_CMD1_CRYPTO_LIST, 0, SE3_CMD1_CRYPTO_LIST_REQ_SIZE, &resp_len);
+		if (error != SE3_OK) {
+			return error;
+		}
 
-	// Read response
-	SE3_GET16(session_data, SE3_CMD1_CRYPTO_LIST_RESP_OFF_COUNT, n_algo);   // extract number of algorithms returned
-	offset_algo = SE3_CMD1_CRYPTO_LIST_RESP_OFF_ALGOINFO + skip * SE3_CMD1_CRYPTO_ALGOINFO_SIZE;
-	size_t j = 0;
-	for (i = 0, j = skip; i < max_algorithms && j < n_algo; i++, j++) {   // Fills array with algorithm(s) received
-		memcpy(algorithms_array[i].name, session_data + offset_algo + SE3_CMD1_CRYPTO_ALGOINFO_OFF_NAME, SE3_CMD1_CRYPTO_ALGOINFO_NAME_SIZE);
-		SE3_GET16(session_data + offset_algo, SE3_CMD1_CRYPTO_ALGOINFO_OFF_TYPE, algorithms_array[i].type);
-		SE3_GET16(session_data + offset_algo, SE3_CMD1_CRYPTO_ALGOINFO_OFF_BLOCK_SIZE, algorithms_array[i].block_size);
-		SE3_GET16(session_data + offset_algo, SE3_CMD1_CRYPTO_ALGOINFO_OFF_KEY_SIZE, algorithms_array[i].key_size);
-		offset_algo += SE3_CMD1_CRYPTO_ALGOINFO_SIZE;
+		// Read response
+		SE3_GET16(session_data, SE3_CMD1_CRYPTO_LIST_RESP_OFF_COUNT, n_algo);   // extract number of algorithms returned
+		offset_algo = SE3_CMD1_CRYPTO_LIST_RESP_OFF_ALGOINFO;
+		for (i = 0; i < n_algo && i < SE3_ALGO_MAX; i++) {   // Fills the cache with algorithm(s) received
+			memcpy(c->algos[i].name, session_data + offset_algo + SE3_CMD1_CRYPTO_ALGOINFO_OFF_NAME, SE3_CMD1_CRYPTO_ALGOINFO_NAME_SIZE);
+			SE3_GET16(session_data + offset_algo, SE3_CMD1_CRYPTO_ALGOINFO_OFF_TYPE, c->algos[i].type);
+			SE3_GET16(session_data + offset_algo, SE3_CMD1_CRYPTO_ALGOINFO_OFF_BLOCK_SIZE, c->algos[i].block_size);
+			SE3_GET16(session_data + offset_algo, SE3_CMD1_CRYPTO_ALGOINFO_OFF_KEY_SIZE, c->algos[i].key_size);
+			offset_algo += SE3_CMD1_CRYPTO_ALGOINFO_SIZE;
+		}
+		c->n_algos = i;
+		c->algos_valid = true;
+	}
+	for (i = 0; i < max_algorithms && skip + i < c->n_algos; i++) {
+		algorithms_array[i] = c->algos[skip + i];
 	}
 	*count = i;
 
@@ -485,6 +630,13 @@ return L1_crypto_update(s,	sess_id, flags,	data1_len, data1, 0, NULL, dataout_le
 }
 */
 
+uint16_t L1_command(se3_session* s, uint16_t cmd, uint16_t cmd_flags, uint16_t req_len, uint16_t* resp_len) {
+	if (s == NULL || resp_len == NULL || req_len > SE3_REQ1_MAX_DATA) {
+		return SE3_ERR_PARAMS;
+	}
+	return L1_TXRX(s, cmd, cmd_flags, req_len, resp_len);
+}
+
 uint16_t L1_crypto_set_time(se3_session* s, uint32_t devtime){
 	uint16_t return_value = 0, resp_len = 0;
 	uint32_t current_time = devtime;
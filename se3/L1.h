@@ -20,6 +20,20 @@
 #define SE3_RESP_CHALLENGE_SC_OFFSET   (32)
 #define SE3_RESP_LOGIN_TOKEN_OFFSET   (32)
 
+/** Keys kept by the key cache of a session; with more keys on the device,
+ *  the key lookups page through the device list */
+#define SE3_L1_CACHE_KEYS   (64)
+
+/** Protection of the L1_crypto_update packets. 0 (default) sends them as the
+ *  other commands, straight from and to the buffers of the caller.
+ *  SE3_CMDFLAG_ENCRYPT | SE3_CMDFLAG_SIGN goes through s->buf instead, for
+ *  about 200 us more per 8 KB: the packet context is keyed from the public
+ *  se3_magic, so this only obfuscates the data on the wire, it does not hide
+ *  it from whoever can read the USB traffic and this source */
+#ifndef SE3_L1_UPDATE_CMDFLAGS
+#define SE3_L1_UPDATE_CMDFLAGS   (0)
+#endif
+
 /* END - defines */
 
 
@@ -29,21 +43,6 @@ extern "C" {
 #endif
 
 /* struct */
-/** \brief SEcube Communication session structure */
-typedef struct se3_session_ {
-	se3_device device;
-	uint8_t token[SE3_L1_TOKEN_SIZE];
-	uint8_t key[SE3_L1_KEY_SIZE];
-	uint8_t buf[SE3_COMM_N * SE3_COMM_BLOCK];
-	bool locked;
-	bool logged_in;
-	uint32_t timeout;
-	se3_file hfile;
-	se3_payload_cryptoctx cryptoctx;
-	bool cryptoctx_initialized;
-	// TODO: Add flag for type of user logged (see set_{admin,user}_PIN) or change type for logged_in
-} se3_session;
-
 /** \brief SEcube Key structure */
 typedef struct se3_key_ {
 	uint32_t id;
@@ -63,6 +62,41 @@ typedef struct se3_algo_ {
 	uint16_t key_size;
 } se3_algo;
 
+/**
+ *  \brief Key and algorithm tables of a device, read once per session
+ *
+ *  \details The keys are read with one key list of SE3_L1_CACHE_KEYS keys
+ *  (no salt) and dropped after \ref L1_key_edit or when a listed key expires;
+ *  the algorithms are read once. A copy of a session copies its cache: call
+ *  \ref L1_cache_invalidate when the keys are changed through another session.
+ */
+typedef struct se3_cache_ {
+	bool keys_valid;
+	bool keys_complete;     ///< keys holds every key of the device
+	uint16_t n_keys;
+	uint32_t keys_expiry;   ///< first validity reached by a listed key, 0 for none
+	se3_key keys[SE3_L1_CACHE_KEYS];
+	bool algos_valid;
+	uint16_t n_algos;
+	se3_algo algos[SE3_ALGO_MAX];
+} se3_cache;
+
+/** \brief SEcube Communication session structure */
+typedef struct se3_session_ {
+	se3_device device;
+	uint8_t token[SE3_L1_TOKEN_SIZE];
+	uint8_t key[SE3_L1_KEY_SIZE];
+	uint8_t buf[SE3_COMM_N * SE3_COMM_BLOCK];
+	bool locked;
+	bool logged_in;
+	uint32_t timeout;
+	se3_file hfile;
+	se3_payload_cryptoctx cryptoctx;
+	bool cryptoctx_initialized;
+	se3_cache cache;
+	// TODO: Add flag for type of user logged (see set_{admin,user}_PIN) or change type for logged_in
+} se3_session;
+
 
 /* END - struct */
 
@@ -84,6 +118,20 @@ typedef struct se3_algo_ {
 *  		 \ref L1_set_user_PIN to change them.
 */
 uint16_t L1_login(se3_session* s, se3_device* dev, const uint8_t* pin, uint16_t access);
+/**
+ *  \brief Continue a login made by an earlier session, without the handshake
+ *
+ *  \param [out] s Pointer to an already allocated se3_session object
+ *  \param [in] dev Device the earlier session logged in to, opened again
+ *  \param [in] token Token of the earlier session
+ *  \param [in] key Session key of the earlier session
+ *  \return It returns SE3_OK on success, otherwise see \ref se3c1def.h
+ *
+ *  \details The device is not contacted: if it no longer holds that login
+ *  		 (logout, power cycle), the next command fails and a full
+ *  		 \ref L1_login is needed. See se3agent.h.
+ */
+uint16_t L1_resume(se3_session* s, se3_device* dev, const uint8_t* token, const uint8_t* key);
 /**
 *  \brief This function is used to change the current admin pin
 *
@@ -131,6 +179,8 @@ uint16_t L1_logout(se3_session* s);
 *  \param [out] key_array Pointer to the already allocated array where to store the keys
 *  \param [out] count Effective number of retrieved keys
 *  \return It returns SE3_OK on success, otherwise see \ref se3c1def.h
+*
+*  \details Without salt, the keys come from the cache of the session (see \ref se3_cache).
 */
 uint16_t L1_key_list(se3_session* s, uint16_t skip, uint16_t max_keys, const uint8_t* salt, se3_key* key_array, uint16_t* count);
 /**
@@ -151,9 +201,17 @@ uint16_t L1_key_edit(se3_session* s, uint16_t op, se3_key* k);
  *  \param [in] key_id ID of key to be found
  *  \return true if key is found, false otherwise
  *  
+ *  \details Looked up in the cache of the session (see \ref se3_cache).
  */
 bool L1_find_key(se3_session* s, uint32_t key_id);
 
+/**
+ *  \brief Drop the key and algorithm tables cached by a session
+ *
+ *  \param [in] s Session whose next lookups read the tables from the device
+ */
+void L1_cache_invalidate(se3_session* s);
+
 /**
  *  \brief Initialise a crypto session
  *  
@@ -194,6 +252,23 @@ uint16_t L1_crypto_update(se3_session* s, uint32_t sess_id, uint16_t flags, uint
  */
 uint16_t L1_crypto_set_time(se3_session* s, uint32_t devtime);
 
+/**
+ *  \brief Send an L1 command whose payload is already in place
+ *
+ *  \param [in] s Pointer to current se3_session, the payload is at
+ *  			  s->buf + SE3_REQ1_OFFSET_DATA
+ *  \param [in] cmd L1 command, see \ref se3c1def.h
+ *  \param [in] cmd_flags Packet protection, SE3_CMDFLAG_ENCRYPT and SE3_CMDFLAG_SIGN
+ *  \param [in] req_len Length of the payload
+ *  \param [out] resp_len Length of the response payload, stored at
+ *  			  s->buf + SE3_RESP1_OFFSET_DATA
+ *  \return The L1 status of the response, or an L0 error code
+ *
+ *  \details Used to relay commands built elsewhere, e.g. by the clients of
+ *  se3broker.h; the other L1 functions build their own payload.
+ */
+uint16_t L1_command(se3_session* s, uint16_t cmd, uint16_t cmd_flags, uint16_t req_len, uint16_t* resp_len);
+
 /**
 *  \brief This function is used to encrypt a buffer of data given the algorithm,
 *  	   the encryption mode, the buffer size, and where to store the encrypted
@@ -254,6 +329,7 @@ uint16_t L1_digest(se3_session* s, uint16_t algorithm, size_t datain_len, int8_t
 *  \param [in] count Effective number of retrieved keys
 *  \return It returns SE3_OK on success, otherwise see \ref se3c1def.h
 *
+*  \details The device is asked once per session (see \ref se3_cache).
 */
 uint16_t L1_get_algorithms(se3_session* s, uint16_t skip, uint16_t max_algorithms, se3_algo* algorithms_array, uint16_t* count);
 
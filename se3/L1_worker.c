@@ -0,0 +1,513 @@
+#include "L1_worker.h"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <pthread.h>
+
+#define SE3_XCHG_PTR(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define SE3_STORE_PTR(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define SE3_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define SE3_STORE_FLAG(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define SE3_LOAD_FLAG(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define SE3_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+typedef pthread_mutex_t se3_lock;
+typedef pthread_cond_t se3_cond;
+#define se3_lock_init(l) pthread_mutex_init((l), NULL)
+#define se3_lock_destroy(l) pthread_mutex_destroy(l)
+#define se3_lock_acquire(l) pthread_mutex_lock(l)
+#define se3_lock_release(l) pthread_mutex_unlock(l)
+#define se3_cond_init(c) pthread_cond_init((c), NULL)
+#define se3_cond_destroy(c) pthread_cond_destroy(c)
+#define se3_cond_wait(c, l) pthread_cond_wait((c), (l))
+#define se3_cond_signal(c) pthread_cond_signal(c)
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+#define registry_acquire() pthread_mutex_lock(&registry_lock)
+#define registry_release() pthread_mutex_unlock(&registry_lock)
+#elif _WIN32
+#include <windows.h>
+
+#define SE3_XCHG_PTR(p, v) InterlockedExchangePointer((PVOID volatile*)(p), (v))
+#define SE3_STORE_PTR(p, v) InterlockedExchangePointer((PVOID volatile*)(p), (v))
+#define SE3_LOAD_PTR(p) InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+#define SE3_STORE_FLAG(p, v) InterlockedExchange((p), (v))
+#define SE3_LOAD_FLAG(p) InterlockedCompareExchange((p), 0, 0)
+#define SE3_FENCE() MemoryBarrier()
+
+typedef CRITICAL_SECTION se3_lock;
+typedef CONDITION_VARIABLE se3_cond;
+#define se3_lock_init(l) InitializeCriticalSection(l)
+#define se3_lock_destroy(l) DeleteCriticalSection(l)
+#define se3_lock_acquire(l) EnterCriticalSection(l)
+#define se3_lock_release(l) LeaveCriticalSection(l)
+#define se3_cond_init(c) InitializeConditionVariable(c)
+#define se3_cond_destroy(c)
+#define se3_cond_wait(c, l) SleepConditionVariableCS((c), (l), INFINITE)
+#define se3_cond_signal(c) WakeConditionVariable(c)
+
+static SRWLOCK registry_lock = SRWLOCK_INIT;
+#define registry_acquire() AcquireSRWLockExclusive(&registry_lock)
+#define registry_release() ReleaseSRWLockExclusive(&registry_lock)
+#endif
+
+/** \brief A pending call. It lives on the stack of the caller, which sleeps
+ *         on lock/cond until the worker sets done. */
+typedef struct se3_worker_req_ {
+	struct se3_worker_req_* volatile next;
+	se3_worker_fn fn;
+	void* arg;
+	uint16_t result;
+	bool done;
+	se3_lock lock;
+	se3_cond cond;
+} se3_worker_req;
+
+struct se3_worker_ {
+	const uint8_t* id;                   // request buffer of the device, shared by all its copies
+	uint32_t refs;                       // protected by registry_lock
+	struct se3_worker_* next_worker;     // protected by registry_lock
+	se3_worker_req* volatile head;       // last pushed request, producers only
+	se3_worker_req* tail;                // next request to pop, worker thread only
+	se3_worker_req stub;
+#ifdef _WIN32
+	volatile LONG idle;
+	HANDLE thread;
+#else
+	volatile int32_t idle;
+	pthread_t thread;
+#endif
+	bool stop;
+	se3_lock lock;
+	se3_cond cond;
+};
+
+static se3_worker* registry = NULL;
+
+/* Intrusive MPSC queue (D. Vyukov). Push is wait-free for producers, pop is
+ * only called by the worker thread. */
+static void queue_push(se3_worker* w, se3_worker_req* req)
+{
+	se3_worker_req* prev;
+	req->next = NULL;
+	prev = SE3_XCHG_PTR(&(w->head), req);
+	SE3_STORE_PTR(&(prev->next), req);
+}
+
+static se3_worker_req* queue_pop(se3_worker* w)
+{
+	se3_worker_req* tail = w->tail;
+	se3_worker_req* next = SE3_LOAD_PTR(&(tail->next));
+
+	if (tail == &(w->stub)) {
+		if (next == NULL) {
+			return NULL;
+		}
+		w->tail = next;
+		tail = next;
+		next = SE3_LOAD_PTR(&(next->next));
+	}
+	if (next != NULL) {
+		w->tail = next;
+		return tail;
+	}
+	if (tail != SE3_LOAD_PTR(&(w->head))) {
+		// a producer is between the exchange and the link, it will wake us up
+		return NULL;
+	}
+	queue_push(w, &(w->stub));
+	next = SE3_LOAD_PTR(&(tail->next));
+	if (next != NULL) {
+		w->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static void req_complete(se3_worker_req* req)
+{
+	req->result = req->fn(req->arg);
+	se3_lock_acquire(&(req->lock));
+	req->done = true;
+	se3_cond_signal(&(req->cond));
+	// req belongs to the caller as soon as the lock is released
+	se3_lock_release(&(req->lock));
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID param)
+#else
+static void* worker_main(void* param)
+#endif
+{
+	se3_worker* w = (se3_worker*)param;
+	se3_worker_req* req = NULL;
+
+	for (;;) {
+		req = queue_pop(w);
+		if (req != NULL) {
+			req_complete(req);
+			continue;
+		}
+		se3_lock_acquire(&(w->lock));
+		SE3_STORE_FLAG(&(w->idle), 1);
+		SE3_FENCE();
+		while (!(w->stop) && (req = queue_pop(w)) == NULL) {
+			se3_cond_wait(&(w->cond), &(w->lock));
+		}
+		SE3_STORE_FLAG(&(w->idle), 0);
+		se3_lock_release(&(w->lock));
+		if (req != NULL) {
+			req_complete(req);
+		}
+		else {
+			break;
+		}
+	}
+#ifdef _WIN32
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+uint16_t L1_worker_get(se3_device* dev, se3_worker** worker)
+{
+	se3_worker* w = NULL;
+
+	if (dev == NULL || worker == NULL || dev->request == NULL) {
+		return SE3_ERR_PARAMS;
+	}
+	registry_acquire();
+	for (w = registry; w != NULL; w = w->next_worker) {
+		if (w->id == dev->request) {
+			w->refs++;
+			registry_release();
+			*worker = w;
+			return SE3_OK;
+		}
+	}
+
+	w = (se3_worker*)calloc(1, sizeof(se3_worker));
+	if (w == NULL) {
+		registry_release();
+		return SE3_ERR_MEMORY;
+	}
+	w->id = dev->request;
+	w->refs = 1;
+	w->stub.next = NULL;
+	w->head = &(w->stub);
+	w->tail = &(w->stub);
+	w->idle = 0;
+	w->stop = false;
+	se3_lock_init(&(w->lock));
+	se3_cond_init(&(w->cond));
+#ifdef _WIN32
+	w->thread = CreateThread(NULL, 0, worker_main, w, 0, NULL);
+	if (w->thread == NULL) {
+#else
+	if (pthread_create(&(w->thread), NULL, worker_main, w)) {
+#endif
+		se3_cond_destroy(&(w->cond));
+		se3_lock_destroy(&(w->lock));
+		free(w);
+		registry_release();
+		return SE3_ERR_RESOURCE;
+	}
+	w->next_worker = registry;
+	registry = w;
+	registry_release();
+
+	*worker = w;
+	return SE3_OK;
+}
+
+void L1_worker_put(se3_worker* worker)
+{
+	se3_worker** pw = NULL;
+
+	if (worker == NULL) {
+		return;
+	}
+	registry_acquire();
+	if (--(worker->refs) > 0) {
+		registry_release();
+		return;
+	}
+	for (pw = &registry; *pw != NULL; pw = &((*pw)->next_worker)) {
+		if (*pw == worker) {
+			*pw = worker->next_worker;
+			break;
+		}
+	}
+	registry_release();
+
+	// no reference left, hence no pending request
+	se3_lock_acquire(&(worker->lock));
+	worker->stop = true;
+	se3_cond_signal(&(worker->cond));
+	se3_lock_release(&(worker->lock));
+#ifdef _WIN32
+	WaitForSingleObject(worker->thread, INFINITE);
+	CloseHandle(worker->thread);
+#else
+	pthread_join(worker->thread, NULL);
+#endif
+	se3_cond_destroy(&(worker->cond));
+	se3_lock_destroy(&(worker->lock));
+	free(worker);
+}
+
+static void req_post(se3_worker* worker, se3_worker_req* req, se3_worker_fn fn, void* arg)
+{
+	req->fn = fn;
+	req->arg = arg;
+	req->result = SE3_OK;
+	req->done = false;
+	se3_lock_init(&(req->lock));
+	se3_cond_init(&(req->cond));
+
+	queue_push(worker, req);
+	SE3_FENCE();
+	if (SE3_LOAD_FLAG(&(worker->idle))) {
+		se3_lock_acquire(&(worker->lock));
+		se3_cond_signal(&(worker->cond));
+		se3_lock_release(&(worker->lock));
+	}
+}
+
+static uint16_t req_wait(se3_worker_req* req)
+{
+	se3_lock_acquire(&(req->lock));
+	while (!req->done) {
+		se3_cond_wait(&(req->cond), &(req->lock));
+	}
+	se3_lock_release(&(req->lock));
+	se3_cond_destroy(&(req->cond));
+	se3_lock_destroy(&(req->lock));
+	return req->result;
+}
+
+uint16_t L1_worker_call(se3_worker* worker, se3_worker_fn fn, void* arg)
+{
+	se3_worker_req req;
+
+	if (worker == NULL) {
+		return fn(arg);
+	}
+	req_post(worker, &req, fn, arg);
+	return req_wait(&req);
+}
+
+/** \brief Work shared by the workers of \ref L1_worker_for */
+typedef struct worker_for_job_ {
+	se3_worker_range_fn fn;
+	void* arg;
+	size_t count;
+	size_t chunk;
+	size_t next;        // first item not taken yet, protected by lock
+	uint16_t error;     // first error, protected by lock
+	se3_lock lock;
+} worker_for_job;
+
+typedef struct worker_for_args_ {
+	worker_for_job* job;
+	size_t device;
+} worker_for_args;
+
+static uint16_t worker_for_fn(void* arg)
+{
+	worker_for_args* a = (worker_for_args*)arg;
+	worker_for_job* job = a->job;
+	size_t begin, end;
+	uint16_t ret;
+
+	for (;;) {
+		se3_lock_acquire(&(job->lock));
+		begin = job->next;
+		if (job->error != SE3_OK || begin >= job->count) {
+			se3_lock_release(&(job->lock));
+			return SE3_OK;
+		}
+		end = (job->count - begin > job->chunk) ? (begin + job->chunk) : (job->count);
+		job->next = end;
+		se3_lock_release(&(job->lock));
+
+		ret = job->fn(job->arg, a->device, begin, end);
+		if (ret != SE3_OK) {
+			se3_lock_acquire(&(job->lock));
+			if (job->error == SE3_OK) {
+				job->error = ret;
+			}
+			se3_lock_release(&(job->lock));
+			return ret;
+		}
+	}
+}
+
+uint16_t L1_worker_for(se3_worker** workers, size_t n_workers, size_t count, size_t chunk, se3_worker_range_fn fn, void* arg)
+{
+	worker_for_job job;
+	worker_for_args args[SE3_WORKER_FOR_MAX];
+	se3_worker_req reqs[SE3_WORKER_FOR_MAX];
+	size_t i;
+
+	if (workers == NULL || fn == NULL || n_workers == 0 || n_workers > SE3_WORKER_FOR_MAX) {
+		return SE3_ERR_PARAMS;
+	}
+	if (count == 0) {
+		return SE3_OK;
+	}
+	job.fn = fn;
+	job.arg = arg;
+	job.count = count;
+	job.chunk = (chunk > 0) ? (chunk) : (1);
+	job.next = 0;
+	job.error = SE3_OK;
+	se3_lock_init(&(job.lock));
+
+	for (i = 0; i < n_workers; i++) {
+		args[i].job = &job;
+		args[i].device = i;
+		if (workers[i] != NULL) {
+			req_post(workers[i], &(reqs[i]), worker_for_fn, &(args[i]));
+		}
+	}
+	// devices without a worker are driven by the calling thread
+	for (i = 0; i < n_workers; i++) {
+		if (workers[i] == NULL) {
+			worker_for_fn(&(args[i]));
+		}
+	}
+	for (i = 0; i < n_workers; i++) {
+		if (workers[i] != NULL) {
+			req_wait(&(reqs[i]));
+		}
+	}
+	se3_lock_destroy(&(job.lock));
+	return job.error;
+}
+
+typedef struct crypto_init_args_ {
+	se3_session* s;
+	uint16_t algorithm;
+	uint16_t mode;
+	uint32_t key_id;
+	uint32_t* sess_id;
+} crypto_init_args;
+
+static uint16_t crypto_init_fn(void* arg)
+{
+	crypto_init_args* a = (crypto_init_args*)arg;
+	return L1_crypto_init(a->s, a->algorithm, a->mode, a->key_id, a->sess_id);
+}
+
+uint16_t L1_worker_crypto_init(se3_worker* worker, se3_session* s, uint16_t algorithm, uint16_t mode, uint32_t key_id, uint32_t* sess_id)
+{
+	crypto_init_args a = { s, algorithm, mode, key_id, sess_id };
+	return L1_worker_call(worker, crypto_init_fn, &a);
+}
+
+typedef struct crypto_update_args_ {
+	se3_session* s;
+	uint32_t sess_id;
+	uint16_t flags;
+	uint16_t data1_len;
+	uint8_t* data1;
+	uint16_t data2_len;
+	uint8_t* data2;
+	uint16_t* dataout_len;
+	uint8_t* data_out;
+} crypto_update_args;
+
+static uint16_t crypto_update_fn(void* arg)
+{
+	crypto_update_args* a = (crypto_update_args*)arg;
+	return L1_crypto_update(a->s, a->sess_id, a->flags, a->data1_len, a->data1, a->data2_len, a->data2, a->dataout_len, a->data_out);
+}
+
+uint16_t L1_worker_crypto_update(se3_worker* worker, se3_session* s, uint32_t sess_id, uint16_t flags, uint16_t data1_len, uint8_t* data1, uint16_t data2_len, uint8_t* data2, uint16_t* dataout_len, uint8_t* data_out)
+{
+	crypto_update_args a = { s, sess_id, flags, data1_len, data1, data2_len, data2, dataout_len, data_out };
+	return L1_worker_call(worker, crypto_update_fn, &a);
+}
+
+typedef struct encrypt_args_ {
+	se3_session* s;
+	uint16_t algorithm;
+	uint16_t mode;
+	uint32_t key_id;
+	size_t datain_len;
+	int8_t* data_in;
+	size_t* dataout_len;
+	uint8_t* data_out;
+} encrypt_args;
+
+static uint16_t encrypt_fn(void* arg)
+{
+	encrypt_args* a = (encrypt_args*)arg;
+	return L1_encrypt(a->s, a->algorithm, a->mode, a->key_id, a->datain_len, a->data_in, a->dataout_len, a->data_out);
+}
+
+uint16_t L1_worker_encrypt(se3_worker* worker, se3_session* s, uint16_t algorithm, uint16_t mode, uint32_t key_id, size_t datain_len, int8_t* data_in, size_t* dataout_len, uint8_t* data_out)
+{
+	encrypt_args a = { s, algorithm, mode, key_id, datain_len, data_in, dataout_len, data_out };
+	return L1_worker_call(worker, encrypt_fn, &a);
+}
+
+typedef struct key_list_args_ {
+	se3_session* s;
+	uint16_t skip;
+	uint16_t max_keys;
+	const uint8_t* salt;
+	se3_key* key_array;
+	uint16_t* count;
+} key_list_args;
+
+static uint16_t key_list_fn(void* arg)
+{
+	key_list_args* a = (key_list_args*)arg;
+	return L1_key_list(a->s, a->skip, a->max_keys, a->salt, a->key_array, a->count);
+}
+
+uint16_t L1_worker_key_list(se3_worker* worker, se3_session* s, uint16_t skip, uint16_t max_keys, const uint8_t* salt, se3_key* key_array, uint16_t* count)
+{
+	key_list_args a = { s, skip, max_keys, salt, key_array, count };
+	return L1_worker_call(worker, key_list_fn, &a);
+}
+
+typedef struct find_key_args_ {
+	se3_session* s;
+	uint32_t key_id;
+} find_key_args;
+
+static uint16_t find_key_fn(void* arg)
+{
+	find_key_args* a = (find_key_args*)arg;
+	return L1_find_key(a->s, a->key_id) ? 1 : 0;
+}
+
+bool L1_worker_find_key(se3_worker* worker, se3_session* s, uint32_t key_id)
+{
+	find_key_args a = { s, key_id };
+	return L1_worker_call(worker, find_key_fn, &a) != 0;
+}
+
+typedef struct get_algorithms_args_ {
+	se3_session* s;
+	uint16_t skip;
+	uint16_t max_algorithms;
+	se3_algo* algorithms_array;
+	uint16_t* count;
+} get_algorithms_args;
+
+static uint16_t get_algorithms_fn(void* arg)
+{
+	get_algorithms_args* a = (get_algorithms_args*)arg;
+	return L1_get_algorithms(a->s, a->skip, a->max_algorithms, a->algorithms_array, a->count);
+}
+
+uint16_t L1_worker_get_algorithms(se3_worker* worker, se3_session* s, uint16_t skip, uint16_t max_algorithms, se3_algo* algorithms_array, uint16_t* count)
+{
+	get_algorithms_args a = { s, skip, max_algorithms, algorithms_array, count };
+	return L1_worker_call(worker, get_algorithms_fn, &a);
+}
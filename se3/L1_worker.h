@@ -0,0 +1,120 @@
+/**
+ *  \file L1_worker.h
+ *  \brief This file contains the device I/O worker used to share one
+ *         device among several threads
+ *
+ *  \details A se3_session owns a single buffer which L1 functions reuse for
+ *  every command, and every session opened on a device shares the request
+ *  and response buffers of that device. L1 functions must therefore never
+ *  run concurrently on the same device. A worker is a thread that owns the
+ *  device: callers push requests on a lock-free multi-producer queue and
+ *  sleep until their own request is completed, so several threads can keep
+ *  the device busy without holding a lock around whole file operations.
+ *  There is one worker per opened device, shared by reference counting.
+ */
+
+#pragma once
+#include "L1.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \brief Device I/O worker, see \ref L1_worker_get */
+typedef struct se3_worker_ se3_worker;
+
+/** \brief Function executed on the worker thread by \ref L1_worker_call */
+typedef uint16_t (*se3_worker_fn)(void* arg);
+
+/** \brief Function executed by \ref L1_worker_for on the items [begin, end),
+ *         on the thread of the worker of index device */
+typedef uint16_t (*se3_worker_range_fn)(void* arg, size_t device, size_t begin, size_t end);
+
+/** Maximum number of workers of a \ref L1_worker_for call */
+#define SE3_WORKER_FOR_MAX (8)
+
+/**
+ *  \brief Get the worker of a device, starting it if no one is using it yet
+ *
+ *  \param [in] dev Opened device, any copy of the se3_device structure
+ *  			   filled by L0_open (e.g. the one inside a se3_session) identifies
+ *  			   the same device
+ *  \param [out] worker Where to store the worker
+ *  \return It returns SE3_OK on success, otherwise see \ref se3c1def.h
+ *
+ *  \details Every successful call must be paired with \ref L1_worker_put.
+ */
+uint16_t L1_worker_get(se3_device* dev, se3_worker** worker);
+
+/**
+ *  \brief Release a worker obtained with \ref L1_worker_get. The thread is
+ *  	   stopped when the last reference is released.
+ *
+ *  \param [in] worker Worker to release, can be NULL
+ */
+void L1_worker_put(se3_worker* worker);
+
+/**
+ *  \brief Run fn(arg) on the worker thread and wait for its completion
+ *
+ *  \param [in] worker Worker of the device used by fn. If NULL, fn is run
+ *  			   on the calling thread.
+ *  \param [in] fn Function to run
+ *  \param [in] arg Argument passed to fn
+ *  \return The value returned by fn
+ */
+uint16_t L1_worker_call(se3_worker* worker, se3_worker_fn fn, void* arg);
+
+/**
+ *  \brief Process count items with several workers at once
+ *
+ *  \param [in] workers Workers of the devices to use, a NULL entry is
+ *  			   driven by the calling thread
+ *  \param [in] n_workers Number of workers, at most \ref SE3_WORKER_FOR_MAX
+ *  \param [in] count Number of items
+ *  \param [in] chunk Items taken at once by a worker
+ *  \param [in] fn Function run on each chunk
+ *  \param [in] arg Argument passed to fn
+ *  \return SE3_OK, or the first error returned by fn
+ *
+ *  \details Each worker takes the next chunk as soon as it is done with
+ *  the previous one, so the devices that are idle or faster process more
+ *  items. fn receives the index of the worker, to pick the session of that
+ *  device. After an error no new chunk is started. The call returns when
+ *  every worker is done.
+ */
+uint16_t L1_worker_for(se3_worker** workers, size_t n_workers, size_t count, size_t chunk, se3_worker_range_fn fn, void* arg);
+
+/**
+ *  \brief Same as \ref L1_crypto_init, executed by worker
+ */
+uint16_t L1_worker_crypto_init(se3_worker* worker, se3_session* s, uint16_t algorithm, uint16_t mode, uint32_t key_id, uint32_t* sess_id);
+
+/**
+ *  \brief Same as \ref L1_crypto_update, executed by worker
+ */
+uint16_t L1_worker_crypto_update(se3_worker* worker, se3_session* s, uint32_t sess_id, uint16_t flags, uint16_t data1_len, uint8_t* data1, uint16_t data2_len, uint8_t* data2, uint16_t* dataout_len, uint8_t* data_out);
+
+/**
+ *  \brief Same as \ref L1_encrypt, executed by worker
+ */
+uint16_t L1_worker_encrypt(se3_worker* worker, se3_session* s, uint16_t algorithm, uint16_t mode, uint32_t key_id, size_t datain_len, int8_t* data_in, size_t* dataout_len, uint8_t* data_out);
+
+/**
+ *  \brief Same as \ref L1_key_list, executed by worker
+ */
+uint16_t L1_worker_key_list(se3_worker* worker, se3_session* s, uint16_t skip, uint16_t max_keys, const uint8_t* salt, se3_key* key_array, uint16_t* count);
+
+/**
+ *  \brief Same as \ref L1_find_key, executed by worker
+ */
+bool L1_worker_find_key(se3_worker* worker, se3_session* s, uint32_t key_id);
+
+/**
+ *  \brief Same as \ref L1_get_algorithms, executed by worker
+ */
+uint16_t L1_worker_get_algorithms(se3_worker* worker, se3_session* s, uint16_t skip, uint16_t max_algorithms, se3_algo* algorithms_array, uint16_t* count);
+
+#ifdef __cplusplus
+}
+#endif
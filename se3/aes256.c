@@ -8,6 +8,7 @@
  */
 
 #include "aes256.h"
+#include "aes256_ni.h"
 
 
 
@@ -729,6 +730,30 @@ void B5_AES256_PUTUINT32 (uint8_t *ct, const uint32_t st)
 
 
 
+/**
+ * @brief XOR a block with a key stream block, a word at a time.
+ * @param out Output block, may be the same as in.
+ * @param in Input block.
+ * @param ks Key stream block.
+ */
+static void B5_Aes256_Xor (uint8_t *out, const uint8_t *in, const uint8_t *ks)
+{
+    uint32_t a[4], b[4];
+    int16_t j;
+    
+    memcpy(a, in, B5_AES_BLK_SIZE);
+    memcpy(b, ks, B5_AES_BLK_SIZE);
+    for (j = 0; j < 4; j++)
+    {
+        a[j] ^= b[j];
+    }
+    memcpy(out, a, B5_AES_BLK_SIZE);
+}
+
+
+
+
+
 
 
 
@@ -1234,6 +1259,18 @@ int32_t B5_Aes256_Init (B5_tAesCtx *ctx, const uint8_t *Key, int16_t keySize, ui
         return B5_AES256_RES_INVALID_MODE;        
     }
     
+#ifdef B5_AES_NI
+    ctx->ni = (uint8_t)B5_AesNi_Available();
+    if (ctx->ni != B5_AESNI_NONE)
+    {
+        int16_t i;
+        
+        for (i = 0; i < 4*(ctx->Nr + 1); i++)
+        {
+            B5_AES256_PUTUINT32(ctx->rkb + 4*i, ctx->rk[i]);
+        }
+    }
+#endif
     
     return B5_AES256_RES_OK;
 }
@@ -1279,6 +1316,13 @@ int32_t B5_Aes256_Update (B5_tAesCtx	*ctx, uint8_t *encData, uint8_t *clrData, i
     if((encData == NULL) || (clrData == NULL) || (nBlk <= 0))
         return B5_AES256_RES_INVALID_ARGUMENT;
     
+#ifdef B5_AES_NI
+    if ((ctx->ni != B5_AESNI_NONE) && (ctx->mode >= B5_AES256_OFB) && (ctx->mode <= B5_AES256_CTR))
+    {
+        B5_AesNi_Update(ctx, encData, clrData, nBlk);
+        return B5_AES256_RES_OK;
+    }
+#endif
     
     switch(ctx->mode) {
         
@@ -1287,16 +1331,11 @@ int32_t B5_Aes256_Update (B5_tAesCtx	*ctx, uint8_t *encData, uint8_t *clrData, i
         {
             for (i = 0; i < nBlk; i++) 
             {
-                B5_rijndaelEncrypt(ctx, ctx->rk, ctx->Nr, ctx->InitVector, encData);
-                for (j = 0; j < B5_AES_BLK_SIZE; j++) 
-                {
-                    //*encData = *clrData++ ^ encData[j];
-                    //*encData++;
-                    /*Working*/
-					*encData = *encData ^ *clrData;
-					encData++;
-					clrData++;
-                }
+                // the key stream goes to tmp: encData may be clrData
+                B5_rijndaelEncrypt(ctx, ctx->rk, ctx->Nr, ctx->InitVector, tmp);
+                B5_Aes256_Xor(encData, clrData, tmp);
+                encData += 16;
+                clrData += 16;
                 
                 j = 15;
                 do {
@@ -1314,10 +1353,9 @@ int32_t B5_Aes256_Update (B5_tAesCtx	*ctx, uint8_t *encData, uint8_t *clrData, i
             for (i = 0; i < nBlk; i++) 
             {
                 B5_rijndaelEncrypt(ctx, ctx->rk, ctx->Nr, ctx->InitVector, ctx->InitVector);
-                for (j = 0; j < 16; j++) 
-                {
-                    *encData++ = *clrData++ ^ ctx->InitVector[j];
-                }
+                B5_Aes256_Xor(encData, clrData, ctx->InitVector);
+                encData += 16;
+                clrData += 16;
             }
             
             break;
@@ -77,6 +77,8 @@ typedef struct {
     uint8_t  Nr;                   /**< Number of rounds */
     uint8_t  InitVector[16];       /**< IV for OFB, CBC, CTR */
     uint8_t  mode;                 /**< Active mode */
+    uint8_t  ni;                   /**< Instruction set of the kernels, see \ref B5_AES256_NI.h */
+    uint8_t  rkb[16*(14 + 1)];     /**< Round keys as bytes, for the AES-NI kernels */
     uint32_t const *Te0;
     uint32_t const *Te1;
     uint32_t const *Te2;
@@ -0,0 +1,501 @@
+/*  LICENSE  */
+
+/**
+ * @file B5_AES256_NI.c
+ * @brief This file includes the AES-NI and VAES kernels. See \ref B5_AES256_NI.h .
+ *
+ */
+
+#include "aes256_ni.h"
+
+#ifdef B5_AES_NI
+
+#include <wmmintrin.h>
+#ifdef B5_AES_VAES
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define B5_AESNI_TARGET
+#define B5_AESNI_BSWAP64(x) _byteswap_uint64(x)
+#else
+#include <cpuid.h>
+#define B5_AESNI_TARGET __attribute__((target("aes,sse2")))
+#define B5_VAES_TARGET __attribute__((target("aes,vaes,avx512f")))
+#define B5_AESNI_BSWAP64(x) __builtin_bswap64(x)
+#endif
+
+#define B5_AESNI_CPUID1_AES         (1u << 25)
+#define B5_AESNI_CPUID1_OSXSAVE     (1u << 27)
+#define B5_AESNI_CPUID7_AVX512F     (1u << 16)
+#define B5_AESNI_CPUID7_VAES        (1u << 9)
+/** XCR0 bits of the SSE, AVX and AVX-512 states, all saved by the OS */
+#define B5_AESNI_XCR0_AVX512        (0xE6)
+
+/** Blocks in flight in the AES-NI kernels of the parallel modes */
+#define B5_AESNI_WAYS               (8)
+/** Blocks in flight in the VAES kernels: four per register */
+#define B5_VAES_WAYS                (16)
+
+
+
+
+
+static void B5_AesNi_GetCtr (const uint8_t *iv, uint64_t *hi, uint64_t *lo)
+{
+    int16_t j;
+
+    *hi = 0;
+    *lo = 0;
+    for (j = 0; j < 8; j++)
+    {
+        *hi = (*hi << 8) | iv[j];
+        *lo = (*lo << 8) | iv[8 + j];
+    }
+}
+
+
+
+
+
+/**
+ * @brief Write n counter blocks, the counter is a 128-bit big-endian integer as in the portable code.
+ */
+static void B5_AesNi_PutCtr (uint8_t *blk, uint64_t *hi, uint64_t *lo, int16_t n)
+{
+    uint64_t h = B5_AESNI_BSWAP64(*hi), l;
+    int16_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        l = B5_AESNI_BSWAP64(*lo);
+        memcpy(blk + 16*i, &h, 8);
+        memcpy(blk + 16*i + 8, &l, 8);
+        if (++(*lo) == 0)
+            h = B5_AESNI_BSWAP64(++(*hi));
+    }
+}
+
+
+
+
+
+int32_t B5_AesNi_Available (void)
+{
+    static int32_t level = -1;
+
+    if (level < 0)
+    {
+#ifdef _MSC_VER
+        int regs[4];
+
+        __cpuid(regs, 1);
+        level = ((uint32_t)regs[2] & B5_AESNI_CPUID1_AES) ? B5_AESNI_AES : B5_AESNI_NONE;
+#else
+        unsigned int eax, ebx, ecx, edx;
+
+        level = B5_AESNI_NONE;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & B5_AESNI_CPUID1_AES))
+        {
+            level = B5_AESNI_AES;
+#ifdef B5_AES_VAES
+            if ((ecx & B5_AESNI_CPUID1_OSXSAVE) && __get_cpuid_max(0, NULL) >= 7)
+            {
+                unsigned int xcr0, xcr0h;
+
+                __asm__ __volatile__ ("xgetbv" : "=a"(xcr0), "=d"(xcr0h) : "c"(0));
+                __cpuid_count(7, 0, eax, ebx, ecx, edx);
+                if (((xcr0 & B5_AESNI_XCR0_AVX512) == B5_AESNI_XCR0_AVX512) &&
+                    (ebx & B5_AESNI_CPUID7_AVX512F) && (ecx & B5_AESNI_CPUID7_VAES))
+                {
+                    level = B5_AESNI_VAES;
+                }
+            }
+#endif
+        }
+#endif
+    }
+    return level;
+}
+
+
+
+
+
+/**
+ * @brief Encrypt n <= \ref B5_AESNI_WAYS independent blocks.
+ */
+static B5_AESNI_TARGET void B5_AesNi_Enc (const __m128i *k, int16_t Nr, __m128i *b, int16_t n)
+{
+    __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+    int16_t j, r;
+
+    if (n == B5_AESNI_WAYS)
+    {
+        // in registers: the array would go through memory at every round
+        b0 = _mm_xor_si128(b[0], k[0]); b1 = _mm_xor_si128(b[1], k[0]);
+        b2 = _mm_xor_si128(b[2], k[0]); b3 = _mm_xor_si128(b[3], k[0]);
+        b4 = _mm_xor_si128(b[4], k[0]); b5 = _mm_xor_si128(b[5], k[0]);
+        b6 = _mm_xor_si128(b[6], k[0]); b7 = _mm_xor_si128(b[7], k[0]);
+        for (r = 1; r < Nr; r++)
+        {
+            b0 = _mm_aesenc_si128(b0, k[r]); b1 = _mm_aesenc_si128(b1, k[r]);
+            b2 = _mm_aesenc_si128(b2, k[r]); b3 = _mm_aesenc_si128(b3, k[r]);
+            b4 = _mm_aesenc_si128(b4, k[r]); b5 = _mm_aesenc_si128(b5, k[r]);
+            b6 = _mm_aesenc_si128(b6, k[r]); b7 = _mm_aesenc_si128(b7, k[r]);
+        }
+        b[0] = _mm_aesenclast_si128(b0, k[Nr]); b[1] = _mm_aesenclast_si128(b1, k[Nr]);
+        b[2] = _mm_aesenclast_si128(b2, k[Nr]); b[3] = _mm_aesenclast_si128(b3, k[Nr]);
+        b[4] = _mm_aesenclast_si128(b4, k[Nr]); b[5] = _mm_aesenclast_si128(b5, k[Nr]);
+        b[6] = _mm_aesenclast_si128(b6, k[Nr]); b[7] = _mm_aesenclast_si128(b7, k[Nr]);
+        return;
+    }
+    for (j = 0; j < n; j++)
+        b[j] = _mm_xor_si128(b[j], k[0]);
+    for (r = 1; r < Nr; r++)
+    {
+        for (j = 0; j < n; j++)
+            b[j] = _mm_aesenc_si128(b[j], k[r]);
+    }
+    for (j = 0; j < n; j++)
+        b[j] = _mm_aesenclast_si128(b[j], k[Nr]);
+}
+
+
+
+
+
+/**
+ * @brief Decrypt n <= \ref B5_AESNI_WAYS independent blocks.
+ */
+static B5_AESNI_TARGET void B5_AesNi_Dec (const __m128i *k, int16_t Nr, __m128i *b, int16_t n)
+{
+    __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+    int16_t j, r;
+
+    if (n == B5_AESNI_WAYS)
+    {
+        b0 = _mm_xor_si128(b[0], k[0]); b1 = _mm_xor_si128(b[1], k[0]);
+        b2 = _mm_xor_si128(b[2], k[0]); b3 = _mm_xor_si128(b[3], k[0]);
+        b4 = _mm_xor_si128(b[4], k[0]); b5 = _mm_xor_si128(b[5], k[0]);
+        b6 = _mm_xor_si128(b[6], k[0]); b7 = _mm_xor_si128(b[7], k[0]);
+        for (r = 1; r < Nr; r++)
+        {
+            b0 = _mm_aesdec_si128(b0, k[r]); b1 = _mm_aesdec_si128(b1, k[r]);
+            b2 = _mm_aesdec_si128(b2, k[r]); b3 = _mm_aesdec_si128(b3, k[r]);
+            b4 = _mm_aesdec_si128(b4, k[r]); b5 = _mm_aesdec_si128(b5, k[r]);
+            b6 = _mm_aesdec_si128(b6, k[r]); b7 = _mm_aesdec_si128(b7, k[r]);
+        }
+        b[0] = _mm_aesdeclast_si128(b0, k[Nr]); b[1] = _mm_aesdeclast_si128(b1, k[Nr]);
+        b[2] = _mm_aesdeclast_si128(b2, k[Nr]); b[3] = _mm_aesdeclast_si128(b3, k[Nr]);
+        b[4] = _mm_aesdeclast_si128(b4, k[Nr]); b[5] = _mm_aesdeclast_si128(b5, k[Nr]);
+        b[6] = _mm_aesdeclast_si128(b6, k[Nr]); b[7] = _mm_aesdeclast_si128(b7, k[Nr]);
+        return;
+    }
+    for (j = 0; j < n; j++)
+        b[j] = _mm_xor_si128(b[j], k[0]);
+    for (r = 1; r < Nr; r++)
+    {
+        for (j = 0; j < n; j++)
+            b[j] = _mm_aesdec_si128(b[j], k[r]);
+    }
+    for (j = 0; j < n; j++)
+        b[j] = _mm_aesdeclast_si128(b[j], k[Nr]);
+}
+
+
+
+
+
+/**
+ * @brief Process nBlk blocks with the AES-NI instructions, see \ref B5_Aes256_Update .
+ */
+static B5_AESNI_TARGET void B5_AesNi_Blocks (B5_tAesCtx *ctx, uint8_t *encData, uint8_t *clrData, int16_t nBlk)
+{
+    __m128i k[14 + 1];
+    __m128i b[B5_AESNI_WAYS], c[B5_AESNI_WAYS];
+    __m128i prev;
+    uint8_t ctr[16*B5_AESNI_WAYS];
+    uint64_t hi, lo;
+    int16_t i, j, n, r, Nr = ctx->Nr;
+
+    for (r = 0; r <= Nr; r++)
+        k[r] = _mm_loadu_si128((const __m128i*)(ctx->rkb + 16*r));
+
+    prev = _mm_loadu_si128((const __m128i*)ctx->InitVector);
+
+    switch(ctx->mode) {
+
+        case B5_AES256_CTR:
+        {
+            B5_AesNi_GetCtr(ctx->InitVector, &hi, &lo);
+            for (i = 0; i < nBlk; i += n)
+            {
+                n = (nBlk - i < B5_AESNI_WAYS) ? (nBlk - i) : (B5_AESNI_WAYS);
+                B5_AesNi_PutCtr(ctr, &hi, &lo, n);
+                for (j = 0; j < n; j++)
+                    b[j] = _mm_loadu_si128((const __m128i*)(ctr + 16*j));
+                B5_AesNi_Enc(k, Nr, b, n);
+                for (j = 0; j < n; j++)
+                {
+                    b[j] = _mm_xor_si128(b[j], _mm_loadu_si128((const __m128i*)(clrData + 16*(i + j))));
+                    _mm_storeu_si128((__m128i*)(encData + 16*(i + j)), b[j]);
+                }
+            }
+            B5_AesNi_PutCtr(ctx->InitVector, &hi, &lo, 1);
+            return;
+        }
+
+        case B5_AES256_OFB:
+        {
+            for (i = 0; i < nBlk; i++)
+            {
+                B5_AesNi_Enc(k, Nr, &prev, 1);
+                _mm_storeu_si128((__m128i*)(encData + 16*i), _mm_xor_si128(prev, _mm_loadu_si128((const __m128i*)(clrData + 16*i))));
+            }
+            break;
+        }
+
+        case B5_AES256_ECB_ENC:
+        {
+            for (i = 0; i < nBlk; i += n)
+            {
+                n = (nBlk - i < B5_AESNI_WAYS) ? (nBlk - i) : (B5_AESNI_WAYS);
+                for (j = 0; j < n; j++)
+                    b[j] = _mm_loadu_si128((const __m128i*)(clrData + 16*(i + j)));
+                B5_AesNi_Enc(k, Nr, b, n);
+                for (j = 0; j < n; j++)
+                    _mm_storeu_si128((__m128i*)(encData + 16*(i + j)), b[j]);
+            }
+            return;
+        }
+
+        case B5_AES256_ECB_DEC:
+        {
+            for (i = 0; i < nBlk; i += n)
+            {
+                n = (nBlk - i < B5_AESNI_WAYS) ? (nBlk - i) : (B5_AESNI_WAYS);
+                for (j = 0; j < n; j++)
+                    b[j] = _mm_loadu_si128((const __m128i*)(encData + 16*(i + j)));
+                B5_AesNi_Dec(k, Nr, b, n);
+                for (j = 0; j < n; j++)
+                    _mm_storeu_si128((__m128i*)(clrData + 16*(i + j)), b[j]);
+            }
+            return;
+        }
+
+        case B5_AES256_CBC_ENC:
+        {
+            for (i = 0; i < nBlk; i++)
+            {
+                prev = _mm_xor_si128(prev, _mm_loadu_si128((const __m128i*)(clrData + 16*i)));
+                B5_AesNi_Enc(k, Nr, &prev, 1);
+                _mm_storeu_si128((__m128i*)(encData + 16*i), prev);
+            }
+            break;
+        }
+
+        case B5_AES256_CBC_DEC:
+        {
+            // the blocks are independent: several are kept in flight to hide the AESDEC latency
+            for (i = 0; i < nBlk; i += n)
+            {
+                n = (nBlk - i < B5_AESNI_WAYS) ? (nBlk - i) : (B5_AESNI_WAYS);
+                for (j = 0; j < n; j++)
+                    b[j] = c[j] = _mm_loadu_si128((const __m128i*)(encData + 16*(i + j)));
+                B5_AesNi_Dec(k, Nr, b, n);
+                for (j = 0; j < n; j++)
+                {
+                    b[j] = _mm_xor_si128(b[j], (j == 0) ? (prev) : (c[j - 1]));
+                    _mm_storeu_si128((__m128i*)(clrData + 16*(i + j)), b[j]);
+                }
+                prev = c[n - 1];
+            }
+            break;
+        }
+
+        case B5_AES256_CFB_ENC:
+        {
+            for (i = 0; i < nBlk; i++)
+            {
+                B5_AesNi_Enc(k, Nr, &prev, 1);
+                prev = _mm_xor_si128(prev, _mm_loadu_si128((const __m128i*)(clrData + 16*i)));
+                _mm_storeu_si128((__m128i*)(encData + 16*i), prev);
+            }
+            break;
+        }
+
+        case B5_AES256_CFB_DEC:
+        {
+            for (i = 0; i < nBlk; i += n)
+            {
+                n = (nBlk - i < B5_AESNI_WAYS) ? (nBlk - i) : (B5_AESNI_WAYS);
+                for (j = 0; j < n; j++)
+                {
+                    c[j] = _mm_loadu_si128((const __m128i*)(encData + 16*(i + j)));
+                    b[j] = (j == 0) ? (prev) : (c[j - 1]);
+                }
+                B5_AesNi_Enc(k, Nr, b, n);
+                for (j = 0; j < n; j++)
+                    _mm_storeu_si128((__m128i*)(clrData + 16*(i + j)), _mm_xor_si128(b[j], c[j]));
+                prev = c[n - 1];
+            }
+            break;
+        }
+
+        default:
+            return;
+    }
+
+    _mm_storeu_si128((__m128i*)ctx->InitVector, prev);
+}
+
+
+
+
+
+#ifdef B5_AES_VAES
+/**
+ * @brief Process the multiples of \ref B5_VAES_WAYS blocks of the parallel modes with the VAES instructions.
+ * @return Number of blocks processed, the rest is left to \ref B5_AesNi_Blocks .
+ */
+static B5_VAES_TARGET int16_t B5_AesVaes_Blocks (B5_tAesCtx *ctx, uint8_t *encData, uint8_t *clrData, int16_t nBlk)
+{
+    __m512i k[14 + 1];
+    __m512i b[4], c[4];
+    __m512i prev;
+    uint8_t ctr[16*B5_VAES_WAYS];
+    uint64_t hi, lo;
+    int16_t i, j, r, Nr = ctx->Nr;
+    int16_t n = nBlk - (nBlk % B5_VAES_WAYS);
+    uint8_t dec = (ctx->mode == B5_AES256_ECB_DEC) || (ctx->mode == B5_AES256_CBC_DEC);
+
+    if (n == 0)
+        return 0;
+
+    for (r = 0; r <= Nr; r++)
+        k[r] = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i*)(ctx->rkb + 16*r)));
+
+    // block 3 of prev is the block before the next four
+    prev = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i*)ctx->InitVector));
+    B5_AesNi_GetCtr(ctx->InitVector, &hi, &lo);
+
+    for (i = 0; i < n; i += B5_VAES_WAYS)
+    {
+        switch(ctx->mode) {
+            case B5_AES256_CTR:
+                B5_AesNi_PutCtr(ctr, &hi, &lo, B5_VAES_WAYS);
+                for (j = 0; j < 4; j++)
+                    b[j] = _mm512_loadu_si512((const void*)(ctr + 64*j));
+                break;
+            case B5_AES256_ECB_ENC:
+                for (j = 0; j < 4; j++)
+                    b[j] = _mm512_loadu_si512((const void*)(clrData + 16*i + 64*j));
+                break;
+            default:
+                // ECB_DEC, CBC_DEC, CFB_DEC: the input is encData
+                for (j = 0; j < 4; j++)
+                    c[j] = _mm512_loadu_si512((const void*)(encData + 16*i + 64*j));
+                if (ctx->mode == B5_AES256_CFB_DEC)
+                {
+                    for (j = 0; j < 4; j++)
+                        b[j] = _mm512_alignr_epi64(c[j], (j == 0) ? (prev) : (c[j - 1]), 6);
+                }
+                else
+                {
+                    for (j = 0; j < 4; j++)
+                        b[j] = c[j];
+                }
+                break;
+        }
+
+        for (j = 0; j < 4; j++)
+            b[j] = _mm512_xor_si512(b[j], k[0]);
+        if (dec)
+        {
+            for (r = 1; r < Nr; r++)
+            {
+                for (j = 0; j < 4; j++)
+                    b[j] = _mm512_aesdec_epi128(b[j], k[r]);
+            }
+            for (j = 0; j < 4; j++)
+                b[j] = _mm512_aesdeclast_epi128(b[j], k[Nr]);
+        }
+        else
+        {
+            for (r = 1; r < Nr; r++)
+            {
+                for (j = 0; j < 4; j++)
+                    b[j] = _mm512_aesenc_epi128(b[j], k[r]);
+            }
+            for (j = 0; j < 4; j++)
+                b[j] = _mm512_aesenclast_epi128(b[j], k[Nr]);
+        }
+
+        switch(ctx->mode) {
+            case B5_AES256_CTR:
+                for (j = 0; j < 4; j++)
+                    _mm512_storeu_si512((void*)(encData + 16*i + 64*j),
+                        _mm512_xor_si512(b[j], _mm512_loadu_si512((const void*)(clrData + 16*i + 64*j))));
+                break;
+            case B5_AES256_ECB_ENC:
+                for (j = 0; j < 4; j++)
+                    _mm512_storeu_si512((void*)(encData + 16*i + 64*j), b[j]);
+                break;
+            case B5_AES256_ECB_DEC:
+                for (j = 0; j < 4; j++)
+                    _mm512_storeu_si512((void*)(clrData + 16*i + 64*j), b[j]);
+                break;
+            case B5_AES256_CBC_DEC:
+                for (j = 0; j < 4; j++)
+                    _mm512_storeu_si512((void*)(clrData + 16*i + 64*j),
+                        _mm512_xor_si512(b[j], _mm512_alignr_epi64(c[j], (j == 0) ? (prev) : (c[j - 1]), 6)));
+                prev = c[3];
+                break;
+            default:
+                // CFB_DEC
+                for (j = 0; j < 4; j++)
+                    _mm512_storeu_si512((void*)(clrData + 16*i + 64*j), _mm512_xor_si512(b[j], c[j]));
+                prev = c[3];
+                break;
+        }
+    }
+
+    if (ctx->mode == B5_AES256_CTR)
+    {
+        B5_AesNi_PutCtr(ctx->InitVector, &hi, &lo, 1);
+    }
+    else if (ctx->mode != B5_AES256_ECB_ENC && ctx->mode != B5_AES256_ECB_DEC)
+    {
+        _mm_storeu_si128((__m128i*)ctx->InitVector, _mm512_extracti32x4_epi32(prev, 3));
+    }
+    return n;
+}
+#endif
+
+
+
+
+
+void B5_AesNi_Update (B5_tAesCtx *ctx, uint8_t *encData, uint8_t *clrData, int16_t nBlk)
+{
+#ifdef B5_AES_VAES
+    int16_t n;
+
+    // CBC and CFB encryption and OFB are serial: wider registers do not help them
+    if ((ctx->ni == B5_AESNI_VAES) &&
+        ((ctx->mode == B5_AES256_CTR) || (ctx->mode == B5_AES256_ECB_ENC) || (ctx->mode == B5_AES256_ECB_DEC) ||
+         (ctx->mode == B5_AES256_CBC_DEC) || (ctx->mode == B5_AES256_CFB_DEC)))
+    {
+        n = B5_AesVaes_Blocks(ctx, encData, clrData, nBlk);
+        encData += 16*n;
+        clrData += 16*n;
+        nBlk -= n;
+    }
+#endif
+    if (nBlk > 0)
+        B5_AesNi_Blocks(ctx, encData, clrData, nBlk);
+}
+
+#endif
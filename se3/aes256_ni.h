@@ -0,0 +1,55 @@
+#pragma once
+/*  LICENSE  */
+
+/**
+ * @file B5_AES256_NI.h
+ * @brief This file includes the AES-NI and VAES kernels used by \ref B5_Aes256_Update when the CPU has the AES instructions.
+ *
+ * The kernels take the round keys of the portable key schedule as bytes: the
+ * decryption schedule is already in the form used by the AESDEC instruction.
+ * The parallel modes (ECB, CTR, CBC and CFB decryption) keep 8 blocks in
+ * flight, 16 with VAES; CBC and CFB encryption and OFB are serial.
+ * Define B5_AES_NO_NI to build the portable code only.
+ */
+
+#include "aes256.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if !defined(B5_AES_NO_NI) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define B5_AES_NI
+/* the 512-bit AES intrinsics need GCC 8 or clang 6 */
+#if (defined(__GNUC__) && !defined(__clang__) && (__GNUC__ >= 8)) || (defined(__clang__) && (__clang_major__ >= 6))
+#define B5_AES_VAES
+#endif
+#endif
+
+/** \name AES instruction sets, see B5_tAesCtx.ni */
+///@{
+#define B5_AESNI_NONE           0       /**< Portable code */
+#define B5_AESNI_AES            1       /**< AES-NI, 128-bit registers */
+#define B5_AESNI_VAES           2       /**< VAES with AVX-512, four blocks per register */
+///@}
+
+#ifdef B5_AES_NI
+/**
+ * @brief Check the CPU for the AES instructions.
+ * @return The best instruction set available, see \ref B5_AESNI_NONE .
+ */
+int32_t B5_AesNi_Available (void);
+
+/**
+ * @brief Encrypt/Decrypt data with the instruction set in ctx->ni, same as \ref B5_Aes256_Update .
+ * @param ctx Pointer to the current AES context, ctx->ni must not be B5_AESNI_NONE.
+ * @param encData Encrypted data.
+ * @param clrData Clear data.
+ * @param nBlk Number of AES blocks to process.
+ */
+void B5_AesNi_Update (B5_tAesCtx *ctx, uint8_t *encData, uint8_t *clrData, int16_t nBlk);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -9,14 +9,14 @@ static  void xor_bb(uint8_t *out, const uint8_t *x, const uint8_t *y, size_t len
 		out[i] = x[i] ^ y[i];
 }
 
-static void F(const B5_tHmacSha256Ctx *startctx,
+static void F(const B5_tHmacSha256Key *key,
 	uint32_t counter,
 	const uint8_t *salt, size_t nsalt,
 	uint32_t iterations,
 	uint8_t *out)
 {
 	uint8_t U[B5_SHA256_DIGEST_SIZE];
-	B5_tHmacSha256Ctx ctx = *startctx;
+	B5_tHmacSha256Ctx ctx;
 	uint8_t countbuf[4];
 	uint32_t i;
 	countbuf[0] = ((counter >> 3 * 8) & 0xFF);
@@ -28,6 +28,7 @@ static void F(const B5_tHmacSha256Ctx *startctx,
 	*   U_1 = PRF(P, S || INT_32_BE(i))
 	*/
 	
+	B5_HmacSha256_InitKey(&ctx, key);
 	B5_HmacSha256_Update(&ctx, salt, nsalt);
 	B5_HmacSha256_Update(&ctx, countbuf, sizeof(countbuf));
 	B5_HmacSha256_Finit(&ctx, U);
@@ -38,7 +39,7 @@ static void F(const B5_tHmacSha256Ctx *startctx,
 	*/
 	for (i = 1; i < iterations; i++)
 	{
-		ctx = *startctx;
+		B5_HmacSha256_InitKey(&ctx, key);
 		B5_HmacSha256_Update(&ctx, U, B5_SHA256_DIGEST_SIZE);
 		B5_HmacSha256_Finit(&ctx, U);
 		xor_bb(out, out, U, B5_SHA256_DIGEST_SIZE);
@@ -56,17 +57,18 @@ void PBKDF2HmacSha256(
 	uint8_t block[B5_SHA256_DIGEST_SIZE];
 	size_t taken;
 
-	/* Starting point for inner loop. */
-	B5_tHmacSha256Ctx ctx;
-	B5_HmacSha256_Init(&ctx, pw, (int16_t)npw);
+	/* Starting point for inner loop: the pads are hashed once. */
+	B5_tHmacSha256Key key;
+	B5_HmacSha256_SetKey(&key, pw, (int16_t)npw);
 
 	while(nout)
 	{
-		F(&ctx, counter, salt, nsalt, iterations, block);
+		F(&key, counter, salt, nsalt, iterations, block);
 		taken = (nout < B5_SHA256_DIGEST_SIZE)?(nout):(B5_SHA256_DIGEST_SIZE);
 		memcpy(out, block, taken);
 		out += taken;
 		nout -= taken;
 		counter++;
 	}
+	memset(&key, 0, sizeof(key));
 }
\ No newline at end of file
@@ -78,20 +78,38 @@ void se3_payload_cryptoinit(se3_payload_cryptoctx* ctx, const uint8_t* key)
 	PBKDF2HmacSha256(key, B5_AES_256, NULL, 0, 1, keys, 2 * B5_AES_256);
     B5_Aes256_Init(&(ctx->aesenc), keys, B5_AES_256, B5_AES256_CBC_ENC);
     B5_Aes256_Init(&(ctx->aesdec), keys, B5_AES_256, B5_AES256_CBC_DEC);
-	memcpy(ctx->hmac_key, keys + B5_AES_256, B5_AES_256);
+	B5_HmacSha256_SetKey(&(ctx->hmac_key), keys + B5_AES_256, B5_AES_256);
 	memset(keys, 0, 2 * B5_AES_256);
 }
+/** Blocks encrypted and authenticated at a time: the MAC reads them back from the L1 cache */
+#define SE3_PAYLOAD_CHUNK_BLOCKS (64)
+
 void se3_payload_encrypt(se3_payload_cryptoctx* ctx, uint8_t* auth, uint8_t* iv, uint8_t* data, uint16_t nblocks, uint16_t flags)
 {
+    uint16_t n;
+
     if (flags & SE3_CMDFLAG_ENCRYPT) {
         B5_Aes256_SetIV(&(ctx->aesenc), iv);
-        B5_Aes256_Update(&(ctx->aesenc), data, data, nblocks);
     }
-
     if (flags & SE3_CMDFLAG_SIGN) {
-        B5_HmacSha256_Init(&(ctx->hmac), ctx->hmac_key, B5_AES_256);
+        B5_HmacSha256_InitKey(&(ctx->hmac), &(ctx->hmac_key));
         B5_HmacSha256_Update(&(ctx->hmac), iv, B5_AES_IV_SIZE);
-        B5_HmacSha256_Update(&(ctx->hmac), data, nblocks*B5_AES_BLK_SIZE);
+    }
+
+    // encrypt-then-MAC in one pass over the packet
+    while (nblocks > 0) {
+        n = (nblocks < SE3_PAYLOAD_CHUNK_BLOCKS) ? (nblocks) : (SE3_PAYLOAD_CHUNK_BLOCKS);
+        if (flags & SE3_CMDFLAG_ENCRYPT) {
+            B5_Aes256_Update(&(ctx->aesenc), data, data, n);
+        }
+        if (flags & SE3_CMDFLAG_SIGN) {
+            B5_HmacSha256_Update(&(ctx->hmac), data, n*B5_AES_BLK_SIZE);
+        }
+        data += n*B5_AES_BLK_SIZE;
+        nblocks -= n;
+    }
+
+    if (flags & SE3_CMDFLAG_SIGN) {
         B5_HmacSha256_Finit(&(ctx->hmac), ctx->auth);
         memcpy(auth, ctx->auth, 16);
     }
@@ -102,21 +120,40 @@ void se3_payload_encrypt(se3_payload_cryptoctx* ctx, uint8_t* auth, uint8_t* iv,
 
 bool se3_payload_decrypt(se3_payload_cryptoctx* ctx, const uint8_t* auth, const uint8_t* iv, uint8_t* data, uint16_t nblocks, uint16_t flags)
 {
+    uint8_t* start = data;
+    size_t len = (size_t)nblocks * B5_AES_BLK_SIZE;
+    uint16_t n;
+
     if (flags & SE3_CMDFLAG_SIGN) {
-        B5_HmacSha256_Init(&(ctx->hmac), ctx->hmac_key, B5_AES_256);
+        B5_HmacSha256_InitKey(&(ctx->hmac), &(ctx->hmac_key));
         B5_HmacSha256_Update(&(ctx->hmac), iv, B5_AES_IV_SIZE);
-        B5_HmacSha256_Update(&(ctx->hmac), data, nblocks*B5_AES_BLK_SIZE);
+    }
+    if (flags & SE3_CMDFLAG_ENCRYPT) {
+        B5_Aes256_SetIV(&(ctx->aesdec), iv);
+    }
+
+    // each chunk is authenticated, then decrypted while in cache; the MAC is
+    // only checked at the end, so on mismatch the plaintext is wiped
+    while (nblocks > 0) {
+        n = (nblocks < SE3_PAYLOAD_CHUNK_BLOCKS) ? (nblocks) : (SE3_PAYLOAD_CHUNK_BLOCKS);
+        if (flags & SE3_CMDFLAG_SIGN) {
+            B5_HmacSha256_Update(&(ctx->hmac), data, n*B5_AES_BLK_SIZE);
+        }
+        if (flags & SE3_CMDFLAG_ENCRYPT) {
+            B5_Aes256_Update(&(ctx->aesdec), data, data, n);
+        }
+        data += n*B5_AES_BLK_SIZE;
+        nblocks -= n;
+    }
+
+    if (flags & SE3_CMDFLAG_SIGN) {
         B5_HmacSha256_Finit(&(ctx->hmac), ctx->auth);
         if (memcmp(auth, ctx->auth, 16)) {
+            memset(start, 0, len);
             return false;
         }
     }
 
-    if (flags & SE3_CMDFLAG_ENCRYPT) {
-        B5_Aes256_SetIV(&(ctx->aesdec), iv);
-        B5_Aes256_Update(&(ctx->aesdec), data, data, nblocks);
-    }
-
     return true;
 }
 
@@ -69,7 +69,7 @@ typedef struct se3_payload_cryptoctx_ {
 	B5_tAesCtx aesenc;
     B5_tAesCtx aesdec;
 	B5_tHmacSha256Ctx hmac;
-	uint8_t hmac_key[B5_AES_256];
+	B5_tHmacSha256Key hmac_key;   ///< pads hashed once by se3_payload_cryptoinit
     uint8_t auth[B5_SHA256_DIGEST_SIZE];
 } se3_payload_cryptoctx;
 void se3_payload_cryptoinit(se3_payload_cryptoctx* ctx, const uint8_t* key);
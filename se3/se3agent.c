@@ -0,0 +1,313 @@
+/**
+ *  \file se3agent.c
+ *  \brief This file contains the session agent, see se3agent.h
+ */
+
+#define _GNU_SOURCE
+#include "se3agent.h"
+#include "se3_common.h"
+#include "pbkdf2.h"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifdef MSG_NOSIGNAL
+#define SE3A_SEND_FLAGS (MSG_NOSIGNAL)
+#else
+#define SE3A_SEND_FLAGS (0)
+#endif
+
+#define SE3A_OFFSET_SERIAL (4)
+#define SE3A_OFFSET_PIN (SE3A_OFFSET_SERIAL + SE3_SN_SIZE)
+#define SE3A_OFFSET_TOKEN (SE3A_OFFSET_PIN + SE3_L1_PIN_SIZE)
+#define SE3A_OFFSET_KEY (SE3A_OFFSET_TOKEN + SE3_L1_TOKEN_SIZE)
+#define SE3A_RESP_OFFSET_TOKEN (4)
+#define SE3A_RESP_OFFSET_KEY (SE3A_RESP_OFFSET_TOKEN + SE3_L1_TOKEN_SIZE)
+/** Time allowed to a client for a whole exchange, in ms */
+#define SE3A_TIMEOUT (1000)
+#define SE3A_VERIFIER_SIZE (32)
+
+/** \brief A login kept by the agent */
+typedef struct se3a_entry_ {
+    bool used;
+    uint64_t expiry;        ///< se3c_clock() time after which the login is dropped
+    uint8_t serialno[SE3_SN_SIZE];
+    uint8_t salt[SE3A_VERIFIER_SIZE];
+    uint8_t verifier[SE3A_VERIFIER_SIZE];   ///< PBKDF2 of the PIN with salt, the PIN is not kept
+    uint8_t token[SE3_L1_TOKEN_SIZE];
+    uint8_t key[SE3_L1_KEY_SIZE];
+} se3a_entry;
+
+static bool se3a_xfer(int fd, uint8_t* buf, size_t len, bool out, uint64_t deadline)
+{
+    struct pollfd p;
+    ssize_t r;
+
+    while (len > 0) {
+        p.fd = fd;
+        p.events = (out) ? (POLLOUT) : (POLLIN);
+        p.revents = 0;
+        r = poll(&p, 1, (int)se3c_remaining(deadline));
+        if (r == 0) {
+            return false;
+        }
+        if (r > 0) {
+            r = (out) ? (send(fd, buf, len, SE3A_SEND_FLAGS)) : (recv(fd, buf, len, 0));
+            if (r == 0) {
+                return false;
+            }
+        }
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += r;
+        len -= (size_t)r;
+    }
+    return true;
+}
+
+/** \brief Check that the other end of a connection runs as the same user */
+static bool se3a_peer_ok(int fd)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+/** \brief Send a request to the agent and read its reply, false if it failed */
+static bool se3a_call(const char* path, uint8_t* req, uint8_t* resp)
+{
+    struct sockaddr_un addr;
+    uint64_t deadline = se3c_deadline(SE3A_TIMEOUT);
+    bool ok = false;
+    int fd;
+
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+#ifdef SO_NOSIGPIPE
+    {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+    }
+#endif
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // the PIN and the login only go to an agent of ours, whoever created the path
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 && se3a_peer_ok(fd) &&
+        se3a_xfer(fd, req, SE3_AGENT_REQ_SIZE, true, deadline) &&
+        se3a_xfer(fd, resp, SE3_AGENT_RESP_SIZE, false, deadline)) {
+        ok = (resp[0] == 0);
+    }
+    close(fd);
+    return ok;
+}
+
+bool se3_agent_resume(const char* path, const uint8_t* serialno, const uint8_t* pin, uint8_t* token, uint8_t* key)
+{
+    uint8_t req[SE3_AGENT_REQ_SIZE];
+    uint8_t resp[SE3_AGENT_RESP_SIZE];
+    bool ok;
+
+    memset(req, 0, SE3_AGENT_REQ_SIZE);
+    req[0] = SE3_AGENT_OP_RESUME;
+    memcpy(req + SE3A_OFFSET_SERIAL, serialno, SE3_SN_SIZE);
+    memcpy(req + SE3A_OFFSET_PIN, pin, SE3_L1_PIN_SIZE);
+    ok = se3a_call(path, req, resp);
+    if (ok) {
+        memcpy(token, resp + SE3A_RESP_OFFSET_TOKEN, SE3_L1_TOKEN_SIZE);
+        memcpy(key, resp + SE3A_RESP_OFFSET_KEY, SE3_L1_KEY_SIZE);
+    }
+    memset(req, 0, SE3_AGENT_REQ_SIZE);
+    memset(resp, 0, SE3_AGENT_RESP_SIZE);
+    return ok;
+}
+
+bool se3_agent_store(const char* path, const se3_session* s, const uint8_t* pin)
+{
+    uint8_t req[SE3_AGENT_REQ_SIZE];
+    uint8_t resp[SE3_AGENT_RESP_SIZE];
+    bool ok;
+
+    if (s == NULL || !s->logged_in) {
+        return false;
+    }
+    memset(req, 0, SE3_AGENT_REQ_SIZE);
+    req[0] = SE3_AGENT_OP_STORE;
+    memcpy(req + SE3A_OFFSET_SERIAL, s->device.info.serialno, SE3_SN_SIZE);
+    memcpy(req + SE3A_OFFSET_PIN, pin, SE3_L1_PIN_SIZE);
+    memcpy(req + SE3A_OFFSET_TOKEN, s->token, SE3_L1_TOKEN_SIZE);
+    memcpy(req + SE3A_OFFSET_KEY, s->key, SE3_L1_KEY_SIZE);
+    ok = se3a_call(path, req, resp);
+    memset(req, 0, SE3_AGENT_REQ_SIZE);
+    return ok;
+}
+
+void se3_agent_forget(const char* path, const uint8_t* serialno)
+{
+    uint8_t req[SE3_AGENT_REQ_SIZE];
+    uint8_t resp[SE3_AGENT_RESP_SIZE];
+
+    memset(req, 0, SE3_AGENT_REQ_SIZE);
+    req[0] = SE3_AGENT_OP_FORGET;
+    memcpy(req + SE3A_OFFSET_SERIAL, serialno, SE3_SN_SIZE);
+    se3a_call(path, req, resp);
+}
+
+static void se3a_verifier(const uint8_t* pin, const uint8_t* salt, uint8_t* verifier)
+{
+    PBKDF2HmacSha256(pin, SE3_L1_PIN_SIZE, salt, SE3A_VERIFIER_SIZE, 1, verifier, SE3A_VERIFIER_SIZE);
+}
+
+static se3a_entry* se3a_find(se3a_entry* entries, const uint8_t* serialno)
+{
+    uint64_t now = se3c_clock();
+    size_t i;
+
+    for (i = 0; i < SE3_AGENT_ENTRIES_MAX; i++) {
+        if (entries[i].used && now > entries[i].expiry) {
+            memset(&(entries[i]), 0, sizeof(se3a_entry));
+        }
+        if (entries[i].used && !memcmp(entries[i].serialno, serialno, SE3_SN_SIZE)) {
+            return &(entries[i]);
+        }
+    }
+    return NULL;
+}
+
+/** \brief Execute a request, the reply status is set in resp */
+static void se3a_exec(se3a_entry* entries, uint32_t ttl, const uint8_t* req, uint8_t* resp)
+{
+    uint8_t verifier[SE3A_VERIFIER_SIZE];
+    se3a_entry* e = se3a_find(entries, req + SE3A_OFFSET_SERIAL);
+    size_t i;
+
+    resp[0] = 1;
+    switch (req[0]) {
+    case SE3_AGENT_OP_RESUME:
+        if (e == NULL) {
+            break;
+        }
+        se3a_verifier(req + SE3A_OFFSET_PIN, e->salt, verifier);
+        if (!memcmp(verifier, e->verifier, SE3A_VERIFIER_SIZE)) {
+            memcpy(resp + SE3A_RESP_OFFSET_TOKEN, e->token, SE3_L1_TOKEN_SIZE);
+            memcpy(resp + SE3A_RESP_OFFSET_KEY, e->key, SE3_L1_KEY_SIZE);
+            resp[0] = 0;
+        }
+        break;
+    case SE3_AGENT_OP_STORE:
+        for (i = 0; e == NULL && i < SE3_AGENT_ENTRIES_MAX; i++) {
+            if (!entries[i].used) {
+                e = &(entries[i]);
+            }
+        }
+        if (e == NULL) {
+            break;
+        }
+        e->used = true;
+        e->expiry = se3c_clock() + (uint64_t)ttl * 1000;
+        memcpy(e->serialno, req + SE3A_OFFSET_SERIAL, SE3_SN_SIZE);
+        se3c_rand(SE3A_VERIFIER_SIZE, e->salt);
+        se3a_verifier(req + SE3A_OFFSET_PIN, e->salt, e->verifier);
+        memcpy(e->token, req + SE3A_OFFSET_TOKEN, SE3_L1_TOKEN_SIZE);
+        memcpy(e->key, req + SE3A_OFFSET_KEY, SE3_L1_KEY_SIZE);
+        resp[0] = 0;
+        break;
+    case SE3_AGENT_OP_FORGET:
+        if (e != NULL) {
+            memset(e, 0, sizeof(se3a_entry));
+        }
+        resp[0] = 0;
+        break;
+    default:
+        break;
+    }
+    memset(verifier, 0, SE3A_VERIFIER_SIZE);
+}
+
+int se3_agent_serve(const char* path, uint32_t ttl)
+{
+    struct sockaddr_un addr;
+    se3a_entry entries[SE3_AGENT_ENTRIES_MAX];
+    uint8_t req[SE3_AGENT_REQ_SIZE];
+    uint8_t resp[SE3_AGENT_RESP_SIZE];
+    uint64_t deadline;
+    int fd, cfd;
+
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(entries, 0, sizeof(entries));
+    signal(SIGPIPE, SIG_IGN);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || chmod(path, S_IRUSR | S_IWUSR) != 0 ||
+        listen(fd, 8) != 0) {
+        close(fd);
+        return -1;
+    }
+    for (;;) {
+        cfd = accept(fd, NULL, NULL);
+        if (cfd < 0) {
+            continue;
+        }
+        // one request per connection, a stuck client is dropped after SE3A_TIMEOUT
+        deadline = se3c_deadline(SE3A_TIMEOUT);
+        memset(resp, 0, SE3_AGENT_RESP_SIZE);
+        if (se3a_peer_ok(cfd) && se3a_xfer(cfd, req, SE3_AGENT_REQ_SIZE, false, deadline)) {
+            se3a_exec(entries, ttl, req, resp);
+            se3a_xfer(cfd, resp, SE3_AGENT_RESP_SIZE, true, deadline);
+        }
+        memset(req, 0, SE3_AGENT_REQ_SIZE);
+        memset(resp, 0, SE3_AGENT_RESP_SIZE);
+        close(cfd);
+    }
+    return 0;
+}
+#elif _WIN32
+bool se3_agent_resume(const char* path, const uint8_t* serialno, const uint8_t* pin, uint8_t* token, uint8_t* key)
+{
+    // not supported
+    return false;
+}
+
+bool se3_agent_store(const char* path, const se3_session* s, const uint8_t* pin)
+{
+    return false;
+}
+
+void se3_agent_forget(const char* path, const uint8_t* serialno)
+{
+}
+
+int se3_agent_serve(const char* path, uint32_t ttl)
+{
+    return -1;
+}
+#endif
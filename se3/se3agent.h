@@ -0,0 +1,85 @@
+/**
+ *  \file se3agent.h
+ *  \brief This file contains the session agent: a local process keeping
+ *         the L1 logins of a user, so later programs resume them with
+ *         \ref L1_resume instead of running the whole \ref L1_login
+ *
+ *  \details A login costs two round trips and three PBKDF2 computations on
+ *  the host, paid by every run of a short lived program such as SEfile-cli.
+ *  The agent keeps the token and session key of each device (by serial
+ *  number) for a time to live, handed out only to a caller presenting the
+ *  same PIN. A program using it does not log out at exit; when the resumed
+ *  login is refused by the device it forgets it and logs in again.
+ *
+ *  The agent listens on a Unix domain socket only its owner can reach,
+ *  and keeps everything in memory. Both ends check that the other one runs
+ *  as the same user before anything is sent. POSIX only.
+ */
+
+#pragma once
+
+#include "L1.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Environment variable: socket path of the agent used by SEfile-cli, unset to log in every time */
+#define SE3_AGENT_ENV "SE3_AGENT"
+/** Default time to live of a login kept by the agent, in seconds */
+#define SE3_AGENT_TTL (900)
+/** Maximum number of logins kept at once */
+#define SE3_AGENT_ENTRIES_MAX (16)
+
+/* Frames: every request is SE3_AGENT_REQ_SIZE bytes (op, three zero bytes,
+ * serial number, PIN, token, key; unused fields are zero), every reply is
+ * SE3_AGENT_RESP_SIZE bytes (status, 0 on success, three zero bytes, token,
+ * key). */
+#define SE3_AGENT_REQ_SIZE (4 + SE3_SN_SIZE + SE3_L1_PIN_SIZE + SE3_L1_TOKEN_SIZE + SE3_L1_KEY_SIZE)
+#define SE3_AGENT_RESP_SIZE (4 + SE3_L1_TOKEN_SIZE + SE3_L1_KEY_SIZE)
+#define SE3_AGENT_OP_RESUME ('R')
+#define SE3_AGENT_OP_STORE ('S')
+#define SE3_AGENT_OP_FORGET ('F')
+
+/**
+ *  \brief Get the login kept for a device
+ *
+ *  \param [in] path Socket path of the agent
+ *  \param [in] serialno Serial number of the device
+ *  \param [in] pin User PIN of the login
+ *  \param [out] token Token to pass to \ref L1_resume
+ *  \param [out] key Session key to pass to \ref L1_resume
+ *  \return true if a login was found for that PIN and has not expired
+ */
+bool se3_agent_resume(const char* path, const uint8_t* serialno, const uint8_t* pin, uint8_t* token, uint8_t* key);
+
+/**
+ *  \brief Hand a login made with \ref L1_login to the agent
+ *
+ *  \param [in] path Socket path of the agent
+ *  \param [in] s Session logged in as user
+ *  \param [in] pin User PIN of the login
+ *  \return true if the agent keeps it
+ */
+bool se3_agent_store(const char* path, const se3_session* s, const uint8_t* pin);
+
+/**
+ *  \brief Drop the login kept for a device, e.g. when the device refused it
+ *
+ *  \param [in] path Socket path of the agent
+ *  \param [in] serialno Serial number of the device
+ */
+void se3_agent_forget(const char* path, const uint8_t* serialno);
+
+/**
+ *  \brief Run the agent, until a fatal error
+ *
+ *  \param [in] path Socket path, replaced if it exists; only the owner can connect
+ *  \param [in] ttl Seconds a login is kept after it is stored
+ *  \return -1 if the socket cannot be created
+ */
+int se3_agent_serve(const char* path, uint32_t ttl);
+
+#ifdef __cplusplus
+}
+#endif
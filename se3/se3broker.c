@@ -0,0 +1,531 @@
+/**
+ *  \file se3broker.c
+ *  \brief This file contains the device broker, see se3broker.h
+ */
+
+#include "se3broker.h"
+#include "se3transport.h"
+#include "se3_common.h"
+#include "pbkdf2.h"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SE3B_PAYLOAD_SIZE (SE3_COMM_N * SE3_COMM_BLOCK)
+
+/* exchange with a client, each step driven by the poll loop */
+#define SE3B_RECV (0)       ///< reading a request, idle until its first byte
+#define SE3B_PENDING (1)    ///< a request waits for the device
+#define SE3B_SEND (2)       ///< sending the reply
+
+/** \brief A connected process, with the L1 state its library expects */
+typedef struct se3b_client_ {
+    int fd;                 ///< -1 if the slot is free
+    uint8_t state;          ///< SE3B_RECV, SE3B_PENDING or SE3B_SEND
+    uint8_t hdr[SE3_BROKER_HDR_SIZE];   ///< header of the request, then of the reply
+    size_t done;            ///< bytes of header and payload transferred so far
+    size_t out_len;         ///< payload length of the reply
+    uint64_t deadline;      ///< se3c_clock() time by which a started transfer must end
+    uint16_t cmd;           ///< L0 command of the request
+    uint16_t cmd_flags;
+    uint16_t len;           ///< payload length of the request
+    uint16_t l1_cmd;        ///< L1 command of a decrypted SE3_CMD0_L1 request, 0 if not valid
+    uint16_t l1_len;
+    uint8_t* buf;           ///< request payload, replaced by the response
+    bool logged_in;
+    bool challenge_pending;
+    uint8_t token[SE3_L1_TOKEN_SIZE];
+    uint8_t cresp_expected[SE3_L1_CHALLENGE_SIZE];
+    uint32_t sessions[SE3_BROKER_SESSIONS_MAX];   ///< crypto sessions opened by the client
+    size_t n_sessions;
+} se3b_client;
+
+typedef struct se3b_broker_ {
+    se3_session* s;
+    const uint8_t* pin;
+    se3_payload_cryptoctx cryptoctx;   ///< packet protection of the clients, as set up by L1_TXRXv
+    se3b_client clients[SE3_BROKER_CLIENTS_MAX];
+    size_t next;            ///< client served first in the next round
+} se3b_broker;
+
+/**
+ *  \brief Move the header and payload of a client up to total bytes, as far as
+ *         the socket allows without blocking; false if the client is gone
+ */
+static bool se3b_io(se3b_client* c, bool out, size_t total)
+{
+    uint8_t* p;
+    size_t len;
+    ssize_t r;
+
+    while (c->done < total) {
+        if (c->done < SE3_BROKER_HDR_SIZE) {
+            p = c->hdr + c->done;
+            len = ((total < SE3_BROKER_HDR_SIZE) ? (total) : (SE3_BROKER_HDR_SIZE)) - c->done;
+        }
+        else {
+            p = c->buf + (c->done - SE3_BROKER_HDR_SIZE);
+            len = total - c->done;
+        }
+        r = (out) ? (send(c->fd, p, len, 0)) : (recv(c->fd, p, len, 0));
+        if (r == 0) {
+            return false;
+        }
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // the rest comes at a later poll
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->done += (size_t)r;
+    }
+    return true;
+}
+
+/** \brief Send more of the reply, reading requests again once it is out */
+static bool se3b_send(se3b_client* c)
+{
+    if (!se3b_io(c, true, SE3_BROKER_HDR_SIZE + c->out_len)) {
+        return false;
+    }
+    if (c->done == SE3_BROKER_HDR_SIZE + c->out_len) {
+        c->state = SE3B_RECV;
+        c->done = 0;
+    }
+    return true;
+}
+
+/** \brief Start sending c->hdr and len bytes of c->buf */
+static bool se3b_send_start(se3b_client* c, size_t len)
+{
+    c->state = SE3B_SEND;
+    c->done = 0;
+    c->out_len = len;
+    c->deadline = se3c_deadline(SE3_TIMEOUT);
+    return se3b_send(c);
+}
+
+/** \brief Close the crypto sessions left open by a client */
+static void se3b_release(se3b_broker* b, se3b_client* c)
+{
+    size_t i;
+
+    for (i = 0; i < c->n_sessions; i++) {
+        L1_crypto_update(b->s, c->sessions[i], SE3_CRYPTO_FLAG_FINIT, 0, NULL, 0, NULL, NULL, NULL);
+    }
+    c->n_sessions = 0;
+}
+
+static void se3b_drop(se3b_broker* b, se3b_client* c)
+{
+    se3b_release(b, c);
+    close(c->fd);
+    free(c->buf);
+    memset(c, 0, sizeof(se3b_client));
+    c->fd = -1;
+}
+
+static bool se3b_owns(se3b_client* c, uint32_t sess_id, size_t* index)
+{
+    size_t i;
+
+    for (i = 0; i < c->n_sessions; i++) {
+        if (c->sessions[i] == sess_id) {
+            if (index != NULL) {
+                *index = i;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool se3b_authorized(se3b_client* c)
+{
+    return c->l1_cmd == SE3_CMD1_CHALLENGE || c->l1_cmd == SE3_CMD1_LOGIN ||
+        (c->logged_in && !memcmp(c->buf + SE3_REQ1_OFFSET_TOKEN, c->token, SE3_L1_TOKEN_SIZE));
+}
+
+/** \brief The device side of L1_login, answered with the broker PIN */
+static uint16_t se3b_challenge(se3b_broker* b, se3b_client* c, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len)
+{
+    uint8_t cc1[SE3_L1_CHALLENGE_SIZE], sc[SE3_L1_CHALLENGE_SIZE];
+    uint16_t access;
+
+    if (req_len < SE3_CMD1_CHALLENGE_REQ_SIZE) {
+        return SE3_ERR_PARAMS;
+    }
+    SE3_GET16(req, SE3_CMD1_CHALLENGE_REQ_OFF_ACCESS, access);
+    // a new login ends the previous one
+    c->logged_in = false;
+    se3b_release(b, c);
+    if (access != SE3_ACCESS_USER) {
+        return SE3_ERR_ACCESS;
+    }
+    memcpy(cc1, req + SE3_CMD1_CHALLENGE_REQ_OFF_CC1, SE3_L1_CHALLENGE_SIZE);
+    se3c_rand(SE3_L1_CHALLENGE_SIZE, sc);
+    memcpy(resp + SE3_CMD1_CHALLENGE_RESP_OFF_SC, sc, SE3_L1_CHALLENGE_SIZE);
+    PBKDF2HmacSha256(b->pin, SE3_L1_PIN_SIZE, cc1, SE3_L1_CHALLENGE_SIZE, SE3_L1_CHALLENGE_ITERATIONS,
+        resp + SE3_CMD1_CHALLENGE_RESP_OFF_SRESP, SE3_L1_CHALLENGE_SIZE);
+    PBKDF2HmacSha256(b->pin, SE3_L1_PIN_SIZE, sc, SE3_L1_CHALLENGE_SIZE, SE3_L1_CHALLENGE_ITERATIONS,
+        c->cresp_expected, SE3_L1_CHALLENGE_SIZE);
+    c->challenge_pending = true;
+    *resp_len = SE3_CMD1_CHALLENGE_RESP_SIZE;
+    return SE3_OK;
+}
+
+static uint16_t se3b_login(se3b_client* c, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len)
+{
+    if (!c->challenge_pending || req_len < SE3_CMD1_LOGIN_REQ_SIZE) {
+        return SE3_ERR_STATE;
+    }
+    c->challenge_pending = false;
+    if (memcmp(req + SE3_CMD1_LOGIN_REQ_OFF_CRESP, c->cresp_expected, SE3_L1_CHALLENGE_SIZE)) {
+        return SE3_ERR_PIN;
+    }
+    se3c_rand(SE3_L1_TOKEN_SIZE, c->token);
+    c->logged_in = true;
+    memcpy(resp + SE3_CMD1_LOGIN_RESP_OFF_TOKEN, c->token, SE3_L1_TOKEN_SIZE);
+    *resp_len = SE3_CMD1_LOGIN_RESP_SIZE;
+    return SE3_OK;
+}
+
+/** \brief Relay a command on the broker session, keeping track of the crypto sessions of the client */
+static uint16_t se3b_forward(se3b_broker* b, se3b_client* c, uint8_t* data, uint16_t* data_len)
+{
+    uint32_t sess_id = 0;
+    uint16_t flags = 0, status, resp_len = 0;
+    size_t i = 0;
+
+    if (c->l1_cmd == SE3_CMD1_CRYPTO_UPDATE) {
+        if (c->l1_len < SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA) {
+            return SE3_ERR_PARAMS;
+        }
+        SE3_GET32(data, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_SID, sess_id);
+        SE3_GET16(data, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_FLAGS, flags);
+        if (!se3b_owns(c, sess_id, &i)) {
+            return SE3_ERR_RESOURCE;
+        }
+    }
+    if (c->l1_cmd == SE3_CMD1_CRYPTO_INIT && c->n_sessions == SE3_BROKER_SESSIONS_MAX) {
+        return SE3_ERR_MEMORY;
+    }
+    memcpy(b->s->buf + SE3_REQ1_OFFSET_DATA, data, c->l1_len);
+    status = L1_command(b->s, c->l1_cmd, c->cmd_flags, c->l1_len, &resp_len);
+    if (status != SE3_OK) {
+        return status;
+    }
+    if (resp_len > SE3_RESP1_MAX_DATA) {
+        return SE3_ERR_COMM;
+    }
+    memcpy(data, b->s->buf + SE3_RESP1_OFFSET_DATA, resp_len);
+    *data_len = resp_len;
+    if (c->l1_cmd == SE3_CMD1_CRYPTO_INIT && resp_len >= SE3_CMD1_CRYPTO_INIT_RESP_SIZE) {
+        SE3_GET32(data, SE3_CMD1_CRYPTO_INIT_RESP_OFF_SID, sess_id);
+        c->sessions[c->n_sessions++] = sess_id;
+    }
+    else if (c->l1_cmd == SE3_CMD1_CRYPTO_UPDATE && (flags & SE3_CRYPTO_FLAG_FINIT)) {
+        c->sessions[i] = c->sessions[--c->n_sessions];
+    }
+    return SE3_OK;
+}
+
+/** \brief Run the L1 request of a client, leaving the response payload in c->buf */
+static uint16_t se3b_exec_L1(se3b_broker* b, se3b_client* c, uint16_t* resp_len)
+{
+    uint8_t* data = c->buf + SE3_REQ1_OFFSET_DATA;
+    uint16_t status = SE3_OK, data_len = 0;
+
+    if (!se3b_authorized(c)) {
+        status = SE3_ERR_ACCESS;
+    }
+    else {
+        switch (c->l1_cmd) {
+        case SE3_CMD1_CHALLENGE:
+            status = se3b_challenge(b, c, data, c->l1_len, data, &data_len);
+            break;
+        case SE3_CMD1_LOGIN:
+            status = se3b_login(c, data, c->l1_len, data, &data_len);
+            break;
+        case SE3_CMD1_LOGOUT:
+            // the broker session stays logged in for the other clients
+            c->logged_in = false;
+            se3b_release(b, c);
+            break;
+        default:
+            status = se3b_forward(b, c, data, &data_len);
+            break;
+        }
+    }
+    if (status != SE3_OK) {
+        data_len = 0;
+    }
+    SE3_SET16(c->buf, SE3_RESP1_OFFSET_STATUS, status);
+    SE3_SET16(c->buf, SE3_RESP1_OFFSET_LEN, data_len);
+    *resp_len = data_len;
+    return SE3_OK;
+}
+
+/** \brief Protect the L1 response in c->buf as the device would and start sending it */
+static bool se3b_reply(se3b_broker* b, se3b_client* c, uint16_t resp_status, uint16_t l1_len)
+{
+    uint16_t resp_len = 0;
+
+    if (resp_status == SE3_OK && c->cmd == SE3_CMD0_L1) {
+        resp_len = l1_len;
+        if (resp_len % SE3_L1_CRYPTOBLOCK_SIZE != 0) {
+            memset(c->buf + SE3_RESP1_OFFSET_DATA + resp_len, 0, SE3_L1_CRYPTOBLOCK_SIZE - (resp_len % SE3_L1_CRYPTOBLOCK_SIZE));
+            resp_len += SE3_L1_CRYPTOBLOCK_SIZE - (resp_len % SE3_L1_CRYPTOBLOCK_SIZE);
+        }
+        memset(c->buf + SE3_RESP1_OFFSET_TOKEN, 0, SE3_L1_TOKEN_SIZE);
+        if (c->logged_in) {
+            memcpy(c->buf + SE3_RESP1_OFFSET_TOKEN, c->token, SE3_L1_TOKEN_SIZE);
+        }
+        memset(c->buf + SE3_RESP1_OFFSET_IV, 0, SE3_L1_IV_SIZE);
+        if (c->cmd_flags & SE3_CMDFLAG_ENCRYPT) {
+            se3c_rand(SE3_L1_IV_SIZE, c->buf + SE3_RESP1_OFFSET_IV);
+        }
+        resp_len += SE3_RESP1_OFFSET_DATA;
+        se3_payload_encrypt(&(b->cryptoctx), c->buf + SE3_RESP1_OFFSET_AUTH, c->buf + SE3_RESP1_OFFSET_IV,
+            c->buf + SE3_L1_AUTH_SIZE + SE3_L1_IV_SIZE, (resp_len - SE3_L1_AUTH_SIZE - SE3_L1_IV_SIZE) / SE3_L1_CRYPTOBLOCK_SIZE, c->cmd_flags);
+    }
+    else if (resp_status == SE3_OK) {
+        resp_len = l1_len;
+    }
+    memset(c->hdr, 0, SE3_BROKER_HDR_SIZE);
+    SE3_SET16(c->hdr, 2, resp_status);
+    SE3_SET16(c->hdr, 6, resp_len);
+    return se3b_send_start(c, resp_len);
+}
+
+/**
+ *  \brief Receive more of a request; once it is whole, answer an INFO request or
+ *         queue a command, decrypting an L1 payload so that it can be checked and coalesced
+ */
+static bool se3b_recv(se3b_broker* b, se3b_client* c)
+{
+    if (c->done == 0) {
+        c->deadline = se3c_deadline(SE3_TIMEOUT);
+    }
+    if (!se3b_io(c, false, SE3_BROKER_HDR_SIZE)) {
+        return false;
+    }
+    if (c->done < SE3_BROKER_HDR_SIZE) {
+        return true;
+    }
+    if (c->hdr[0] == SE3_BROKER_OP_INFO) {
+        // same discovery block as the magic file of the device
+        memset(c->buf, 0, SE3_COMM_BLOCK);
+        memcpy(c->buf, se3_magic + SE3_MAGIC_SIZE / 2, SE3_MAGIC_SIZE / 2);
+        memcpy(c->buf + SE3_MAGIC_SIZE / 2, se3_magic, SE3_MAGIC_SIZE / 2);
+        memcpy(c->buf + SE3_DISCO_OFFSET_SERIAL, b->s->device.info.serialno, SE3_SN_SIZE);
+        memcpy(c->buf + SE3_DISCO_OFFSET_HELLO, b->s->device.info.hello_msg, SE3_HELLO_SIZE);
+        SE3_SET16(c->buf, SE3_DISCO_OFFSET_STATUS, b->s->device.info.status);
+        memset(c->hdr, 0, SE3_BROKER_HDR_SIZE);
+        return se3b_send_start(c, SE3_COMM_BLOCK);
+    }
+    if (c->hdr[0] != SE3_BROKER_OP_CMD) {
+        return false;
+    }
+    SE3_GET16(c->hdr, 6, c->len);
+    if (c->len > SE3_REQ_MAX_DATA || !se3b_io(c, false, SE3_BROKER_HDR_SIZE + (size_t)c->len)) {
+        return false;
+    }
+    if (c->done < SE3_BROKER_HDR_SIZE + (size_t)c->len) {
+        return true;
+    }
+    SE3_GET16(c->hdr, 2, c->cmd);
+    SE3_GET16(c->hdr, 4, c->cmd_flags);
+    c->state = SE3B_PENDING;
+    c->done = 0;
+    c->l1_cmd = 0;
+    c->l1_len = 0;
+    if (c->cmd != SE3_CMD0_L1 || c->len < SE3_REQ1_OFFSET_DATA || (c->len % SE3_L1_CRYPTOBLOCK_SIZE) != 0) {
+        return true;
+    }
+    if (!se3_payload_decrypt(&(b->cryptoctx), c->buf + SE3_REQ1_OFFSET_AUTH, c->buf + SE3_REQ1_OFFSET_IV,
+        c->buf + SE3_L1_AUTH_SIZE + SE3_L1_IV_SIZE, (c->len - SE3_L1_AUTH_SIZE - SE3_L1_IV_SIZE) / SE3_L1_CRYPTOBLOCK_SIZE, c->cmd_flags)) {
+        return true;
+    }
+    SE3_GET16(c->buf, SE3_REQ1_OFFSET_CMD, c->l1_cmd);
+    SE3_GET16(c->buf, SE3_REQ1_OFFSET_LEN, c->l1_len);
+    if (c->l1_len > c->len - SE3_REQ1_OFFSET_DATA) {
+        c->l1_cmd = 0;
+    }
+    return true;
+}
+
+/** \brief Serve the pending request of a client, and the identical ones of the others */
+static void se3b_serve(se3b_broker* b, se3b_client* c)
+{
+    se3b_client* same[SE3_BROKER_CLIENTS_MAX];
+    se3b_client* d;
+    uint16_t resp_status = SE3_OK, resp_len = 0;
+    size_t i, n_same = 0;
+
+    // key and algorithm lists only depend on the request: the same queries waiting now are sent once
+    if (c->cmd == SE3_CMD0_L1 && (c->l1_cmd == SE3_CMD1_KEY_LIST || c->l1_cmd == SE3_CMD1_CRYPTO_LIST) && se3b_authorized(c)) {
+        for (i = 0; i < SE3_BROKER_CLIENTS_MAX; i++) {
+            d = &(b->clients[i]);
+            if (d != c && d->fd >= 0 && d->state == SE3B_PENDING && d->cmd == SE3_CMD0_L1 &&
+                d->l1_cmd == c->l1_cmd && d->l1_len == c->l1_len && se3b_authorized(d) &&
+                !memcmp(d->buf + SE3_REQ1_OFFSET_DATA, c->buf + SE3_REQ1_OFFSET_DATA, c->l1_len)) {
+                same[n_same++] = d;
+            }
+        }
+    }
+
+    switch (c->cmd) {
+    case SE3_CMD0_L1:
+        if (c->l1_cmd == 0) {
+            resp_status = SE3_ERR_COMM;
+            break;
+        }
+        resp_status = se3b_exec_L1(b, c, &resp_len);
+        break;
+    case SE3_CMD0_ECHO:
+        resp_status = L0_echo(&(b->s->device), c->buf, c->len, c->buf);
+        resp_len = c->len;
+        break;
+    default:
+        // the device is not the client's to initialize
+        resp_status = SE3_ERR_CMD;
+        break;
+    }
+
+    for (i = 0; i < n_same; i++) {
+        d = same[i];
+        memcpy(d->buf + SE3_RESP1_OFFSET_LEN, c->buf + SE3_RESP1_OFFSET_LEN, SE3_RESP1_OFFSET_DATA - SE3_RESP1_OFFSET_LEN);
+        memcpy(d->buf + SE3_RESP1_OFFSET_DATA, c->buf + SE3_RESP1_OFFSET_DATA, resp_len);
+        if (!se3b_reply(b, d, resp_status, resp_len)) {
+            se3b_drop(b, d);
+        }
+    }
+    if (!se3b_reply(b, c, resp_status, resp_len)) {
+        se3b_drop(b, c);
+    }
+}
+
+int se3_broker_serve(se3_session* s, const uint8_t* pin, const char* path)
+{
+    struct sockaddr_un addr;
+    struct pollfd fds[SE3_BROKER_CLIENTS_MAX + 1];
+    se3b_client* map[SE3_BROKER_CLIENTS_MAX + 1];
+    se3b_broker* b;
+    se3b_client* c;
+    size_t i, n, k;
+    int fd, cfd, timeout;
+    bool pending, ok;
+
+    if (s == NULL || pin == NULL || !s->logged_in || strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    b = (se3b_broker*)calloc(1, sizeof(se3b_broker));
+    if (b == NULL) {
+        return -1;
+    }
+    b->s = s;
+    b->pin = pin;
+    se3_payload_cryptoinit(&(b->cryptoctx), se3_magic);
+    for (i = 0; i < SE3_BROKER_CLIENTS_MAX; i++) {
+        b->clients[i].fd = -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        free(b);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || chmod(path, S_IRUSR | S_IWUSR) != 0 ||
+        listen(fd, SE3_BROKER_CLIENTS_MAX) != 0) {
+        close(fd);
+        free(b);
+        return -1;
+    }
+
+    for (;;) {
+        // wait for new requests and for the transfers under way, without blocking while
+        // requests are queued; a transfer is never waited for, a stalled client only loses its slot
+        pending = false;
+        timeout = -1;
+        fds[0].fd = fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        n = 1;
+        for (i = 0; i < SE3_BROKER_CLIENTS_MAX; i++) {
+            c = &(b->clients[i]);
+            if (c->fd < 0) {
+                continue;
+            }
+            if (c->state == SE3B_PENDING) {
+                pending = true;
+                continue;
+            }
+            if (c->state == SE3B_SEND || c->done > 0) {
+                if (timeout < 0 || se3c_remaining(c->deadline) < (uint32_t)timeout) {
+                    timeout = (int)se3c_remaining(c->deadline);
+                }
+            }
+            fds[n].fd = c->fd;
+            fds[n].events = (c->state == SE3B_SEND) ? (POLLOUT) : (POLLIN);
+            fds[n].revents = 0;
+            map[n++] = c;
+        }
+        if (poll(fds, (nfds_t)n, (pending) ? (0) : (timeout)) < 0 && errno != EINTR) {
+            break;
+        }
+        for (k = 1; k < n; k++) {
+            c = map[k];
+            ok = true;
+            if (fds[k].revents != 0) {
+                ok = (c->state == SE3B_SEND) ? (se3b_send(c)) : (se3b_recv(b, c));
+            }
+            if (ok && (c->state == SE3B_SEND || (c->state == SE3B_RECV && c->done > 0)) && se3c_remaining(c->deadline) == 0) {
+                ok = false;
+            }
+            if (!ok) {
+                se3b_drop(b, c);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            cfd = accept(fd, NULL, NULL);
+            for (i = 0; cfd >= 0 && i < SE3_BROKER_CLIENTS_MAX && b->clients[i].fd >= 0; i++);
+            if (cfd >= 0 && i < SE3_BROKER_CLIENTS_MAX && fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK) == 0 &&
+                (b->clients[i].buf = (uint8_t*)malloc(SE3B_PAYLOAD_SIZE)) != NULL) {
+                b->clients[i].fd = cfd;
+            }
+            else if (cfd >= 0) {
+                close(cfd);
+            }
+        }
+
+        // one request per round, from the first client after the last one served
+        for (k = 0; k < SE3_BROKER_CLIENTS_MAX; k++) {
+            c = &(b->clients[(b->next + k) % SE3_BROKER_CLIENTS_MAX]);
+            if (c->fd >= 0 && c->state == SE3B_PENDING) {
+                b->next = (b->next + k + 1) % SE3_BROKER_CLIENTS_MAX;
+                se3b_serve(b, c);
+                break;
+            }
+        }
+    }
+    close(fd);
+    free(b);
+    return -1;
+}
+#elif _WIN32
+int se3_broker_serve(se3_session* s, const uint8_t* pin, const char* path)
+{
+    // not supported
+    return -1;
+}
+#endif
@@ -0,0 +1,50 @@
+/**
+ *  \file se3broker.h
+ *  \brief This file contains the device broker: one process owns a SEcube
+ *         and serves the L1 commands of many processes on a Unix domain
+ *         socket, reached by them as broker://<socket path>
+ *
+ *  \details Opening a device takes an exclusive lock on its magic file, so
+ *  a second process waits until the first one exits. The broker is logged in
+ *  to the device once and relays whole L0 commands of its clients (see the
+ *  broker:// transport in se3transport.h), so CLI invocations and services
+ *  share the token at the same time.
+ *
+ *  Each client sees a device of its own: its L1 login is checked by the
+ *  broker against the broker PIN, its packets are protected as by the device,
+ *  and the crypto sessions it opens can only be used and are closed by it.
+ *  The other commands are relayed on the broker session. Requests are served
+ *  round robin, one per client at a time, and identical key and algorithm
+ *  list requests waiting together are sent to the device once. Transfers
+ *  never block the broker: a client that stalls in the middle of a request or
+ *  of a reply is dropped after SE3_TIMEOUT, and the others are served meanwhile.
+ *
+ *  Only user logins are accepted. POSIX only.
+ */
+
+#pragma once
+
+#include "L1.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of clients connected at once */
+#define SE3_BROKER_CLIENTS_MAX (32)
+/** Maximum number of crypto sessions opened by a client */
+#define SE3_BROKER_SESSIONS_MAX (64)
+
+/**
+ *  \brief Serve a device on a Unix domain socket, until a fatal error
+ *
+ *  \param [in] s Session logged in to the device as user
+ *  \param [in] pin User PIN of s, checked against the logins of the clients
+ *  \param [in] path Socket path, replaced if it exists; only the owner can connect
+ *  \return -1 if the socket cannot be created
+ */
+int se3_broker_serve(se3_session* s, const uint8_t* pin, const char* path);
+
+#ifdef __cplusplus
+}
+#endif
@@ -21,7 +21,46 @@ enum {
 #define FSCTL_IS_VOLUME_MOUNTED (0x90028)
 #endif
 
-void se3c_rand(size_t len, uint8_t* buf)
+#ifndef _WIN32
+#include <pthread.h>
+#include <limits.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#elif defined(__APPLE__)
+#include <sys/random.h>
+#endif
+#endif
+
+#define SE3C_RAND_BUF (512)                   // keystream generated at each refill, multiple of 16
+#define SE3C_RAND_SEED (B5_AES_256 + B5_AES_IV_SIZE)
+#define SE3C_RAND_RESEED (1024*1024)          // output bytes after which fresh OS entropy is mixed in
+#define SE3C_RAND_BULK (128)                  // requests this long bypass the buffer
+
+#ifdef _WIN32
+#define SE3C_THREAD_LOCAL __declspec(thread)
+#else
+#define SE3C_THREAD_LOCAL __thread
+#endif
+
+/** \brief Per-thread AES-256-CTR generator state */
+typedef struct se3c_rand_state_ {
+    B5_tAesCtx aes;
+    uint8_t buf[SE3C_RAND_BUF];   // unused keystream, consumed bytes are wiped
+    size_t pos;
+    uint64_t output;              // bytes produced since the last reseed
+    uint32_t generation;          // value of se3c_rand_generation when seeded
+    uint32_t unfix;               // value of se3c_rand_unfixes when fixed
+    bool seeded;
+    bool fixed;                   // stream set by se3c_rand_fix, never mixed with OS entropy
+} se3c_rand_state;
+
+static SE3C_THREAD_LOCAL se3c_rand_state se3c_rand_st;
+static const uint8_t se3c_rand_zero[SE3C_RAND_BUF] = { 0 };
+static volatile uint32_t se3c_rand_generation = 0;   // bumped in the child after fork()
+static volatile uint32_t se3c_rand_unfixes = 0;      // bumped by se3c_rand_unfix
+
+/** \brief Fill buf with len bytes from the operating system generator */
+static void se3c_rand_os(size_t len, uint8_t* buf)
 {
 #ifdef _WIN32
     HCRYPTPROV hProvider;
@@ -42,12 +81,157 @@ void se3c_rand(size_t len, uint8_t* buf)
         }
     }
 #else
-    int frnd = open("/dev/urandom", O_RDONLY);
+    int frnd = -1;
+#if defined(__linux__) && defined(SYS_getrandom)
+    if (syscall(SYS_getrandom, buf, len, 0) == (long)len) {
+        return;
+    }
+#elif defined(__APPLE__)
+    if (len <= 256 && getentropy(buf, len) == 0) {
+        return;
+    }
+#endif
+    frnd = open("/dev/urandom", O_RDONLY);
     read(frnd, buf, len);
     close(frnd);
 #endif
 }
 
+#ifndef _WIN32
+static pthread_once_t se3c_rand_once = PTHREAD_ONCE_INIT;
+
+static void se3c_rand_atfork_child(void)
+{
+    // parent and child must not share the keystream
+    se3c_rand_generation++;
+}
+
+static void se3c_rand_register(void)
+{
+    pthread_atfork(NULL, NULL, se3c_rand_atfork_child);
+}
+#endif
+
+/**
+ *  \brief Replace key and counter with the next keystream bytes XOR seed
+ *  		(fast key erasure, previous outputs cannot be recomputed)
+ */
+static void se3c_rand_rekey(se3c_rand_state* st, const uint8_t* seed)
+{
+    uint8_t k[SE3C_RAND_SEED];
+    size_t i;
+    B5_Aes256_Update(&(st->aes), k, (uint8_t*)se3c_rand_zero, SE3C_RAND_SEED / B5_AES_BLK_SIZE);
+    if (seed != NULL) {
+        for (i = 0; i < SE3C_RAND_SEED; i++) {
+            k[i] ^= seed[i];
+        }
+    }
+    B5_Aes256_Init(&(st->aes), k, B5_AES_256, B5_AES256_CTR);
+    B5_Aes256_SetIV(&(st->aes), k + B5_AES_256);
+    memset(k, 0, SE3C_RAND_SEED);
+}
+
+static void se3c_rand_seed(se3c_rand_state* st)
+{
+    uint8_t seed[SE3C_RAND_SEED];
+#ifndef _WIN32
+    pthread_once(&se3c_rand_once, se3c_rand_register);
+#endif
+    se3c_rand_os(SE3C_RAND_SEED, seed);
+    if (st->seeded) {
+        se3c_rand_rekey(st, seed);
+    }
+    else {
+        B5_Aes256_Init(&(st->aes), seed, B5_AES_256, B5_AES256_CTR);
+        B5_Aes256_SetIV(&(st->aes), seed + B5_AES_256);
+    }
+    memset(seed, 0, SE3C_RAND_SEED);
+    memset(st->buf, 0, SE3C_RAND_BUF);
+    st->pos = SE3C_RAND_BUF;
+    st->output = 0;
+    st->generation = se3c_rand_generation;
+    st->seeded = true;
+    st->fixed = false;
+}
+
+void se3c_rand_fix(const uint8_t* seed)
+{
+    se3c_rand_state* st = &se3c_rand_st;
+    uint8_t k[SE3C_RAND_SEED];
+#ifndef _WIN32
+    pthread_once(&se3c_rand_once, se3c_rand_register);
+#endif
+    memset(k, 0, SE3C_RAND_SEED);
+    memcpy(k, seed, SE3C_RAND_FIX_SIZE);
+    B5_Aes256_Init(&(st->aes), k, B5_AES_256, B5_AES256_CTR);
+    B5_Aes256_SetIV(&(st->aes), k + B5_AES_256);
+    memset(k, 0, SE3C_RAND_SEED);
+    memset(st->buf, 0, SE3C_RAND_BUF);
+    st->pos = SE3C_RAND_BUF;
+    st->output = 0;
+    st->generation = se3c_rand_generation;
+    st->unfix = se3c_rand_unfixes;
+    st->seeded = true;
+    st->fixed = true;
+}
+
+void se3c_rand_unfix(void)
+{
+    // the fixing thread may not be the calling one: it reseeds on its next draw
+    se3c_rand_unfixes++;
+}
+
+void se3c_rand_unfixed(size_t len, uint8_t* buf)
+{
+    se3c_rand_os(len, buf);
+}
+
+void se3c_rand(size_t len, uint8_t* buf)
+{
+    se3c_rand_state* st = &se3c_rand_st;
+    size_t n;
+
+    if (st->fixed && st->generation == se3c_rand_generation && st->output >= SE3C_RAND_RESEED) {
+        st->output = 0;
+    }
+    if (!(st->seeded) || st->generation != se3c_rand_generation || st->output >= SE3C_RAND_RESEED ||
+        (st->fixed && st->unfix != se3c_rand_unfixes)) {
+        se3c_rand_seed(st);
+    }
+    st->output += len;
+
+    // bulk requests (e.g. sector padding): keystream straight into buf
+    if (len >= SE3C_RAND_BULK) {
+        while (len >= B5_AES_BLK_SIZE) {
+            n = len / B5_AES_BLK_SIZE;
+            if (n > SE3C_RAND_BUF / B5_AES_BLK_SIZE) {
+                n = SE3C_RAND_BUF / B5_AES_BLK_SIZE;
+            }
+            B5_Aes256_Update(&(st->aes), buf, (uint8_t*)se3c_rand_zero, (int16_t)n);
+            buf += n * B5_AES_BLK_SIZE;
+            len -= n * B5_AES_BLK_SIZE;
+        }
+        se3c_rand_rekey(st, NULL);
+    }
+
+    while (len > 0) {
+        if (st->pos == SE3C_RAND_BUF) {
+            B5_Aes256_Update(&(st->aes), st->buf, (uint8_t*)se3c_rand_zero, SE3C_RAND_BUF / B5_AES_BLK_SIZE);
+            se3c_rand_rekey(st, NULL);
+            st->pos = 0;
+        }
+        n = SE3C_RAND_BUF - st->pos;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(buf, st->buf + st->pos, n);
+        memset(st->buf + st->pos, 0, n);
+        st->pos += n;
+        buf += n;
+        len -= n;
+    }
+}
+
 #ifdef _WIN32
 static bool se3c_win32_disk_in_drive(wchar_t* path)
 {
@@ -103,6 +287,7 @@ void se3c_drive_init(se3_drive_it* it)
 bool se3c_drive_next(se3_drive_it* it)
 {
     bool found = false;
+    DWORD serial;
     while (!found) {
         if (it->path == NULL) {
             if (it->buf_len_ == 0)return false;
@@ -123,6 +308,11 @@ bool se3c_drive_next(se3_drive_it* it)
             }
         }
     }
+    if (!GetVolumeInformationW(it->path, NULL, 0, &serial, NULL, NULL, NULL, 0)) {
+        serial = 0;
+    }
+    it->mount_id = (uint64_t)serial;
+    it->disk_seq = 0;
     return true;
 }
 
@@ -148,8 +338,10 @@ bool se3c_write(uint8_t* buf, se3_file hfile, size_t block, size_t nblocks, uint
                 }
             }
             else if (WAIT_TIMEOUT == wret) {
-                //CancelIo(hfile.h);
-                //ResetEvent(hfile.ol.hEvent);
+                // buf must not be touched once we return, retire the request
+                CancelIo(hfile.h);
+                GetOverlappedResult(hfile.h, &hfile.ol, &bytes_written, TRUE);
+                ResetEvent(hfile.ol.hEvent);
                 se3_trace(("se3c_write timeout\n"));
             }
         }
@@ -186,8 +378,10 @@ bool se3c_read(uint8_t* buf, se3_file hfile, size_t block, size_t nblocks, uint3
                 }
             }
             else if (WAIT_TIMEOUT == wret) {
-                //CancelIo(hfile.h);
-                //ResetEvent(hfile.ol.hEvent);
+                // buf must not be touched once we return, retire the request
+                CancelIo(hfile.h);
+                GetOverlappedResult(hfile.h, &hfile.ol, &bytes_read, TRUE);
+                ResetEvent(hfile.ol.hEvent);
                 se3_trace(("se3c_read timeout\n"));
             }
         }
@@ -233,18 +427,105 @@ void se3c_unix_unlock(int fd) {
 
 void se3c_drive_init(se3_drive_it* it)
 {
+    const char* all = getenv(SE3_DRIVE_ALL_ENV);
 
-    it->fp_ = fopen("/proc/mounts", "r");
+    it->all_ = (all != NULL && all[0] != '\0' && strcmp(all, "0"));
+    it->mount_id = 0;
+    it->disk_seq = 0;
+    it->mountinfo_ = true;
+    it->fp_ = fopen("/proc/self/mountinfo", "r");
+    if (it->fp_ == NULL) {
+        it->mountinfo_ = false;
+        it->fp_ = fopen("/proc/mounts", "r");
+    }
+}
 
+/** \brief Decode the octal escapes (\040 for a space) of a mount point, in place */
+static void se3c_unescape_mount(char* s)
+{
+    char* d = s;
+    while (*s != '\0') {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+            *d++ = (char)(((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0'));
+            s += 4;
+        }
+        else {
+            *d++ = *s++;
+        }
+    }
+    *d = '\0';
+}
+
+/** \brief True if the block device major:minor sits on a USB bus, according to sysfs.
+ *         disk_seq is set for any block device: a mount ID can be reused, the
+ *         pair is unique. */
+static bool se3c_usb_block(unsigned major, unsigned minor, uint64_t* disk_seq)
+{
+    bool usb;
+    char link[64];
+    char real[PATH_MAX + 16];
+    size_t len;
+    FILE* fp;
+    unsigned long long seq = 0;
+
+    *disk_seq = 0;
+    if (major == 0) {
+        // not backed by a block device: tmpfs, nfs, overlay, proc...
+        return false;
+    }
+    snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major, minor);
+    if (realpath(link, real) == NULL) {
+        return false;
+    }
+    usb = (strstr(real, "/usb") != NULL);
+    // diskseq belongs to the whole disk, the parent of a partition
+    len = strlen(real);
+    strcpy(real + len, "/diskseq");
+    fp = fopen(real, "r");
+    if (fp == NULL) {
+        strcpy(real + len, "/../diskseq");
+        fp = fopen(real, "r");
+    }
+    if (fp != NULL) {
+        if (fscanf(fp, "%llu", &seq) == 1) {
+            *disk_seq = (uint64_t)seq;
+        }
+        fclose(fp);
+    }
+    return usb;
 }
 
 bool se3c_drive_next(se3_drive_it* it)
 {
     char buf[SE3_DRIVE_BUF_MAX];
+    unsigned long long id;
+    unsigned major, minor;
+    size_t len;
+    int c;
     if (it->fp_ == NULL)return false;
-    if (NULL != fgets(it->buf_, SE3_DRIVE_BUF_MAX, it->fp_))
+    while (NULL != fgets(it->buf_, SE3_DRIVE_BUF_MAX, it->fp_))
     {
-        sscanf(it->buf_, "%*s%s", buf);
+        len = strlen(it->buf_);
+        if (len > 0 && it->buf_[len - 1] != '\n') {
+            // skip the rest of a long line
+            while ((c = fgetc(it->fp_)) != EOF && c != '\n');
+        }
+        it->mount_id = 0;
+        it->disk_seq = 0;
+        if (it->mountinfo_) {
+            // mount ID, parent ID, major:minor, root, mount point, ...
+            if (sscanf(it->buf_, "%llu %*u %u:%u %*s %1023s", &id, &major, &minor, buf) != 4) {
+                continue;
+            }
+            if (!se3c_usb_block(major, minor, &(it->disk_seq)) && !it->all_) {
+                continue;
+            }
+            it->mount_id = (uint64_t)id;
+        }
+        else if (sscanf(it->buf_, "%*s %1023s", buf) != 1) {
+            continue;
+        }
+        se3c_unescape_mount(buf);
         strcpy(it->buf_, buf);
         it->path = it->buf_;
         return true;
@@ -256,8 +537,13 @@ bool se3c_drive_next(se3_drive_it* it)
 
 bool se3c_write(uint8_t* buf, se3_file hfile, size_t block, size_t nblocks, uint32_t timeout)
 {
-    memcpy(hfile.buf, buf, nblocks*SE3_COMM_BLOCK);
-    if (nblocks*SE3_COMM_BLOCK != pwrite(hfile.fd, hfile.buf, nblocks*SE3_COMM_BLOCK, block*SE3_COMM_BLOCK)) {
+    uint8_t* io = buf;
+    // O_DIRECT needs an aligned buffer: bounce through hfile.buf only if buf is not
+    if (((uintptr_t)buf % SE3_COMM_BLOCK) != 0) {
+        memcpy(hfile.buf, buf, nblocks*SE3_COMM_BLOCK);
+        io = (uint8_t*)hfile.buf;
+    }
+    if (nblocks*SE3_COMM_BLOCK != pwrite(hfile.fd, io, nblocks*SE3_COMM_BLOCK, block*SE3_COMM_BLOCK)) {
         return false;
     }
     return true;
@@ -265,10 +551,14 @@ bool se3c_write(uint8_t* buf, se3_file hfile, size_t block, size_t nblocks, uint
 
 bool se3c_read(uint8_t* buf, se3_file hfile, size_t block, size_t nblocks, uint32_t timeout)
 {
-    if (nblocks*SE3_COMM_BLOCK != pread(hfile.fd, hfile.buf, nblocks*SE3_COMM_BLOCK, block*SE3_COMM_BLOCK)) {
+    bool aligned = (((uintptr_t)buf % SE3_COMM_BLOCK) == 0);
+    uint8_t* io = (aligned) ? (buf) : ((uint8_t*)hfile.buf);
+    if (nblocks*SE3_COMM_BLOCK != pread(hfile.fd, io, nblocks*SE3_COMM_BLOCK, block*SE3_COMM_BLOCK)) {
         return false;
     }
-    memcpy(buf, hfile.buf, nblocks*SE3_COMM_BLOCK);
+    if (!aligned) {
+        memcpy(buf, hfile.buf, nblocks*SE3_COMM_BLOCK);
+    }
     return true;
 }
 void se3c_close(se3_file hfile) {
@@ -603,6 +893,14 @@ uint64_t se3c_deadline(uint32_t timeout) {
     return (se3c_clock() + timeout);
 }
 
+uint32_t se3c_remaining(uint64_t deadline) {
+    uint64_t now = se3c_clock();
+    if (now >= deadline) {
+        return 0;
+    }
+    return ((deadline - now) > UINT32_MAX) ? (UINT32_MAX) : ((uint32_t)(deadline - now));
+}
+
 
 bool se3c_open(se3_char* path, uint64_t deadline, se3_file* phfile, se3_discover_info* disco) {
     uint8_t buf[SE3_COMM_BLOCK];
@@ -646,9 +944,28 @@ void se3c_pathcopy(se3_char* dest, se3_char* src)
 
 uint64_t se3c_clock()
 {
-    uint64_t ms = (uint64_t)clock();
-    ms = (ms * 1000) / CLOCKS_PER_SEC;
-    return ms;
+    // monotonic wall time in ms, unaffected by clock adjustments
+    return (uint64_t)GetTickCount64();
+}
+
+uint8_t* se3c_alloc_blocks(size_t nblocks)
+{
+    // aligned as FILE_FLAG_NO_BUFFERING requires
+    return (uint8_t*)_aligned_malloc(nblocks*SE3_COMM_BLOCK, SE3_COMM_BLOCK);
+}
+
+void se3c_free_blocks(uint8_t* buf)
+{
+    _aligned_free(buf);
+}
+
+uint64_t se3c_clock_us()
+{
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+        (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / (uint64_t)freq.QuadPart;
 }
 #else
 void se3c_pathcopy(se3_char* dest, se3_char* src)
@@ -660,13 +977,36 @@ uint64_t se3c_clock()
 {
     uint64_t ms;
     struct timespec spec;
-    clock_gettime(CLOCK_REALTIME, &spec);
+    // monotonic wall time, deadlines must expire while sleeping and must not jump with the system clock
+    clock_gettime(CLOCK_MONOTONIC, &spec);
     ms = spec.tv_sec;
     ms *= 1000;
     ms += (uint64_t)spec.tv_nsec / ((uint64_t)1000000);
     return ms;
 }
 
+uint8_t* se3c_alloc_blocks(size_t nblocks)
+{
+    // aligned as O_DIRECT requires, so se3c_read and se3c_write can skip hfile.buf
+    return (uint8_t*)memalign(SE3_COMM_BLOCK, nblocks*SE3_COMM_BLOCK);
+}
+
+void se3c_free_blocks(uint8_t* buf)
+{
+    free(buf);
+}
+
+uint64_t se3c_clock_us()
+{
+    uint64_t us;
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    us = spec.tv_sec;
+    us *= 1000000;
+    us += (uint64_t)spec.tv_nsec / ((uint64_t)1000);
+    return us;
+}
+
 
 #endif
 
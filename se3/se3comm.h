@@ -62,10 +62,15 @@ extern "C" {
 	} se3_discover_info;
 
 #define SE3_DRIVE_BUF_MAX (1024)
+/** Environment variable: if set and not "0", the drive iterator reports every
+ *  mount point instead of USB block devices only (Linux) */
+#define SE3_DRIVE_ALL_ENV "SE3_DISCO_ALL"
 
 
     typedef struct se3_drive_it_ {
         se3_char* path;
+        uint64_t mount_id;   ///< mount of path (Linux mount ID, Windows volume serial), 0 if unknown
+        uint64_t disk_seq;   ///< sequence number of the block device (Linux diskseq), 0 if unknown
 
         se3_char buf_[SE3_DRIVE_BUF_MAX + 1];
         size_t buf_len_;
@@ -73,10 +78,24 @@ extern "C" {
         size_t pos_;
 #else
         FILE* fp_;
+        bool mountinfo_;   // fp_ reads /proc/self/mountinfo, else /proc/mounts
+        bool all_;         // no filter, see SE3_DRIVE_ALL_ENV
 #endif
     } se3_drive_it;
 
     void se3c_rand(size_t len, uint8_t* buf);
+/** Size of the seed of \ref se3c_rand_fix */
+#define SE3C_RAND_FIX_SIZE (32)
+    /** \brief Make se3c_rand a repeatable stream in the calling thread, from a
+     *         SE3C_RAND_FIX_SIZE byte seed, until it forks. Only for recording
+     *         and replaying device traffic, see se3trace.c */
+    void se3c_rand_fix(const uint8_t* seed);
+    /** \brief End every stream made by \ref se3c_rand_fix, in any thread: the
+     *         next se3c_rand call there reseeds from the operating system */
+    void se3c_rand_unfix(void);
+    /** \brief Random bytes straight from the operating system, never from a
+     *         fixed stream: for emulators playing the device in process */
+    void se3c_rand_unfixed(size_t len, uint8_t* buf);
 
     void se3c_drive_init(se3_drive_it* it);
     bool se3c_drive_next(se3_drive_it* it);
@@ -89,13 +108,19 @@ extern "C" {
     //bool se3c_flock_acquire(se3_file hfile, clock_t deadline);
     //void se3c_flock_release(se3_file hfile);
     uint64_t se3c_deadline(uint32_t timeout);
+    uint32_t se3c_remaining(uint64_t deadline);
     void se3c_pathcopy(se3_char* dest, se3_char* src);
     uint64_t se3c_clock();
+    uint64_t se3c_clock_us();
+    uint8_t* se3c_alloc_blocks(size_t nblocks);
+    void se3c_free_blocks(uint8_t* buf);
 
 #ifdef _WIN32
 #define se3c_sleep() Sleep(0)
+#define se3c_usleep(us) Sleep((DWORD)((us) / 1000))
 #else
 #define se3c_sleep() usleep(1000)
+#define se3c_usleep(us) usleep(us)
 #endif
 
 #define SE3C_MAGIC_TIMEOUT (1000)
@@ -0,0 +1,405 @@
+#include "se3disco.h"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <pthread.h>
+
+typedef pthread_mutex_t se3_lock;
+typedef pthread_cond_t se3_cond;
+#define se3_lock_init(l) pthread_mutex_init((l), NULL)
+#define se3_lock_destroy(l) pthread_mutex_destroy(l)
+#define se3_lock_acquire(l) pthread_mutex_lock(l)
+#define se3_lock_release(l) pthread_mutex_unlock(l)
+#define se3_cond_init(c) pthread_cond_init((c), NULL)
+#define se3_cond_destroy(c) pthread_cond_destroy(c)
+#define se3_cond_signal(c) pthread_cond_signal(c)
+#elif _WIN32
+#include <windows.h>
+
+typedef CRITICAL_SECTION se3_lock;
+typedef CONDITION_VARIABLE se3_cond;
+#define se3_lock_init(l) InitializeCriticalSection(l)
+#define se3_lock_destroy(l) DeleteCriticalSection(l)
+#define se3_lock_acquire(l) EnterCriticalSection(l)
+#define se3_lock_release(l) LeaveCriticalSection(l)
+#define se3_cond_init(c) InitializeConditionVariable(c)
+#define se3_cond_destroy(c)
+#define se3_cond_signal(c) WakeConditionVariable(c)
+#endif
+
+/** \brief A candidate mount */
+typedef struct se3_disco_job_ {
+    se3_char path[SE3_MAX_PATH];
+    uint64_t mount_id;
+    uint64_t disk_seq;
+    bool known;     // result from the cache or from a completed probe
+    bool cached;
+    bool found;     // a SEcube
+    se3_discover_info info;
+    struct se3_disco_run_* run;
+} se3_disco_job;
+
+/** \brief State shared by a scan and its probes. The probes abandoned at the
+ *         deadline keep it alive: the last one to leave frees it. */
+typedef struct se3_disco_run_ {
+    se3_lock lock;
+    se3_cond cond;
+    uint32_t refs;      // the scan and the running probes
+    uint32_t pending;   // probes not completed
+    bool closed;        // the scan stopped waiting, later results are dropped
+    uint64_t deadline;
+    size_t count;
+    se3_disco_job jobs[SE3_DISCO_CANDIDATES_MAX];
+} se3_disco_run;
+
+static void se3_disco_release(se3_disco_run* run);
+static void se3_disco_probe(se3_disco_job* job);
+static bool se3_disco_start(se3_disco_job* job);
+static void se3_disco_wait(se3_disco_run* run);
+static size_t se3_disco_cache_load(se3_disco_run* run);
+static void se3_disco_cache_store(se3_disco_run* run);
+
+
+size_t se3_disco_scan(se3_disco_result* found, size_t max, se3_disco_stats* stats)
+{
+    se3_drive_it drive_it;
+    se3_disco_run* run;
+    se3_disco_stats st;
+    size_t i, n = 0;
+
+    memset(&st, 0, sizeof(se3_disco_stats));
+    run = (se3_disco_run*)calloc(1, sizeof(se3_disco_run));
+    if (run == NULL) {
+        if (stats != NULL) {
+            memcpy(stats, &st, sizeof(se3_disco_stats));
+        }
+        return 0;
+    }
+    se3_lock_init(&(run->lock));
+    se3_cond_init(&(run->cond));
+    run->refs = 1;
+
+    se3c_drive_init(&drive_it);
+    while (se3c_drive_next(&drive_it)) {
+        if (run->count == SE3_DISCO_CANDIDATES_MAX) {
+            continue;
+        }
+        se3c_pathcopy(run->jobs[run->count].path, drive_it.path);
+        run->jobs[run->count].mount_id = drive_it.mount_id;
+        run->jobs[run->count].disk_seq = drive_it.disk_seq;
+        run->jobs[run->count].run = run;
+        run->count++;
+    }
+    st.candidates = (uint32_t)run->count;
+    st.cached = (uint32_t)se3_disco_cache_load(run);
+
+    // probe the rest, all at once
+    run->deadline = se3c_deadline(SE3_DISCO_PROBE_TIMEOUT);
+    for (i = 0; i < run->count; i++) {
+        if (run->jobs[i].known) {
+            continue;
+        }
+        se3_lock_acquire(&(run->lock));
+        run->refs++;
+        run->pending++;
+        se3_lock_release(&(run->lock));
+        if (!se3_disco_start(&(run->jobs[i]))) {
+            // no thread, probe here
+            se3_disco_probe(&(run->jobs[i]));
+        }
+    }
+    se3_disco_wait(run);
+
+    se3_lock_acquire(&(run->lock));
+    run->closed = true;
+    for (i = 0; i < run->count; i++) {
+        if (!run->jobs[i].known) {
+            st.timeouts++;
+            continue;
+        }
+        if (!run->jobs[i].cached) {
+            st.probed++;
+        }
+        if (run->jobs[i].found && n < max) {
+            se3c_pathcopy(found[n].path, run->jobs[i].path);
+            memcpy(&(found[n].info), &(run->jobs[i].info), sizeof(se3_discover_info));
+            n++;
+        }
+    }
+    if (st.probed > 0) {
+        se3_disco_cache_store(run);
+    }
+    se3_lock_release(&(run->lock));
+    se3_disco_release(run);
+
+    if (stats != NULL) {
+        memcpy(stats, &st, sizeof(se3_disco_stats));
+    }
+    return n;
+}
+
+static void se3_disco_release(se3_disco_run* run)
+{
+    bool last;
+
+    se3_lock_acquire(&(run->lock));
+    last = (--run->refs == 0);
+    se3_lock_release(&(run->lock));
+    if (last) {
+        se3_cond_destroy(&(run->cond));
+        se3_lock_destroy(&(run->lock));
+        free(run);
+    }
+}
+
+static void se3_disco_probe(se3_disco_job* job)
+{
+    se3_disco_run* run = job->run;
+    se3_discover_info info;
+    bool found;
+
+    found = se3c_info(job->path, run->deadline, &info);
+    se3_lock_acquire(&(run->lock));
+    // a probe that ends after the deadline is not reported: the scan is over
+    if (!run->closed) {
+        job->found = found;
+        memcpy(&(job->info), &info, sizeof(se3_discover_info));
+        job->known = true;
+    }
+    run->pending--;
+    se3_cond_signal(&(run->cond));
+    se3_lock_release(&(run->lock));
+    se3_disco_release(run);
+}
+
+
+#if defined(__linux__) || defined(__APPLE__)
+static void* se3_disco_main(void* arg)
+{
+    se3_disco_probe((se3_disco_job*)arg);
+    return NULL;
+}
+
+static bool se3_disco_start(se3_disco_job* job)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, se3_disco_main, job)) {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+static void se3_disco_wait(se3_disco_run* run)
+{
+    struct timespec ts;
+    uint32_t ms;
+
+    se3_lock_acquire(&(run->lock));
+    while (run->pending > 0 && (ms = se3c_remaining(run->deadline)) > 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&(run->cond), &(run->lock), &ts);
+    }
+    se3_lock_release(&(run->lock));
+}
+
+/** \brief Path of the cache file, false if the cache is disabled */
+static bool se3_disco_cache_path(char* path, size_t size)
+{
+    const char* s = getenv(SE3_DISCO_CACHE_ENV);
+    int n;
+
+    if (s != NULL) {
+        n = snprintf(path, size, "%s", s);
+    }
+    else if ((s = getenv("XDG_RUNTIME_DIR")) != NULL && s[0] != '\0') {
+        n = snprintf(path, size, "%s/se3disco.cache", s);
+    }
+    else {
+        n = snprintf(path, size, "/tmp/se3disco-%u.cache", (unsigned)getuid());
+    }
+    return (n > 0 && (size_t)n < size);
+}
+
+static void se3_disco_hex(char* dst, const uint8_t* src, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    size_t i;
+    for (i = 0; i < len; i++) {
+        dst[2*i] = digits[src[i] >> 4];
+        dst[2*i + 1] = digits[src[i] & 15];
+    }
+    dst[2*len] = '\0';
+}
+
+static bool se3_disco_unhex(uint8_t* dst, const char* src, size_t len)
+{
+    size_t i;
+    unsigned v;
+    for (i = 0; i < len; i++) {
+        if (sscanf(src + 2*i, "%2x", &v) != 1) {
+            return false;
+        }
+        dst[i] = (uint8_t)v;
+    }
+    return true;
+}
+
+/* Cache file: a "se3disco 1" line, then one line per candidate probed:
+ * mount ID, disk sequence, 1 if SEcube, status, serial and hello in hex,
+ * mount point (rest of the line). */
+#define SE3_DISCO_CACHE_MAGIC "se3disco 1\n"
+#define SE3_DISCO_CACHE_LINE (SE3_MAX_PATH + 2*SE3_SERIAL_SIZE + 2*SE3_HELLO_SIZE + 80)
+
+static size_t se3_disco_cache_load(se3_disco_run* run)
+{
+    char path[SE3_MAX_PATH + 32];
+    char line[SE3_DISCO_CACHE_LINE];
+    char serial[2*SE3_SERIAL_SIZE + 1], hello[2*SE3_HELLO_SIZE + 1];
+    unsigned long long mount_id, disk_seq;
+    unsigned found, status;
+    int fd, pos;
+    size_t i, len, hits = 0;
+    struct stat sb;
+    FILE* fp;
+
+    if (!se3_disco_cache_path(path, sizeof(path)) || path[0] == '\0') {
+        return 0;
+    }
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        return 0;
+    }
+    // only trust a private file of ours, it tells which drive to talk to
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_uid != getuid() || (sb.st_mode & (S_IWGRP | S_IWOTH))) {
+        close(fd);
+        return 0;
+    }
+    fp = fdopen(fd, "r");
+    if (fp == NULL) {
+        close(fd);
+        return 0;
+    }
+    if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, SE3_DISCO_CACHE_MAGIC)) {
+        fclose(fp);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') {
+            break;
+        }
+        line[len - 1] = '\0';
+        if (sscanf(line, "%llu %llu %u %u %64s %64s %n", &mount_id, &disk_seq, &found, &status, serial, hello, &pos) != 6 ||
+            strlen(serial) != 2*SE3_SERIAL_SIZE || strlen(hello) != 2*SE3_HELLO_SIZE || mount_id == 0) {
+            continue;
+        }
+        for (i = 0; i < run->count; i++) {
+            se3_disco_job* job = &(run->jobs[i]);
+            if (job->known || job->mount_id != (uint64_t)mount_id || job->disk_seq != (uint64_t)disk_seq ||
+                strcmp(job->path, line + pos)) {
+                continue;
+            }
+            if (!se3_disco_unhex(job->info.serialno, serial, SE3_SERIAL_SIZE) ||
+                !se3_disco_unhex(job->info.hello_msg, hello, SE3_HELLO_SIZE)) {
+                break;
+            }
+            job->info.status = (uint16_t)status;
+            job->found = (found != 0);
+            job->known = true;
+            job->cached = true;
+            hits++;
+            break;
+        }
+    }
+    fclose(fp);
+    return hits;
+}
+
+static void se3_disco_cache_store(se3_disco_run* run)
+{
+    char path[SE3_MAX_PATH + 32];
+    char tmp[SE3_MAX_PATH + 48];
+    char serial[2*SE3_SERIAL_SIZE + 1], hello[2*SE3_HELLO_SIZE + 1];
+    size_t i;
+    int fd;
+    bool ok;
+    FILE* fp;
+
+    if (!se3_disco_cache_path(path, sizeof(path)) || path[0] == '\0') {
+        return;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        return;
+    }
+    fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    ok = (fputs(SE3_DISCO_CACHE_MAGIC, fp) >= 0);
+    for (i = 0; ok && i < run->count; i++) {
+        se3_disco_job* job = &(run->jobs[i]);
+        // without a mount ID a cached answer could not be validated
+        if (!job->known || job->mount_id == 0 || strchr(job->path, '\n') != NULL) {
+            continue;
+        }
+        se3_disco_hex(serial, job->info.serialno, SE3_SERIAL_SIZE);
+        se3_disco_hex(hello, job->info.hello_msg, SE3_HELLO_SIZE);
+        ok = (fprintf(fp, "%llu %llu %u %u %s %s %s\n", (unsigned long long)job->mount_id, (unsigned long long)job->disk_seq,
+            (job->found) ? (1u) : (0u), (unsigned)job->info.status, serial, hello, job->path) > 0);
+    }
+    ok = (fclose(fp) == 0) && ok;
+    // readers see the old file or the new one, never a partial one
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+    }
+}
+#elif _WIN32
+static DWORD WINAPI se3_disco_main(LPVOID arg)
+{
+    se3_disco_probe((se3_disco_job*)arg);
+    return 0;
+}
+
+static bool se3_disco_start(se3_disco_job* job)
+{
+    HANDLE thread = CreateThread(NULL, 0, se3_disco_main, job, 0, NULL);
+
+    if (thread == NULL) {
+        return false;
+    }
+    CloseHandle(thread);
+    return true;
+}
+
+static void se3_disco_wait(se3_disco_run* run)
+{
+    uint32_t ms;
+
+    se3_lock_acquire(&(run->lock));
+    while (run->pending > 0 && (ms = se3c_remaining(run->deadline)) > 0) {
+        SleepConditionVariableCS(&(run->cond), &(run->lock), ms);
+    }
+    se3_lock_release(&(run->lock));
+}
+
+static size_t se3_disco_cache_load(se3_disco_run* run)
+{
+    // not supported: at most a few removable drive letters are probed
+    return 0;
+}
+
+static void se3_disco_cache_store(se3_disco_run* run)
+{
+}
+#endif
@@ -0,0 +1,61 @@
+/**
+ *  \file se3disco.h
+ *  \brief This file contains the drive scan used by L0_discover_init
+ *
+ *  \details Probing a mount point means opening its .se3magic file with
+ *  O_DIRECT, which can block for seconds on network or stale mounts. A scan
+ *  therefore:
+ *  - lists the candidate mounts with se3c_drive_next, which on Linux keeps
+ *    only USB block devices (see \ref SE3_DRIVE_ALL_ENV);
+ *  - answers from a cache file for the mounts probed by an earlier scan,
+ *    as long as their mount ID and disk sequence number did not change;
+ *  - probes the other candidates in parallel, all with the same deadline of
+ *    \ref SE3_DISCO_PROBE_TIMEOUT ms. A probe still running at the deadline
+ *    is abandoned and its mount is not reported.
+ */
+
+#pragma once
+
+#include "se3comm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of SEcube drives reported by a scan */
+#define SE3_DISCO_MAX (16)
+/** Maximum number of candidate mounts considered by a scan */
+#define SE3_DISCO_CANDIDATES_MAX (64)
+/** Deadline of the probes, in ms from the start of the scan */
+#define SE3_DISCO_PROBE_TIMEOUT (2000)
+/** Environment variable: path of the cache file, empty to disable the cache.
+ *  The default is $XDG_RUNTIME_DIR/se3disco.cache, or /tmp/se3disco-<uid>.cache */
+#define SE3_DISCO_CACHE_ENV "SE3_DISCO_CACHE"
+
+/** \brief A SEcube drive found by \ref se3_disco_scan */
+typedef struct se3_disco_result_ {
+    se3_char path[SE3_MAX_PATH];
+    se3_discover_info info;
+} se3_disco_result;
+
+/** \brief What a scan did */
+typedef struct se3_disco_stats_ {
+    uint32_t candidates;    ///< mounts left by the drive filter
+    uint32_t cached;        ///< candidates answered by the cache
+    uint32_t probed;        ///< probes completed before the deadline
+    uint32_t timeouts;      ///< probes abandoned at the deadline
+} se3_disco_stats;
+
+/**
+ *  \brief Find the SEcube drives
+ *
+ *  \param [out] found Drives found, in mount order
+ *  \param [in] max Size of found
+ *  \param [out] stats What the scan did, can be NULL
+ *  \return Number of drives stored in found
+ */
+size_t se3_disco_scan(se3_disco_result* found, size_t max, se3_disco_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
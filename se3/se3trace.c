@@ -0,0 +1,344 @@
+/**
+ *  \file se3trace.c
+ *  \brief This file contains the record:// and replay:// transports: the
+ *         traffic of a device saved to a trace file, and served back from it
+ *
+ *  \details record://<trace file>@<device path> opens the device path with
+ *  its own transport and logs every block read and write to the trace: the
+ *  host time elapsed since the previous operation, the time spent in the
+ *  operation, the blocks moved, a hash of them and the blocks read.
+ *  replay://<trace file> serves the same operations without a device, each
+ *  one taking its recorded time scaled by SE3_REPLAY_SCALE_ENV (1 by
+ *  default, 0 for no wait), so the host side of L0, L1 and SEfile can be
+ *  measured alone on any machine.
+ *
+ *  Login challenges are random: both transports make se3c_rand of the
+ *  opening thread a repeatable stream (see \ref se3c_rand_fix), seeded by a
+ *  value stored in the trace, so a replayed run issues the same requests,
+ *  until the transport is closed (see \ref se3c_rand_unfix). The emulators
+ *  draw from se3c_rand_unfixed, so a sim:// device under record:// does not
+ *  shift the stream of the host.
+ *  A trace holds the random values and the plaintext L1 traffic of its run,
+ *  keys included: record only devices holding test keys. The trace file is
+ *  created readable by its owner only, and must not exist yet.
+ *
+ *  Trace format, integers little endian: a SE3_TRACE_HDR_SIZE header (magic,
+ *  version, seed, discovery information), then one SE3_TRACE_REC_SIZE record
+ *  per operation (op, success, number of blocks, first block, gap and
+ *  duration in microseconds, 64 bit FNV-1a hash of the blocks), followed by
+ *  the blocks for a successful read.
+ */
+
+#include "se3transport.h"
+#include "se3_common.h"
+
+#define SE3_TRACE_MAGIC "SE3TRACE"
+#define SE3_TRACE_VERSION (1)
+#define SE3_TRACE_HDR_SIZE (128)
+#define SE3_TRACE_HDR_OFFSET_VERSION (8)
+#define SE3_TRACE_HDR_OFFSET_SEED (16)
+#define SE3_TRACE_HDR_OFFSET_SERIAL (48)
+#define SE3_TRACE_HDR_OFFSET_HELLO (80)
+#define SE3_TRACE_HDR_OFFSET_STATUS (112)
+#define SE3_TRACE_REC_SIZE (24)
+#define SE3_TRACE_REC_OFFSET_OP (0)
+#define SE3_TRACE_REC_OFFSET_OK (1)
+#define SE3_TRACE_REC_OFFSET_NBLOCKS (2)
+#define SE3_TRACE_REC_OFFSET_BLOCK (4)
+#define SE3_TRACE_REC_OFFSET_GAP (8)
+#define SE3_TRACE_REC_OFFSET_DURATION (12)
+#define SE3_TRACE_REC_OFFSET_HASH (16)
+#define SE3_TRACE_OP_READ ('R')
+#define SE3_TRACE_OP_WRITE ('W')
+/** Separator between the trace file and the device path of record:// */
+#define SE3_TRACE_SEP ('@')
+#define SE3_TRACE_IOBUF (1024*1024)
+
+typedef struct se3t_record_ {
+    const se3_transport* transport;   ///< transport of the recorded device
+    void* handle;
+    FILE* fp;
+    uint64_t last;   ///< se3c_clock_us() at the end of the previous operation
+} se3t_record;
+
+typedef struct se3t_replay_ {
+    uint8_t* trace;   ///< whole trace file, read at open
+    size_t len;
+    size_t pos;   ///< next record
+    double scale;
+} se3t_replay;
+
+static uint64_t se3t_trace_hash(const uint8_t* buf, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ buf[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static FILE* se3t_trace_fopen(const se3_char* path, bool write)
+{
+#ifdef _WIN32
+    return _wfopen(path, (write) ? (L"wbx") : (L"rb"));
+#else
+    FILE* fp;
+    int fd;
+    if (!write) {
+        return fopen(path, "rb");
+    }
+    // the trace holds keys: never follow a planted link or reuse a file
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return NULL;
+    }
+    if ((fp = fdopen(fd, "wb")) == NULL) {
+        close(fd);
+    }
+    return fp;
+#endif
+}
+
+
+/* record://<trace file>@<device path> */
+
+static bool se3t_record_log(se3t_record* r, uint8_t op, bool ok, uint8_t* buf, size_t block, size_t nblocks, uint64_t start)
+{
+    uint8_t rec[SE3_TRACE_REC_SIZE];
+    uint64_t end = se3c_clock_us();
+    uint64_t hash = se3t_trace_hash(buf, nblocks * SE3_COMM_BLOCK);
+    uint32_t u32tmp;
+    uint16_t u16tmp = (uint16_t)nblocks;
+
+    memset(rec, 0, SE3_TRACE_REC_SIZE);
+    rec[SE3_TRACE_REC_OFFSET_OP] = op;
+    rec[SE3_TRACE_REC_OFFSET_OK] = (ok) ? (1) : (0);
+    SE3_SET16(rec, SE3_TRACE_REC_OFFSET_NBLOCKS, u16tmp);
+    u32tmp = (uint32_t)block;
+    SE3_SET32(rec, SE3_TRACE_REC_OFFSET_BLOCK, u32tmp);
+    u32tmp = (uint32_t)(start - r->last);
+    SE3_SET32(rec, SE3_TRACE_REC_OFFSET_GAP, u32tmp);
+    u32tmp = (uint32_t)(end - start);
+    SE3_SET32(rec, SE3_TRACE_REC_OFFSET_DURATION, u32tmp);
+    u32tmp = (uint32_t)hash;
+    SE3_SET32(rec, SE3_TRACE_REC_OFFSET_HASH, u32tmp);
+    u32tmp = (uint32_t)(hash >> 32);
+    SE3_SET32(rec, SE3_TRACE_REC_OFFSET_HASH + 4, u32tmp);
+    if (fwrite(rec, 1, SE3_TRACE_REC_SIZE, r->fp) != SE3_TRACE_REC_SIZE) {
+        return false;
+    }
+    if (op == SE3_TRACE_OP_READ && ok && fwrite(buf, SE3_COMM_BLOCK, nblocks, r->fp) != nblocks) {
+        return false;
+    }
+    // the time spent logging is not counted as host time
+    r->last = se3c_clock_us();
+    return true;
+}
+
+static bool se3t_record_open(const se3_char* path, uint64_t deadline, void** handle, se3_discover_info* disco)
+{
+    se3_char trace[SE3_MAX_PATH];
+    const se3_char* dev_path = NULL;
+    uint8_t hdr[SE3_TRACE_HDR_SIZE];
+    se3t_record* r;
+    size_t n;
+    uint32_t u32tmp = SE3_TRACE_VERSION;
+
+    for (n = 0; path[n] != 0 && path[n] != (se3_char)SE3_TRACE_SEP; n++);
+    if (n == 0 || n >= SE3_MAX_PATH || path[n] == 0) {
+        return false;
+    }
+    memcpy(trace, path, n * sizeof(se3_char));
+    trace[n] = 0;
+    if ((r = (se3t_record*)calloc(1, sizeof(se3t_record))) == NULL) {
+        return false;
+    }
+    r->transport = se3_transport_find(path + n + 1, &dev_path);
+    if (r->transport == NULL || !r->transport->open(dev_path, deadline, &(r->handle), disco)) {
+        free(r);
+        return false;
+    }
+    if ((r->fp = se3t_trace_fopen(trace, true)) == NULL) {
+        r->transport->close(r->handle);
+        free(r);
+        return false;
+    }
+    setvbuf(r->fp, NULL, _IOFBF, SE3_TRACE_IOBUF);
+
+    memset(hdr, 0, SE3_TRACE_HDR_SIZE);
+    memcpy(hdr, SE3_TRACE_MAGIC, strlen(SE3_TRACE_MAGIC));
+    SE3_SET32(hdr, SE3_TRACE_HDR_OFFSET_VERSION, u32tmp);
+    se3c_rand(SE3C_RAND_FIX_SIZE, hdr + SE3_TRACE_HDR_OFFSET_SEED);
+    se3c_rand_fix(hdr + SE3_TRACE_HDR_OFFSET_SEED);
+    memcpy(hdr + SE3_TRACE_HDR_OFFSET_SERIAL, disco->serialno, SE3_SN_SIZE);
+    memcpy(hdr + SE3_TRACE_HDR_OFFSET_HELLO, disco->hello_msg, SE3_HELLO_SIZE);
+    SE3_SET16(hdr, SE3_TRACE_HDR_OFFSET_STATUS, disco->status);
+    if (fwrite(hdr, 1, SE3_TRACE_HDR_SIZE, r->fp) != SE3_TRACE_HDR_SIZE) {
+        se3c_rand_unfix();
+        fclose(r->fp);
+        r->transport->close(r->handle);
+        free(r);
+        return false;
+    }
+    r->last = se3c_clock_us();
+    *handle = r;
+    return true;
+}
+
+static bool se3t_record_read(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    se3t_record* r = (se3t_record*)handle;
+    uint64_t start = se3c_clock_us();
+    bool ok = r->transport->read_blocks(r->handle, buf, block, nblocks, timeout);
+
+    return se3t_record_log(r, SE3_TRACE_OP_READ, ok, buf, block, nblocks, start) && ok;
+}
+
+static bool se3t_record_write(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    se3t_record* r = (se3t_record*)handle;
+    uint64_t start = se3c_clock_us();
+    bool ok = r->transport->write_blocks(r->handle, buf, block, nblocks, timeout);
+
+    return se3t_record_log(r, SE3_TRACE_OP_WRITE, ok, buf, block, nblocks, start) && ok;
+}
+
+static bool se3t_record_buffers(void* handle, uint8_t* request, uint8_t* response, size_t len)
+{
+    se3t_record* r = (se3t_record*)handle;
+
+    return r->transport->buffers == NULL || r->transport->buffers(r->handle, request, response, len);
+}
+
+static void se3t_record_close(void* handle)
+{
+    se3t_record* r = (se3t_record*)handle;
+
+    se3c_rand_unfix();
+    fclose(r->fp);
+    r->transport->close(r->handle);
+    free(r);
+}
+
+// no poll: L0 reads the responses through read_blocks, as for most devices
+const se3_transport se3_transport_record = {
+    "record", se3t_record_open, se3t_record_read, se3t_record_write, NULL, se3t_record_close, se3t_record_buffers
+};
+
+
+/* replay://<trace file> */
+
+static bool se3t_replay_open(const se3_char* path, uint64_t deadline, void** handle, se3_discover_info* disco)
+{
+    se3t_replay* r;
+    FILE* fp;
+    long len;
+    const char* env = getenv(SE3_REPLAY_SCALE_ENV);
+    uint32_t u32tmp;
+
+    // the trace is local, there is nothing to time out
+    (void)deadline;
+    if ((fp = se3t_trace_fopen(path, false)) == NULL) {
+        return false;
+    }
+    if ((r = (se3t_replay*)calloc(1, sizeof(se3t_replay))) == NULL) {
+        fclose(fp);
+        return false;
+    }
+    // the whole trace is loaded, no file access is measured with the host stack
+    if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < SE3_TRACE_HDR_SIZE || fseek(fp, 0, SEEK_SET) != 0 ||
+        (r->trace = (uint8_t*)malloc((size_t)len)) == NULL || fread(r->trace, 1, (size_t)len, fp) != (size_t)len) {
+        fclose(fp);
+        free(r->trace);
+        free(r);
+        return false;
+    }
+    fclose(fp);
+    r->len = (size_t)len;
+    SE3_GET32(r->trace, SE3_TRACE_HDR_OFFSET_VERSION, u32tmp);
+    if (memcmp(r->trace, SE3_TRACE_MAGIC, strlen(SE3_TRACE_MAGIC)) || u32tmp != SE3_TRACE_VERSION) {
+        free(r->trace);
+        free(r);
+        return false;
+    }
+    se3c_rand_fix(r->trace + SE3_TRACE_HDR_OFFSET_SEED);
+    memcpy(disco->serialno, r->trace + SE3_TRACE_HDR_OFFSET_SERIAL, SE3_SN_SIZE);
+    memcpy(disco->hello_msg, r->trace + SE3_TRACE_HDR_OFFSET_HELLO, SE3_HELLO_SIZE);
+    SE3_GET16(r->trace, SE3_TRACE_HDR_OFFSET_STATUS, disco->status);
+    r->pos = SE3_TRACE_HDR_SIZE;
+    r->scale = (env != NULL && *env != '\0') ? (strtod(env, NULL)) : (1.0);
+    if (r->scale < 0) {
+        r->scale = 0;
+    }
+    *handle = r;
+    return true;
+}
+
+/** \brief Take the next record, which must be op on the same blocks, and wait its scaled duration */
+static const uint8_t* se3t_replay_next(se3t_replay* r, uint8_t op, size_t block, size_t nblocks, bool* ok)
+{
+    const uint8_t* rec = r->trace + r->pos;
+    uint16_t rec_nblocks;
+    uint32_t rec_block, duration;
+    size_t len = SE3_TRACE_REC_SIZE;
+
+    if (r->len - r->pos < SE3_TRACE_REC_SIZE) {
+        return NULL;
+    }
+    SE3_GET16(rec, SE3_TRACE_REC_OFFSET_NBLOCKS, rec_nblocks);
+    SE3_GET32(rec, SE3_TRACE_REC_OFFSET_BLOCK, rec_block);
+    SE3_GET32(rec, SE3_TRACE_REC_OFFSET_DURATION, duration);
+    *ok = (rec[SE3_TRACE_REC_OFFSET_OK] != 0);
+    if (rec[SE3_TRACE_REC_OFFSET_OP] != op || rec_block != block || rec_nblocks != nblocks) {
+        // the run took another path than the recorded one
+        return NULL;
+    }
+    if (op == SE3_TRACE_OP_READ && *ok) {
+        len += nblocks * SE3_COMM_BLOCK;
+    }
+    if (r->len - r->pos < len) {
+        return NULL;
+    }
+    r->pos += len;
+    if (r->scale > 0 && duration > 0) {
+        se3c_usleep((uint32_t)(duration * r->scale));
+    }
+    return rec;
+}
+
+static bool se3t_replay_read(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    bool ok = false;
+    const uint8_t* rec = se3t_replay_next((se3t_replay*)handle, SE3_TRACE_OP_READ, block, nblocks, &ok);
+
+    (void)timeout;
+    if (rec == NULL || !ok) {
+        return false;
+    }
+    memcpy(buf, rec + SE3_TRACE_REC_SIZE, nblocks * SE3_COMM_BLOCK);
+    return true;
+}
+
+static bool se3t_replay_write(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    bool ok = false;
+
+    (void)buf; (void)timeout;
+    // the request is not compared: a changed host stack may frame it differently
+    return se3t_replay_next((se3t_replay*)handle, SE3_TRACE_OP_WRITE, block, nblocks, &ok) != NULL && ok;
+}
+
+static void se3t_replay_close(void* handle)
+{
+    se3t_replay* r = (se3t_replay*)handle;
+
+    se3c_rand_unfix();
+    free(r->trace);
+    free(r);
+}
+
+const se3_transport se3_transport_replay = {
+    "replay", se3t_replay_open, se3t_replay_read, se3t_replay_write, NULL, se3t_replay_close, NULL
+};
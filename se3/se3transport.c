@@ -0,0 +1,556 @@
+#define _GNU_SOURCE
+#include "se3transport.h"
+#include "se3_common.h"
+#include "crc16.h"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#ifdef CUBESIM
+#include "se3sim.h"
+#endif
+
+/** \brief Parse a discovery block, as stored at the end of the magic file */
+static bool se3t_read_info(const uint8_t* buf, se3_discover_info* info)
+{
+    uint8_t magic_inv[SE3_MAGIC_SIZE];
+
+    // magic is stored with its halves swapped
+    memcpy(magic_inv + SE3_MAGIC_SIZE/2, buf, SE3_MAGIC_SIZE/2);
+    memcpy(magic_inv, buf + SE3_MAGIC_SIZE/2, SE3_MAGIC_SIZE/2);
+    if (memcmp(magic_inv, se3_magic, SE3_MAGIC_SIZE)) {
+        return false;
+    }
+    memcpy(info->serialno, buf + SE3_DISCO_OFFSET_SERIAL, SE3_SN_SIZE);
+    memcpy(info->hello_msg, buf + SE3_DISCO_OFFSET_HELLO, SE3_HELLO_SIZE);
+    SE3_GET16(buf, SE3_DISCO_OFFSET_STATUS, info->status);
+    return true;
+}
+
+
+/* file:// - the .se3magic file of a SEcube drive, see se3comm.h */
+
+static bool se3t_file_open(const se3_char* path, uint64_t deadline, void** handle, se3_discover_info* disco)
+{
+    se3_file* f = (se3_file*)malloc(sizeof(se3_file));
+    if (f == NULL) {
+        return false;
+    }
+    if (!se3c_open((se3_char*)path, deadline, f, disco)) {
+        free(f);
+        return false;
+    }
+    *handle = f;
+    return true;
+}
+
+static bool se3t_file_read(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    return se3c_read(buf, *(se3_file*)handle, block, nblocks, timeout);
+}
+
+static bool se3t_file_write(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    return se3c_write(buf, *(se3_file*)handle, block, nblocks, timeout);
+}
+
+static void se3t_file_close(void* handle)
+{
+    se3c_close(*(se3_file*)handle);
+    free(handle);
+}
+
+static const se3_transport se3_transport_file = {
+    "file", se3t_file_open, se3t_file_read, se3t_file_write, NULL, se3t_file_close, NULL
+};
+
+
+/* unix:// - blocks exchanged with a server on a Unix domain socket */
+
+#if defined(__linux__) || defined(__APPLE__)
+#ifdef MSG_NOSIGNAL
+#define SE3T_SEND_FLAGS (MSG_NOSIGNAL)
+#else
+#define SE3T_SEND_FLAGS (0)
+#endif
+
+static bool se3t_unix_xfer(int fd, uint8_t* buf, size_t len, bool out, uint64_t deadline)
+{
+    struct pollfd p;
+    ssize_t r;
+
+    while (len > 0) {
+        p.fd = fd;
+        p.events = (out) ? (POLLOUT) : (POLLIN);
+        p.revents = 0;
+        r = poll(&p, 1, (int)se3c_remaining(deadline));
+        if (r == 0) {
+            return false;
+        }
+        if (r > 0) {
+            r = (out) ? (send(fd, buf, len, SE3T_SEND_FLAGS)) : (recv(fd, buf, len, 0));
+            if (r == 0) {
+                return false;
+            }
+        }
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += r;
+        len -= (size_t)r;
+    }
+    return true;
+}
+
+static bool se3t_unix_cmd(int fd, uint8_t op, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    uint8_t hdr[SE3_UNIX_HDR_SIZE];
+    uint32_t u32tmp;
+    uint64_t deadline = se3c_deadline(timeout);
+
+    memset(hdr, 0, SE3_UNIX_HDR_SIZE);
+    hdr[0] = op;
+    u32tmp = (uint32_t)block;
+    SE3_SET32(hdr, 4, u32tmp);
+    u32tmp = (uint32_t)nblocks;
+    SE3_SET32(hdr, 8, u32tmp);
+    if (!se3t_unix_xfer(fd, hdr, SE3_UNIX_HDR_SIZE, true, deadline)) {
+        return false;
+    }
+    if (op == SE3_UNIX_OP_WRITE && !se3t_unix_xfer(fd, buf, nblocks*SE3_COMM_BLOCK, true, deadline)) {
+        return false;
+    }
+    if (!se3t_unix_xfer(fd, hdr, 1, false, deadline) || hdr[0] != 0) {
+        return false;
+    }
+    if (op != SE3_UNIX_OP_WRITE && !se3t_unix_xfer(fd, buf, nblocks*SE3_COMM_BLOCK, false, deadline)) {
+        return false;
+    }
+    return true;
+}
+
+/** \brief True if the peer of a connected socket runs as the current user */
+static bool se3t_peer_ok(int fd)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+/** \brief Connect to a Unix domain socket served by the current user, -1 on failure */
+static int se3t_unix_connect(const se3_char* path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+#ifdef SO_NOSIGPIPE
+    {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // nothing is sent to a server run by another user, it could be impersonating the device
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || !se3t_peer_ok(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool se3t_unix_open(const se3_char* path, uint64_t deadline, void** handle, se3_discover_info* disco)
+{
+    uint8_t buf[SE3_COMM_BLOCK];
+    int* fd;
+
+    fd = (int*)malloc(sizeof(int));
+    if (fd == NULL) {
+        return false;
+    }
+    *fd = se3t_unix_connect(path);
+    if (*fd < 0) {
+        free(fd);
+        return false;
+    }
+    if (!se3t_unix_cmd(*fd, SE3_UNIX_OP_INFO, buf, 0, 1, se3c_remaining(deadline)) ||
+        !se3t_read_info(buf, disco)) {
+        close(*fd);
+        free(fd);
+        return false;
+    }
+    *handle = fd;
+    return true;
+}
+
+static bool se3t_unix_read(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    return se3t_unix_cmd(*(int*)handle, SE3_UNIX_OP_READ, buf, block, nblocks, timeout);
+}
+
+static bool se3t_unix_write(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    return se3t_unix_cmd(*(int*)handle, SE3_UNIX_OP_WRITE, buf, block, nblocks, timeout);
+}
+
+static void se3t_unix_close(void* handle)
+{
+    close(*(int*)handle);
+    free(handle);
+}
+
+
+/* broker:// - whole L0 commands exchanged with se3brokerd, see se3broker.h */
+
+/** \brief Magic file of a brokered device, emulated in memory */
+typedef struct se3t_broker_ {
+    int fd;
+    uint8_t request[SE3_COMM_N * SE3_COMM_BLOCK];
+    uint8_t response[SE3_COMM_N * SE3_COMM_BLOCK];
+    uint8_t payload[SE3_COMM_N * SE3_COMM_BLOCK];
+} se3t_broker;
+
+/** \brief Send the request in b->request to the broker and frame its answer in b->response */
+static bool se3t_broker_exec(se3t_broker* b, uint32_t timeout)
+{
+    uint8_t hdr[SE3_BROKER_HDR_SIZE];
+    uint16_t cmd = 0, cmd_flags = 0, len_data_and_headers = 0, len = 0, n = 0, u16tmp = 0;
+    uint16_t resp_status = 0, resp_len = 0;
+    uint32_t cmd_token = 0, u32tmp = 0;
+    size_t offset = 0, i = 0, nblocks = 0;
+    uint64_t deadline = se3c_deadline(timeout);
+#if SE3_CONF_CRC
+    uint16_t crc;
+#endif
+
+    SE3_GET16(b->request, SE3_REQ_OFFSET_CMD, cmd);
+    SE3_GET16(b->request, SE3_REQ_OFFSET_CMDFLAGS, cmd_flags);
+    SE3_GET16(b->request, SE3_REQ_OFFSET_LEN, len_data_and_headers);
+    SE3_GET32(b->request, SE3_REQ_OFFSET_CMDTOKEN, cmd_token);
+    len = se3_req_len_data(len_data_and_headers);
+    nblocks = se3_nblocks(len_data_and_headers);
+    if (nblocks > SE3_COMM_N || len > SE3_REQ_MAX_DATA) {
+        return false;
+    }
+
+    /* unframe the payload, as the device would */
+    n = (len < SE3_REQ_SIZE_DATA) ? len : SE3_REQ_SIZE_DATA;
+    memcpy(b->payload, b->request + SE3_REQ_OFFSET_DATA, n);
+    offset = n;
+    for (i = 1; i < nblocks && offset < len; i++) {
+        SE3_GET32(b->request + i*SE3_COMM_BLOCK, SE3_REQDATA_OFFSET_CMDTOKEN, u32tmp);
+        if (u32tmp != cmd_token + i) {
+            return false;
+        }
+        n = ((len - offset) < SE3_REQDATA_SIZE_DATA) ? (uint16_t)(len - offset) : SE3_REQDATA_SIZE_DATA;
+        memcpy(b->payload + offset, b->request + i*SE3_COMM_BLOCK + SE3_REQDATA_OFFSET_DATA, n);
+        offset += n;
+    }
+
+    memset(hdr, 0, SE3_BROKER_HDR_SIZE);
+    hdr[0] = SE3_BROKER_OP_CMD;
+    SE3_SET16(hdr, 2, cmd);
+    SE3_SET16(hdr, 4, cmd_flags);
+    SE3_SET16(hdr, 6, len);
+    if (!se3t_unix_xfer(b->fd, hdr, SE3_BROKER_HDR_SIZE, true, deadline) ||
+        !se3t_unix_xfer(b->fd, b->payload, len, true, deadline) ||
+        !se3t_unix_xfer(b->fd, hdr, SE3_BROKER_HDR_SIZE, false, deadline) || hdr[0] != 0) {
+        return false;
+    }
+    SE3_GET16(hdr, 2, resp_status);
+    SE3_GET16(hdr, 6, resp_len);
+    if (resp_len > SE3_RESP_MAX_DATA || !se3t_unix_xfer(b->fd, b->payload, resp_len, false, deadline)) {
+        return false;
+    }
+
+    /* frame the response, ready at the first poll */
+    memset(b->response, 0, SE3_COMM_BLOCK);
+    u16tmp = se3_resp_len_data_and_headers(resp_len);
+    SE3_SET16(b->response, SE3_RESP_OFFSET_STATUS, resp_status);
+    SE3_SET16(b->response, SE3_RESP_OFFSET_LEN, u16tmp);
+    SE3_SET32(b->response, SE3_RESP_OFFSET_CMDTOKEN, cmd_token);
+    n = (resp_len < SE3_RESP_SIZE_DATA) ? resp_len : SE3_RESP_SIZE_DATA;
+    memcpy(b->response + SE3_RESP_SIZE_HEADER, b->payload, n);
+    offset = n;
+    for (i = 1; offset < resp_len; i++) {
+        u32tmp = cmd_token + (uint32_t)i;
+        SE3_SET32(b->response + i*SE3_COMM_BLOCK, SE3_RESPDATA_OFFSET_CMDTOKEN, u32tmp);
+        n = ((resp_len - offset) < SE3_RESPDATA_SIZE_DATA) ? (uint16_t)(resp_len - offset) : SE3_RESPDATA_SIZE_DATA;
+        memcpy(b->response + i*SE3_COMM_BLOCK + SE3_RESPDATA_OFFSET_DATA, b->payload + offset, n);
+        offset += n;
+    }
+    u16tmp = 1;
+    SE3_SET16(b->response, SE3_RESP_OFFSET_READY, u16tmp);
+#if SE3_CONF_CRC
+    crc = se3_crc16_update(SE3_RESP_OFFSET_CRC, b->response, 0);
+    offset = 0;
+    for (i = 0; offset < resp_len; i++) {
+        n = (i == 0) ? (SE3_RESP_SIZE_DATA) : (SE3_RESPDATA_SIZE_DATA);
+        n = ((resp_len - offset) < n) ? (uint16_t)(resp_len - offset) : n;
+        crc = se3_crc16_update(n, b->response + i*SE3_COMM_BLOCK + ((i == 0) ? (SE3_RESP_SIZE_HEADER) : (SE3_RESPDATA_SIZE_HEADER)), crc);
+        offset += n;
+    }
+    SE3_SET16(b->response, SE3_RESP_OFFSET_CRC, crc);
+#endif
+    return true;
+}
+
+static bool se3t_broker_open(const se3_char* path, uint64_t deadline, void** handle, se3_discover_info* disco)
+{
+    uint8_t hdr[SE3_BROKER_HDR_SIZE];
+    uint8_t buf[SE3_COMM_BLOCK];
+    se3t_broker* b = (se3t_broker*)calloc(1, sizeof(se3t_broker));
+
+    if (b == NULL) {
+        return false;
+    }
+    b->fd = se3t_unix_connect(path);
+    if (b->fd < 0) {
+        free(b);
+        return false;
+    }
+    memset(hdr, 0, SE3_BROKER_HDR_SIZE);
+    hdr[0] = SE3_BROKER_OP_INFO;
+    if (!se3t_unix_xfer(b->fd, hdr, SE3_BROKER_HDR_SIZE, true, deadline) ||
+        !se3t_unix_xfer(b->fd, hdr, SE3_BROKER_HDR_SIZE, false, deadline) || hdr[0] != 0 ||
+        !se3t_unix_xfer(b->fd, buf, SE3_COMM_BLOCK, false, deadline) ||
+        !se3t_read_info(buf, disco)) {
+        close(b->fd);
+        free(b);
+        return false;
+    }
+    *handle = b;
+    return true;
+}
+
+static bool se3t_broker_read(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    se3t_broker* b = (se3t_broker*)handle;
+
+    // the response was received with the request, under the write timeout
+    (void)timeout;
+    if (block + nblocks > SE3_COMM_N) {
+        return false;
+    }
+    memcpy(buf, b->response + block*SE3_COMM_BLOCK, nblocks*SE3_COMM_BLOCK);
+    return true;
+}
+
+static bool se3t_broker_write(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    se3t_broker* b = (se3t_broker*)handle;
+    uint16_t len_data_and_headers = 0;
+
+    if (block + nblocks > SE3_COMM_N) {
+        return false;
+    }
+    memcpy(b->request + block*SE3_COMM_BLOCK, buf, nblocks*SE3_COMM_BLOCK);
+    if (block == 0) {
+        // new request: no response until the broker answers
+        memset(b->response, 0, SE3_COMM_BLOCK);
+    }
+    SE3_GET16(b->request, SE3_REQ_OFFSET_LEN, len_data_and_headers);
+    if (block + nblocks < se3_nblocks(len_data_and_headers)) {
+        return true;
+    }
+    return se3t_broker_exec(b, timeout);
+}
+
+static void se3t_broker_close(void* handle)
+{
+    close(((se3t_broker*)handle)->fd);
+    free(handle);
+}
+#elif _WIN32
+static bool se3t_unix_open(const se3_char* path, uint64_t deadline, void** handle, se3_discover_info* disco)
+{
+    // not supported
+    return false;
+}
+
+static bool se3t_unix_read(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    return false;
+}
+
+static bool se3t_unix_write(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    return false;
+}
+
+static void se3t_unix_close(void* handle)
+{
+}
+
+static bool se3t_broker_open(const se3_char* path, uint64_t deadline, void** handle, se3_discover_info* disco)
+{
+    // not supported
+    return false;
+}
+
+static bool se3t_broker_read(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    return false;
+}
+
+static bool se3t_broker_write(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    return false;
+}
+
+static void se3t_broker_close(void* handle)
+{
+}
+#endif
+
+static const se3_transport se3_transport_unix = {
+    "unix", se3t_unix_open, se3t_unix_read, se3t_unix_write, NULL, se3t_unix_close, NULL
+};
+
+static const se3_transport se3_transport_broker = {
+    "broker", se3t_broker_open, se3t_broker_read, se3t_broker_write, NULL, se3t_broker_close, NULL
+};
+
+
+/* sim:// - the in-process emulator of se3sim.h */
+
+#ifdef CUBESIM
+static bool se3t_sim_open(const se3_char* path, uint64_t deadline, void** handle, se3_discover_info* disco)
+{
+    uint8_t buf[SE3_COMM_BLOCK];
+    uint32_t index = 0;
+    size_t i, k;
+    se3sim_device* dev;
+
+    // the emulator answers at once, there is nothing to time out
+    (void)deadline;
+    for (i = 0; path[i] != 0; i++) {
+        if (path[i] < '0' || path[i] > '9') {
+            return false;
+        }
+        index = index * 10 + (uint32_t)(path[i] - '0');
+    }
+    if (i == 0 || index >= se3sim_count() || (dev = se3sim_get(index)) == NULL) {
+        return false;
+    }
+    for (k = 0; k < SE3_COMM_BLOCK; k += SE3_MAGIC_SIZE) {
+        memcpy(buf + k, se3_magic, SE3_MAGIC_SIZE);
+    }
+    se3sim_write(dev, buf, 0, 1);
+    // the emulator publishes the discovery block at the end of the magic file
+    se3sim_read(dev, buf, SE3_COMM_N - 1, 1);
+    if (!se3t_read_info(buf, disco)) {
+        return false;
+    }
+    *handle = dev;
+    return true;
+}
+
+static bool se3t_sim_read(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    (void)timeout;
+    se3sim_read((se3sim_device*)handle, buf, (uint32_t)block, (uint32_t)nblocks);
+    return true;
+}
+
+static bool se3t_sim_write(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    (void)timeout;
+    se3sim_write((se3sim_device*)handle, buf, (uint32_t)block, (uint32_t)nblocks);
+    return true;
+}
+
+static void se3t_sim_close(void* handle)
+{
+    // the device belongs to the emulator, which outlives the session
+    (void)handle;
+}
+
+static const se3_transport se3_transport_sim = {
+    "sim", se3t_sim_open, se3t_sim_read, se3t_sim_write, NULL, se3t_sim_close, NULL
+};
+#endif
+
+
+static const se3_transport* se3_transports[SE3_TRANSPORTS_MAX] = {
+    &se3_transport_file,
+    &se3_transport_unix,
+    &se3_transport_broker,
+#ifdef CUBESIM
+    &se3_transport_sim,
+#endif
+#if SE3_CONF_IO_URING
+    &se3_transport_uring,
+#endif
+    &se3_transport_record,
+    &se3_transport_replay,
+};
+
+bool se3_transport_register(const se3_transport* transport)
+{
+    size_t i;
+
+    if (transport == NULL || transport->scheme == NULL || transport->open == NULL ||
+        transport->read_blocks == NULL || transport->write_blocks == NULL || transport->close == NULL) {
+        return false;
+    }
+    for (i = 0; i < SE3_TRANSPORTS_MAX; i++) {
+        if (se3_transports[i] == NULL) {
+            se3_transports[i] = transport;
+            return true;
+        }
+        if (!strcmp(se3_transports[i]->scheme, transport->scheme)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+const se3_transport* se3_transport_find(const se3_char* uri, const se3_char** path)
+{
+    size_t i, k, n;
+    const char* sep = SE3_TRANSPORT_SEP;
+
+    // the scheme ends at the first "://"
+    for (n = 0; uri[n] != 0; n++) {
+        for (k = 0; sep[k] != '\0' && uri[n + k] == (se3_char)sep[k]; k++);
+        if (sep[k] == '\0') {
+            break;
+        }
+    }
+    if (uri[n] == 0) {
+        // plain drive path
+        *path = uri;
+        return &se3_transport_file;
+    }
+    for (i = 0; i < SE3_TRANSPORTS_MAX && se3_transports[i] != NULL; i++) {
+        for (k = 0; k < n && se3_transports[i]->scheme[k] != '\0' && uri[k] == (se3_char)se3_transports[i]->scheme[k]; k++);
+        if (k == n && se3_transports[i]->scheme[k] == '\0') {
+            *path = uri + n + strlen(sep);
+            return se3_transports[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,124 @@
+/**
+ *  \file se3transport.h
+ *  \brief This file contains the transports used by L0 to move blocks
+ *         to and from a SEcube device
+ *
+ *  \details A transport is selected at run time by the path given to
+ *  L0_open, read as a URI: "scheme://rest". A path without a scheme is a
+ *  drive, handled by the "file" transport (the O_DIRECT .se3magic file of
+ *  \ref se3comm.h). Built-in transports:
+ *  - file://<drive>: the SEcube mass storage device;
+ *  - unix://<socket path>: a device served on a Unix domain socket, e.g. by
+ *    the se3simd emulator daemon (POSIX only);
+ *  - broker://<socket path>: a device shared by the se3brokerd daemon with
+ *    other processes, see se3broker.h (POSIX only);
+ *  - sim://<index>: the in-process emulator, in CUBESIM builds only;
+ *  - uring://<drive>: the file transport driven by io_uring, in Linux builds
+ *    with SE3_CONF_IO_URING (CMake option SEFILE_IO_URING);
+ *  - record://<trace file>@<device path>: any other device, its traffic
+ *    saved to a trace file; replay://<trace file>: the traffic of a trace
+ *    served again without a device, see se3trace.c.
+ *  The servers of unix:// and broker:// must run as the current user, other
+ *  sockets are closed before anything is sent.
+ *  Other transports can be added with \ref se3_transport_register.
+ */
+
+#pragma once
+
+#include "se3comm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \brief Block transport operations, see \ref se3_transport_register */
+typedef struct se3_transport_ {
+    const char* scheme;     ///< URI scheme, without "://"
+    /**
+     *  \brief Open a device and read its discovery information
+     *  \param [in] path URI without the scheme, or the whole path for the file transport
+     *  \param [in] deadline se3c_clock() time after which opening fails
+     *  \param [out] handle transport handle passed to the other operations
+     *  \param [out] disco device information
+     */
+    bool (*open)(const se3_char* path, uint64_t deadline, void** handle, se3_discover_info* disco);
+    /** \brief Read nblocks SE3_COMM_BLOCK blocks starting at block, within timeout ms */
+    bool (*read_blocks)(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout);
+    /** \brief Write nblocks SE3_COMM_BLOCK blocks starting at block, within timeout ms */
+    bool (*write_blocks)(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout);
+    /** \brief Read the first response block while waiting for a response, can be NULL to use read_blocks */
+    bool (*poll)(void* handle, uint8_t* buf, uint32_t timeout);
+    /** \brief Close the handle returned by open */
+    void (*close)(void* handle);
+    /**
+     *  \brief Learn the request and response buffers L0 transfers, before the
+     *         first transfer (e.g. to register them), can be NULL
+     *  \param [in] len length of each buffer; other buffers can still be passed
+     *  \return false fails L0_open
+     */
+    bool (*buffers)(void* handle, uint8_t* request, uint8_t* response, size_t len);
+} se3_transport;
+
+#ifndef SE3_CONF_IO_URING
+#define SE3_CONF_IO_URING 0
+#endif
+
+#if SE3_CONF_IO_URING
+/** \brief io_uring transport, see se3uring.c */
+extern const se3_transport se3_transport_uring;
+#endif
+
+/** \brief Trace recording and replay transports, see se3trace.c */
+extern const se3_transport se3_transport_record;
+extern const se3_transport se3_transport_replay;
+/** Environment variable: factor applied to the recorded durations by
+ *  replay://, 0 to serve the operations without waiting (default 1) */
+#define SE3_REPLAY_SCALE_ENV "SE3_REPLAY_SCALE"
+
+/** Maximum number of transports, built-in ones included */
+#define SE3_TRANSPORTS_MAX (12)
+/** Separator between the scheme and the rest of a URI */
+#define SE3_TRANSPORT_SEP "://"
+
+/**
+ *  \brief Make a transport available to L0_open
+ *
+ *  \param [in] transport Operations, must stay valid while the program runs
+ *  \return true on success, false if the table is full or the scheme is taken
+ *
+ *  \details Not thread safe: register transports before opening devices.
+ */
+bool se3_transport_register(const se3_transport* transport);
+
+/**
+ *  \brief Find the transport of a device path
+ *
+ *  \param [in] uri Device path, see \ref se3transport.h
+ *  \param [out] path Where to store the part of uri passed to the open operation
+ *  \return The transport, NULL if the scheme is unknown
+ */
+const se3_transport* se3_transport_find(const se3_char* uri, const se3_char** path);
+
+/* unix:// frames. A request is a SE3_UNIX_HDR_SIZE header: op, three zero
+ * bytes, first block and number of blocks (32 bit little endian), followed
+ * by the blocks for SE3_UNIX_OP_WRITE. The reply is a status byte (0 on
+ * success), followed by the blocks for SE3_UNIX_OP_READ and by the discovery
+ * block for SE3_UNIX_OP_INFO. */
+#define SE3_UNIX_HDR_SIZE (12)
+#define SE3_UNIX_OP_INFO ('I')
+#define SE3_UNIX_OP_READ ('R')
+#define SE3_UNIX_OP_WRITE ('W')
+
+/* broker:// frames. A request is a SE3_BROKER_HDR_SIZE header: op, a zero
+ * byte, L0 command, command flags and payload length (16 bit little endian),
+ * followed by the payload for SE3_BROKER_OP_CMD. The reply header is a
+ * status byte (0 on success), a zero byte, the L0 response status, two zero
+ * bytes and the response length, followed by the response payload, or by
+ * the discovery block for SE3_BROKER_OP_INFO. */
+#define SE3_BROKER_HDR_SIZE (8)
+#define SE3_BROKER_OP_INFO ('I')
+#define SE3_BROKER_OP_CMD ('C')
+
+#ifdef __cplusplus
+}
+#endif
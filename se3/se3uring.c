@@ -0,0 +1,309 @@
+/**
+ *  \file se3uring.c
+ *  \brief This file contains the uring:// transport: the .se3magic file
+ *         of a SEcube drive accessed through io_uring (Linux only)
+ *
+ *  \details The magic file is opened as by the file transport, then the fd
+ *  and the request and response buffers of L0 (see the buffers operation of
+ *  \ref se3_transport) are registered with a small ring, so no page is
+ *  pinned per call and no block is copied; other buffers are transferred
+ *  unregistered and must be aligned for O_DIRECT. Writing a request also
+ *  queues the first read of the response block, linked after the write: both
+ *  go to the kernel with one io_uring_enter, and the first poll of L0_RX is
+ *  served from that read. Every transfer is followed by a linked timeout, so
+ *  the timeout of the operation bounds it as with the other transports. The
+ *  ring is driven with raw system calls, no liburing.
+ */
+
+#include "se3transport.h"
+#include "se3_common.h"
+
+#if SE3_CONF_IO_URING
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define SE3U_ENTRIES (8)
+#define SE3U_BUF_REQUEST (0)
+#define SE3U_BUF_RESPONSE (1)
+#define SE3U_BUF_NONE (-1)
+/** user_data of the linked timeouts, the transfers use their index in the submission */
+#define SE3U_TIMEOUT_DATA (~(uint64_t)0)
+
+typedef struct se3u_ring_ {
+    se3_file f;
+    int ring_fd;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    uint8_t* bufs[2];   ///< registered buffers of L0, SE3U_BUF_REQUEST and SE3U_BUF_RESPONSE
+    size_t buf_len;   ///< length of each registered buffer, 0 if none
+    bool prefetched;   ///< block 0 of the response buffer holds the read linked to the last request
+} se3u_ring;
+
+static void se3u_free(se3u_ring* r)
+{
+    if (r->sqes != NULL && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_len);
+    if (r->ring_fd >= 0) close(r->ring_fd);
+    se3c_close(r->f);
+    free(r);
+}
+
+static bool se3u_setup(se3u_ring* r)
+{
+    struct io_uring_params p;
+    int fds[1];
+
+    memset(&p, 0, sizeof(p));
+    r->ring_fd = (int)syscall(__NR_io_uring_setup, SE3U_ENTRIES, &p);
+    if (r->ring_fd < 0) {
+        return false;
+    }
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_len = r->cq_len = (r->sq_len > r->cq_len) ? (r->sq_len) : (r->cq_len);
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    }
+    else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            return false;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        return false;
+    }
+    r->sq_tail = (unsigned*)((uint8_t*)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned*)((uint8_t*)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((uint8_t*)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned*)((uint8_t*)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned*)((uint8_t*)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned*)((uint8_t*)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((uint8_t*)r->cq_ptr + p.cq_off.cqes);
+
+    // fixed file, registered once for the life of the handle
+    fds[0] = r->f.fd;
+    if (syscall(__NR_io_uring_register, r->ring_fd, IORING_REGISTER_FILES, fds, 1) < 0) {
+        return false;
+    }
+    return true;
+}
+
+/** \brief Registered buffer holding len bytes at buf, SE3U_BUF_NONE if not registered */
+static int se3u_buf_index(se3u_ring* r, uint8_t* buf, size_t len)
+{
+    int i;
+
+    for (i = SE3U_BUF_REQUEST; i <= SE3U_BUF_RESPONSE; i++) {
+        if (r->buf_len > 0 && buf >= r->bufs[i] && buf + len <= r->bufs[i] + r->buf_len) {
+            return i;
+        }
+    }
+    return SE3U_BUF_NONE;
+}
+
+static struct io_uring_sqe* se3u_sqe(se3u_ring* r)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &(r->sqes[index]);
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/**
+ *  \brief Queue a transfer followed by its timeout
+ *  \param [in] write IORING_OP_WRITE(_FIXED) if true, else IORING_OP_READ(_FIXED)
+ *  \param [in] data user_data of the transfer, its index in the submission
+ *  \param [in] ts timeout, must stay valid until se3u_submit returns
+ *  \param [in] link link the entry after the timeout to this transfer
+ */
+static void se3u_prep(se3u_ring* r, bool write, uint8_t* buf, size_t block, size_t nblocks, uint64_t data, struct __kernel_timespec* ts, bool link)
+{
+    size_t len = nblocks * SE3_COMM_BLOCK;
+    int index = se3u_buf_index(r, buf, len);
+    struct io_uring_sqe* sqe = se3u_sqe(r);
+
+    if (index == SE3U_BUF_NONE) {
+        sqe->opcode = (write) ? (IORING_OP_WRITE) : (IORING_OP_READ);
+    }
+    else {
+        sqe->opcode = (write) ? (IORING_OP_WRITE_FIXED) : (IORING_OP_READ_FIXED);
+        sqe->buf_index = (uint16_t)index;
+    }
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->fd = 0;
+    sqe->off = (uint64_t)block * SE3_COMM_BLOCK;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->user_data = data;
+
+    sqe = se3u_sqe(r);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->flags = (link) ? (IOSQE_IO_LINK) : (0);
+    sqe->addr = (uint64_t)(uintptr_t)ts;
+    sqe->len = 1;
+    sqe->user_data = SE3U_TIMEOUT_DATA;
+}
+
+static void se3u_timespec(struct __kernel_timespec* ts, uint32_t timeout)
+{
+    ts->tv_sec = timeout / 1000;
+    ts->tv_nsec = (long long)(timeout % 1000) * 1000000;
+}
+
+/**
+ *  \brief Submit the n transfers queued by se3u_prep and wait for them
+ *  \return true if transfer i moved len[i] bytes, for every i
+ */
+static bool se3u_submit(se3u_ring* r, unsigned n, const uint32_t* len)
+{
+    unsigned head, entries = 2 * n, done = 0, moved = 0;
+    struct io_uring_cqe* cqe;
+    long ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, r->ring_fd, entries, entries, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        return false;
+    }
+    // every entry completes, a failed or timed out transfer cancels the rest of its chain
+    while (done < entries) {
+        head = *r->cq_head;
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, r->ring_fd, 0, entries - done, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+                return false;
+            }
+            continue;
+        }
+        cqe = &(r->cqes[head & *r->cq_mask]);
+        if (cqe->user_data < n && cqe->res >= 0 && (uint32_t)cqe->res == len[cqe->user_data]) {
+            moved++;
+        }
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+        done++;
+    }
+    return moved == n;
+}
+
+static bool se3u_open(const se3_char* path, uint64_t deadline, void** handle, se3_discover_info* disco)
+{
+    se3u_ring* r = (se3u_ring*)calloc(1, sizeof(se3u_ring));
+
+    if (r == NULL) {
+        return false;
+    }
+    r->ring_fd = -1;
+    if (!se3c_open((se3_char*)path, deadline, &(r->f), disco)) {
+        free(r);
+        return false;
+    }
+    if (!se3u_setup(r)) {
+        se3u_free(r);
+        return false;
+    }
+    *handle = r;
+    return true;
+}
+
+static bool se3u_buffers(void* handle, uint8_t* request, uint8_t* response, size_t len)
+{
+    se3u_ring* r = (se3u_ring*)handle;
+    struct iovec iov[2];
+
+    iov[SE3U_BUF_REQUEST].iov_base = request;
+    iov[SE3U_BUF_REQUEST].iov_len = len;
+    iov[SE3U_BUF_RESPONSE].iov_base = response;
+    iov[SE3U_BUF_RESPONSE].iov_len = len;
+    // without registration (e.g. RLIMIT_MEMLOCK) each transfer pins its pages
+    if (syscall(__NR_io_uring_register, r->ring_fd, IORING_REGISTER_BUFFERS, iov, 2) == 0) {
+        r->bufs[SE3U_BUF_REQUEST] = request;
+        r->bufs[SE3U_BUF_RESPONSE] = response;
+        r->buf_len = len;
+    }
+    return true;
+}
+
+static bool se3u_read(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    se3u_ring* r = (se3u_ring*)handle;
+    uint32_t len = (uint32_t)(nblocks * SE3_COMM_BLOCK);
+    struct __kernel_timespec ts;
+
+    r->prefetched = false;
+    se3u_timespec(&ts, timeout);
+    se3u_prep(r, false, buf, block, nblocks, 0, &ts, false);
+    return se3u_submit(r, 1, &len);
+}
+
+static bool se3u_write(void* handle, uint8_t* buf, size_t block, size_t nblocks, uint32_t timeout)
+{
+    se3u_ring* r = (se3u_ring*)handle;
+    uint32_t len[2];
+    struct __kernel_timespec ts;
+
+    len[0] = (uint32_t)(nblocks * SE3_COMM_BLOCK);
+    len[1] = SE3_COMM_BLOCK;
+    r->prefetched = false;
+    se3u_timespec(&ts, timeout);
+    if (block != 0 || r->buf_len == 0) {
+        se3u_prep(r, true, buf, block, nblocks, 0, &ts, false);
+        return se3u_submit(r, 1, len);
+    }
+    // a new request: read the response header right after it, as L0_RX would
+    se3u_prep(r, true, buf, 0, nblocks, 0, &ts, true);
+    se3u_prep(r, false, r->bufs[SE3U_BUF_RESPONSE], 0, 1, 1, &ts, false);
+    r->prefetched = se3u_submit(r, 2, len);
+    return r->prefetched;
+}
+
+static bool se3u_poll(void* handle, uint8_t* buf, uint32_t timeout)
+{
+    se3u_ring* r = (se3u_ring*)handle;
+
+    if (r->prefetched) {
+        r->prefetched = false;
+        if (buf != r->bufs[SE3U_BUF_RESPONSE]) {
+            memcpy(buf, r->bufs[SE3U_BUF_RESPONSE], SE3_COMM_BLOCK);
+        }
+        return true;
+    }
+    return se3u_read(handle, buf, 0, 1, timeout);
+}
+
+static void se3u_close(void* handle)
+{
+    se3u_free((se3u_ring*)handle);
+}
+
+const se3_transport se3_transport_uring = {
+    "uring", se3u_open, se3u_read, se3u_write, se3u_poll, se3u_close, se3u_buffers
+};
+#endif
@@ -313,10 +313,34 @@ int32_t B5_Sha256_Finit (B5_tSha256Ctx *ctx, uint8_t* rDigest)
 
 
 
+int32_t B5_Sha256_InitFrom (B5_tSha256Ctx *ctx, const uint32_t *state, uint32_t dataLen)
+{
+    if(ctx == NULL)
+        return  B5_SHA256_RES_INVALID_CONTEXT;
+
+    if((state == NULL) || (dataLen & 0x3F))
+        return B5_SHA256_RES_INVALID_ARGUMENT;
+
+    // the prefix is whole blocks: nothing is buffered
+    ctx->total[0] = dataLen;
+    ctx->total[1] = 0;
+    memcpy(ctx->state, state, sizeof(ctx->state));
+
+    return B5_SHA256_RES_OK;
+}
+
+
+
+
+
+
+
 int32_t B5_HmacSha256_Init (B5_tHmacSha256Ctx *ctx, const uint8_t *Key, int16_t keySize)
 {
     int32_t   i;
     uint8_t    digest[B5_SHA256_DIGEST_SIZE];
+    uint8_t    iPad[B5_SHA256_BLOCK_SIZE];
+    uint8_t    oPad[B5_SHA256_BLOCK_SIZE];
 
     
     if(Key == NULL) 
@@ -342,23 +366,31 @@ int32_t B5_HmacSha256_Init (B5_tHmacSha256Ctx *ctx, const uint8_t *Key, int16_t
     }
  
     
-    memset( ctx->iPad, B5_HMAC_IPAD, 64 );
-    memset( ctx->oPad, B5_HMAC_OPAD, 64 );
+    memset( iPad, B5_HMAC_IPAD, 64 );
+    memset( oPad, B5_HMAC_OPAD, 64 );
     
     
     for( i = 0; i < keySize; i++ )
     {
-        ctx->iPad[i] = (unsigned char)( ctx->iPad[i] ^ Key[i] );
-        ctx->oPad[i] = (unsigned char)( ctx->oPad[i] ^ Key[i] );
+        iPad[i] = (unsigned char)( iPad[i] ^ Key[i] );
+        oPad[i] = (unsigned char)( oPad[i] ^ Key[i] );
     }
     
     
+    // Keep the midstate after the outer pad for the second pass
+		B5_Sha256_Init(&ctx->shaCtx);
+    B5_Sha256_Update(&ctx->shaCtx, oPad, B5_SHA256_BLOCK_SIZE);
+    memcpy(ctx->oState, ctx->shaCtx.state, sizeof(ctx->oState));
+
     // Initialize context for the first pass
 		B5_Sha256_Init(&ctx->shaCtx);
     
     // Start with the inner pad
-    B5_Sha256_Update(&ctx->shaCtx, ctx->iPad, B5_SHA256_BLOCK_SIZE);    
+    B5_Sha256_Update(&ctx->shaCtx, iPad, B5_SHA256_BLOCK_SIZE);    
     
+    memset(iPad, 0, B5_SHA256_BLOCK_SIZE);
+    memset(oPad, 0, B5_SHA256_BLOCK_SIZE);
+    memset(digest, 0, B5_SHA256_DIGEST_SIZE);
     return B5_HMAC_SHA256_RES_OK;
 }
 
@@ -404,10 +436,8 @@ int32_t B5_HmacSha256_Finit (B5_tHmacSha256Ctx *ctx, uint8_t *rDigest)
     // Finish the first pass
 		B5_Sha256_Finit(&ctx->shaCtx, digest);    
     
-    // Initialize context for the second pass
-		B5_Sha256_Init(&ctx->shaCtx);
-    // Start with outer pad
-    B5_Sha256_Update(&ctx->shaCtx, ctx->oPad, B5_SHA256_BLOCK_SIZE);
+    // Initialize context for the second pass, from the outer pad midstate
+		B5_Sha256_InitFrom(&ctx->shaCtx, ctx->oState, B5_SHA256_BLOCK_SIZE);
     // Then digest the result of the first hash
     B5_Sha256_Update(&ctx->shaCtx, digest, B5_SHA256_DIGEST_SIZE);
     // Finish the second pass
@@ -419,3 +449,44 @@ int32_t B5_HmacSha256_Finit (B5_tHmacSha256Ctx *ctx, uint8_t *rDigest)
 }
 
 
+
+
+
+int32_t B5_HmacSha256_SetKey (B5_tHmacSha256Key *key, const uint8_t *Key, int16_t keySize)
+{
+    B5_tHmacSha256Ctx ctx;
+    int32_t ret;
+
+    if(key == NULL)
+        return B5_HMAC_SHA256_RES_INVALID_ARGUMENT;
+
+    if((ret = B5_HmacSha256_Init(&ctx, Key, keySize)) != B5_HMAC_SHA256_RES_OK)
+        return ret;
+
+    memcpy(key->iState, ctx.shaCtx.state, sizeof(key->iState));
+    memcpy(key->oState, ctx.oState, sizeof(key->oState));
+    memset(&ctx, 0, sizeof(B5_tHmacSha256Ctx));
+
+    return B5_HMAC_SHA256_RES_OK;
+}
+
+
+
+
+
+int32_t B5_HmacSha256_InitKey (B5_tHmacSha256Ctx *ctx, const B5_tHmacSha256Key *key)
+{
+    if(ctx == NULL)
+        return  B5_HMAC_SHA256_RES_INVALID_CONTEXT;
+
+    if(key == NULL)
+        return B5_HMAC_SHA256_RES_INVALID_ARGUMENT;
+
+    // the inner pad is already hashed
+    B5_Sha256_InitFrom(&ctx->shaCtx, key->iState, B5_SHA256_BLOCK_SIZE);
+    memcpy(ctx->oState, key->oState, sizeof(ctx->oState));
+
+    return B5_HMAC_SHA256_RES_OK;
+}
+
+
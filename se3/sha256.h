@@ -77,6 +77,15 @@ int32_t B5_Sha256_Update (B5_tSha256Ctx *ctx, const uint8_t *data, int32_t dataL
  * @return See \ref shaReturn .
  */
 int32_t B5_Sha256_Finit (B5_tSha256Ctx *ctx, uint8_t *rDigest);
+
+/**
+ * @brief Initialize the SHA256 context from a midstate, the state reached after hashing a common prefix.
+ * @param ctx Pointer to the SHA256 data structure to be initialized.
+ * @param state The eight state words of a context after the prefix.
+ * @param dataLen Length of the prefix in bytes, a multiple of \ref B5_SHA256_BLOCK_SIZE.
+ * @return See \ref shaReturn .
+ */
+int32_t B5_Sha256_InitFrom (B5_tSha256Ctx *ctx, const uint32_t *state, uint32_t dataLen);
 ///@}
 /** @} */
 
@@ -103,9 +112,15 @@ int32_t B5_Sha256_Finit (B5_tSha256Ctx *ctx, uint8_t *rDigest);
 typedef struct
 {
    B5_tSha256Ctx        shaCtx;
-   uint8_t     		iPad[64];
-   uint8_t     		oPad[64];
+   uint32_t     	oState[8];    ///< SHA256 midstate after the outer pad
 } B5_tHmacSha256Ctx;
+
+/** HMAC-SHA256 key prepared once: SHA256 midstates after the inner and outer pads */
+typedef struct
+{
+   uint32_t     	iState[8];
+   uint32_t     	oState[8];
+} B5_tHmacSha256Key;
 ///@}
 /** @} */
 
@@ -142,6 +157,23 @@ int32_t B5_HmacSha256_Update (B5_tHmacSha256Ctx *ctx, const uint8_t *data, int32
  * @return See \ref hmacshaReturn .
  */
 int32_t B5_HmacSha256_Finit (B5_tHmacSha256Ctx *ctx, uint8_t *rDigest);
+
+/**
+ * @brief Prepare a key for \ref B5_HmacSha256_InitKey, hashing its pads once.
+ * @param key Pointer to the prepared key.
+ * @param Key Pointer to the Key that must be used.
+ * @param keySize Key size.
+ * @return See \ref hmacshaReturn .
+ */
+int32_t B5_HmacSha256_SetKey (B5_tHmacSha256Key *key, const uint8_t *Key, int16_t keySize);
+
+/**
+ * @brief Initialize the HMAC-SHA256 context with a prepared key: no block is hashed.
+ * @param ctx Pointer to the HMAC-SHA256 data structure to be initialized.
+ * @param key Pointer to a key prepared by \ref B5_HmacSha256_SetKey .
+ * @return See \ref hmacshaReturn .
+ */
+int32_t B5_HmacSha256_InitKey (B5_tHmacSha256Ctx *ctx, const B5_tHmacSha256Key *key);
 ///@}
 /** @} */
 
@@ -0,0 +1,156 @@
+/**
+ *  \file se3aesbench.c
+ *  \brief Measure B5_Aes256_Update in every mode with the portable code and
+ *         with each AES instruction set of the CPU (see aes256_ni.h)
+ *
+ *  Usage: se3aesbench [buffer size in bytes]
+ *  Reports TSC cycles per byte with a 256-bit key; build with optimizations
+ *  (-DCMAKE_BUILD_TYPE=Release). The output of the accelerated kernels is
+ *  checked against the portable code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "aes256_ni.h"
+
+#ifdef B5_AES_NI
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define BENCH_UNIT "cycles/byte"
+#else
+#define BENCH_UNIT "ns/byte"
+#endif
+
+/** Bytes processed per measure, per mode and instruction set */
+#define BENCH_BYTES (64 * 1024 * 1024)
+/** Measures per mode and instruction set, the best one is reported */
+#define BENCH_RUNS (5)
+
+static const struct {
+    uint8_t mode;
+    const char* name;
+} modes[] = {
+    { B5_AES256_ECB_ENC, "ECB enc" },
+    { B5_AES256_ECB_DEC, "ECB dec" },
+    { B5_AES256_CBC_ENC, "CBC enc" },
+    { B5_AES256_CBC_DEC, "CBC dec" },
+    { B5_AES256_CFB_ENC, "CFB enc" },
+    { B5_AES256_CFB_DEC, "CFB dec" },
+    { B5_AES256_OFB, "OFB" },
+    { B5_AES256_CTR, "CTR" }
+};
+
+static const char* levels[] = { "portable", "AES-NI", "VAES" };
+
+static uint64_t bench_clock(void)
+{
+#ifdef B5_AES_NI
+    return (uint64_t)__rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/** \brief Run one mode with one instruction set, the output of the first pass is left in out */
+static double bench_mode(uint8_t mode, int32_t level, const uint8_t* key, uint8_t* in, uint8_t* out, int16_t nblk)
+{
+    B5_tAesCtx ctx;
+    uint8_t iv[B5_AES_IV_SIZE];
+    uint64_t t, best = 0;
+    size_t i, n = BENCH_BYTES / ((size_t)nblk * B5_AES_BLK_SIZE) / BENCH_RUNS;
+    int run;
+    int dec = (mode == B5_AES256_ECB_DEC || mode == B5_AES256_CBC_DEC || mode == B5_AES256_CFB_DEC);
+
+    memset(iv, 0xa5, B5_AES_IV_SIZE);
+    B5_Aes256_Init(&ctx, key, B5_AES_256, mode);
+    ctx.ni = (uint8_t)level;
+    if (mode != B5_AES256_ECB_ENC && mode != B5_AES256_ECB_DEC) {
+        B5_Aes256_SetIV(&ctx, iv);
+    }
+    if (n == 0) {
+        n = 1;
+    }
+    for (run = 0; run < BENCH_RUNS; run++) {
+        t = bench_clock();
+        for (i = 0; i < n; i++) {
+            if (dec) {
+                B5_Aes256_Update(&ctx, (run == 0 && i == 0) ? (in) : (out), out, nblk);
+            }
+            else {
+                B5_Aes256_Update(&ctx, out, (run == 0 && i == 0) ? (in) : (out), nblk);
+            }
+            if (run == 0 && i == 0) {
+                // the checked output is the first pass, from in
+                memcpy(in + (size_t)nblk * B5_AES_BLK_SIZE, out, (size_t)nblk * B5_AES_BLK_SIZE);
+            }
+        }
+        t = bench_clock() - t;
+        if (run == 0 || t < best) {
+            best = t;
+        }
+    }
+    memcpy(out, in + (size_t)nblk * B5_AES_BLK_SIZE, (size_t)nblk * B5_AES_BLK_SIZE);
+    return (double)best / ((double)n * nblk * B5_AES_BLK_SIZE);
+}
+
+int main(int argc, char* argv[])
+{
+    uint8_t key[B5_AES_256];
+    uint8_t *in, *ref, *out;
+    size_t size = 8192, i, m;
+    int32_t level, max_level = 0;
+    int ret = 0;
+
+    if (argc > 1) {
+        size = (size_t)strtoul(argv[1], NULL, 10);
+    }
+    if (size < B5_AES_BLK_SIZE || size % B5_AES_BLK_SIZE != 0 || size / B5_AES_BLK_SIZE > 32767) {
+        fprintf(stderr, "Usage: %s [buffer size in bytes, a multiple of 16 up to 524272]\n", argv[0]);
+        return 1;
+    }
+#ifdef B5_AES_NI
+    max_level = B5_AesNi_Available();
+#endif
+    in = (uint8_t*)malloc(2 * size);
+    ref = (uint8_t*)malloc(size);
+    out = (uint8_t*)malloc(size);
+    if (in == NULL || ref == NULL || out == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return 1;
+    }
+    srand((unsigned)time(NULL));
+    for (i = 0; i < B5_AES_256; i++) {
+        key[i] = (uint8_t)rand();
+    }
+    for (i = 0; i < size; i++) {
+        in[i] = (uint8_t)rand();
+    }
+
+    printf("%s, %u byte buffers\n%-8s", BENCH_UNIT, (unsigned)size, "");
+    for (level = 0; level <= max_level; level++) {
+        printf("%10s", levels[level]);
+    }
+    printf("\n");
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        printf("%-8s", modes[m].name);
+        for (level = 0; level <= max_level; level++) {
+            printf("%10.2f", bench_mode(modes[m].mode, level, key, in, (level == 0) ? (ref) : (out), (int16_t)(size / B5_AES_BLK_SIZE)));
+            if (level > 0 && memcmp(ref, out, size)) {
+                printf(" (wrong output)");
+                ret = 1;
+            }
+        }
+        printf("\n");
+    }
+    free(in);
+    free(ref);
+    free(out);
+    return ret;
+}
@@ -0,0 +1,31 @@
+/**
+ *  \file se3agent.c
+ *  \brief Keep the SEcube logins of a user, so SEfile-cli resumes them
+ *         instead of logging in at every run (see se3agent.h)
+ *
+ *  Usage: se3agent <socket path> [time to live in seconds]
+ *  then run SEfile-cli with SE3_AGENT=<socket path>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "se3agent.h"
+
+int main(int argc, char* argv[])
+{
+    uint32_t ttl = SE3_AGENT_TTL;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <socket path> [time to live in seconds]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) {
+        ttl = (uint32_t)strtoul(argv[2], NULL, 10);
+    }
+    if (se3_agent_serve(argv[1], ttl) < 0) {
+        fprintf(stderr, "ERROR: cannot serve on %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
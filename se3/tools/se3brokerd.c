@@ -0,0 +1,49 @@
+/**
+ *  \file se3brokerd.c
+ *  \brief Share a SEcube among many processes: the broker opens the device,
+ *         logs in and serves it on a Unix domain socket, reached by the
+ *         clients as broker://<socket path> (see se3broker.h)
+ *
+ *  Usage: SE3BROKER_PIN=<user pin> se3brokerd <device path> <socket path>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "se3broker.h"
+
+int main(int argc, char* argv[])
+{
+    se3_device_info info;
+    se3_device dev;
+    se3_session s;
+    uint8_t pin[SE3_L1_PIN_SIZE];
+    const char* env = getenv("SE3BROKER_PIN");
+    uint16_t ret;
+
+    if (argc < 3 || env == NULL) {
+        fprintf(stderr, "Usage: SE3BROKER_PIN=<user pin> %s <device path> <socket path>\n", argv[0]);
+        return 1;
+    }
+    memset(pin, 0, SE3_L1_PIN_SIZE);
+    memcpy(pin, env, (strlen(env) < SE3_L1_PIN_SIZE) ? (strlen(env)) : (SE3_L1_PIN_SIZE));
+    memset(&info, 0, sizeof(se3_device_info));
+    se3c_pathcopy(info.path, argv[1]);
+    if ((ret = L0_open(&dev, &info, SE3_TIMEOUT)) != SE3_OK) {
+        fprintf(stderr, "ERROR: L0_open() - error code: 0x%X\n", ret);
+        return 1;
+    }
+    if ((ret = L1_login(&s, &dev, pin, SE3_ACCESS_USER)) != SE3_OK ||
+        (ret = L1_crypto_set_time(&s, (uint32_t)time(0))) != SE3_OK) {
+        fprintf(stderr, "ERROR: L1_login() - error code: 0x%X\n", ret);
+        L0_close(&dev);
+        return 1;
+    }
+    if (se3_broker_serve(&s, pin, argv[2]) < 0) {
+        fprintf(stderr, "ERROR: cannot serve on %s\n", argv[2]);
+    }
+    L1_logout(&s);
+    L0_close(&dev);
+    return 1;
+}
@@ -0,0 +1,42 @@
+/**
+ *  \file se3_proto.h
+ *  \brief This file contains the block-level entry points of the
+ *         SEcube device protocol, as called by the CUBESIM build of L0.c
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Block address of the first block of the magic file */
+#define SE3SIM_PROTO_BASE (101)
+
+/**
+ *  \brief Receive blocks written by the host
+ *
+ *  \param [in] lun Logical unit (ignored)
+ *  \param [in] buf Data written by the host
+ *  \param [in] blk_addr Block address
+ *  \param [in] blk_len Number of blocks
+ *  \return 0 on success
+ */
+int32_t se3_proto_recv(uint8_t lun, const uint8_t* buf, uint32_t blk_addr, uint16_t blk_len);
+
+/**
+ *  \brief Send blocks read by the host
+ *
+ *  \param [in] lun Logical unit (ignored)
+ *  \param [out] buf Data read by the host
+ *  \param [in] blk_addr Block address
+ *  \param [in] blk_len Number of blocks
+ *  \return 0 on success
+ */
+int32_t se3_proto_send(uint8_t lun, uint8_t* buf, uint32_t blk_addr, uint16_t blk_len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,219 @@
+/**
+ *  \file se3sim.c
+ *  \brief This file contains the L0 side of the SEcube emulator:
+ *         instance management, request/response framing and the
+ *         se3_proto hooks used by the CUBESIM build of L0.c
+ */
+
+#include "se3sim_internal.h"
+#include "se3_proto.h"
+
+static se3sim_device* se3sim_devices[SE3SIM_DEVICES_MAX];
+
+static void se3sim_init(se3sim_device* dev, uint32_t index)
+{
+    char serialno[SE3_SERIAL_SIZE + 1];   // the serial number is not NUL terminated
+    memset(dev, 0, sizeof(se3sim_device));
+    dev->index = index;
+    snprintf(serialno, sizeof(serialno), "SE3SIM%026u", (unsigned)index);
+    memcpy(dev->serialno, serialno, SE3_SERIAL_SIZE);
+    memcpy(dev->hello, "SEcube host emulator", 20);
+    se3sim_L1_config(dev);
+}
+
+se3sim_device* se3sim_get(uint32_t index)
+{
+    if (index >= SE3SIM_DEVICES_MAX) {
+        return NULL;
+    }
+    if (se3sim_devices[index] == NULL) {
+        se3sim_devices[index] = (se3sim_device*)malloc(sizeof(se3sim_device));
+        if (se3sim_devices[index] == NULL) {
+            return NULL;
+        }
+        se3sim_init(se3sim_devices[index], index);
+    }
+    return se3sim_devices[index];
+}
+
+uint32_t se3sim_count(void)
+{
+    const char* s = getenv("SE3SIM_DEVICES");
+    long n = (s != NULL) ? strtol(s, NULL, 10) : 1;
+    if (n < 1) {
+        return 1;
+    }
+    return (n > SE3SIM_DEVICES_MAX) ? (SE3SIM_DEVICES_MAX) : ((uint32_t)n);
+}
+
+void se3sim_serialno(se3sim_device* dev, uint8_t* serialno)
+{
+    memcpy(serialno, dev->serialno, SE3_SERIAL_SIZE);
+}
+
+void se3sim_reset(se3sim_device* dev)
+{
+    dev->logged_in = false;
+    dev->challenge_pending = false;
+    se3sim_crypto_reset(dev);
+    memset(dev->resp, 0, SE3_COMM_BLOCK);
+}
+
+static bool se3sim_is_magic(const uint8_t* block)
+{
+    return (0 == memcmp(block, se3_magic, SE3_MAGIC_SIZE));
+}
+
+static void se3sim_make_disco(se3sim_device* dev)
+{
+    uint16_t status = 0;
+    memset(dev->disco, 0, SE3_COMM_BLOCK);
+    // magic is stored with its halves swapped
+    memcpy(dev->disco, se3_magic + SE3_MAGIC_SIZE / 2, SE3_MAGIC_SIZE / 2);
+    memcpy(dev->disco + SE3_MAGIC_SIZE / 2, se3_magic, SE3_MAGIC_SIZE / 2);
+    memcpy(dev->disco + SE3_DISCO_OFFSET_SERIAL, dev->serialno, SE3_SERIAL_SIZE);
+    memcpy(dev->disco + SE3_DISCO_OFFSET_HELLO, dev->hello, SE3_HELLO_SIZE);
+    SE3_SET16(dev->disco, SE3_DISCO_OFFSET_STATUS, status);
+}
+
+static void se3sim_exec(se3sim_device* dev)
+{
+    uint8_t* data = dev->data;
+    uint16_t cmd = 0, cmd_flags = 0, len_data_and_headers = 0, len = 0;
+    uint16_t resp_len = 0, status = SE3_OK, n = 0, u16tmp = 0;
+    uint32_t cmd_token = 0, u32tmp = 0;
+    size_t offset = 0, i = 0, nblocks = 0;
+
+    SE3_GET16(dev->req, SE3_REQ_OFFSET_CMD, cmd);
+    SE3_GET16(dev->req, SE3_REQ_OFFSET_CMDFLAGS, cmd_flags);
+    SE3_GET16(dev->req, SE3_REQ_OFFSET_LEN, len_data_and_headers);
+    SE3_GET32(dev->req, SE3_REQ_OFFSET_CMDTOKEN, cmd_token);
+    len = se3_req_len_data(len_data_and_headers);
+    nblocks = se3_nblocks(len_data_and_headers);
+
+    /* gather request payload */
+    n = (len < SE3_REQ_SIZE_DATA) ? len : SE3_REQ_SIZE_DATA;
+    memcpy(data, dev->req + SE3_REQ_OFFSET_DATA, n);
+    offset = n;
+    for (i = 1; i < nblocks && offset < len; i++) {
+        SE3_GET32(dev->req + i*SE3_COMM_BLOCK, SE3_REQDATA_OFFSET_CMDTOKEN, u32tmp);
+        if (u32tmp != cmd_token + i) {
+            status = SE3_ERR_COMM;
+            break;
+        }
+        n = ((len - offset) < SE3_REQDATA_SIZE_DATA) ? (uint16_t)(len - offset) : SE3_REQDATA_SIZE_DATA;
+        memcpy(data + offset, dev->req + i*SE3_COMM_BLOCK + SE3_REQDATA_OFFSET_DATA, n);
+        offset += n;
+    }
+
+    if (status == SE3_OK) {
+        switch (cmd) {
+        case SE3_CMD0_ECHO:
+            resp_len = len;
+            break;
+        case SE3_CMD0_FACTORY_INIT:
+            if (len < SE3_SERIAL_SIZE) {
+                status = SE3_ERR_PARAMS;
+            }
+            else {
+                memcpy(dev->serialno, data, SE3_SERIAL_SIZE);
+            }
+            break;
+        case SE3_CMD0_L1:
+            status = se3sim_L1_exec(dev, cmd_flags, data, len, &resp_len);
+            break;
+        default:
+            status = SE3_ERR_CMD;
+            break;
+        }
+    }
+    if (status != SE3_OK) {
+        resp_len = 0;
+    }
+
+    /* frame response */
+    memset(dev->resp, 0, SE3_COMM_BLOCK);
+    u16tmp = se3_resp_len_data_and_headers(resp_len);
+    SE3_SET16(dev->resp, SE3_RESP_OFFSET_STATUS, status);
+    SE3_SET16(dev->resp, SE3_RESP_OFFSET_LEN, u16tmp);
+    SE3_SET32(dev->resp, SE3_RESP_OFFSET_CMDTOKEN, cmd_token);
+    n = (resp_len < SE3_RESP_SIZE_DATA) ? resp_len : SE3_RESP_SIZE_DATA;
+    memcpy(dev->resp + SE3_RESP_SIZE_HEADER, data, n);
+    offset = n;
+    for (i = 1; offset < resp_len; i++) {
+        u32tmp = cmd_token + (uint32_t)i;
+        SE3_SET32(dev->resp + i*SE3_COMM_BLOCK, SE3_RESPDATA_OFFSET_CMDTOKEN, u32tmp);
+        n = ((resp_len - offset) < SE3_RESPDATA_SIZE_DATA) ? (uint16_t)(resp_len - offset) : SE3_RESPDATA_SIZE_DATA;
+        memcpy(dev->resp + i*SE3_COMM_BLOCK + SE3_RESPDATA_OFFSET_DATA, data + offset, n);
+        offset += n;
+    }
+    u16tmp = 1;
+    SE3_SET16(dev->resp, SE3_RESP_OFFSET_READY, u16tmp);
+}
+
+void se3sim_write(se3sim_device* dev, const uint8_t* buf, uint32_t block, uint32_t nblocks)
+{
+    uint16_t len_data_and_headers = 0;
+    uint32_t i;
+
+    if (dev == NULL || block >= SE3_COMM_N) {
+        return;
+    }
+    if (block + nblocks > SE3_COMM_N) {
+        nblocks = SE3_COMM_N - block;
+    }
+    if (se3sim_is_magic(buf)) {
+        // magic file (re)initialisation, one block at a time
+        dev->magic_written = true;
+        se3sim_make_disco(dev);
+        return;
+    }
+    dev->magic_written = false;
+    for (i = 0; i < nblocks; i++) {
+        memcpy(dev->req + (block + i)*SE3_COMM_BLOCK, buf + i*SE3_COMM_BLOCK, SE3_COMM_BLOCK);
+    }
+    if (block == 0) {
+        // new request: response is not ready until it has been executed
+        memset(dev->resp, 0, SE3_COMM_BLOCK);
+    }
+    SE3_GET16(dev->req, SE3_REQ_OFFSET_LEN, len_data_and_headers);
+    if (block + nblocks >= se3_nblocks(len_data_and_headers)) {
+        se3sim_exec(dev);
+    }
+}
+
+void se3sim_read(se3sim_device* dev, uint8_t* buf, uint32_t block, uint32_t nblocks)
+{
+    uint32_t i;
+    for (i = 0; i < nblocks; i++) {
+        if (dev == NULL || block + i >= SE3_COMM_N) {
+            memset(buf + i*SE3_COMM_BLOCK, 0, SE3_COMM_BLOCK);
+        }
+        else if (dev->magic_written && block + i == SE3_COMM_N - 1) {
+            memcpy(buf + i*SE3_COMM_BLOCK, dev->disco, SE3_COMM_BLOCK);
+        }
+        else {
+            memcpy(buf + i*SE3_COMM_BLOCK, dev->resp + (block + i)*SE3_COMM_BLOCK, SE3_COMM_BLOCK);
+        }
+    }
+}
+
+/* se3_proto hooks: the magic file starts at SE3SIM_PROTO_BASE */
+
+int32_t se3_proto_recv(uint8_t lun, const uint8_t* buf, uint32_t blk_addr, uint16_t blk_len)
+{
+    if (blk_addr < SE3SIM_PROTO_BASE) {
+        return -1;
+    }
+    se3sim_write(se3sim_get(0), buf, blk_addr - SE3SIM_PROTO_BASE, blk_len);
+    return 0;
+}
+
+int32_t se3_proto_send(uint8_t lun, uint8_t* buf, uint32_t blk_addr, uint16_t blk_len)
+{
+    if (blk_addr < SE3SIM_PROTO_BASE) {
+        return -1;
+    }
+    se3sim_read(se3sim_get(0), buf, blk_addr - SE3SIM_PROTO_BASE, blk_len);
+    return 0;
+}
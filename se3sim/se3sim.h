@@ -0,0 +1,115 @@
+/**
+ *  \file se3sim.h
+ *  \brief This file contains the public interface of the host-side
+ *         SEcube emulator.
+ *
+ *  The emulator implements the device side of the L0/L1 protocol
+ *  (login challenge, key table, crypto_list, crypto_init/update) on
+ *  top of the in-tree aes256.c, sha256.c and pbkdf2.c, so that SEfile
+ *  and SEfile-cli can run without a physical token.
+ *
+ *  Each emulated token is an instance selected by index. The instance
+ *  is configured from the environment the first time it is used:
+ *  - SE3SIM_USER_PIN / SE3SIM_ADMIN_PIN: PIN strings, zero padded to
+ *    32 bytes (default: 32 zero bytes, as after a flash erase);
+ *  - SE3SIM_KEYS: comma separated list of id:hexkey entries. If it is
+ *    not set, key 1 is provisioned with a fixed 256 bit value so that
+ *    files written by one process can be read back by the next one;
+ *  - SE3SIM_DEVICES: number of tokens reported by discovery (default 1).
+ *
+ *  The CUBESIM build of L0 reaches the tokens through the sim:// transport;
+ *  se3simd serves one of them on a Unix socket for the unix:// transport.
+ */
+
+#pragma once
+
+#include "se3c1def.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of emulated tokens */
+#define SE3SIM_DEVICES_MAX (8)
+/** Environment variable: if set and not "0", se3sim_serve keeps the logins
+ *  and sessions of the token between clients */
+#define SE3SIM_KEEP_ENV "SE3SIM_KEEP"
+
+/** \brief Emulated SEcube token */
+typedef struct se3sim_device_ se3sim_device;
+
+/**
+ *  \brief Get an emulated token by index
+ *
+ *  \param [in] index Instance index, less than \ref SE3SIM_DEVICES_MAX
+ *  \return Pointer to the instance, NULL if index is out of range
+ *
+ *  \details The instance is created and configured on first use.
+ */
+se3sim_device* se3sim_get(uint32_t index);
+
+/**
+ *  \brief Number of emulated tokens reported by discovery
+ *
+ *  \return SE3SIM_DEVICES if set, clamped to [1, SE3SIM_DEVICES_MAX], else 1
+ */
+uint32_t se3sim_count(void);
+
+/**
+ *  \brief Host to device transfer
+ *
+ *  \param [in] dev Emulated token
+ *  \param [in] buf Blocks written by the host
+ *  \param [in] block Index of the first block inside the magic file
+ *  \param [in] nblocks Number of SE3_COMM_BLOCK blocks
+ *
+ *  \details A request is executed as soon as all of its blocks have
+ *           been received.
+ */
+void se3sim_write(se3sim_device* dev, const uint8_t* buf, uint32_t block, uint32_t nblocks);
+
+/**
+ *  \brief Device to host transfer
+ *
+ *  \param [in] dev Emulated token
+ *  \param [out] buf Blocks read by the host
+ *  \param [in] block Index of the first block inside the magic file
+ *  \param [in] nblocks Number of SE3_COMM_BLOCK blocks
+ */
+void se3sim_read(se3sim_device* dev, uint8_t* buf, uint32_t block, uint32_t nblocks);
+
+/**
+ *  \brief Get the serial number of an emulated token
+ *
+ *  \param [in] dev Emulated token
+ *  \param [out] serialno Buffer of SE3_SERIAL_SIZE bytes
+ */
+void se3sim_serialno(se3sim_device* dev, uint8_t* serialno);
+
+/**
+ *  \brief Power cycle an emulated token
+ *
+ *  \param [in] dev Emulated token
+ *
+ *  \details Logs out and releases every crypto session. The key table
+ *           and the PINs are kept.
+ */
+void se3sim_reset(se3sim_device* dev);
+
+/**
+ *  \brief Serve an emulated token on a Unix domain socket
+ *
+ *  \param [in] dev Emulated token
+ *  \param [in] path Socket path, an existing file is replaced
+ *  \return -1 if the socket cannot be created, otherwise it does not return
+ *
+ *  \details Implements the server side of the unix:// transport frames of
+ *           se3transport.h. Clients are served one at a time, each one by
+ *           a token reset as if plugged in again, unless SE3SIM_KEEP_ENV
+ *           is set. Not available on Windows.
+ */
+int se3sim_serve(se3sim_device* dev, const char* path);
+
+#ifdef __cplusplus
+}
+#endif
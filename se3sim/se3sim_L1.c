@@ -0,0 +1,374 @@
+/**
+ *  \file se3sim_L1.c
+ *  \brief This file contains the L1 side of the SEcube emulator:
+ *         packet protection, login, configuration records and
+ *         key table management
+ */
+
+#include "se3sim_internal.h"
+#include "se3comm.h"
+
+static void se3sim_parse_pin(const char* env, uint8_t* pin)
+{
+    const char* s = getenv(env);
+    memset(pin, 0, SE3_L1_PIN_SIZE);
+    if (s != NULL) {
+        size_t n = strlen(s);
+        memcpy(pin, s, (n < SE3_L1_PIN_SIZE) ? n : SE3_L1_PIN_SIZE);
+    }
+}
+
+static int se3sim_hexval(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static void se3sim_add_key(se3sim_device* dev, uint32_t id, const uint8_t* data, uint16_t data_size)
+{
+    size_t i;
+    for (i = 0; i < SE3SIM_KEYS_MAX; i++) {
+        if (!dev->keys[i].used) {
+            dev->keys[i].used = true;
+            dev->keys[i].id = id;
+            dev->keys[i].validity = 0xFFFFFFFF;
+            dev->keys[i].data_size = data_size;
+            memcpy(dev->keys[i].data, data, data_size);
+            dev->keys[i].name_size = (uint16_t)snprintf((char*)dev->keys[i].name, SE3_KEY_NAME_MAX, "simkey%u", (unsigned)id);
+            return;
+        }
+    }
+}
+
+void se3sim_L1_config(se3sim_device* dev)
+{
+    const char* keys = getenv("SE3SIM_KEYS");
+    uint8_t data[SE3_KEY_DATA_MAX];
+    B5_tSha256Ctx sha;
+
+    se3sim_parse_pin("SE3SIM_ADMIN_PIN", dev->pin[SE3_RECORD_TYPE_ADMINPIN]);
+    se3sim_parse_pin("SE3SIM_USER_PIN", dev->pin[SE3_RECORD_TYPE_USERPIN]);
+    se3_payload_cryptoinit(&(dev->cryptoctx), se3_magic);
+
+    if (keys == NULL || *keys == '\0') {
+        B5_Sha256_Init(&sha);
+        B5_Sha256_Update(&sha, (const uint8_t*)"se3sim default key 1", 20);
+        B5_Sha256_Finit(&sha, data);
+        se3sim_add_key(dev, 1, data, B5_AES_256);
+        return;
+    }
+    while (*keys != '\0') {
+        char* end = NULL;
+        uint32_t id = (uint32_t)strtoul(keys, &end, 10);
+        uint16_t n = 0;
+        int hi, lo;
+        if (end == NULL || *end != ':') {
+            break;
+        }
+        keys = end + 1;
+        while ((hi = se3sim_hexval(keys[0])) >= 0 && (lo = se3sim_hexval(keys[1])) >= 0 && n < SE3_KEY_DATA_MAX) {
+            data[n++] = (uint8_t)((hi << 4) | lo);
+            keys += 2;
+        }
+        se3sim_add_key(dev, id, data, n);
+        while (*keys != '\0' && *keys != ',') keys++;
+        if (*keys == ',') keys++;
+    }
+}
+
+se3sim_key* se3sim_key_find(se3sim_device* dev, uint32_t id)
+{
+    size_t i;
+    for (i = 0; i < SE3SIM_KEYS_MAX; i++) {
+        if (dev->keys[i].used && dev->keys[i].id == id) {
+            return &(dev->keys[i]);
+        }
+    }
+    return NULL;
+}
+
+static uint16_t se3sim_challenge(se3sim_device* dev, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len)
+{
+    uint8_t cc1[SE3_L1_CHALLENGE_SIZE], cc2[SE3_L1_CHALLENGE_SIZE], sc[SE3_L1_CHALLENGE_SIZE];
+    const uint8_t* pin;
+    uint16_t access;
+
+    if (req_len < SE3_CMD1_CHALLENGE_REQ_SIZE) {
+        return SE3_ERR_PARAMS;
+    }
+    memcpy(cc1, req + SE3_CMD1_CHALLENGE_REQ_OFF_CC1, SE3_L1_CHALLENGE_SIZE);
+    memcpy(cc2, req + SE3_CMD1_CHALLENGE_REQ_OFF_CC2, SE3_L1_CHALLENGE_SIZE);
+    SE3_GET16(req, SE3_CMD1_CHALLENGE_REQ_OFF_ACCESS, access);
+    if (access == SE3_ACCESS_ADMIN) {
+        pin = dev->pin[SE3_RECORD_TYPE_ADMINPIN];
+    }
+    else if (access == SE3_ACCESS_USER) {
+        pin = dev->pin[SE3_RECORD_TYPE_USERPIN];
+    }
+    else {
+        return SE3_ERR_PARAMS;
+    }
+
+    dev->logged_in = false;
+    se3sim_crypto_reset(dev);
+    se3c_rand_unfixed(SE3_L1_CHALLENGE_SIZE, sc);
+    memcpy(resp + SE3_CMD1_CHALLENGE_RESP_OFF_SC, sc, SE3_L1_CHALLENGE_SIZE);
+    PBKDF2HmacSha256(pin, SE3_L1_PIN_SIZE, cc1, SE3_L1_CHALLENGE_SIZE, SE3_L1_CHALLENGE_ITERATIONS,
+        resp + SE3_CMD1_CHALLENGE_RESP_OFF_SRESP, SE3_L1_CHALLENGE_SIZE);
+    PBKDF2HmacSha256(pin, SE3_L1_PIN_SIZE, sc, SE3_L1_CHALLENGE_SIZE, SE3_L1_CHALLENGE_ITERATIONS,
+        dev->cresp_expected, SE3_L1_CHALLENGE_SIZE);
+    dev->challenge_pending = true;
+    dev->challenge_access = access;
+    *resp_len = SE3_CMD1_CHALLENGE_RESP_SIZE;
+    return SE3_OK;
+}
+
+static uint16_t se3sim_login(se3sim_device* dev, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len)
+{
+    if (!dev->challenge_pending || req_len < SE3_CMD1_LOGIN_REQ_SIZE) {
+        return SE3_ERR_STATE;
+    }
+    dev->challenge_pending = false;
+    if (memcmp(req + SE3_CMD1_LOGIN_REQ_OFF_CRESP, dev->cresp_expected, SE3_L1_CHALLENGE_SIZE)) {
+        return SE3_ERR_PIN;
+    }
+    se3c_rand_unfixed(SE3_L1_TOKEN_SIZE, dev->token);
+    dev->logged_in = true;
+    dev->access = dev->challenge_access;
+    memcpy(resp + SE3_CMD1_LOGIN_RESP_OFF_TOKEN, dev->token, SE3_L1_TOKEN_SIZE);
+    *resp_len = SE3_CMD1_LOGIN_RESP_SIZE;
+    return SE3_OK;
+}
+
+static uint16_t se3sim_config(se3sim_device* dev, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len)
+{
+    uint16_t type, op;
+    if (req_len < SE3_CMD1_CONFIG_REQ_OFF_VALUE + SE3_RECORD_SIZE) {
+        return SE3_ERR_PARAMS;
+    }
+    SE3_GET16(req, SE3_CMD1_CONFIG_REQ_OFF_ID, type);
+    SE3_GET16(req, SE3_CMD1_CONFIG_REQ_OFF_OP, op);
+    if (type >= SE3_RECORD_MAX) {
+        return SE3_ERR_PARAMS;
+    }
+    if (op == SE3_CONFIG_OP_SET) {
+        if (dev->access != SE3_ACCESS_ADMIN) {
+            return SE3_ERR_ACCESS;
+        }
+        memcpy(dev->pin[type], req + SE3_CMD1_CONFIG_REQ_OFF_VALUE, SE3_RECORD_SIZE);
+        memset(resp, 0, SE3_RECORD_SIZE);
+    }
+    else if (op == SE3_CONFIG_OP_GET) {
+        // PIN records are write-only
+        memset(resp, 0, SE3_RECORD_SIZE);
+    }
+    else {
+        return SE3_ERR_PARAMS;
+    }
+    *resp_len = SE3_RECORD_SIZE;
+    return SE3_OK;
+}
+
+static uint16_t se3sim_key_edit(se3sim_device* dev, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len)
+{
+    uint16_t op, data_size, name_size;
+    uint32_t id, validity;
+    se3sim_key* k;
+    size_t i;
+
+    if (dev->access != SE3_ACCESS_ADMIN) {
+        return SE3_ERR_ACCESS;
+    }
+    if (req_len < SE3_CMD1_KEY_EDIT_REQ_OFF_DATA_AND_NAME) {
+        return SE3_ERR_PARAMS;
+    }
+    SE3_GET16(req, SE3_CMD1_KEY_EDIT_REQ_OFF_OP, op);
+    SE3_GET32(req, SE3_CMD1_KEY_EDIT_REQ_OFF_ID, id);
+    SE3_GET32(req, SE3_CMD1_KEY_EDIT_REQ_OFF_VALIDITY, validity);
+    SE3_GET16(req, SE3_CMD1_KEY_EDIT_REQ_OFF_DATA_LEN, data_size);
+    SE3_GET16(req, SE3_CMD1_KEY_EDIT_REQ_OFF_NAME_LEN, name_size);
+    if (data_size > SE3_KEY_DATA_MAX || name_size > SE3_KEY_NAME_MAX ||
+        SE3_CMD1_KEY_EDIT_REQ_OFF_DATA_AND_NAME + data_size + name_size > req_len) {
+        return SE3_ERR_PARAMS;
+    }
+    k = se3sim_key_find(dev, id);
+    switch (op) {
+    case SE3_KEY_OP_DELETE:
+        if (k == NULL) {
+            return SE3_ERR_RESOURCE;
+        }
+        memset(k, 0, sizeof(se3sim_key));
+        break;
+    case SE3_KEY_OP_INSERT:
+        if (k != NULL) {
+            return SE3_ERR_RESOURCE;
+        }
+        /* fall through */
+    case SE3_KEY_OP_UPSERT:
+        if (k == NULL) {
+            for (i = 0; i < SE3SIM_KEYS_MAX && k == NULL; i++) {
+                if (!dev->keys[i].used) {
+                    k = &(dev->keys[i]);
+                }
+            }
+            if (k == NULL) {
+                return SE3_ERR_MEMORY;
+            }
+        }
+        k->used = true;
+        k->id = id;
+        k->validity = validity;
+        k->data_size = data_size;
+        k->name_size = name_size;
+        memcpy(k->data, req + SE3_CMD1_KEY_EDIT_REQ_OFF_DATA_AND_NAME, data_size);
+        memcpy(k->name, req + SE3_CMD1_KEY_EDIT_REQ_OFF_DATA_AND_NAME + data_size, name_size);
+        break;
+    default:
+        return SE3_ERR_PARAMS;
+    }
+    *resp_len = 0;
+    return SE3_OK;
+}
+
+static uint16_t se3sim_key_list(se3sim_device* dev, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len)
+{
+    uint16_t skip, nmax, count = 0;
+    uint16_t offset = SE3_CMD1_KEY_LIST_RESP_OFF_KEYINFO;
+    const uint8_t* salt;
+    size_t i;
+    se3sim_key* k;
+
+    if (req_len < SE3_CMD1_KEY_LIST_REQ_SIZE) {
+        return SE3_ERR_PARAMS;
+    }
+    SE3_GET16(req, SE3_CMD1_KEY_LIST_REQ_OFF_SKIP, skip);
+    SE3_GET16(req, SE3_CMD1_KEY_LIST_REQ_OFF_NMAX, nmax);
+    salt = req + SE3_CMD1_KEY_LIST_REQ_OFF_SALT;
+
+    for (i = 0; i < SE3SIM_KEYS_MAX && count < nmax; i++) {
+        k = &(dev->keys[i]);
+        if (!k->used) {
+            continue;
+        }
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+        if (offset + SE3_CMD1_KEY_LIST_KEYINFO_OFF_NAME + k->name_size > SE3_RESP1_MAX_DATA) {
+            break;
+        }
+        SE3_SET32(resp + offset, SE3_CMD1_KEY_LIST_KEYINFO_OFF_ID, k->id);
+        SE3_SET32(resp + offset, SE3_CMD1_KEY_LIST_KEYINFO_OFF_VALIDITY, k->validity);
+        SE3_SET16(resp + offset, SE3_CMD1_KEY_LIST_KEYINFO_OFF_DATA_LEN, k->data_size);
+        SE3_SET16(resp + offset, SE3_CMD1_KEY_LIST_KEYINFO_OFF_NAME_LEN, k->name_size);
+        PBKDF2HmacSha256(k->data, k->data_size, salt, SE3_KEY_SALT_SIZE, 1,
+            resp + offset + SE3_CMD1_KEY_LIST_KEYINFO_OFF_FINGERPRINT, SE3_KEY_FINGERPRINT_SIZE);
+        memcpy(resp + offset + SE3_CMD1_KEY_LIST_KEYINFO_OFF_NAME, k->name, k->name_size);
+        offset += SE3_CMD1_KEY_LIST_KEYINFO_OFF_NAME + k->name_size;
+        count++;
+    }
+    SE3_SET16(resp, SE3_CMD1_KEY_LIST_RESP_OFF_COUNT, count);
+    *resp_len = offset;
+    return SE3_OK;
+}
+
+static uint16_t se3sim_set_time(se3sim_device* dev, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len)
+{
+    if (req_len < SE3_CMD1_CRYPTO_SET_TIME_REQ_SIZE) {
+        return SE3_ERR_PARAMS;
+    }
+    SE3_GET32(req, SE3_CMD1_CRYPTO_SET_TIME_REQ_OFF_DEVTIME, dev->devtime);
+    *resp_len = 0;
+    return SE3_OK;
+}
+
+uint16_t se3sim_L1_exec(se3sim_device* dev, uint16_t cmd_flags, uint8_t* buf, uint16_t req_len, uint16_t* resp_len)
+{
+    uint8_t* resp_data = dev->resp_data;
+    uint16_t cmd = 0, len = 0, status = SE3_OK, data_len = 0, u16tmp;
+    uint8_t* data = buf + SE3_REQ1_OFFSET_DATA;
+
+    if (req_len < SE3_REQ1_OFFSET_DATA || (req_len % SE3_L1_CRYPTOBLOCK_SIZE) != 0) {
+        return SE3_ERR_PARAMS;
+    }
+    if (!se3_payload_decrypt(&(dev->cryptoctx), buf + SE3_REQ1_OFFSET_AUTH, buf + SE3_REQ1_OFFSET_IV,
+        buf + SE3_L1_AUTH_SIZE + SE3_L1_IV_SIZE, (req_len - SE3_L1_AUTH_SIZE - SE3_L1_IV_SIZE) / SE3_L1_CRYPTOBLOCK_SIZE, cmd_flags)) {
+        return SE3_ERR_COMM;
+    }
+    SE3_GET16(buf, SE3_REQ1_OFFSET_CMD, cmd);
+    SE3_GET16(buf, SE3_REQ1_OFFSET_LEN, len);
+    if (len > req_len - SE3_REQ1_OFFSET_DATA) {
+        return SE3_ERR_PARAMS;
+    }
+
+    if (cmd != SE3_CMD1_CHALLENGE && cmd != SE3_CMD1_LOGIN) {
+        if (!dev->logged_in || memcmp(buf + SE3_REQ1_OFFSET_TOKEN, dev->token, SE3_L1_TOKEN_SIZE)) {
+            status = SE3_ERR_ACCESS;
+        }
+    }
+    if (status == SE3_OK) {
+        switch (cmd) {
+        case SE3_CMD1_CHALLENGE:
+            status = se3sim_challenge(dev, data, len, resp_data, &data_len);
+            break;
+        case SE3_CMD1_LOGIN:
+            status = se3sim_login(dev, data, len, resp_data, &data_len);
+            break;
+        case SE3_CMD1_LOGOUT:
+            dev->logged_in = false;
+            se3sim_crypto_reset(dev);
+            break;
+        case SE3_CMD1_CONFIG:
+            status = se3sim_config(dev, data, len, resp_data, &data_len);
+            break;
+        case SE3_CMD1_KEY_EDIT:
+            status = se3sim_key_edit(dev, data, len, resp_data, &data_len);
+            break;
+        case SE3_CMD1_KEY_LIST:
+            status = se3sim_key_list(dev, data, len, resp_data, &data_len);
+            break;
+        case SE3_CMD1_CRYPTO_INIT:
+            status = se3sim_crypto_init(dev, data, len, resp_data, &data_len);
+            break;
+        case SE3_CMD1_CRYPTO_UPDATE:
+            status = se3sim_crypto_update(dev, data, len, resp_data, &data_len);
+            break;
+        case SE3_CMD1_CRYPTO_LIST:
+            status = se3sim_crypto_list(dev, data, len, resp_data, &data_len);
+            break;
+        case SE3_CMD1_CRYPTO_SET_TIME:
+            status = se3sim_set_time(dev, data, len, resp_data, &data_len);
+            break;
+        default:
+            status = SE3_ERR_CMD;
+            break;
+        }
+    }
+    if (status != SE3_OK) {
+        data_len = 0;
+    }
+
+    /* build response packet */
+    memset(buf, 0, SE3_RESP1_OFFSET_DATA);
+    memcpy(buf + SE3_RESP1_OFFSET_DATA, resp_data, data_len);
+    u16tmp = data_len;
+    if (u16tmp % SE3_L1_CRYPTOBLOCK_SIZE != 0) {
+        memset(buf + SE3_RESP1_OFFSET_DATA + u16tmp, 0, SE3_L1_CRYPTOBLOCK_SIZE - (u16tmp % SE3_L1_CRYPTOBLOCK_SIZE));
+        u16tmp += SE3_L1_CRYPTOBLOCK_SIZE - (u16tmp % SE3_L1_CRYPTOBLOCK_SIZE);
+    }
+    SE3_SET16(buf, SE3_RESP1_OFFSET_LEN, data_len);
+    SE3_SET16(buf, SE3_RESP1_OFFSET_STATUS, status);
+    if (dev->logged_in) {
+        memcpy(buf + SE3_RESP1_OFFSET_TOKEN, dev->token, SE3_L1_TOKEN_SIZE);
+    }
+    if (cmd_flags & SE3_CMDFLAG_ENCRYPT) {
+        se3c_rand_unfixed(SE3_L1_IV_SIZE, buf + SE3_RESP1_OFFSET_IV);
+    }
+    *resp_len = SE3_RESP1_OFFSET_DATA + u16tmp;
+    se3_payload_encrypt(&(dev->cryptoctx), buf + SE3_RESP1_OFFSET_AUTH, buf + SE3_RESP1_OFFSET_IV,
+        buf + SE3_L1_AUTH_SIZE + SE3_L1_IV_SIZE, (*resp_len - SE3_L1_AUTH_SIZE - SE3_L1_IV_SIZE) / SE3_L1_CRYPTOBLOCK_SIZE, cmd_flags);
+    (void)len;
+    return SE3_OK;
+}
@@ -0,0 +1,243 @@
+/**
+ *  \file se3sim_crypto.c
+ *  \brief This file contains the crypto sessions of the SEcube emulator
+ *         (crypto_init, crypto_update and crypto_list)
+ */
+
+#include "se3sim_internal.h"
+
+/** \brief Algorithm table returned by crypto_list, indexed by SE3_ALGO_* */
+static const struct {
+    const char* name;
+    uint16_t type;
+    uint16_t block_size;
+    uint16_t key_size;
+} se3sim_algo_table[] = {
+    { "AES", SE3_CRYPTO_TYPE_BLOCKCIPHER, B5_AES_BLK_SIZE, B5_AES_256 },
+    { "SHA256", SE3_CRYPTO_TYPE_DIGEST, B5_SHA256_BLOCK_SIZE, 0 },
+    { "HMACSHA256", SE3_CRYPTO_TYPE_DIGEST, B5_SHA256_BLOCK_SIZE, B5_AES_256 },
+    { "AES256HMACSHA256", SE3_CRYPTO_TYPE_BLOCKCIPHER_AUTH, B5_AES_BLK_SIZE, B5_AES_256 },
+    { "AES_HMAC", SE3_CRYPTO_TYPE_BLOCKCIPHER_AUTH, B5_AES_BLK_SIZE, B5_AES_256 }
+};
+
+enum {
+    SE3SIM_ALGO_COUNT = sizeof(se3sim_algo_table) / sizeof(se3sim_algo_table[0]),
+    SE3SIM_FEEDBACK_MASK = (1 << SE3_DIR_SHIFT) - 1
+};
+
+void se3sim_crypto_reset(se3sim_device* dev)
+{
+    memset(dev->sessions, 0, sizeof(dev->sessions));
+}
+
+static bool se3sim_is_cipher(uint16_t algo)
+{
+    return (algo == SE3_ALGO_AES || algo == SE3_ALGO_AES_HMACSHA256 || algo == SE3_ALGO_AES_HMAC);
+}
+
+static bool se3sim_is_decrypt(uint16_t mode)
+{
+    return ((mode & ~SE3SIM_FEEDBACK_MASK) == SE3_DIR_DECRYPT);
+}
+
+static int se3sim_aes_mode(uint16_t mode)
+{
+    bool dec = se3sim_is_decrypt(mode);
+    switch (mode & SE3SIM_FEEDBACK_MASK) {
+    case SE3_FEEDBACK_ECB: return dec ? B5_AES256_ECB_DEC : B5_AES256_ECB_ENC;
+    case SE3_FEEDBACK_CBC: return dec ? B5_AES256_CBC_DEC : B5_AES256_CBC_ENC;
+    case SE3_FEEDBACK_CFB: return dec ? B5_AES256_CFB_DEC : B5_AES256_CFB_ENC;
+    case SE3_FEEDBACK_OFB: return B5_AES256_OFB;
+    case SE3_FEEDBACK_CTR: return B5_AES256_CTR;
+    default: return -1;
+    }
+}
+
+static void se3sim_session_rekey(se3sim_session* ss, const uint8_t* aes_key, const uint8_t* hmac_key)
+{
+    B5_Aes256_Init(&(ss->aes), aes_key, B5_AES_256, (uint8_t)se3sim_aes_mode(ss->mode));
+    memcpy(ss->hmac_key, hmac_key, B5_AES_256);
+    B5_HmacSha256_Init(&(ss->hmac), ss->hmac_key, B5_AES_256);
+}
+
+uint16_t se3sim_crypto_init(se3sim_device* dev, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len)
+{
+    uint16_t algo, mode;
+    uint32_t key_id, sid;
+    se3sim_key* k = NULL;
+    se3sim_session* ss = NULL;
+
+    if (req_len < SE3_CMD1_CRYPTO_INIT_REQ_SIZE) {
+        return SE3_ERR_PARAMS;
+    }
+    SE3_GET16(req, SE3_CMD1_CRYPTO_INIT_REQ_OFF_ALGO, algo);
+    SE3_GET16(req, SE3_CMD1_CRYPTO_INIT_REQ_OFF_MODE, mode);
+    SE3_GET32(req, SE3_CMD1_CRYPTO_INIT_REQ_OFF_KEY_ID, key_id);
+    if (algo >= SE3SIM_ALGO_COUNT) {
+        return SE3_ERR_PARAMS;
+    }
+    if (algo != SE3_ALGO_SHA256) {
+        k = se3sim_key_find(dev, key_id);
+        if (k == NULL) {
+            return SE3_ERR_RESOURCE;
+        }
+        if (dev->devtime != 0 && k->validity < dev->devtime) {
+            return SE3_ERR_EXPIRED;
+        }
+        if (k->data_size < B5_AES_256) {
+            return SE3_ERR_PARAMS;
+        }
+    }
+    if (se3sim_is_cipher(algo) && se3sim_aes_mode(mode) < 0) {
+        return SE3_ERR_PARAMS;
+    }
+    for (sid = 0; sid < SE3SIM_SESSIONS_MAX; sid++) {
+        if (!dev->sessions[sid].used) {
+            ss = &(dev->sessions[sid]);
+            break;
+        }
+    }
+    if (ss == NULL) {
+        return SE3_ERR_MEMORY;
+    }
+
+    memset(ss, 0, sizeof(se3sim_session));
+    ss->used = true;
+    ss->algo = algo;
+    ss->mode = mode;
+    if (k != NULL) {
+        memcpy(ss->key, k->data, B5_AES_256);
+    }
+    switch (algo) {
+    case SE3_ALGO_SHA256:
+        B5_Sha256_Init(&(ss->sha));
+        break;
+    case SE3_ALGO_HMACSHA256:
+        memcpy(ss->hmac_key, ss->key, B5_AES_256);
+        B5_HmacSha256_Init(&(ss->hmac), ss->hmac_key, B5_AES_256);
+        break;
+    default:
+        se3sim_session_rekey(ss, ss->key, ss->key);
+        break;
+    }
+
+    SE3_SET32(resp, SE3_CMD1_CRYPTO_INIT_RESP_OFF_SID, sid);
+    *resp_len = SE3_CMD1_CRYPTO_INIT_RESP_SIZE;
+    return SE3_OK;
+}
+
+uint16_t se3sim_crypto_update(se3sim_device* dev, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len)
+{
+    uint32_t sid;
+    uint16_t flags, data1_len, data2_len, data1_len_pad16, dataout_len = 0;
+    const uint8_t* data1;
+    uint8_t* data2;
+    uint8_t* out = resp + SE3_CMD1_CRYPTO_UPDATE_RESP_OFF_DATA;
+    se3sim_session* ss;
+    uint8_t keys[2 * B5_AES_256];
+
+    if (req_len < SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA) {
+        return SE3_ERR_PARAMS;
+    }
+    SE3_GET32(req, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_SID, sid);
+    SE3_GET16(req, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_FLAGS, flags);
+    SE3_GET16(req, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATAIN1_LEN, data1_len);
+    SE3_GET16(req, SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATAIN2_LEN, data2_len);
+    data1_len_pad16 = (data1_len % 16) ? data1_len + (16 - (data1_len % 16)) : data1_len;
+    if (SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA + data1_len_pad16 + data2_len > req_len) {
+        return SE3_ERR_PARAMS;
+    }
+    if (sid >= SE3SIM_SESSIONS_MAX || !dev->sessions[sid].used) {
+        return SE3_ERR_RESOURCE;
+    }
+    ss = &(dev->sessions[sid]);
+    data1 = req + SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA;
+    data2 = (uint8_t*)req + SE3_CMD1_CRYPTO_UPDATE_REQ_OFF_DATA + data1_len_pad16;
+
+    switch (ss->algo) {
+    case SE3_ALGO_SHA256:
+        if (data1_len > 0) {
+            B5_Sha256_Update(&(ss->sha), data1, data1_len);
+        }
+        if (flags & SE3_CRYPTO_FLAG_FINIT) {
+            B5_Sha256_Finit(&(ss->sha), out);
+            dataout_len = B5_SHA256_DIGEST_SIZE;
+        }
+        break;
+    case SE3_ALGO_HMACSHA256:
+        if (data1_len > 0) {
+            B5_HmacSha256_Update(&(ss->hmac), data1, data1_len);
+        }
+        if (flags & SE3_CRYPTO_FLAG_FINIT) {
+            B5_HmacSha256_Finit(&(ss->hmac), out);
+            dataout_len = B5_SHA256_DIGEST_SIZE;
+        }
+        break;
+    default:
+        if (flags & SE3_CRYPTO_FLAG_SETNONCE) {
+            // session keys are derived from the stored key and the nonce
+            PBKDF2HmacSha256(ss->key, B5_AES_256, data1, data1_len, 1, keys, 2 * B5_AES_256);
+            se3sim_session_rekey(ss, keys, keys + B5_AES_256);
+            memset(keys, 0, sizeof(keys));
+        }
+        else if (flags & SE3_CRYPTO_FLAG_RESET) {
+            if (data1_len >= B5_AES_IV_SIZE) {
+                B5_Aes256_SetIV(&(ss->aes), data1);
+            }
+            B5_HmacSha256_Init(&(ss->hmac), ss->hmac_key, B5_AES_256);
+        }
+        if (data2_len > 0) {
+            if ((data2_len % B5_AES_BLK_SIZE) != 0 ||
+                data2_len + (ss->algo != SE3_ALGO_AES ? B5_SHA256_DIGEST_SIZE : 0) > SE3_CRYPTO_MAX_DATAOUT) {
+                return SE3_ERR_PARAMS;
+            }
+            if (ss->algo != SE3_ALGO_AES && se3sim_is_decrypt(ss->mode)) {
+                B5_HmacSha256_Update(&(ss->hmac), data2, data2_len);
+            }
+            if ((ss->mode & SE3SIM_FEEDBACK_MASK) == SE3_FEEDBACK_CTR) {
+                // CTR cannot run in place: the keystream is written to the output first
+                B5_Aes256_Update(&(ss->aes), out, data2, data2_len / B5_AES_BLK_SIZE);
+            }
+            else {
+                memcpy(out, data2, data2_len);
+                B5_Aes256_Update(&(ss->aes), out, out, data2_len / B5_AES_BLK_SIZE);
+            }
+            if (ss->algo != SE3_ALGO_AES && !se3sim_is_decrypt(ss->mode)) {
+                B5_HmacSha256_Update(&(ss->hmac), out, data2_len);
+            }
+            dataout_len = data2_len;
+        }
+        if (ss->algo != SE3_ALGO_AES && (flags & SE3_CRYPTO_FLAG_AUTH)) {
+            B5_HmacSha256_Finit(&(ss->hmac), out + dataout_len);
+            dataout_len += B5_SHA256_DIGEST_SIZE;
+            B5_HmacSha256_Init(&(ss->hmac), ss->hmac_key, B5_AES_256);
+        }
+        break;
+    }
+
+    if (flags & SE3_CRYPTO_FLAG_FINIT) {
+        memset(ss, 0, sizeof(se3sim_session));
+    }
+    SE3_SET16(resp, SE3_CMD1_CRYPTO_UPDATE_RESP_OFF_DATAOUT_LEN, dataout_len);
+    *resp_len = SE3_CMD1_CRYPTO_UPDATE_RESP_OFF_DATA + dataout_len;
+    return SE3_OK;
+}
+
+uint16_t se3sim_crypto_list(se3sim_device* dev, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len)
+{
+    uint16_t i, count = SE3SIM_ALGO_COUNT;
+    uint8_t* p;
+
+    SE3_SET16(resp, SE3_CMD1_CRYPTO_LIST_RESP_OFF_COUNT, count);
+    for (i = 0; i < count; i++) {
+        p = resp + SE3_CMD1_CRYPTO_LIST_RESP_OFF_ALGOINFO + i * SE3_CMD1_CRYPTO_ALGOINFO_SIZE;
+        memset(p, 0, SE3_CMD1_CRYPTO_ALGOINFO_SIZE);
+        strncpy((char*)p + SE3_CMD1_CRYPTO_ALGOINFO_OFF_NAME, se3sim_algo_table[i].name, SE3_CMD1_CRYPTO_ALGOINFO_NAME_SIZE);
+        SE3_SET16(p, SE3_CMD1_CRYPTO_ALGOINFO_OFF_TYPE, se3sim_algo_table[i].type);
+        SE3_SET16(p, SE3_CMD1_CRYPTO_ALGOINFO_OFF_BLOCK_SIZE, se3sim_algo_table[i].block_size);
+        SE3_SET16(p, SE3_CMD1_CRYPTO_ALGOINFO_OFF_KEY_SIZE, se3sim_algo_table[i].key_size);
+    }
+    *resp_len = SE3_CMD1_CRYPTO_LIST_RESP_OFF_ALGOINFO + count * SE3_CMD1_CRYPTO_ALGOINFO_SIZE;
+    (void)dev; (void)req; (void)req_len;
+    return SE3_OK;
+}
@@ -0,0 +1,105 @@
+/**
+ *  \file se3sim_internal.h
+ *  \brief This file contains the state of an emulated SEcube token,
+ *         shared by the L0, L1 and crypto parts of the emulator.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "se3_common.h"
+#include "se3c1def.h"
+#include "se3sim.h"
+
+/** Emulator limits */
+enum {
+    SE3SIM_KEYS_MAX = 64,
+    SE3SIM_SESSIONS_MAX = 100,
+    SE3SIM_COMM_SIZE = SE3_COMM_N * SE3_COMM_BLOCK
+};
+
+/** \brief Key table entry */
+typedef struct se3sim_key_ {
+    bool used;
+    uint32_t id;
+    uint32_t validity;
+    uint16_t data_size;
+    uint16_t name_size;
+    uint8_t data[SE3_KEY_DATA_MAX];
+    uint8_t name[SE3_KEY_NAME_MAX];
+} se3sim_key;
+
+/** \brief Crypto session opened by crypto_init */
+typedef struct se3sim_session_ {
+    bool used;
+    uint16_t algo;
+    uint16_t mode;
+    uint8_t key[B5_AES_256];
+    B5_tAesCtx aes;
+    B5_tSha256Ctx sha;
+    B5_tHmacSha256Ctx hmac;
+    uint8_t hmac_key[B5_AES_256];
+} se3sim_session;
+
+struct se3sim_device_ {
+    uint32_t index;
+    uint8_t serialno[SE3_SERIAL_SIZE];
+    uint8_t hello[SE3_HELLO_SIZE];
+
+    /* L0 */
+    uint8_t req[SE3SIM_COMM_SIZE];
+    uint8_t resp[SE3SIM_COMM_SIZE];
+    uint8_t disco[SE3_COMM_BLOCK];
+    uint8_t data[SE3SIM_COMM_SIZE];   ///< payload of the request being executed
+    bool magic_written;
+
+    /* L1 */
+    uint8_t pin[SE3_RECORD_MAX][SE3_L1_PIN_SIZE];
+    bool challenge_pending;
+    uint16_t challenge_access;
+    uint8_t cresp_expected[SE3_L1_CHALLENGE_SIZE];
+    bool logged_in;
+    uint16_t access;
+    uint8_t token[SE3_L1_TOKEN_SIZE];
+    se3_payload_cryptoctx cryptoctx;
+    uint8_t resp_data[SE3_RESP1_MAX_DATA];   ///< payload of the response being built
+    uint32_t devtime;
+    se3sim_key keys[SE3SIM_KEYS_MAX];
+    se3sim_session sessions[SE3SIM_SESSIONS_MAX];
+};
+
+/**
+ *  \brief Execute an L1 request
+ *
+ *  \param [in] dev Emulated token
+ *  \param [in] cmd_flags L0 command flags of the request
+ *  \param [in,out] buf L1 packet; it is overwritten with the response
+ *  \param [in] req_len Length of the L1 request packet
+ *  \param [out] resp_len Length of the L1 response packet
+ *  \return L0 status of the response
+ */
+uint16_t se3sim_L1_exec(se3sim_device* dev, uint16_t cmd_flags, uint8_t* buf, uint16_t req_len, uint16_t* resp_len);
+
+/**
+ *  \brief Load PINs and keys from the environment
+ */
+void se3sim_L1_config(se3sim_device* dev);
+
+/** \brief Release every crypto session */
+void se3sim_crypto_reset(se3sim_device* dev);
+
+/** \brief Handle SE3_CMD1_CRYPTO_INIT */
+uint16_t se3sim_crypto_init(se3sim_device* dev, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len);
+
+/** \brief Handle SE3_CMD1_CRYPTO_UPDATE */
+uint16_t se3sim_crypto_update(se3sim_device* dev, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len);
+
+/** \brief Handle SE3_CMD1_CRYPTO_LIST */
+uint16_t se3sim_crypto_list(se3sim_device* dev, const uint8_t* req, uint16_t req_len, uint8_t* resp, uint16_t* resp_len);
+
+/** \brief Look up a key by id, NULL if not present */
+se3sim_key* se3sim_key_find(se3sim_device* dev, uint32_t id);
@@ -0,0 +1,124 @@
+/**
+ *  \file se3sim_socket.c
+ *  \brief This file contains the Unix socket server of the SEcube
+ *         emulator, the device side of the unix:// transport
+ */
+
+#include "se3sim_internal.h"
+#include "se3transport.h"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool se3sim_xfer(int fd, uint8_t* buf, size_t len, bool out)
+{
+    ssize_t r;
+    while (len > 0) {
+        r = (out) ? (send(fd, buf, len, 0)) : (recv(fd, buf, len, 0));
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        buf += r;
+        len -= (size_t)r;
+    }
+    return true;
+}
+
+static void se3sim_client(se3sim_device* dev, int fd)
+{
+    uint8_t hdr[SE3_UNIX_HDR_SIZE];
+    uint8_t* buf = (uint8_t*)malloc(SE3SIM_COMM_SIZE);
+    uint8_t status;
+    uint32_t block, nblocks;
+    size_t k;
+
+    if (buf == NULL) {
+        close(fd);
+        return;
+    }
+    while (se3sim_xfer(fd, hdr, SE3_UNIX_HDR_SIZE, false)) {
+        SE3_GET32(hdr, 4, block);
+        SE3_GET32(hdr, 8, nblocks);
+        status = (nblocks <= SE3_COMM_N) ? (0) : (1);
+        if (status == 0 && hdr[0] == SE3_UNIX_OP_WRITE) {
+            if (!se3sim_xfer(fd, buf, nblocks*SE3_COMM_BLOCK, false)) {
+                break;
+            }
+            se3sim_write(dev, buf, block, nblocks);
+        }
+        else if (status == 0 && hdr[0] == SE3_UNIX_OP_READ) {
+            se3sim_read(dev, buf, block, nblocks);
+        }
+        else if (status == 0 && hdr[0] == SE3_UNIX_OP_INFO) {
+            for (k = 0; k < SE3_COMM_BLOCK; k += SE3_MAGIC_SIZE) {
+                memcpy(buf + k, se3_magic, SE3_MAGIC_SIZE);
+            }
+            se3sim_write(dev, buf, 0, 1);
+            se3sim_read(dev, buf, SE3_COMM_N - 1, 1);
+            nblocks = 1;
+        }
+        else {
+            status = 1;
+        }
+        if (!se3sim_xfer(fd, &status, 1, true)) {
+            break;
+        }
+        if (status == 0 && hdr[0] != SE3_UNIX_OP_WRITE &&
+            !se3sim_xfer(fd, buf, nblocks*SE3_COMM_BLOCK, true)) {
+            break;
+        }
+    }
+    free(buf);
+    close(fd);
+}
+
+int se3sim_serve(se3sim_device* dev, const char* path)
+{
+    struct sockaddr_un addr;
+    int fd, cfd;
+    const char* env = getenv(SE3SIM_KEEP_ENV);
+    bool keep = (env != NULL && env[0] != '\0' && strcmp(env, "0") != 0);
+
+    if (dev == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+        close(fd);
+        return -1;
+    }
+    for (;;) {
+        cfd = accept(fd, NULL, NULL);
+        if (cfd < 0) {
+            continue;
+        }
+        // a new host session starts from a powered up token, unless it stays plugged in
+        if (!keep) {
+            se3sim_reset(dev);
+        }
+        se3sim_client(dev, cfd);
+    }
+    return 0;
+}
+#elif _WIN32
+int se3sim_serve(se3sim_device* dev, const char* path)
+{
+    // not supported
+    return -1;
+}
+#endif
@@ -0,0 +1,10 @@
+/**
+ *  \file stubs.h
+ *  \brief Host replacements for the firmware definitions that
+ *         se3c0def.h pulls in when CUBESIM is defined.
+ */
+
+#pragma once
+
+#include <string.h>
+#include <stdint.h>
@@ -0,0 +1,30 @@
+/**
+ *  \file se3simd.c
+ *  \brief Serve an emulated SEcube token on a Unix domain socket, so that
+ *         any build of SEfile-cli can reach it as unix://<socket path>
+ *
+ *  Usage: se3simd <socket path> [token index]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "se3sim.h"
+
+int main(int argc, char* argv[])
+{
+    uint32_t index = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <socket path> [token index]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) {
+        index = (uint32_t)strtoul(argv[2], NULL, 10);
+    }
+    if (se3sim_serve(se3sim_get(index), argv[1]) < 0) {
+        fprintf(stderr, "ERROR: cannot serve on %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
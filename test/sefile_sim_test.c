@@ -0,0 +1,345 @@
+/**
+ *  \file sefile_sim_test.c
+ *  \brief Regression test of the SEfile API against the in-process SEcube
+ *         emulator (sim://), run by ctest
+ *
+ *  Every case works in the current directory, on the emulated devices
+ *  sim://0 to sim://3 (SE3SIM_DEVICES=4) logged in with SE3SIM_USER_PIN.
+ *  The file contents are checked against a plain copy kept in memory.
+ *
+ *  Usage: sefile_sim_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "L0.h"
+#include "L1.h"
+#include "SEfile.h"
+
+#define TEST_FILE_MAX (1 << 20)
+#define TEST_TRACE "sefile_sim_test.trace"
+
+static uint8_t model[TEST_FILE_MAX];
+static uint32_t model_len = 0;
+static uint8_t buf[TEST_FILE_MAX], rbuf[TEST_FILE_MAX];
+static uint8_t pin[SE3_L1_PIN_SIZE];
+static int failures = 0;
+
+#define CHECK(x) do { \
+    uint16_t ret_ = (uint16_t)(x); \
+    if (ret_) { \
+        fprintf(stderr, "FAIL %s:%d %s returned 0x%X\n", __func__, __LINE__, #x, ret_); \
+        failures++; \
+        return; \
+    } \
+} while (0)
+
+#define EXPECT(x) do { \
+    if (!(x)) { \
+        fprintf(stderr, "FAIL %s:%d %s\n", __func__, __LINE__, #x); \
+        failures++; \
+        return; \
+    } \
+} while (0)
+
+static void fill(uint8_t* p, uint32_t n)
+{
+    uint32_t i;
+    for (i = 0; i < n; i++) {
+        p[i] = (uint8_t)rand();
+    }
+}
+
+static uint16_t login(const char* path, se3_device* dev, se3_session* s)
+{
+    se3_device_info info;
+    uint16_t ret;
+
+    memset(&info, 0, sizeof(se3_device_info));
+    strncpy((char*)info.path, path, SE3_MAX_PATH - 1);
+    if ((ret = L0_open(dev, &info, SE3_TIMEOUT)) != SE3_OK) {
+        return ret;
+    }
+    if ((ret = L1_login(s, dev, pin, SE3_ACCESS_USER)) != SE3_OK) {
+        return ret;
+    }
+    return L1_crypto_set_time(s, (uint32_t)time(0));
+}
+
+static void logout(se3_device* dev, se3_session* s)
+{
+    L1_logout(s);
+    L0_close(dev);
+}
+
+/** \brief The whole file must match the model, read back through a new handle */
+static void check_file(const char* name)
+{
+    SEFILE_FHANDLE h;
+    uint32_t got = 0, total = 0;
+    uint64_t size = 0;
+
+    CHECK(secure_open((char*)name, &h, SEFILE_READ, SEFILE_OPEN));
+    do {
+        CHECK(secure_read(&h, rbuf + total, 7777, &got));
+        total += got;
+    } while (got > 0 && total < TEST_FILE_MAX - 7777);
+    CHECK(secure_close(&h));
+    EXPECT(total == model_len);
+    EXPECT(memcmp(rbuf, model, model_len) == 0);
+    CHECK(secure_getfilesize64((char*)name, &size));
+    EXPECT(size == model_len);
+}
+
+/** \brief Random writes, reads, seeks and truncations, across batch and sector boundaries */
+static void test_round_trip(uint32_t cache)
+{
+    SEFILE_FHANDLE h;
+    uint32_t pos = 0, n, got, t;
+    int32_t np;
+    int i, op;
+
+    model_len = 0;
+    CHECK(secure_open("round_trip.bin", &h, SEFILE_WRITE, SEFILE_NEWFILE));
+    CHECK(secure_set_cache_size(&h, cache));
+    for (i = 0; i < 300; i++) {
+        op = rand() % 5;
+        if (op <= 1) {
+            // up to a few batches at once, or a few bytes
+            n = (op == 0) ? ((uint32_t)rand() % (3 * SEFILE_BATCH_SECTORS * SEFILE_LOGIC_DATA)) : ((uint32_t)rand() % 600);
+            if (pos + n > TEST_FILE_MAX / 2) {
+                n = 0;
+            }
+            fill(buf, n);
+            CHECK(secure_write(&h, buf, n));
+            memcpy(model + pos, buf, n);
+            pos += n;
+            if (pos > model_len) {
+                model_len = pos;
+            }
+        }
+        else if (op == 2) {
+            n = (uint32_t)rand() % (2 * SEFILE_BATCH_SECTORS * SEFILE_LOGIC_DATA);
+            CHECK(secure_read(&h, rbuf, n, &got));
+            EXPECT(got == ((pos >= model_len) ? (0) : ((model_len - pos < n) ? (model_len - pos) : (n))));
+            EXPECT(memcmp(rbuf, model + pos, got) == 0);
+            pos += got;
+        }
+        else if (op == 3) {
+            // past the end the gap is filled with zeros
+            t = (uint32_t)rand() % (model_len + 2 * SEFILE_LOGIC_DATA + 1);
+            CHECK(secure_seek(&h, (int32_t)t, &np, SEFILE_BEGIN));
+            EXPECT((uint32_t)np == t);
+            if (t > model_len) {
+                memset(model + model_len, 0, t - model_len);
+                model_len = t;
+            }
+            pos = t;
+        }
+        else if (model_len > 0) {
+            t = (uint32_t)rand() % (model_len + SEFILE_LOGIC_DATA);
+            CHECK(secure_truncate(&h, t));
+            if (t > model_len) {
+                memset(model + model_len, 0, t - model_len);
+            }
+            model_len = t;
+            CHECK(secure_seek(&h, 0, &np, SEFILE_CURRENT));
+            pos = (uint32_t)np;
+        }
+    }
+    // with a cache, the last writes reach the file here
+    CHECK(secure_close(&h));
+    check_file("round_trip.bin");
+}
+
+/** \brief Cached sectors are counted as hits only when they are read */
+static void test_cache(void)
+{
+    SEFILE_FHANDLE h;
+    uint32_t got, hits, misses, hits0, misses0;
+    int32_t np;
+
+    model_len = 8 * SEFILE_LOGIC_DATA;
+    fill(model, model_len);
+    CHECK(secure_open("cache.bin", &h, SEFILE_WRITE, SEFILE_NEWFILE));
+    CHECK(secure_set_cache_size(&h, 32));
+    CHECK(secure_write(&h, model, model_len));
+    CHECK(secure_close(&h));
+
+    CHECK(secure_open("cache.bin", &h, SEFILE_READ, SEFILE_OPEN));
+    CHECK(secure_set_cache_size(&h, 32));
+    CHECK(secure_read(&h, rbuf, model_len, &got));
+    EXPECT(got == model_len && memcmp(rbuf, model, model_len) == 0);
+    CHECK(secure_get_cache_stats(&h, &hits0, &misses0));
+    EXPECT(misses0 == 8);
+    CHECK(secure_seek(&h, 0, &np, SEFILE_BEGIN));
+    CHECK(secure_read(&h, rbuf, 10, &got));
+    EXPECT(got == 10 && memcmp(rbuf, model, 10) == 0);
+    CHECK(secure_get_cache_stats(&h, &hits, &misses));
+    EXPECT(hits == hits0 + 1 && misses == misses0);
+    CHECK(secure_close(&h));
+    check_file("cache.bin");
+}
+
+/** \brief 64 bit positions and sizes, and secure_seek refusing what does not fit 32 bits */
+static void test_offsets64(void)
+{
+    SEFILE_FHANDLE h;
+    int64_t pos64;
+    int32_t np;
+    uint64_t size;
+
+    model_len = 3 * SEFILE_LOGIC_DATA + 100;
+    fill(model, model_len);
+    CHECK(secure_open("offsets.bin", &h, SEFILE_WRITE, SEFILE_NEWFILE));
+    CHECK(secure_write(&h, model, model_len));
+    CHECK(secure_seek64(&h, -(int64_t)SEFILE_LOGIC_DATA, &pos64, SEFILE_END));
+    EXPECT(pos64 == (int64_t)(model_len - SEFILE_LOGIC_DATA));
+    CHECK(secure_seek64(&h, 10, &pos64, SEFILE_CURRENT));
+    EXPECT(pos64 == (int64_t)(model_len - SEFILE_LOGIC_DATA + 10));
+
+    // rejected before anything moves or is written
+    EXPECT(secure_seek(&h, INT32_MAX, &np, SEFILE_CURRENT) == SEFILE_SEEK_ERROR);
+    EXPECT(np == -1);
+    CHECK(secure_seek64(&h, 0, &pos64, SEFILE_CURRENT));
+    EXPECT(pos64 == (int64_t)(model_len - SEFILE_LOGIC_DATA + 10));
+    EXPECT(secure_seek(&h, INT32_MAX, &np, SEFILE_END) == SEFILE_SEEK_ERROR);
+    CHECK(secure_seek64(&h, 0, &pos64, SEFILE_END));
+    EXPECT(pos64 == (int64_t)model_len);
+
+    CHECK(secure_truncate64(&h, (uint64_t)model_len - 50));
+    model_len -= 50;
+    CHECK(secure_close(&h));
+    CHECK(secure_getfilesize64("offsets.bin", &size));
+    EXPECT(size == model_len);
+    check_file("offsets.bin");
+}
+
+/** \brief Two devices with the same keys share the work of one context */
+static void test_pool(void)
+{
+    static se3_device dev;
+    static se3_session s;
+    SEFILE_FHANDLE h;
+
+    CHECK(login("sim://1", &dev, &s));
+    CHECK(secure_add_device(&s));
+    model_len = 5 * SEFILE_BATCH_SECTORS * SEFILE_LOGIC_DATA + 1234;
+    fill(model, model_len);
+    CHECK(secure_open("pool.bin", &h, SEFILE_WRITE, SEFILE_NEWFILE));
+    CHECK(secure_write(&h, model, model_len));
+    CHECK(secure_close(&h));
+    check_file("pool.bin");
+}
+
+/** \brief Each emulated device has its own serial number */
+static void test_serials(void)
+{
+    se3_device dev[2];
+    se3_device_info info;
+
+    memset(&info, 0, sizeof(se3_device_info));
+    strcpy((char*)info.path, "sim://2");
+    CHECK(L0_open(&dev[0], &info, SE3_TIMEOUT));
+    strcpy((char*)info.path, "sim://3");
+    CHECK(L0_open(&dev[1], &info, SE3_TIMEOUT));
+    EXPECT(memcmp(dev[0].info.serialno, dev[1].info.serialno, SE3_SN_SIZE) != 0);
+    L0_close(&dev[0]);
+    L0_close(&dev[1]);
+}
+
+/** \brief Write the model through its own context, on the device at path */
+static void write_file_ctx(const char* path)
+{
+    se3_device dev;
+    se3_session s;
+    SEFILE_CTX ctx = NULL;
+    SEFILE_FHANDLE h;
+
+    CHECK(login(path, &dev, &s));
+    CHECK(secure_ctx_init(&ctx, &s, -1, SE3_ALGO_MAX + 1));
+    CHECK(secure_ctx_open(ctx, "traced.bin", &h, SEFILE_WRITE, SEFILE_NEWFILE));
+    CHECK(secure_write(&h, model, model_len));
+    CHECK(secure_close(&h));
+    CHECK(secure_ctx_finit(&ctx));
+    logout(&dev, &s);
+}
+
+/** \brief Same as write_file_ctx, in the subdirectory dir */
+static void write_file_in(const char* path, const char* dir)
+{
+    mkdir(dir, 0700);
+    EXPECT(chdir(dir) == 0);
+    write_file_ctx(path);
+    EXPECT(chdir("..") == 0);
+}
+
+/** \brief A recorded run replays without the device and writes the same bytes */
+static void test_record_replay(void)
+{
+    FILE* fp;
+    long n[2];
+    int i;
+    static uint8_t cipher[2][TEST_FILE_MAX];
+    char enc_name[MAX_PATHNAME], name[2][MAX_PATHNAME + 4];
+    uint16_t len = 0;
+
+    model_len = 2 * SEFILE_BATCH_SECTORS * SEFILE_LOGIC_DATA + 77;
+    fill(model, model_len);
+    unlink(TEST_TRACE);
+    write_file_in("record://../" TEST_TRACE "@sim://2", "rec");
+    write_file_in("replay://../" TEST_TRACE, "rep");
+    if (failures) {
+        return;
+    }
+    memset(enc_name, 0, MAX_PATHNAME);
+    CHECK(crypto_filename("traced.bin", enc_name, &len));
+    snprintf(name[0], sizeof(name[0]), "rec/%s", enc_name);
+    snprintf(name[1], sizeof(name[1]), "rep/%s", enc_name);
+    for (i = 0; i < 2; i++) {
+        EXPECT((fp = fopen(name[i], "rb")) != NULL);
+        n[i] = (long)fread(cipher[i], 1, TEST_FILE_MAX, fp);
+        fclose(fp);
+    }
+    EXPECT(n[0] > (long)model_len && n[0] == n[1]);
+    EXPECT(memcmp(cipher[0], cipher[1], (size_t)n[0]) == 0);
+}
+
+int main(void)
+{
+    se3_device dev;
+    se3_session s;
+    const char* env = getenv("SE3SIM_USER_PIN");
+
+    memset(pin, 0, SE3_L1_PIN_SIZE);
+    if (env != NULL) {
+        memcpy(pin, env, (strlen(env) < SE3_L1_PIN_SIZE) ? (strlen(env)) : (SE3_L1_PIN_SIZE));
+    }
+    srand(1);
+    if (login("sim://0", &dev, &s) != SE3_OK || secure_init(&s, -1, SE3_ALGO_MAX + 1)) {
+        fprintf(stderr, "FAIL cannot log in to sim://0\n");
+        return 1;
+    }
+    test_round_trip(0);
+    test_round_trip(32);
+    test_cache();
+    test_offsets64();
+    test_record_replay();
+    test_serials();
+    // last: the pool stays in the default context
+    test_pool();
+    secure_finit();
+    logout(&dev, &s);
+    if (failures) {
+        fprintf(stderr, "%d failure(s)\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -8,6 +8,15 @@
 
 #include "wrapper.h"
 
+static char pool_paths[SEFILE_POOL_MAX - 1][SE3_MAX_PATH];   //devices after the first one of -pe
+static se3_session pool_sessions[SEFILE_POOL_MAX - 1];
+static size_t n_pool = 0;
+static bool agent_kept = false;   //the first login is left to se3agent, see SE3_AGENT_ENV
+static bool pool_kept[SEFILE_POOL_MAX - 1];
+
+static se3_disco_it choose_device(char *drive);
+static se3_session login_device(char *password, se3_disco_it it, bool *kept);
+
 //prints a list of available devices ex: D:, E:
 se3_disco_it show_and_choose_devices(void) {
     se3_disco_it it;
@@ -31,9 +40,33 @@ se3_disco_it show_and_choose_devices(void) {
     return it;
 }
 
-//chooses a device given an ASCII letter
+//chooses the devices of a comma separated list, the first one is returned
 se3_disco_it choose_devices(char *drive)    {
+    char *sep;
+    n_pool = 0;
+    while((sep = strrchr(drive, ',')) != NULL)    {
+        *sep = '\0';
+        if(sep[1] == '\0') continue;
+        if(n_pool == SEFILE_POOL_MAX - 1)  {
+            fprintf(stderr, "ERROR: at most %d devices can be used.\n", SEFILE_POOL_MAX);
+            exit(-1);
+        }
+        strncpy(pool_paths[n_pool], sep + 1, SE3_MAX_PATH - 1);
+        pool_paths[n_pool][SE3_MAX_PATH - 1] = '\0';
+        n_pool++;
+    }
+    return choose_device(drive);
+}
+
+//chooses a device given an ASCII letter
+static se3_disco_it choose_device(char *drive)    {
     se3_disco_it it;
+    if(strstr(drive, SE3_TRANSPORT_SEP) != NULL)   {
+        //transport URI (ex: unix:///tmp/se3.sock), opened without discovery
+        memset(&it, 0, sizeof(se3_disco_it));
+        strncpy((char *) it.device_info.path, drive, SE3_MAX_PATH - 1);
+        return it;
+    }
     L0_discover_init(&it);
     while(L0_discover_next(&it) == 1)   {
         if(strcmp(drive, (char *) it.device_info.path) == 0) break;
@@ -41,11 +74,31 @@ se3_disco_it choose_devices(char *drive)    {
     return it;
 }
 
-//handshakes the SEcube USB connection
+//handshakes the SEcube USB connection of every chosen device
 se3_session init_device(char *password, se3_disco_it it)   {
+    se3_session s = login_device(password, it, &agent_kept);
+    size_t i;
+    if(secure_init(&s, -1, SE3_ALGO_MAX + 1)) {
+        fprintf(stderr, "ERROR: secure_init()\n");
+        exit(-1);
+    }
+    //listed in reverse order by choose_devices()
+    for(i = n_pool; i > 0; i--)  {
+        pool_sessions[i - 1] = login_device(password, choose_device(pool_paths[i - 1]), &pool_kept[i - 1]);
+        if(secure_add_device(&pool_sessions[i - 1])) {
+            fprintf(stderr, "ERROR: secure_add_device() - %s\n", pool_paths[i - 1]);
+            exit(-1);
+        }
+    }
+    return s;
+}
+
+//opens a device and logs in, kept tells whether se3agent holds the login
+static se3_session login_device(char *password, se3_disco_it it, bool *kept)   {
     se3_device dev;
     se3_session s;
     uint16_t ret;
+    memset(&dev, 0, sizeof(se3_device));
     if(!dev.opened) {
         if((ret = L0_open(&dev, &(it.device_info), SE3_TIMEOUT)) != SE3_OK) {
             fprintf(stderr, "ERROR: L0_open() - error code: 0x%X\n", ret);
@@ -53,26 +106,41 @@ se3_session init_device(char *password, se3_disco_it it)   {
         }
     }
     uint8_t *pin = (uint8_t *)calloc(32, 1);
+    uint8_t token[SE3_L1_TOKEN_SIZE], key[SE3_L1_KEY_SIZE];
+    const char *agent = getenv(SE3_AGENT_ENV);
     memcpy(pin, password, strlen(password));
+    bool agent_on = (agent != NULL && agent[0] != '\0');
+    *kept = false;
+    if(agent_on && se3_agent_resume(agent, dev.info.serialno, pin, token, key)) {
+        //login left by an earlier run, the device checks it with the first command
+        L1_resume(&s, &dev, token, key);
+        memset(token, 0, SE3_L1_TOKEN_SIZE);
+        memset(key, 0, SE3_L1_KEY_SIZE);
+        if(L1_crypto_set_time(&s, (uint32_t) time(0)) == SE3_OK) {
+            *kept = true;
+            free(pin);
+            return s;
+        }
+        se3_agent_forget(agent, dev.info.serialno);
+    }
     if((ret = L1_login(&s, &dev, pin, SE3_ACCESS_USER)) != SE3_OK) {
-        free(pin);
         if(ret == SE3_ERR_PIN) fprintf(stderr, "Wrong password.\n");
         else {
+            free(pin);
             fprintf(stderr, "ERROR: L1_login()\n");
             exit(-1);
         }
     } else {
-        free(pin);
         //printf("Correct password.\n");
     }
     if(L1_crypto_set_time(&s, (uint32_t) time(0))) {
+        free(pin);
         fprintf(stderr, "ERROR: L1_crypto_set_time()\n");
         exit(-1);
     }
-    if(secure_init(&s, -1, SE3_ALGO_MAX + 1)) {
-        fprintf(stderr, "ERROR: secure_init()\n");
-        exit(-1);
-    }
+    //without the agent holding it, close_device() logs out
+    *kept = agent_on && se3_agent_store(agent, &s, pin);
+    free(pin);
     return s;
 }
 
@@ -146,6 +214,16 @@ void write_cipher_file_from_buffer(se3_session *s, uint8_t *buffer, int buffer_l
     }
 }
 
+//closes an encrypted file, the sectors still in its cache are written now
+void close_cipher_file(se3_session *s, SEFILE_FHANDLE *sefile_file)   {
+    int ret;
+    if ((ret = secure_close(sefile_file))) {
+        fprintf(stderr, "ERROR: secure_close() - code: 0x%X, the cipher file is incomplete\n", ret);
+        close_device(s);
+        exit(-1);
+    }
+}
+
 //lists all the encrypted files in the directory with decrypted file names
 void list_cipher_files_in_directory(char* path)  {
     char fileList[MAX_SHOWN_FILE*MAX_PATHNAME] = {0}, *pFile = NULL;
@@ -206,6 +284,11 @@ int write_buffer_from_cipher_file(se3_session *s, uint8_t *buffer, int buffer_le
 
 //closes the SEcube USB connection
 void close_device(se3_session *s)  {
+    size_t i;
     secure_finit();
-    if (s->logged_in) L1_logout(s);
+    //the logins kept by se3agent are resumed by the next run
+    if (s->logged_in && !agent_kept) L1_logout(s);
+    for(i = 0; i < n_pool; i++)  {
+        if (pool_sessions[i].logged_in && !pool_kept[i]) L1_logout(&pool_sessions[i]);
+    }
 }
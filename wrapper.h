@@ -14,6 +14,7 @@
 #include <string.h>
 #include <stdio.h>
 #include "SEfile.h"
+#include "se3agent.h"
 
 
 #ifndef WRAPPER_H
@@ -34,15 +35,18 @@ se3_disco_it show_and_choose_devices(void);
  * @brief This function chooses a device given an ASCII capital
  *        letter ex: D, E in Windows or the mount point in linux.
  *        In Linux only already mounted devices will be shown.
+ *        A comma separated list chooses several devices holding
+ *        the same keys, they share the encryption work (see
+ *        secure_add_device()).
  * @param [in] drive letter in Windows, ex: D, E
- *        or the mount point in linux.
+ *        or the mount point in linux. The string is split in place.
  * @return The function returns a se3_disco_it Discovery iterator
  *         data structure.
  */
 se3_disco_it choose_devices(char *drive);
 /**
  * @brief This function handshakes the SEcube USB connection
- *        with the PC.
+ *        with the PC, for every device chosen by \ref choose_devices().
  * @param [in] *password is the pointer to an already allocated
  *        ASCII string containing the device password.
  * @param [in] it is the Discovery iterator data structure
@@ -92,6 +96,17 @@ void write_cipher_file_from_file(se3_session *s, FILE *fd, SEFILE_FHANDLE *sefil
  *        success, NULL in case of failure.
  */
 void write_cipher_file_from_buffer(se3_session *s, uint8_t *buffer, int buffer_len, SEFILE_FHANDLE *sefile_file);
+/**
+ * @brief This function closes an encrypted file written by
+ *        \ref write_cipher_file_from_file() or
+ *        \ref write_cipher_file_from_buffer(). The sectors still in
+ *        the cache of the handle are written here: the program exits
+ *        with an error if they cannot be.
+ * @param [in] *s is the SEcube Communication session
+ *         structure initialized by \ref init_device()
+ * @param [in] *sefile_file is the SEFILE_FHANDLE of the file.
+ */
+void close_cipher_file(se3_session *s, SEFILE_FHANDLE *sefile_file);
 /**
  * @brief This function lists all the encrypted files in the
  *        directory with decrypted file names.